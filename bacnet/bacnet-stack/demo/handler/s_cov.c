@@ -118,7 +118,7 @@ uint8_t Send_COV_Subscribe(
     status = address_get_by_device(device_id, &max_apdu, &dest);
     /* is there a tsm available? */
     if (status) {
-        invoke_id = tsm_next_free_invokeID();
+        invoke_id = tsm_next_free_peer_invokeID(&dest);
     }
     if (invoke_id) {
         /* encode the NPDU portion of the packet */
@@ -149,7 +149,7 @@ uint8_t Send_COV_Subscribe(
                     strerror(errno));
 #endif
         } else {
-            tsm_free_invoke_id(invoke_id);
+            tsm_free_peer_invoke_id(&dest, invoke_id);
             invoke_id = 0;
 #if PRINT_ENABLED
             fprintf(stderr,
@@ -182,7 +182,7 @@ uint8_t Send_COV_Subscribe_Property(
     status = address_get_by_device(device_id, &max_apdu, &dest);
     /* is there a tsm available? */
     if (status) {
-        invoke_id = tsm_next_free_invokeID();
+        invoke_id = tsm_next_free_peer_invokeID(&dest);
     }
     if (invoke_id) {
         /* encode the NPDU portion of the packet */
@@ -213,7 +213,7 @@ uint8_t Send_COV_Subscribe_Property(
                     strerror(errno));
 #endif
         } else {
-            tsm_free_invoke_id(invoke_id);
+            tsm_free_peer_invoke_id(&dest, invoke_id);
             invoke_id = 0;
 #if PRINT_ENABLED
             fprintf(stderr,
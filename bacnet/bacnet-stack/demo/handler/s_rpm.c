@@ -78,7 +78,7 @@ uint8_t Send_Read_Property_Multiple_Request(
     status = address_get_by_device(device_id, &max_apdu, &dest);
     /* is there a tsm available? */
     if (status)
-        invoke_id = tsm_next_free_invokeID();
+        invoke_id = tsm_next_free_peer_invokeID(&dest);
     if (invoke_id) {
         /* encode the NPDU portion of the packet */
         datalink_get_my_address(&my_address);
@@ -108,8 +108,10 @@ uint8_t Send_Read_Property_Multiple_Request(
                     "Failed to Send ReadPropertyMultiple Request (%s)!\n",
                     strerror(errno));
 #endif
-        } else {
-            tsm_free_invoke_id(invoke_id);
+        } else if (!tsm_set_confirmed_segmented_transaction(invoke_id, &dest,
+                &npdu_data, &pdu[0], (uint16_t) pdu_len, max_apdu)) {
+            /* too large for the destination even in segments */
+            tsm_free_peer_invoke_id(&dest, invoke_id);
             invoke_id = 0;
 #if PRINT_ENABLED
             fprintf(stderr,
@@ -1438,10 +1438,17 @@ typedef enum {
     ABORT_REASON_INVALID_APDU_IN_THIS_STATE = 2,
     ABORT_REASON_PREEMPTED_BY_HIGHER_PRIORITY_TASK = 3,
     ABORT_REASON_SEGMENTATION_NOT_SUPPORTED = 4,
+    ABORT_REASON_SECURITY_ERROR = 5,
+    ABORT_REASON_INSUFFICIENT_SECURITY = 6,
+    ABORT_REASON_WINDOW_SIZE_OUT_OF_RANGE = 7,
+    ABORT_REASON_APPLICATION_EXCEEDED_REPLY_TIME = 8,
+    ABORT_REASON_OUT_OF_RESOURCES = 9,
+    ABORT_REASON_TSM_TIMEOUT = 10,
+    ABORT_REASON_APDU_TOO_LONG = 11,
     /* Enumerated values 0-63 are reserved for definition by ASHRAE. */
     /* Enumerated values 64-65535 may be used by others subject to */
     /* the procedures and constraints described in Clause 23. */
-    MAX_BACNET_ABORT_REASON = 5,
+    MAX_BACNET_ABORT_REASON = 12,
     FIRST_PROPRIETARY_ABORT_REASON = 64,
     LAST_PROPRIETARY_ABORT_REASON = 65535
 } BACNET_ABORT_REASON;
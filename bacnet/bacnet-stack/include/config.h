@@ -96,6 +96,30 @@
 #if !defined(MAX_TSM_TRANSACTIONS)
 #define MAX_TSM_TRANSACTIONS 255
 #endif
+/* TSM_REQUEST_WINDOW is the most confirmed requests a client keeps */
+/* outstanding to one peer. */
+#if !defined(TSM_REQUEST_WINDOW)
+#define TSM_REQUEST_WINDOW 4
+#endif
+/* Segmented complex ACKs to our confirmed requests are reassembled */
+/* into one of MAX_TSM_SEGMENTED_ACKS buffers of MAX_SEGMENTS_ACCEPTED */
+/* segments each, MAX_APDU bytes per segment, so every buffer costs */
+/* about 23 KB of static memory with the defaults: the pool is a small */
+/* fixed one (at most 255), not one per transaction. A segmented ACK */
+/* that finds no free buffer is aborted, and the request is reported */
+/* to the client through tsm_set_no_buffer_handler() to be sent again. */
+/* Configure MAX_SEGMENTS_ACCEPTED to 1 to only accept */
+/* unsegmented ACKs. TSM_WINDOW_SIZE is the most segments sent or */
+/* received before a SegmentACK. */
+#if !defined(MAX_SEGMENTS_ACCEPTED)
+#define MAX_SEGMENTS_ACCEPTED 16
+#endif
+#if !defined(MAX_TSM_SEGMENTED_ACKS)
+#define MAX_TSM_SEGMENTED_ACKS 16
+#endif
+#if !defined(TSM_WINDOW_SIZE)
+#define TSM_WINDOW_SIZE 4
+#endif
 /* The address cache is used for binding to BACnet devices */
 /* The number of entries corresponds to the number of */
 /* devices that might respond to an I-Am on the network. */
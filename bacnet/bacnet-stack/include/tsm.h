@@ -29,11 +29,13 @@
 #include <stddef.h>
 #include "bacdef.h"
 #include "npdu.h"
+#include "apdu.h"
 
 /* note: TSM functionality is optional - only needed if we are
    doing client requests */
 #if (!MAX_TSM_TRANSACTIONS)
 #define tsm_free_invoke_id(x) (void)x;
+#define tsm_free_peer_invoke_id(p,x) (void)p; (void)x;
 #else
 typedef enum {
     TSM_STATE_IDLE,
@@ -50,20 +52,21 @@ typedef struct BACnet_TSM_Data {
     /* used to count APDU retries */
     uint8_t RetryCount;
     /* used to count segment retries */
-    /*uint8_t SegmentRetryCount;  */
+    uint8_t SegmentRetryCount;
     /* used to control APDU retries and the acceptance of server replies */
-    /*bool SentAllSegments;  */
+    bool SentAllSegments;
     /* stores the sequence number of the last segment received in order */
-    /*uint8_t LastSequenceNumber; */
+    uint8_t LastSequenceNumber;
     /* stores the sequence number of the first segment of */
     /* a sequence of segments that fill a window */
-    /*uint8_t InitialSequenceNumber; */
+    uint8_t InitialSequenceNumber;
     /* stores the current window size */
-    /*uint8_t ActualWindowSize; */
+    uint8_t ActualWindowSize;
     /* stores the window size proposed by the segment sender */
-    /*uint8_t ProposedWindowSize;  */
+    uint8_t ProposedWindowSize;
     /*  used to perform timeout on PDU segments */
-    /*uint8_t SegmentTimer; */
+    /* in milliseconds */
+    uint16_t SegmentTimer;
     /* used to perform timeout on Confirmed Requests */
     /* in milliseconds */
     uint16_t RequestTimer;
@@ -78,8 +81,28 @@ typedef struct BACnet_TSM_Data {
     /* copy of the APDU, should we need to send it again */
     uint8_t apdu[MAX_PDU];
     unsigned apdu_len;
+    /* a segmented request: the length of the NPDU header in apdu, */
+    /* the service data sent per segment, and the number of segments. */
+    /* SegmentCount is zero for an unsegmented request */
+    uint16_t npdu_len;
+    uint16_t SegmentSize;
+    uint16_t SegmentCount;
+    /* the buffer a segmented ACK is reassembled in, */
+    /* MAX_TSM_SEGMENTED_ACKS if none */
+    uint8_t SegmentBuffer;
+    /* the next transaction of the same hash chain */
+    uint16_t HashNext;
+    /* attached by the sender of the request */
+    void *Context;
 } BACNET_TSM_DATA;
 
+/* a transaction with a context ended, and nobody took the context */
+typedef void (
+    *tsm_failed_function) (
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID,
+    void *context);
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -90,12 +113,27 @@ extern "C" {
         void);
     void tsm_timer_milliseconds(
         uint16_t milliseconds);
+/* milliseconds until the first timer of a transaction runs out, */
+/* 0xFFFF when no transaction is waiting on a timer */
+    uint16_t tsm_timer_next_expiry(
+        void);
 /* free the invoke ID when the reply comes back */
     void tsm_free_invoke_id(
         uint8_t invokeID);
+/* free the invoke ID of a request to the peer */
+    void tsm_free_peer_invoke_id(
+        BACNET_ADDRESS * peer,
+        uint8_t invokeID);
+/* frees all the invoke IDs, passing the contexts to the function */
+    void tsm_free_all(
+        tsm_failed_function pFunction);
 /* use these in tandem */
     uint8_t tsm_next_free_invokeID(
         void);
+/* an invoke ID only unique for dest, returns 0 if none is available. */
+/* the transactions to other peers may use the same invoke ID */
+    uint8_t tsm_next_free_peer_invokeID(
+        BACNET_ADDRESS * dest);
     void tsm_invokeID_set(
         uint8_t invokeID);
 /* returns the same invoke ID that was given */
@@ -105,6 +143,35 @@ extern "C" {
         BACNET_NPDU_DATA * ndpu_data,
         uint8_t * apdu,
         uint16_t apdu_len);
+/* sends a request too large for one APDU of the destination in */
+/* segments, returns false if it can't be segmented */
+    bool tsm_set_confirmed_segmented_transaction(
+        uint8_t invokeID,
+        BACNET_ADDRESS * dest,
+        BACNET_NPDU_DATA * ndpu_data,
+        uint8_t * pdu,
+        uint16_t pdu_len,
+        unsigned max_apdu);
+/* handles a segment of a ComplexACK. returns 1 when the ACK is */
+/* complete, with service_request set to the whole service data, */
+/* 0 while more segments are expected or the segment isn't ours, */
+/* -1 with the abort_reason when the ACK was aborted, and -2 when */
+/* it was aborted for lack of a local buffer and the transaction */
+/* was freed, its context given to the no buffer handler */
+    int tsm_segmented_ack_received(
+        BACNET_ADDRESS * src,
+        BACNET_CONFIRMED_SERVICE_ACK_DATA * service_data,
+        uint8_t service_choice,
+        uint8_t ** service_request,
+        uint16_t * service_request_len,
+        uint8_t * abort_reason);
+/* handles a SegmentACK to a segmented request */
+    void tsm_segment_ack_received(
+        BACNET_ADDRESS * src,
+        uint8_t invokeID,
+        uint8_t sequence_number,
+        uint8_t actual_window_size,
+        bool nak);
 /* returns true if transaction is found */
     bool tsm_get_transaction_pdu(
         uint8_t invokeID,
@@ -115,11 +182,37 @@ extern "C" {
 
     bool tsm_invoke_id_free(
         uint8_t invokeID);
+    bool tsm_peer_invoke_id_free(
+        BACNET_ADDRESS * peer,
+        uint8_t invokeID);
     bool tsm_invoke_id_failed(
         uint8_t invokeID);
 
-    void my_tsm_logic_invokeID_set(
+/* attaches a context to the transaction of the request to the peer, */
+/* returns false if there is no such transaction */
+    bool tsm_set_context(
+        BACNET_ADDRESS * peer,
+        uint8_t invokeID,
+        void *context);
+/* returns the context of the transaction, and detaches it */
+    void *tsm_take_context(
+        BACNET_ADDRESS * peer,
         uint8_t invokeID);
+/* the function is called, and the transaction freed, when a */
+/* transaction with a context fails to confirm, or is freed with */
+/* its context, e.g. a reply nobody handled. With a handler set the */
+/* TSM owns the transactions: one without a context (taken, or never */
+/* set) is freed as well when it fails, instead of waiting for */
+/* tsm_invoke_id_failed() and tsm_free_invoke_id() */
+    void tsm_set_failed_handler(
+        tsm_failed_function pFunction);
+/* the function is called, and the transaction freed, when a */
+/* segmented ACK to a transaction with a context finds none of the */
+/* MAX_TSM_SEGMENTED_ACKS buffers free. The request did nothing wrong */
+/* and may be sent again. Without a handler the ACK is aborted with */
+/* ABORT_REASON_OUT_OF_RESOURCES like any other */
+    void tsm_set_no_buffer_handler(
+        tsm_failed_function pFunction);
 
 #ifdef __cplusplus
 }
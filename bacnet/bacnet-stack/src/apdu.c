@@ -430,6 +430,22 @@ static bool apdu_unconfirmed_dcc_disabled(
     return status;
 }
 
+/* a reply to a request of ours that is still waited for, */
+/* and not a duplicate or one that came too late */
+static bool apdu_reply_expected(
+    BACNET_ADDRESS * src,
+    uint8_t invoke_id)
+{
+#if (MAX_TSM_TRANSACTIONS)
+    return !tsm_peer_invoke_id_free(src, invoke_id);
+#else
+    (void) src;
+    (void) invoke_id;
+
+    return true;
+#endif
+}
+
 /** Process the APDU header and invoke the appropriate service handler
  * to manage the received request.
  * Almost all requests and ACKs invoke this function.
@@ -457,6 +473,9 @@ void apdu_handler(
     uint32_t error_class = 0;
     uint8_t reason = 0;
     bool server = false;
+#if (MAX_TSM_TRANSACTIONS)
+    int status = 0;
+#endif
 
     if (apdu) {
         /* PDU Type */
@@ -501,6 +520,9 @@ void apdu_handler(
             case PDU_TYPE_SIMPLE_ACK:
                 invoke_id = apdu[1];
                 service_choice = apdu[2];
+                if (!apdu_reply_expected(src, invoke_id)) {
+                    break;
+                }
                 switch (service_choice) {
                     case SERVICE_CONFIRMED_ACKNOWLEDGE_ALARM:
                     case SERVICE_CONFIRMED_COV_NOTIFICATION:
@@ -527,7 +549,7 @@ void apdu_handler(
                                 Confirmed_ACK_Function[service_choice]) (src,
                                 invoke_id);
                         }
-                        tsm_free_invoke_id(invoke_id);
+                        tsm_free_peer_invoke_id(src, invoke_id);
                         break;
                     default:
                         break;
@@ -547,6 +569,26 @@ void apdu_handler(
                 service_choice = apdu[len++];
                 service_request = &apdu[len];
                 service_request_len = apdu_len - (uint16_t) len;
+                if (!apdu_reply_expected(src, invoke_id)) {
+                    break;
+                }
+#if (MAX_TSM_TRANSACTIONS)
+                if (service_ack_data.segmented_message) {
+                    /* handled once the TSM has all the segments */
+                    status =
+                        tsm_segmented_ack_received(src, &service_ack_data,
+                        service_choice, &service_request, &service_request_len,
+                        &reason);
+                    if (status == -1) {
+                        if (Abort_Function)
+                            Abort_Function(src, invoke_id, reason, false);
+                        tsm_free_peer_invoke_id(src, invoke_id);
+                    }
+                    if (status <= 0) {
+                        break;
+                    }
+                }
+#endif
                 switch (service_choice) {
                     case SERVICE_CONFIRMED_GET_ALARM_SUMMARY:
                     case SERVICE_CONFIRMED_GET_ENROLLMENT_SUMMARY:
@@ -571,21 +613,35 @@ void apdu_handler(
                                 (service_request, service_request_len, src,
                                 &service_ack_data);
                         }
-                        tsm_free_invoke_id(invoke_id);
+                        tsm_free_peer_invoke_id(src, invoke_id);
                         break;
                     default:
                         break;
                 }
+#if (MAX_TSM_TRANSACTIONS)
+                if (service_ack_data.segmented_message) {
+                    /* release the reassembly buffer, even if nobody
+                       handled the service */
+                    tsm_free_peer_invoke_id(src, invoke_id);
+                }
+#endif
                 break;
             case PDU_TYPE_SEGMENT_ACK:
-                /* FIXME: what about a denial of service attack here?
-                   we could check src to see if that matched the tsm */
-                tsm_free_invoke_id(invoke_id);
+#if (MAX_TSM_TRANSACTIONS)
+                /* the TSM checks that src is the peer of the transaction */
+                if (apdu_len >= 4) {
+                    tsm_segment_ack_received(src, apdu[1], apdu[2], apdu[3],
+                        (apdu[0] & BIT1) ? true : false);
+                }
+#endif
                 break;
             case PDU_TYPE_ERROR:
                 invoke_id = apdu[1];
                 service_choice = apdu[2];
                 len = 3;
+                if (!apdu_reply_expected(src, invoke_id)) {
+                    break;
+                }
 
                 /* FIXME: Currently special case for C_P_T but there are others which may
                    need consideration such as ChangeList-Error, CreateObject-Error,
@@ -619,22 +675,31 @@ void apdu_handler(
                             (BACNET_ERROR_CLASS) error_class,
                             (BACNET_ERROR_CODE) error_code);
                 }
-                tsm_free_invoke_id(invoke_id);
+                tsm_free_peer_invoke_id(src, invoke_id);
                 break;
             case PDU_TYPE_REJECT:
                 invoke_id = apdu[1];
                 reason = apdu[2];
+                if (!apdu_reply_expected(src, invoke_id)) {
+                    break;
+                }
                 if (Reject_Function)
                     Reject_Function(src, invoke_id, reason);
-                tsm_free_invoke_id(invoke_id);
+                tsm_free_peer_invoke_id(src, invoke_id);
                 break;
             case PDU_TYPE_ABORT:
                 server = apdu[0] & 0x01;
                 invoke_id = apdu[1];
                 reason = apdu[2];
+                if (server && !apdu_reply_expected(src, invoke_id)) {
+                    break;
+                }
                 if (Abort_Function)
                     Abort_Function(src, invoke_id, reason, server);
-                tsm_free_invoke_id(invoke_id);
+                /* an abort from a client is for a request we serve */
+                if (server) {
+                    tsm_free_peer_invoke_id(src, invoke_id);
+                }
                 break;
             default:
                 break;
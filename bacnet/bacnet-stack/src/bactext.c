@@ -1514,6 +1514,21 @@ INDTEXT_DATA bacnet_abort_reason_names[] = {
     ,
     {ABORT_REASON_SEGMENTATION_NOT_SUPPORTED, "Segmentation Not Supported"}
     ,
+    {ABORT_REASON_SECURITY_ERROR, "Security Error"}
+    ,
+    {ABORT_REASON_INSUFFICIENT_SECURITY, "Insufficient Security"}
+    ,
+    {ABORT_REASON_WINDOW_SIZE_OUT_OF_RANGE, "Window Size out of Range"}
+    ,
+    {ABORT_REASON_APPLICATION_EXCEEDED_REPLY_TIME,
+        "Application Exceeded Reply Time"}
+    ,
+    {ABORT_REASON_OUT_OF_RESOURCES, "Out of Resources"}
+    ,
+    {ABORT_REASON_TSM_TIMEOUT, "TSM Timeout"}
+    ,
+    {ABORT_REASON_APDU_TOO_LONG, "APDU Too Long"}
+    ,
     {0, NULL}
 };
 
@@ -575,12 +575,56 @@ void testNPDU1(
 
 #ifdef TEST_NPDU
 /* dummy stub for testing */
-void tsm_free_invoke_id(
+void tsm_free_peer_invoke_id(
+    BACNET_ADDRESS * peer,
     uint8_t invokeID)
 {
+    (void) peer;
     (void) invokeID;
 }
 
+bool tsm_peer_invoke_id_free(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID)
+{
+    (void) peer;
+    (void) invokeID;
+
+    return false;
+}
+
+int tsm_segmented_ack_received(
+    BACNET_ADDRESS * src,
+    BACNET_CONFIRMED_SERVICE_ACK_DATA * service_data,
+    uint8_t service_choice,
+    uint8_t ** service_request,
+    uint16_t * service_request_len,
+    uint8_t * abort_reason)
+{
+    (void) src;
+    (void) service_data;
+    (void) service_choice;
+    (void) service_request;
+    (void) service_request_len;
+    (void) abort_reason;
+
+    return 0;
+}
+
+void tsm_segment_ack_received(
+    BACNET_ADDRESS * src,
+    uint8_t invokeID,
+    uint8_t sequence_number,
+    uint8_t actual_window_size,
+    bool nak)
+{
+    (void) src;
+    (void) invokeID;
+    (void) sequence_number;
+    (void) actual_window_size;
+    (void) nak;
+}
+
 void iam_handler(
     uint8_t * service_request,
     uint16_t service_len,
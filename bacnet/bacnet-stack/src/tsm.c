@@ -35,6 +35,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include "bits.h"
 #include "apdu.h"
 #include "bacdef.h"
@@ -46,6 +47,8 @@
 #include "handlers.h"
 #include "address.h"
 #include "bacaddr.h"
+#include "abort.h"
+#include "npdu.h"
 
 /** @file tsm.c  BACnet Transaction State Machine operations  */
 
@@ -55,108 +58,322 @@
 /* If we are only a server and only initiate broadcasts, */
 /* then we don't need a TSM layer. */
 
-/* FIXME: not coded for segmentation */
-
 /* declare space for the TSM transactions, and set it up in the init. */
 /* table rules: an Invoke ID = 0 is an unused spot in the table */
 static BACNET_TSM_DATA TSM_List[MAX_TSM_TRANSACTIONS];
 
+#if (MAX_SEGMENTS_ACCEPTED > 1)
+#if ((MAX_SEGMENTS_ACCEPTED * MAX_APDU) > 65535)
+#error "MAX_SEGMENTS_ACCEPTED * MAX_APDU must fit the 16 bit service length"
+#endif
+#if (MAX_TSM_SEGMENTED_ACKS > 255)
+#error "MAX_TSM_SEGMENTED_ACKS must fit the 8 bit buffer index"
+#endif
+/* the buffers segmented ACKs are reassembled in */
+typedef struct {
+    bool in_use;
+    uint16_t len;
+    uint8_t data[MAX_SEGMENTS_ACCEPTED * MAX_APDU];
+} TSM_SEGMENT_BUFFER;
+
+static TSM_SEGMENT_BUFFER Segment_Buffers[MAX_TSM_SEGMENTED_ACKS];
+#endif
+
+static bool tsm_segment_buffer_alloc(
+    BACNET_TSM_DATA * tsm)
+{
+#if (MAX_SEGMENTS_ACCEPTED > 1)
+    unsigned i = 0;
+
+    for (i = 0; i < MAX_TSM_SEGMENTED_ACKS; i++) {
+        if (!Segment_Buffers[i].in_use) {
+            Segment_Buffers[i].in_use = true;
+            Segment_Buffers[i].len = 0;
+            tsm->SegmentBuffer = (uint8_t) i;
+            return true;
+        }
+    }
+#else
+    (void) tsm;
+#endif
+
+    return false;
+}
+
+static void tsm_segment_buffer_free(
+    BACNET_TSM_DATA * tsm)
+{
+#if (MAX_SEGMENTS_ACCEPTED > 1)
+    if (tsm->SegmentBuffer < MAX_TSM_SEGMENTED_ACKS) {
+        Segment_Buffers[tsm->SegmentBuffer].in_use = false;
+    }
+#endif
+    tsm->SegmentBuffer = MAX_TSM_SEGMENTED_ACKS;
+}
+
+/* returns false if the segment doesn't fit */
+static bool tsm_segment_append(
+    BACNET_TSM_DATA * tsm,
+    uint8_t * data,
+    uint16_t len)
+{
+#if (MAX_SEGMENTS_ACCEPTED > 1)
+    TSM_SEGMENT_BUFFER *buffer = NULL;
+
+    if (tsm->SegmentBuffer >= MAX_TSM_SEGMENTED_ACKS) {
+        return false;
+    }
+    buffer = &Segment_Buffers[tsm->SegmentBuffer];
+    if (((unsigned) buffer->len + len) > sizeof(buffer->data)) {
+        return false;
+    }
+    memcpy(&buffer->data[buffer->len], data, len);
+    buffer->len += len;
+
+    return true;
+#else
+    (void) tsm;
+    (void) data;
+    (void) len;
+
+    return false;
+#endif
+}
+
+static void tsm_segment_buffer_get(
+    BACNET_TSM_DATA * tsm,
+    uint8_t ** data,
+    uint16_t * len)
+{
+#if (MAX_SEGMENTS_ACCEPTED > 1)
+    if (tsm->SegmentBuffer < MAX_TSM_SEGMENTED_ACKS) {
+        *data = &Segment_Buffers[tsm->SegmentBuffer].data[0];
+        *len = Segment_Buffers[tsm->SegmentBuffer].len;
+    }
+#else
+    (void) tsm;
+    (void) data;
+    (void) len;
+#endif
+}
+
+#if (MAX_TSM_TRANSACTIONS >= 0xFFFF)
+#error "MAX_TSM_TRANSACTIONS must fit the 16 bit TSM index"
+#endif
+/* the transactions are hashed by their peer and invoke ID, */
+/* an invoke ID is only unique for the peer it was sent to */
+#if (MAX_TSM_TRANSACTIONS > 1024)
+#define TSM_HASH_SIZE 4096
+#elif (MAX_TSM_TRANSACTIONS > 256)
+#define TSM_HASH_SIZE 1024
+#else
+#define TSM_HASH_SIZE 256
+#endif
+/* the end of a chain, or no transaction */
+#define TSM_NONE MAX_TSM_TRANSACTIONS
+
+/* the chains hold the index + 1, so zero is an empty chain */
+static uint16_t TSM_Hash[TSM_HASH_SIZE];
+/* the entries that were freed, chained through HashNext */
+static uint16_t TSM_Free;
+/* the entries below it have been used */
+static uint16_t TSM_Top;
+static uint16_t TSM_Count;
+/* the transactions using an invoke ID, whatever their peer */
+static uint16_t Invoke_ID_Uses[256];
+/* the peer of an invoke ID reserved before its peer is known */
+static BACNET_ADDRESS Unbound_Peer;
+static tsm_failed_function Failed_Function;
+static tsm_failed_function No_Buffer_Function;
+
 /* invoke ID for incrementing between subsequent calls. */
 static uint8_t Current_Invoke_ID = 1;
 
-// my tsm logic
-static bool MY_TSM_LOGIC = false;
-static uint8_t Old_Current_Invoke_ID = 0;
-
-void reset_tsm_logic()
+static unsigned tsm_hash(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID)
 {
-    if(MY_TSM_LOGIC)
-    {
-        MY_TSM_LOGIC = false;
-        Current_Invoke_ID = Old_Current_Invoke_ID;
+    /* the same octets bacnet_address_same compares */
+    uint8_t *octets = peer->net ? peer->adr : peer->mac;
+    uint8_t len = peer->net ? peer->len : peer->mac_len;
+    uint32_t hash = 2166136261UL;
+    uint8_t i = 0;
+
+    for (i = 0; (i < len) && (i < MAX_MAC_LEN); i++) {
+        hash = (hash ^ octets[i]) * 16777619UL;
     }
+    hash = (hash ^ (peer->net & 0xFF)) * 16777619UL;
+    hash = (hash ^ (peer->net >> 8)) * 16777619UL;
+    hash = (hash ^ invokeID) * 16777619UL;
+
+    return (unsigned) (hash & (TSM_HASH_SIZE - 1));
 }
 
-/* returns MAX_TSM_TRANSACTIONS if not found */
-static uint8_t tsm_find_invokeID_index(
+/* returns TSM_NONE if not found */
+static uint16_t tsm_find_index(
+    BACNET_ADDRESS * peer,
     uint8_t invokeID)
 {
-    if(MY_TSM_LOGIC)
-    {
-        return MAX_TSM_TRANSACTIONS;
+    uint16_t index = TSM_NONE;
+    uint16_t next = 0;
+
+    if (invokeID == 0) {
+        return TSM_NONE;
+    }
+    next = TSM_Hash[tsm_hash(peer, invokeID)];
+    while (next) {
+        index = next - 1;
+        if ((TSM_List[index].InvokeID == invokeID) &&
+            bacnet_address_same(&TSM_List[index].dest, peer)) {
+            return index;
+        }
+        next = TSM_List[index].HashNext;
     }
 
-    unsigned i = 0;     /* counter */
-    uint8_t index = MAX_TSM_TRANSACTIONS;       /* return value */
+    return TSM_NONE;
+}
 
-    for (i = 0; i < MAX_TSM_TRANSACTIONS; i++) {
-        if (TSM_List[i].InvokeID == invokeID) {
-            index = (uint8_t) i;
+static void tsm_hash_insert(
+    uint16_t index)
+{
+    unsigned bucket = tsm_hash(&TSM_List[index].dest,
+        TSM_List[index].InvokeID);
+
+    TSM_List[index].HashNext = TSM_Hash[bucket];
+    TSM_Hash[bucket] = index + 1;
+}
+
+static void tsm_hash_remove(
+    uint16_t index)
+{
+    uint16_t *next = &TSM_Hash[tsm_hash(&TSM_List[index].dest,
+            TSM_List[index].InvokeID)];
+
+    while (*next) {
+        if (*next == (index + 1)) {
+            *next = TSM_List[index].HashNext;
             break;
         }
+        next = &TSM_List[*next - 1].HashNext;
     }
+}
+
+/* takes an unused entry for the invoke ID, returns TSM_NONE if none */
+static uint16_t tsm_alloc(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID)
+{
+    uint16_t index = TSM_NONE;
+
+    if (TSM_Free) {
+        index = TSM_Free - 1;
+        TSM_Free = TSM_List[index].HashNext;
+    } else if (TSM_Top < MAX_TSM_TRANSACTIONS) {
+        index = TSM_Top++;
+    } else {
+        return TSM_NONE;
+    }
+    TSM_List[index].InvokeID = invokeID;
+    bacnet_address_copy(&TSM_List[index].dest, peer);
+    TSM_List[index].state = TSM_STATE_IDLE;
+    TSM_List[index].RequestTimer = apdu_timeout();
+    TSM_List[index].SegmentCount = 0;
+    TSM_List[index].SegmentBuffer = MAX_TSM_SEGMENTED_ACKS;
+    TSM_List[index].Context = NULL;
+    tsm_hash_insert(index);
+    Invoke_ID_Uses[invokeID]++;
+    TSM_Count++;
 
     return index;
 }
 
-static uint8_t tsm_find_first_free_index(
-    void)
+/* frees the entry, and returns the context it held */
+static void *tsm_release(
+    uint16_t index)
 {
-    if(MY_TSM_LOGIC)
-    {
-        return Current_Invoke_ID;
-    }
+    BACNET_TSM_DATA *tsm = &TSM_List[index];
+    void *context = tsm->Context;
 
-    unsigned i = 0;     /* counter */
-    uint8_t index = MAX_TSM_TRANSACTIONS;       /* return value */
+    tsm_hash_remove(index);
+    tsm_segment_buffer_free(tsm);
+    Invoke_ID_Uses[tsm->InvokeID]--;
+    TSM_Count--;
+    tsm->state = TSM_STATE_IDLE;
+    tsm->InvokeID = 0;
+    tsm->Context = NULL;
+    tsm->HashNext = TSM_Free;
+    TSM_Free = index + 1;
 
-    for (i = 0; i < MAX_TSM_TRANSACTIONS; i++) {
-        if (TSM_List[i].InvokeID == 0) {
-            index = (uint8_t) i;
-            break;
+    return context;
+}
+
+/* by the invoke ID alone, for the callers that don't tell the peer.
+   returns TSM_NONE if not found */
+static uint16_t tsm_find_invokeID_index(
+    uint8_t invokeID)
+{
+    uint16_t index = TSM_NONE;
+    unsigned i = 0;
+
+    if ((invokeID == 0) || (Invoke_ID_Uses[invokeID] == 0)) {
+        return TSM_NONE;
+    }
+    index = tsm_find_index(&Unbound_Peer, invokeID);
+    if (index != TSM_NONE) {
+        return index;
+    }
+    for (i = 0; i < TSM_Top; i++) {
+        if (TSM_List[i].InvokeID == invokeID) {
+            return (uint16_t) i;
         }
     }
 
-    return index;
+    return TSM_NONE;
 }
 
-bool tsm_transaction_available(
-    void)
+/* the transaction a request to dest is sent with, binding the
+   invoke ID reserved without a peer to dest */
+static uint16_t tsm_bind(
+    uint8_t invokeID,
+    BACNET_ADDRESS * dest)
 {
-    if(MY_TSM_LOGIC)
-    {
-        return true;
+    uint16_t index = tsm_find_index(dest, invokeID);
+
+    if (index != TSM_NONE) {
+        return index;
+    }
+    index = tsm_find_index(&Unbound_Peer, invokeID);
+    if (index != TSM_NONE) {
+        tsm_hash_remove(index);
+        bacnet_address_copy(&TSM_List[index].dest, dest);
+        tsm_hash_insert(index);
     }
 
-    bool status = false;        /* return value */
-    unsigned i = 0;     /* counter */
+    return index;
+}
 
-    for (i = 0; i < MAX_TSM_TRANSACTIONS; i++) {
-        if (TSM_List[i].InvokeID == 0) {
-            /* one is available! */
-            status = true;
-            break;
-        }
+static void tsm_next_invokeID(
+    void)
+{
+    Current_Invoke_ID++;
+    /* skip zero - we treat that internally as invalid or no free */
+    if (Current_Invoke_ID == 0) {
+        Current_Invoke_ID = 1;
     }
+}
 
-    return status;
+bool tsm_transaction_available(
+    void)
+{
+    return TSM_Count < MAX_TSM_TRANSACTIONS;
 }
 
 uint8_t tsm_transaction_idle_count(
     void)
 {
-    uint8_t count = 0;  /* return value */
-    unsigned i = 0;     /* counter */
+    unsigned count = MAX_TSM_TRANSACTIONS - TSM_Count;
 
-    for (i = 0; i < MAX_TSM_TRANSACTIONS; i++) {
-        if ((TSM_List[i].InvokeID == 0) &&
-            (TSM_List[i].state == TSM_STATE_IDLE)) {
-            /* one is available! */
-            count++;
-        }
-    }
-
-    return count;
+    return (uint8_t) (count > 255 ? 255 : count);
 }
 
 /* sets the invokeID */
@@ -176,44 +393,45 @@ void tsm_invokeID_set(
 uint8_t tsm_next_free_invokeID(
     void)
 {
-    uint8_t index = 0;
+    unsigned i = 0;
     uint8_t invokeID = 0;
-    bool found = false;
 
-    /* is there even space available? */
-    if (tsm_transaction_available()) {
-        while (!found) {
-            index = tsm_find_invokeID_index(Current_Invoke_ID);
-            if (index == MAX_TSM_TRANSACTIONS) {
-                /* Not found, so this invokeID is not used */
-                found = true;
-                /* set this id into the table */
-                index = tsm_find_first_free_index();
-                if (index != MAX_TSM_TRANSACTIONS) {
-                    TSM_List[index].InvokeID = invokeID = Current_Invoke_ID;
-                    TSM_List[index].state = TSM_STATE_IDLE;
-                    TSM_List[index].RequestTimer = apdu_timeout();
-                    /* update for the next call or check */
-                    Current_Invoke_ID++;
-                    /* skip zero - we treat that internally as invalid or no free */
-                    if (Current_Invoke_ID == 0) {
-                        Current_Invoke_ID = 1;
-                    }
-                }
-            } else {
-                /* found! This invokeID is already used */
-                /* try next one */
-                Current_Invoke_ID++;
-                /* skip zero - we treat that internally as invalid or no free */
-                if (Current_Invoke_ID == 0) {
-                    Current_Invoke_ID = 1;
-                }
-            }
+    if (!tsm_transaction_available()) {
+        return 0;
+    }
+    /* unused by any peer, as its peer isn't known yet */
+    for (i = 0; i < 255; i++) {
+        invokeID = Current_Invoke_ID;
+        tsm_next_invokeID();
+        if (Invoke_ID_Uses[invokeID] == 0) {
+            tsm_alloc(&Unbound_Peer, invokeID);
+            return invokeID;
+        }
+    }
+
+    return 0;
+}
+
+uint8_t tsm_next_free_peer_invokeID(
+    BACNET_ADDRESS * dest)
+{
+    unsigned i = 0;
+    uint8_t invokeID = 0;
+
+    if (!dest || !tsm_transaction_available()) {
+        return 0;
+    }
+    for (i = 0; i < 255; i++) {
+        invokeID = Current_Invoke_ID;
+        tsm_next_invokeID();
+        if ((tsm_find_index(dest, invokeID) == TSM_NONE) &&
+            (tsm_find_index(&Unbound_Peer, invokeID) == TSM_NONE)) {
+            tsm_alloc(dest, invokeID);
+            return invokeID;
         }
     }
 
-    reset_tsm_logic();
-    return invokeID;
+    return 0;
 }
 
 void tsm_set_confirmed_unsegmented_transaction(
@@ -224,14 +442,15 @@ void tsm_set_confirmed_unsegmented_transaction(
     uint16_t apdu_len)
 {
     uint16_t j = 0;
-    uint8_t index;
+    uint16_t index;
 
     if (invokeID) {
-        index = tsm_find_invokeID_index(invokeID);
+        index = tsm_bind(invokeID, dest);
         if (index < MAX_TSM_TRANSACTIONS) {
             /* SendConfirmedUnsegmented */
             TSM_List[index].state = TSM_STATE_AWAIT_CONFIRMATION;
             TSM_List[index].RetryCount = 0;
+            TSM_List[index].SegmentCount = 0;
             /* start the timer */
             TSM_List[index].RequestTimer = apdu_timeout();
             /* copy the data */
@@ -240,7 +459,6 @@ void tsm_set_confirmed_unsegmented_transaction(
             }
             TSM_List[index].apdu_len = apdu_len;
             npdu_copy_data(&TSM_List[index].npdu_data, ndpu_data);
-            bacnet_address_copy(&TSM_List[index].dest, dest);
         }
     }
 
@@ -257,7 +475,7 @@ bool tsm_get_transaction_pdu(
     uint16_t * apdu_len)
 {
     uint16_t j = 0;
-    uint8_t index;
+    uint16_t index;
     bool found = false;
 
     if (invokeID) {
@@ -280,13 +498,410 @@ bool tsm_get_transaction_pdu(
     return found;
 }
 
+bool tsm_set_context(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID,
+    void *context)
+{
+    uint16_t index = tsm_find_index(peer, invokeID);
+
+    if (index == TSM_NONE) {
+        return false;
+    }
+    TSM_List[index].Context = context;
+
+    return true;
+}
+
+void *tsm_take_context(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID)
+{
+    uint16_t index = tsm_find_index(peer, invokeID);
+    void *context = NULL;
+
+    if (index != TSM_NONE) {
+        context = TSM_List[index].Context;
+        TSM_List[index].Context = NULL;
+    }
+
+    return context;
+}
+
+void tsm_set_failed_handler(
+    tsm_failed_function pFunction)
+{
+    Failed_Function = pFunction;
+}
+
+void tsm_set_no_buffer_handler(
+    tsm_failed_function pFunction)
+{
+    No_Buffer_Function = pFunction;
+}
+
+/* frees the transaction, and tells about a context nobody took */
+static void tsm_end(
+    uint16_t index)
+{
+    BACNET_ADDRESS peer;
+    uint8_t invokeID = TSM_List[index].InvokeID;
+    void *context = NULL;
+
+    bacnet_address_copy(&peer, &TSM_List[index].dest);
+    context = tsm_release(index);
+    if (context && Failed_Function) {
+        Failed_Function(&peer, invokeID, context);
+    }
+}
+
+/* sends an APDU that expects no reply, as a SegmentACK or an Abort */
+static void tsm_send_apdu(
+    BACNET_ADDRESS * dest,
+    uint8_t * apdu,
+    unsigned apdu_len)
+{
+    uint8_t pdu[MAX_PDU];
+    BACNET_ADDRESS my_address;
+    BACNET_NPDU_DATA npdu_data;
+    int pdu_len = 0;
+
+    datalink_get_my_address(&my_address);
+    npdu_encode_npdu_data(&npdu_data, false, MESSAGE_PRIORITY_NORMAL);
+    pdu_len = npdu_encode_pdu(&pdu[0], dest, &my_address, &npdu_data);
+    memcpy(&pdu[pdu_len], apdu, apdu_len);
+    datalink_send_pdu(dest, &npdu_data, &pdu[0], pdu_len + apdu_len);
+}
+
+static void tsm_send_segment_ack(
+    BACNET_ADDRESS * dest,
+    uint8_t invokeID,
+    uint8_t sequence_number,
+    uint8_t actual_window_size,
+    bool nak)
+{
+    uint8_t apdu[4];
+
+    apdu[0] = PDU_TYPE_SEGMENT_ACK;
+    if (nak) {
+        apdu[0] |= BIT1;
+    }
+    apdu[1] = invokeID;
+    apdu[2] = sequence_number;
+    apdu[3] = actual_window_size;
+    tsm_send_apdu(dest, &apdu[0], sizeof(apdu));
+}
+
+/* sends one segment of a segmented request */
+static void tsm_send_segment(
+    BACNET_TSM_DATA * tsm,
+    uint8_t sequence_number)
+{
+    uint8_t pdu[MAX_PDU];
+    uint8_t *apdu = &tsm->apdu[tsm->npdu_len];
+    unsigned service_len = tsm->apdu_len - tsm->npdu_len - 4;
+    unsigned offset = (unsigned) sequence_number * tsm->SegmentSize;
+    unsigned len = service_len - offset;
+    bool more_follows = (sequence_number + 1) < tsm->SegmentCount;
+    unsigned pdu_len = 0;
+
+    if (len > tsm->SegmentSize) {
+        len = tsm->SegmentSize;
+    }
+    memcpy(&pdu[0], &tsm->apdu[0], tsm->npdu_len);
+    pdu_len = tsm->npdu_len;
+    pdu[pdu_len++] = apdu[0] | BIT3 | (more_follows ? BIT2 : 0);
+    pdu[pdu_len++] = apdu[1];   /* max segments and max APDU accepted */
+    pdu[pdu_len++] = apdu[2];   /* invoke ID */
+    pdu[pdu_len++] = sequence_number;
+    pdu[pdu_len++] = tsm->ProposedWindowSize;
+    pdu[pdu_len++] = apdu[3];   /* service choice */
+    memcpy(&pdu[pdu_len], &apdu[4 + offset], len);
+    pdu_len += len;
+    datalink_send_pdu(&tsm->dest, &tsm->npdu_data, &pdu[0], pdu_len);
+    if (!more_follows) {
+        tsm->SentAllSegments = true;
+    }
+}
+
+/* sends the segments of a window, from the sequence number on */
+static void tsm_fill_window(
+    BACNET_TSM_DATA * tsm,
+    uint8_t sequence_number)
+{
+    unsigned i = 0;
+
+    for (i = 0; (i < tsm->ActualWindowSize) &&
+        ((sequence_number + i) < tsm->SegmentCount); i++) {
+        tsm_send_segment(tsm, (uint8_t) (sequence_number + i));
+    }
+    tsm->SegmentTimer = apdu_timeout();
+}
+
+/* starts, or starts over, sending a segmented request */
+static void tsm_start_segmented_request(
+    BACNET_TSM_DATA * tsm)
+{
+    tsm->state = TSM_STATE_SEGMENTED_REQUEST;
+    tsm->SentAllSegments = false;
+    tsm->SegmentRetryCount = 0;
+    tsm->InitialSequenceNumber = 0;
+    /* only the first segment, until the SegmentACK tells the window */
+    tsm->ActualWindowSize = 1;
+    tsm->ProposedWindowSize = TSM_WINDOW_SIZE;
+    tsm_fill_window(tsm, 0);
+}
+
+bool tsm_set_confirmed_segmented_transaction(
+    uint8_t invokeID,
+    BACNET_ADDRESS * dest,
+    BACNET_NPDU_DATA * ndpu_data,
+    uint8_t * pdu,
+    uint16_t pdu_len,
+    unsigned max_apdu)
+{
+    BACNET_ADDRESS npdu_dest;
+    BACNET_ADDRESS npdu_src;
+    BACNET_NPDU_DATA npdu_data;
+    BACNET_TSM_DATA *tsm = NULL;
+    int npdu_len = 0;
+    unsigned service_len = 0;
+    unsigned segment_size = 0;
+    unsigned segment_count = 0;
+    uint16_t index;
+
+    if ((invokeID == 0) || (pdu_len > MAX_PDU) || (max_apdu <= 6)) {
+        return false;
+    }
+    index = tsm_bind(invokeID, dest);
+    if (index >= MAX_TSM_TRANSACTIONS) {
+        return false;
+    }
+    npdu_len = npdu_decode(&pdu[0], &npdu_dest, &npdu_src, &npdu_data);
+    if ((npdu_len <= 0) || (pdu_len < (npdu_len + 4))) {
+        return false;
+    }
+    /* the segmented request header takes two more octets */
+    service_len = pdu_len - npdu_len - 4;
+    segment_size = max_apdu - 6;
+    segment_count = (service_len + segment_size - 1) / segment_size;
+    if (segment_count > 256) {
+        return false;
+    }
+    if (segment_count < 2) {
+        tsm_set_confirmed_unsegmented_transaction(invokeID, dest, ndpu_data,
+            pdu, pdu_len);
+        datalink_send_pdu(dest, ndpu_data, pdu, pdu_len);
+        return true;
+    }
+
+    tsm = &TSM_List[index];
+    tsm->RetryCount = 0;
+    memcpy(&tsm->apdu[0], pdu, pdu_len);
+    tsm->apdu_len = pdu_len;
+    tsm->npdu_len = (uint16_t) npdu_len;
+    tsm->SegmentSize = (uint16_t) segment_size;
+    tsm->SegmentCount = (uint16_t) segment_count;
+    npdu_copy_data(&tsm->npdu_data, ndpu_data);
+    tsm_start_segmented_request(tsm);
+
+    return true;
+}
+
+void tsm_segment_ack_received(
+    BACNET_ADDRESS * src,
+    uint8_t invokeID,
+    uint8_t sequence_number,
+    uint8_t actual_window_size,
+    bool nak)
+{
+    BACNET_TSM_DATA *tsm = NULL;
+    unsigned next = (unsigned) sequence_number + 1;
+    uint16_t index;
+
+    /* a negative ACK asks for the same as a positive one does:
+       the segments after the last one received in order */
+    (void) nak;
+    index = tsm_find_index(src, invokeID);
+    if (index >= MAX_TSM_TRANSACTIONS) {
+        return;
+    }
+    tsm = &TSM_List[index];
+    if (tsm->state != TSM_STATE_SEGMENTED_REQUEST) {
+        return;
+    }
+    /* a duplicate, or not for the current window */
+    if ((next < tsm->InitialSequenceNumber) ||
+        (next > (unsigned) tsm->InitialSequenceNumber +
+            tsm->ActualWindowSize)) {
+        return;
+    }
+    if (next >= tsm->SegmentCount) {
+        /* all the segments are acknowledged, wait for the response */
+        tsm->state = TSM_STATE_AWAIT_CONFIRMATION;
+        tsm->RequestTimer = apdu_timeout();
+        return;
+    }
+    tsm->ActualWindowSize = actual_window_size ? actual_window_size : 1;
+    if (tsm->ActualWindowSize > tsm->ProposedWindowSize) {
+        tsm->ActualWindowSize = tsm->ProposedWindowSize;
+    }
+    tsm->InitialSequenceNumber = (uint8_t) next;
+    tsm->SegmentRetryCount = 0;
+    tsm_fill_window(tsm, (uint8_t) next);
+}
+
+/* gives up on an ACK being received, and tells the peer */
+static int tsm_abort_segmented_ack(
+    BACNET_TSM_DATA * tsm,
+    uint8_t reason,
+    uint8_t * abort_reason)
+{
+    uint8_t apdu[3];
+    int apdu_len = 0;
+
+    apdu_len = abort_encode_apdu(&apdu[0], tsm->InvokeID, reason, false);
+    tsm_send_apdu(&tsm->dest, &apdu[0], apdu_len);
+    tsm_segment_buffer_free(tsm);
+    tsm->state = TSM_STATE_IDLE;
+    *abort_reason = reason;
+
+    return -1;
+}
+
+/* no buffer for the ACK: aborts it, frees the transaction, and hands */
+/* the context to the no buffer handler */
+static int tsm_no_buffer(
+    uint16_t index)
+{
+    BACNET_ADDRESS peer;
+    uint8_t invokeID = TSM_List[index].InvokeID;
+    uint8_t reason = 0;
+    void *context = NULL;
+
+    tsm_abort_segmented_ack(&TSM_List[index],
+        ABORT_REASON_OUT_OF_RESOURCES, &reason);
+    bacnet_address_copy(&peer, &TSM_List[index].dest);
+    context = tsm_release(index);
+    No_Buffer_Function(&peer, invokeID, context);
+
+    return -2;
+}
+
+int tsm_segmented_ack_received(
+    BACNET_ADDRESS * src,
+    BACNET_CONFIRMED_SERVICE_ACK_DATA * service_data,
+    uint8_t service_choice,
+    uint8_t ** service_request,
+    uint16_t * service_request_len,
+    uint8_t * abort_reason)
+{
+    BACNET_TSM_DATA *tsm = NULL;
+    uint8_t sequence_number = service_data->sequence_number;
+    uint16_t index;
+
+    (void) service_choice;
+    index = tsm_find_index(src, service_data->invoke_id);
+    if (index >= MAX_TSM_TRANSACTIONS) {
+        return 0;
+    }
+    tsm = &TSM_List[index];
+    if ((tsm->state == TSM_STATE_AWAIT_CONFIRMATION) ||
+        ((tsm->state == TSM_STATE_SEGMENTED_REQUEST) &&
+            tsm->SentAllSegments)) {
+        if (sequence_number != 0) {
+            return 0;
+        }
+        /* the first segment */
+        if (!tsm_segment_buffer_alloc(tsm)) {
+            /* our buffers are busy, not the peer's fault: the sender */
+            /* gets its request back to send it again as it is */
+            if (tsm->Context && No_Buffer_Function) {
+                return tsm_no_buffer(index);
+            }
+            return tsm_abort_segmented_ack(tsm,
+                ABORT_REASON_OUT_OF_RESOURCES, abort_reason);
+        }
+        if (!tsm_segment_append(tsm, *service_request, *service_request_len)) {
+            return tsm_abort_segmented_ack(tsm, ABORT_REASON_BUFFER_OVERFLOW,
+                abort_reason);
+        }
+        tsm->InitialSequenceNumber = 0;
+        tsm->LastSequenceNumber = 0;
+        tsm->ActualWindowSize = service_data->proposed_window_number;
+        if (tsm->ActualWindowSize == 0) {
+            tsm->ActualWindowSize = 1;
+        } else if (tsm->ActualWindowSize > TSM_WINDOW_SIZE) {
+            tsm->ActualWindowSize = TSM_WINDOW_SIZE;
+        }
+        tsm_send_segment_ack(src, tsm->InvokeID, 0, tsm->ActualWindowSize,
+            false);
+        if (!service_data->more_follows) {
+            tsm_segment_buffer_get(tsm, service_request, service_request_len);
+            return 1;
+        }
+        tsm->state = TSM_STATE_SEGMENTED_CONFIRMATION;
+        tsm->SegmentTimer = apdu_timeout();
+        return 0;
+    }
+    if (tsm->state != TSM_STATE_SEGMENTED_CONFIRMATION) {
+        return 0;
+    }
+
+    tsm->SegmentTimer = apdu_timeout();
+    if (sequence_number != (uint8_t) (tsm->LastSequenceNumber + 1)) {
+        /* lost or duplicate: ask for the ones after the last in order */
+        tsm_send_segment_ack(src, tsm->InvokeID, tsm->LastSequenceNumber,
+            tsm->ActualWindowSize, true);
+        tsm->InitialSequenceNumber = tsm->LastSequenceNumber;
+        return 0;
+    }
+    if (!tsm_segment_append(tsm, *service_request, *service_request_len)) {
+        return tsm_abort_segmented_ack(tsm, ABORT_REASON_BUFFER_OVERFLOW,
+            abort_reason);
+    }
+    tsm->LastSequenceNumber = sequence_number;
+    if (!service_data->more_follows) {
+        tsm_send_segment_ack(src, tsm->InvokeID, sequence_number,
+            tsm->ActualWindowSize, false);
+        tsm_segment_buffer_get(tsm, service_request, service_request_len);
+        return 1;
+    }
+    if (sequence_number ==
+        (uint8_t) (tsm->InitialSequenceNumber + tsm->ActualWindowSize)) {
+        /* the window is full */
+        tsm_send_segment_ack(src, tsm->InvokeID, sequence_number,
+            tsm->ActualWindowSize, false);
+        tsm->InitialSequenceNumber = sequence_number;
+    }
+
+    return 0;
+}
+
+/* no confirmation came */
+static void tsm_failed(
+    uint16_t index)
+{
+    tsm_segment_buffer_free(&TSM_List[index]);
+    /* note: the invoke id has not been cleared yet
+       and this indicates a failed message:
+       IDLE and a valid invoke id */
+    TSM_List[index].state = TSM_STATE_IDLE;
+    /* unless the TSM owns the transactions, which is when there is */
+    /* a failed handler: they're freed, with or without a context, */
+    /* as nobody polls tsm_invoke_id_failed() for them */
+    if (Failed_Function) {
+        tsm_end(index);
+    }
+}
+
 /* called once a millisecond or slower */
 void tsm_timer_milliseconds(
     uint16_t milliseconds)
 {
     unsigned i = 0;     /* counter */
 
-    for (i = 0; i < MAX_TSM_TRANSACTIONS; i++) {
+    for (i = 0; i < TSM_Top; i++) {
         if (TSM_List[i].state == TSM_STATE_AWAIT_CONFIRMATION) {
             if (TSM_List[i].RequestTimer > milliseconds)
                 TSM_List[i].RequestTimer -= milliseconds;
@@ -297,30 +912,105 @@ void tsm_timer_milliseconds(
                 if (TSM_List[i].RetryCount < apdu_retries()) {
                     TSM_List[i].RequestTimer = apdu_timeout();
                     TSM_List[i].RetryCount++;
-                    datalink_send_pdu(&TSM_List[i].dest,
-                        &TSM_List[i].npdu_data, &TSM_List[i].apdu[0],
-                        TSM_List[i].apdu_len);
+                    if (TSM_List[i].SegmentCount) {
+                        tsm_start_segmented_request(&TSM_List[i]);
+                    } else {
+                        datalink_send_pdu(&TSM_List[i].dest,
+                            &TSM_List[i].npdu_data, &TSM_List[i].apdu[0],
+                            TSM_List[i].apdu_len);
+                    }
+                } else {
+                    tsm_failed((uint16_t) i);
+                }
+            }
+        } else if (TSM_List[i].state == TSM_STATE_SEGMENTED_REQUEST) {
+            if (TSM_List[i].SegmentTimer > milliseconds)
+                TSM_List[i].SegmentTimer -= milliseconds;
+            else
+                TSM_List[i].SegmentTimer = 0;
+            if (TSM_List[i].SegmentTimer == 0) {
+                if (TSM_List[i].SegmentRetryCount < apdu_retries()) {
+                    TSM_List[i].SegmentRetryCount++;
+                    tsm_fill_window(&TSM_List[i],
+                        TSM_List[i].InitialSequenceNumber);
                 } else {
-                    /* note: the invoke id has not been cleared yet
-                       and this indicates a failed message:
-                       IDLE and a valid invoke id */
-                    TSM_List[i].state = TSM_STATE_IDLE;
+                    tsm_failed((uint16_t) i);
                 }
             }
+        } else if (TSM_List[i].state == TSM_STATE_SEGMENTED_CONFIRMATION) {
+            if (TSM_List[i].SegmentTimer > milliseconds)
+                TSM_List[i].SegmentTimer -= milliseconds;
+            else
+                TSM_List[i].SegmentTimer = 0;
+            if (TSM_List[i].SegmentTimer == 0) {
+                /* the rest of the ACK never came */
+                tsm_failed((uint16_t) i);
+            }
         }
     }
 }
 
+uint16_t tsm_timer_next_expiry(
+    void)
+{
+    unsigned i = 0;     /* counter */
+    uint16_t next = 0xFFFF;
+
+    for (i = 0; i < TSM_Top; i++) {
+        if (TSM_List[i].state == TSM_STATE_AWAIT_CONFIRMATION) {
+            if (TSM_List[i].RequestTimer < next)
+                next = TSM_List[i].RequestTimer;
+        } else if ((TSM_List[i].state == TSM_STATE_SEGMENTED_REQUEST) ||
+            (TSM_List[i].state == TSM_STATE_SEGMENTED_CONFIRMATION)) {
+            if (TSM_List[i].SegmentTimer < next)
+                next = TSM_List[i].SegmentTimer;
+        }
+    }
+
+    return next;
+}
+
 /* frees the invokeID and sets its state to IDLE */
 void tsm_free_invoke_id(
     uint8_t invokeID)
 {
-    uint8_t index;
+    uint16_t index;
 
     index = tsm_find_invokeID_index(invokeID);
     if (index < MAX_TSM_TRANSACTIONS) {
-        TSM_List[index].state = TSM_STATE_IDLE;
-        TSM_List[index].InvokeID = 0;
+        tsm_end(index);
+    }
+}
+
+void tsm_free_peer_invoke_id(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID)
+{
+    uint16_t index;
+
+    index = tsm_find_index(peer, invokeID);
+    if (index < MAX_TSM_TRANSACTIONS) {
+        tsm_end(index);
+    }
+}
+
+void tsm_free_all(
+    tsm_failed_function pFunction)
+{
+    BACNET_ADDRESS peer;
+    uint8_t invokeID = 0;
+    void *context = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < TSM_Top; i++) {
+        if (TSM_List[i].InvokeID) {
+            invokeID = TSM_List[i].InvokeID;
+            bacnet_address_copy(&peer, &TSM_List[i].dest);
+            context = tsm_release((uint16_t) i);
+            if (context && pFunction) {
+                pFunction(&peer, invokeID, context);
+            }
+        }
     }
 }
 
@@ -332,7 +1022,7 @@ bool tsm_invoke_id_free(
     uint8_t invokeID)
 {
     bool status = true;
-    uint8_t index;
+    uint16_t index;
 
     index = tsm_find_invokeID_index(invokeID);
     if (index < MAX_TSM_TRANSACTIONS)
@@ -341,6 +1031,13 @@ bool tsm_invoke_id_free(
     return status;
 }
 
+bool tsm_peer_invoke_id_free(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID)
+{
+    return tsm_find_index(peer, invokeID) == TSM_NONE;
+}
+
 /** See if we failed get a confirmation for the message associated
  *  with this invoke ID.
  * @param invokeID [in] The invokeID to be checked, normally of last message sent.
@@ -351,7 +1048,7 @@ bool tsm_invoke_id_failed(
     uint8_t invokeID)
 {
     bool status = false;
-    uint8_t index;
+    uint16_t index;
 
     index = tsm_find_invokeID_index(invokeID);
     if (index < MAX_TSM_TRANSACTIONS) {
@@ -364,14 +1061,6 @@ bool tsm_invoke_id_failed(
     return status;
 }
 
-void my_tsm_logic_invokeID_set(
-    uint8_t invokeID)
-{
-    MY_TSM_LOGIC = true;
-    Old_Current_Invoke_ID = Current_Invoke_ID;
-    Current_Invoke_ID = invokeID;
-}
-
 #ifdef TEST
 #include <assert.h>
 #include <string.h>
@@ -380,7 +1069,11 @@ void my_tsm_logic_invokeID_set(
 /* flag to send an I-Am */
 bool I_Am_Request = true;
 
-/* dummy function stubs */
+/* the PDUs sent, and a copy of the last one */
+static unsigned Sent_Count;
+static uint8_t Sent_PDU[MAX_PDU];
+static unsigned Sent_PDU_Len;
+
 int datalink_send_pdu(
     BACNET_ADDRESS * dest,
     BACNET_NPDU_DATA * npdu_data,
@@ -389,10 +1082,11 @@ int datalink_send_pdu(
 {
     (void) dest;
     (void) npdu_data;
-    (void) pdu;
-    (void) pdu_len;
+    Sent_Count++;
+    memcpy(&Sent_PDU[0], pdu, pdu_len);
+    Sent_PDU_Len = pdu_len;
 
-    return 0;
+    return (int) pdu_len;
 }
 
 /* dummy function stubs */
@@ -402,11 +1096,459 @@ void datalink_get_broadcast_address(
     (void) dest;
 }
 
+void datalink_get_my_address(
+    BACNET_ADDRESS * my_address)
+{
+    memset(my_address, 0, sizeof(BACNET_ADDRESS));
+    my_address->mac_len = 1;
+    my_address->mac[0] = 1;
+}
+
+uint16_t apdu_timeout(
+    void)
+{
+    return 3000;
+}
+
+uint8_t apdu_retries(
+    void)
+{
+    return 3;
+}
+
+/* the APDU of the last PDU sent */
+static uint8_t *Sent_APDU(
+    unsigned *apdu_len)
+{
+    BACNET_ADDRESS dest;
+    BACNET_ADDRESS src;
+    BACNET_NPDU_DATA npdu_data;
+    int npdu_len = 0;
+
+    npdu_len = npdu_decode(&Sent_PDU[0], &dest, &src, &npdu_data);
+    *apdu_len = Sent_PDU_Len - npdu_len;
+
+    return &Sent_PDU[npdu_len];
+}
+
+/* the transactions handed back for lack of a buffer */
+static unsigned No_Buffer_Count;
+static void *No_Buffer_Context;
+
+static void testTSMNoBuffer(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID,
+    void *context)
+{
+    (void) peer;
+    (void) invokeID;
+    No_Buffer_Count++;
+    No_Buffer_Context = context;
+}
+
+static void testTSMSegmentedAck(
+    Test * pTest,
+    BACNET_ADDRESS * peer)
+{
+    BACNET_NPDU_DATA npdu_data;
+    BACNET_CONFIRMED_SERVICE_ACK_DATA ack_data;
+    uint8_t pdu[16];
+    uint8_t segment[MAX_APDU];
+    uint8_t *service_request = NULL;
+    uint16_t service_request_len = 0;
+    uint8_t abort_reason = 0;
+    uint8_t *apdu = NULL;
+    unsigned apdu_len = 0;
+    unsigned count = 0;
+    uint8_t invoke_id = 0;
+    uint8_t invoke_ids[MAX_TSM_SEGMENTED_ACKS + 1];
+    uint8_t i = 0;
+    int status = 0;
+
+    npdu_encode_npdu_data(&npdu_data, true, MESSAGE_PRIORITY_NORMAL);
+    invoke_id = tsm_next_free_invokeID();
+    ct_test(pTest, invoke_id != 0);
+    tsm_set_confirmed_unsegmented_transaction(invoke_id, peer, &npdu_data,
+        &pdu[0], sizeof(pdu));
+
+    memset(&ack_data, 0, sizeof(ack_data));
+    ack_data.segmented_message = true;
+    ack_data.invoke_id = invoke_id;
+    ack_data.proposed_window_number = 2;
+    /* the first segment is acknowledged, with the window we take */
+    ack_data.more_follows = true;
+    ack_data.sequence_number = 0;
+    memset(&segment[0], 0, 10);
+    service_request = &segment[0];
+    service_request_len = 10;
+    status =
+        tsm_segmented_ack_received(peer, &ack_data,
+        SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &service_request,
+        &service_request_len, &abort_reason);
+    ct_test(pTest, status == 0);
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, apdu_len == 4);
+    ct_test(pTest, apdu[0] == PDU_TYPE_SEGMENT_ACK);
+    ct_test(pTest, apdu[1] == invoke_id);
+    ct_test(pTest, apdu[2] == 0);
+    ct_test(pTest, apdu[3] == 2);
+    /* then once per window */
+    count = Sent_Count;
+    for (i = 1; i <= 2; i++) {
+        ack_data.sequence_number = i;
+        memset(&segment[0], i, 10);
+        service_request = &segment[0];
+        service_request_len = 10;
+        status =
+            tsm_segmented_ack_received(peer, &ack_data,
+            SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &service_request,
+            &service_request_len, &abort_reason);
+        ct_test(pTest, status == 0);
+    }
+    ct_test(pTest, Sent_Count == (count + 1));
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, apdu[0] == PDU_TYPE_SEGMENT_ACK);
+    ct_test(pTest, apdu[2] == 2);
+    /* a lost segment is asked for again */
+    ack_data.sequence_number = 4;
+    service_request = &segment[0];
+    service_request_len = 10;
+    status =
+        tsm_segmented_ack_received(peer, &ack_data,
+        SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &service_request,
+        &service_request_len, &abort_reason);
+    ct_test(pTest, status == 0);
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, apdu[0] == (PDU_TYPE_SEGMENT_ACK | BIT1));
+    ct_test(pTest, apdu[2] == 2);
+    /* the last segment completes the ACK */
+    ack_data.sequence_number = 3;
+    ack_data.more_follows = false;
+    memset(&segment[0], 3, 5);
+    service_request = &segment[0];
+    service_request_len = 5;
+    status =
+        tsm_segmented_ack_received(peer, &ack_data,
+        SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &service_request,
+        &service_request_len, &abort_reason);
+    ct_test(pTest, status == 1);
+    ct_test(pTest, service_request_len == 35);
+    ct_test(pTest, service_request != &segment[0]);
+    for (i = 0; i < 35; i++) {
+        ct_test(pTest, service_request[i] == (i / 10));
+    }
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, apdu[0] == PDU_TYPE_SEGMENT_ACK);
+    ct_test(pTest, apdu[2] == 3);
+    tsm_free_invoke_id(invoke_id);
+    ct_test(pTest, tsm_invoke_id_free(invoke_id));
+
+    /* an ACK larger than we take is aborted */
+    invoke_id = tsm_next_free_invokeID();
+    tsm_set_confirmed_unsegmented_transaction(invoke_id, peer, &npdu_data,
+        &pdu[0], sizeof(pdu));
+    ack_data.invoke_id = invoke_id;
+    ack_data.proposed_window_number = 1;
+    ack_data.more_follows = true;
+    status = 0;
+    for (i = 0; (i <= MAX_SEGMENTS_ACCEPTED) && (status == 0); i++) {
+        ack_data.sequence_number = i;
+        service_request = &segment[0];
+        service_request_len = MAX_APDU;
+        status =
+            tsm_segmented_ack_received(peer, &ack_data,
+            SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &service_request,
+            &service_request_len, &abort_reason);
+    }
+    ct_test(pTest, status == -1);
+    ct_test(pTest, i == (MAX_SEGMENTS_ACCEPTED + 1));
+    ct_test(pTest, abort_reason == ABORT_REASON_BUFFER_OVERFLOW);
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, (apdu[0] & 0xF0) == PDU_TYPE_ABORT);
+    tsm_free_invoke_id(invoke_id);
+
+    /* with all the buffers busy, an ACK is aborted for lack of resources */
+    ack_data.sequence_number = 0;
+    ack_data.more_follows = true;
+    status = 0;
+    for (count = 0; (count <= MAX_TSM_SEGMENTED_ACKS) && (status == 0);
+        count++) {
+        invoke_ids[count] = tsm_next_free_invokeID();
+        tsm_set_confirmed_unsegmented_transaction(invoke_ids[count], peer,
+            &npdu_data, &pdu[0], sizeof(pdu));
+        ack_data.invoke_id = invoke_ids[count];
+        service_request = &segment[0];
+        service_request_len = 10;
+        status =
+            tsm_segmented_ack_received(peer, &ack_data,
+            SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &service_request,
+            &service_request_len, &abort_reason);
+    }
+    ct_test(pTest, status == -1);
+    ct_test(pTest, count == (MAX_TSM_SEGMENTED_ACKS + 1));
+    ct_test(pTest, abort_reason == ABORT_REASON_OUT_OF_RESOURCES);
+    /* with a no buffer handler, the request is handed back, freed */
+    tsm_set_no_buffer_handler(testTSMNoBuffer);
+    No_Buffer_Count = 0;
+    invoke_id = tsm_next_free_invokeID();
+    tsm_set_confirmed_unsegmented_transaction(invoke_id, peer, &npdu_data,
+        &pdu[0], sizeof(pdu));
+    ct_test(pTest, tsm_set_context(peer, invoke_id, &count));
+    ack_data.invoke_id = invoke_id;
+    service_request = &segment[0];
+    service_request_len = 10;
+    status =
+        tsm_segmented_ack_received(peer, &ack_data,
+        SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &service_request,
+        &service_request_len, &abort_reason);
+    ct_test(pTest, status == -2);
+    ct_test(pTest, No_Buffer_Count == 1);
+    ct_test(pTest, No_Buffer_Context == &count);
+    ct_test(pTest, tsm_peer_invoke_id_free(peer, invoke_id));
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, (apdu[0] & 0xF0) == PDU_TYPE_ABORT);
+    tsm_set_no_buffer_handler(NULL);
+    while (count > 0) {
+        tsm_free_invoke_id(invoke_ids[--count]);
+    }
+}
+
+/* a request of service_len octets of service data */
+static uint16_t encode_test_request(
+    uint8_t * pdu,
+    BACNET_ADDRESS * peer,
+    BACNET_NPDU_DATA * npdu_data,
+    uint8_t invoke_id,
+    unsigned service_len)
+{
+    BACNET_ADDRESS my_address;
+    int pdu_len = 0;
+    unsigned i = 0;
+
+    datalink_get_my_address(&my_address);
+    npdu_encode_npdu_data(npdu_data, true, MESSAGE_PRIORITY_NORMAL);
+    pdu_len = npdu_encode_pdu(&pdu[0], peer, &my_address, npdu_data);
+    pdu[pdu_len++] = PDU_TYPE_CONFIRMED_SERVICE_REQUEST;
+    pdu[pdu_len++] = encode_max_segs_max_apdu(0, MAX_APDU);
+    pdu[pdu_len++] = invoke_id;
+    pdu[pdu_len++] = SERVICE_CONFIRMED_READ_PROP_MULTIPLE;
+    for (i = 0; i < service_len; i++) {
+        pdu[pdu_len++] = (uint8_t) i;
+    }
+
+    return (uint16_t) pdu_len;
+}
+
+static void testTSMSegmentedRequest(
+    Test * pTest,
+    BACNET_ADDRESS * peer)
+{
+    BACNET_NPDU_DATA npdu_data;
+    uint8_t pdu[MAX_PDU];
+    uint16_t pdu_len = 0;
+    uint8_t *apdu = NULL;
+    unsigned apdu_len = 0;
+    unsigned count = 0;
+    uint8_t invoke_id = 0;
+    unsigned i = 0;
+    bool status = false;
+
+    /* 100 octets in segments of 44 */
+    invoke_id = tsm_next_free_invokeID();
+    pdu_len = encode_test_request(&pdu[0], peer, &npdu_data, invoke_id, 100);
+    count = Sent_Count;
+    status =
+        tsm_set_confirmed_segmented_transaction(invoke_id, peer, &npdu_data,
+        &pdu[0], pdu_len, 50);
+    ct_test(pTest, status);
+    /* only the first segment, until the window is known */
+    ct_test(pTest, Sent_Count == (count + 1));
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, apdu_len == (6 + 44));
+    ct_test(pTest, apdu[0] == (PDU_TYPE_CONFIRMED_SERVICE_REQUEST | BIT3 |
+            BIT2));
+    ct_test(pTest, apdu[2] == invoke_id);
+    ct_test(pTest, apdu[3] == 0);
+    ct_test(pTest, apdu[4] == TSM_WINDOW_SIZE);
+    ct_test(pTest, apdu[5] == SERVICE_CONFIRMED_READ_PROP_MULTIPLE);
+    ct_test(pTest, apdu[6] == 0);
+    /* an ACK from another peer is ignored */
+    peer->mac[0]++;
+    tsm_segment_ack_received(peer, invoke_id, 0, 4, false);
+    peer->mac[0]--;
+    ct_test(pTest, Sent_Count == (count + 1));
+    /* the rest fits the window */
+    tsm_segment_ack_received(peer, invoke_id, 0, 4, false);
+    ct_test(pTest, Sent_Count == (count + 3));
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, apdu_len == (6 + 12));
+    ct_test(pTest, apdu[0] == (PDU_TYPE_CONFIRMED_SERVICE_REQUEST | BIT3));
+    ct_test(pTest, apdu[3] == 2);
+    for (i = 0; i < 12; i++) {
+        ct_test(pTest, apdu[6 + i] == (88 + i));
+    }
+    /* all acknowledged, the response is awaited */
+    tsm_segment_ack_received(peer, invoke_id, 2, 4, false);
+    ct_test(pTest, !tsm_invoke_id_failed(invoke_id));
+    ct_test(pTest, !tsm_invoke_id_free(invoke_id));
+    tsm_free_invoke_id(invoke_id);
+
+    /* segments never acknowledged are sent again, then it fails */
+    invoke_id = tsm_next_free_invokeID();
+    pdu_len = encode_test_request(&pdu[0], peer, &npdu_data, invoke_id, 100);
+    status =
+        tsm_set_confirmed_segmented_transaction(invoke_id, peer, &npdu_data,
+        &pdu[0], pdu_len, 50);
+    ct_test(pTest, status);
+    count = Sent_Count;
+    for (i = 0; i < apdu_retries(); i++) {
+        tsm_timer_milliseconds(apdu_timeout());
+        ct_test(pTest, !tsm_invoke_id_failed(invoke_id));
+    }
+    ct_test(pTest, Sent_Count == (count + apdu_retries()));
+    tsm_timer_milliseconds(apdu_timeout());
+    ct_test(pTest, tsm_invoke_id_failed(invoke_id));
+    tsm_free_invoke_id(invoke_id);
+
+    /* a request that fits one APDU isn't segmented */
+    invoke_id = tsm_next_free_invokeID();
+    pdu_len = encode_test_request(&pdu[0], peer, &npdu_data, invoke_id, 40);
+    status =
+        tsm_set_confirmed_segmented_transaction(invoke_id, peer, &npdu_data,
+        &pdu[0], pdu_len, 50);
+    ct_test(pTest, status);
+    apdu = Sent_APDU(&apdu_len);
+    ct_test(pTest, apdu[0] == PDU_TYPE_CONFIRMED_SERVICE_REQUEST);
+    /* the next expiry is the one of its request timer */
+    ct_test(pTest, tsm_timer_next_expiry() == apdu_timeout());
+    tsm_timer_milliseconds(1000);
+    ct_test(pTest, tsm_timer_next_expiry() == (apdu_timeout() - 1000));
+    tsm_free_invoke_id(invoke_id);
+    ct_test(pTest, tsm_timer_next_expiry() == 0xFFFF);
+}
+
+/* the failed transactions */
+static unsigned Failed_Count;
+static uint8_t Failed_Invoke_ID;
+static void *Failed_Context;
+
+static void testTSMFailed(
+    BACNET_ADDRESS * peer,
+    uint8_t invokeID,
+    void *context)
+{
+    (void) peer;
+    Failed_Count++;
+    Failed_Invoke_ID = invokeID;
+    Failed_Context = context;
+}
+
+static void testTSMPeers(
+    Test * pTest,
+    BACNET_ADDRESS * peer)
+{
+    BACNET_ADDRESS other;
+    BACNET_NPDU_DATA npdu_data;
+    uint8_t pdu[16];
+    int context = 0;
+    uint8_t invoke_id = 0;
+    unsigned i = 0;
+
+    bacnet_address_copy(&other, peer);
+    other.mac[3]++;
+    /* each peer has its own invoke IDs */
+    tsm_invokeID_set(5);
+    invoke_id = tsm_next_free_peer_invokeID(peer);
+    ct_test(pTest, invoke_id == 5);
+    tsm_invokeID_set(5);
+    invoke_id = tsm_next_free_peer_invokeID(&other);
+    ct_test(pTest, invoke_id == 5);
+    tsm_invokeID_set(5);
+    invoke_id = tsm_next_free_peer_invokeID(peer);
+    ct_test(pTest, invoke_id == 6);
+    /* without a peer, one no peer uses */
+    tsm_invokeID_set(5);
+    invoke_id = tsm_next_free_invokeID();
+    ct_test(pTest, invoke_id == 7);
+    tsm_free_invoke_id(7);
+    tsm_free_peer_invoke_id(peer, 6);
+    ct_test(pTest, tsm_peer_invoke_id_free(peer, 6));
+    ct_test(pTest, !tsm_peer_invoke_id_free(peer, 5));
+    ct_test(pTest, !tsm_peer_invoke_id_free(&other, 5));
+
+    /* the context is kept until it's taken */
+    ct_test(pTest, tsm_set_context(peer, 5, &context));
+    ct_test(pTest, !tsm_set_context(peer, 6, &context));
+    ct_test(pTest, tsm_take_context(&other, 5) == NULL);
+    ct_test(pTest, tsm_take_context(peer, 5) == &context);
+    ct_test(pTest, tsm_take_context(peer, 5) == NULL);
+
+    /* the sender is told when no confirmation comes, after the retries */
+    tsm_set_failed_handler(testTSMFailed);
+    Failed_Count = 0;
+    npdu_encode_npdu_data(&npdu_data, true, MESSAGE_PRIORITY_NORMAL);
+    memset(&pdu[0], 0, sizeof(pdu));
+    tsm_set_confirmed_unsegmented_transaction(5, peer, &npdu_data, &pdu[0],
+        sizeof(pdu));
+    tsm_set_context(peer, 5, &context);
+    for (i = 0; i < apdu_retries(); i++) {
+        tsm_timer_milliseconds(apdu_timeout());
+    }
+    ct_test(pTest, Failed_Count == 0);
+    tsm_timer_milliseconds(apdu_timeout());
+    ct_test(pTest, Failed_Count == 1);
+    ct_test(pTest, Failed_Invoke_ID == 5);
+    ct_test(pTest, Failed_Context == &context);
+    ct_test(pTest, tsm_peer_invoke_id_free(peer, 5));
+    ct_test(pTest, !tsm_peer_invoke_id_free(&other, 5));
+    /* and when it's freed without the context taken */
+    tsm_set_context(&other, 5, &context);
+    tsm_free_peer_invoke_id(&other, 5);
+    ct_test(pTest, Failed_Count == 2);
+    ct_test(pTest, tsm_peer_invoke_id_free(&other, 5));
+    /* a failed one without a context is freed as well, nobody is told */
+    tsm_set_confirmed_unsegmented_transaction(5, peer, &npdu_data, &pdu[0],
+        sizeof(pdu));
+    for (i = 0; i <= apdu_retries(); i++) {
+        tsm_timer_milliseconds(apdu_timeout());
+    }
+    ct_test(pTest, Failed_Count == 2);
+    ct_test(pTest, tsm_peer_invoke_id_free(peer, 5));
+    tsm_set_failed_handler(NULL);
+
+    /* all the transactions, whatever their invoke IDs */
+    for (i = 0; i < MAX_TSM_TRANSACTIONS; i++) {
+        other.mac[5] = (uint8_t) (i / 200);
+        invoke_id = tsm_next_free_peer_invokeID(&other);
+        ct_test(pTest, invoke_id != 0);
+        tsm_set_context(&other, invoke_id, &context);
+    }
+    ct_test(pTest, !tsm_transaction_available());
+    ct_test(pTest, tsm_next_free_peer_invokeID(peer) == 0);
+    Failed_Count = 0;
+    tsm_free_all(testTSMFailed);
+    ct_test(pTest, Failed_Count == MAX_TSM_TRANSACTIONS);
+    ct_test(pTest, tsm_transaction_available());
+    ct_test(pTest, tsm_transaction_idle_count() ==
+        (MAX_TSM_TRANSACTIONS > 255 ? 255 : MAX_TSM_TRANSACTIONS));
+}
+
 void testTSM(
     Test * pTest)
 {
-    /* FIXME: add some unit testing... */
-    return;
+    BACNET_ADDRESS peer;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.mac_len = 6;
+    peer.mac[0] = 192;
+    peer.mac[1] = 168;
+    peer.mac[2] = 0;
+    peer.mac[3] = 2;
+    peer.mac[4] = 0xBA;
+    peer.mac[5] = 0xC0;
+    testTSMSegmentedAck(pTest, &peer);
+    testTSMSegmentedRequest(pTest, &peer);
+    testTSMPeers(pTest, &peer);
 }
 
 #ifdef TEST_TSM
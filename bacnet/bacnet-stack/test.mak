@@ -12,7 +12,7 @@ LOGFILE = test.log
 all: abort address arf awf bacapp bacdcode bacerror bacint bacstr \
 	cov crc datetime dcc event filename fifo getevent iam ihave \
 	indtext keylist key memcopy npdu ptransfer \
-	rd reject ringbuf rp rpm sbuf timesync \
+	rd reject ringbuf rp rpm sbuf timesync tsm \
 	whohas whois wp objects
 
 clean: logfile
@@ -181,6 +181,11 @@ timesync: logfile test/timesync.mak
 	( ./test/timesync >> ${LOGFILE} )
 	$(MAKE) -s -C test -f timesync.mak clean
 
+tsm: logfile test/tsm.mak
+	$(MAKE) -s -C test -f tsm.mak clean all
+	( ./test/tsm >> ${LOGFILE} )
+	$(MAKE) -s -C test -f tsm.mak clean
+
 whohas: logfile test/whohas.mak
 	$(MAKE) -s -C test -f whohas.mak clean all
 	( ./test/whohas >> ${LOGFILE} )
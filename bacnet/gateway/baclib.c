@@ -53,12 +53,19 @@
 #include "mqttutil.h"
 #include "common.h"
 #include "bacutil.h"
+#include "registry.h"
+#include "objecttable.h"
+#include "receiver.h"
 
 static GlobalVar* s_vars = NULL;
-static char s_log_buff[BUFF_LEN] = {0};
-static char s_rpm_object_num_max = 50;
+static char s_wpm_object_num_max = 50;
 
-uint8_t g_rx_buf1[MAX_MPDU] = { 0 };
+// full rpms answered before trying larger ones
+#define RPM_GROW_STREAK 16
+
+// the packet being handled, from the receiver
+Packet* g_rx_packet = NULL;
+uint8_t* g_rx_buf1 = NULL;
 uint16_t g_pdu_len = 0;
 
 bool is_need_to_subscribe(BacObject* object)
@@ -100,36 +107,30 @@ void subscribe_if_need(BacDevice2* device)
     BacObject* next_subscribe_object = NULL;
     if(s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
     {
-        if(device->handle_next_object == NULL)
-        {
-            device->handle_next_object = device->objects_header;
-            next_subscribe_object = device->handle_next_object;
-        }
-        else
-        {
-            next_subscribe_object = device->handle_next_object->next;
-        }
-    
-        while(next_subscribe_object)
+        int i = 0;
+        for(i = device->handle_next_object + 1; i < device->objects.num; i++)
         {
+            next_subscribe_object = &device->objects.objects[i];
             if(next_subscribe_object->support_cov == NEED_TO_SUB)
             {
                 if(!is_need_to_subscribe(next_subscribe_object))
                 {
                     next_subscribe_object->support_cov = SUPPORT_SUB;
-                    next_subscribe_object = next_subscribe_object->next;
                     continue;
                 }
 
                 // keep this object for handle unexpected message
-                device->handle_next_object = next_subscribe_object;
+                device->handle_next_object = i;
                 next_subscribe_object->support_cov = SUPPORT_SUB;
                 subscribe_unconfirmed(
                         device,
                         next_subscribe_object);
                 break;
             }
-            next_subscribe_object = next_subscribe_object->next;
+        }
+        if(i >= device->objects.num)
+        {
+            next_subscribe_object = NULL;
         }
     }
     
@@ -138,9 +139,8 @@ void subscribe_if_need(BacDevice2* device)
         // already subscribe for all objects which support subscribe
         // this device can enter main loop
         device->current_state = ENTER_MAIN_LOOP;
-        device->handle_next_object = device->objects_header;
+        device->handle_next_object = -1;
         device->disable = 0;
-        device->send_next = 1;
     }
 }
 
@@ -152,22 +152,14 @@ void cancel_subscribe_object_if_need(BacDevice2* device)
     }
 
     BacObject* next_subscribe_object = NULL;
-    if(device->handle_next_object == NULL)
-    {
-        device->handle_next_object = device->objects_header;
-        next_subscribe_object = device->handle_next_object;
-    }
-    else
-    {
-        next_subscribe_object = device->handle_next_object->next;
-    }
-
-    while(next_subscribe_object)
+    int i = 0;
+    for(i = device->handle_next_object + 1; i < device->objects.num; i++)
     {
+        next_subscribe_object = &device->objects.objects[i];
         if(next_subscribe_object->support_cov == NEED_TO_CANCEL_OBJECT
             || next_subscribe_object->support_cov == NEED_TO_CANCEL_PROPERTY)
         {
-            device->handle_next_object = next_subscribe_object;
+            device->handle_next_object = i;
             // un-subscribe
             BACNET_SUBSCRIBE_COV_DATA *cov_data = calloc(1, sizeof(BACNET_SUBSCRIBE_COV_DATA));
             cov_data->monitoredObjectIdentifier.type = next_subscribe_object->objectType;
@@ -181,13 +173,13 @@ void cancel_subscribe_object_if_need(BacDevice2* device)
                 cov_data->monitoredProperty.propertyIdentifier = PROP_PRESENT_VALUE;
                 cov_data->monitoredProperty.propertyArrayIndex = BACNET_ARRAY_ALL;
                 cov_data->monitoredProperty.next = NULL;
-                my_tsm_logic_invokeID_set(device->invokeId);
-                Send_COV_Subscribe_Property(device->instanceNumber, cov_data);
+                track_transaction(device->instanceNumber,
+                        Send_COV_Subscribe_Property(device->instanceNumber, cov_data));
             }
             else
             {
-                my_tsm_logic_invokeID_set(device->invokeId);
-                Send_COV_Subscribe(device->instanceNumber, cov_data);
+                track_transaction(device->instanceNumber,
+                        Send_COV_Subscribe(device->instanceNumber, cov_data));
             }
             free(cov_data);
             if(device->current_state == CANCEL_AND_RE_SUBSCRIBE)
@@ -200,23 +192,21 @@ void cancel_subscribe_object_if_need(BacDevice2* device)
             }
             break;
         }
-        next_subscribe_object = next_subscribe_object->next;
     }
     
-    if(next_subscribe_object == NULL)
+    if(i >= device->objects.num)
     {
         if(device->current_state == CANCEL_AND_RE_SUBSCRIBE)
         {
-            device->handle_next_object = NULL;
+            device->handle_next_object = -1;
             device->current_state = SUBSCRIBE_ALL_OBJECT;
             subscribe_if_need(device);
         }
         else
         {
             device->current_state = ENTER_MAIN_LOOP;
-            device->handle_next_object = device->objects_header;
+            device->handle_next_object = -1;
             device->disable = 0;
-            device->send_next = 1;
         }
     }
 }
@@ -225,14 +215,14 @@ void read_object_list_if_need(BacDevice2* device)
 {
     if(device->next_index <= device->objects_size)
     {    
-        my_tsm_logic_invokeID_set(device->invokeId);
-        Send_Read_Property_Request(device->instanceNumber,
-                        OBJECT_DEVICE, device->instanceNumber,
-                        PROP_OBJECT_LIST, device->next_index);
+        track_transaction(device->instanceNumber,
+                Send_Read_Property_Request(device->instanceNumber,
+                            OBJECT_DEVICE, device->instanceNumber,
+                            PROP_OBJECT_LIST, device->next_index));
     }
     else
     {
-        device->handle_next_object = NULL;
+        device->handle_next_object = -1;
         device->current_state = SUBSCRIBE_ALL_OBJECT;
         subscribe_if_need(device);
     }
@@ -292,17 +282,17 @@ void cancel_cov_subscribe(BacDevice2* device, BacObject* object)
     cov_data->subscriberProcessIdentifier = 1;
     cov_data->cancellationRequest = true;
     cov_data->next = NULL;
-    my_tsm_logic_invokeID_set(device->invokeId);
-    Send_COV_Subscribe(device->instanceNumber, cov_data);
+    track_transaction(device->instanceNumber,
+            Send_COV_Subscribe(device->instanceNumber, cov_data));
     free(cov_data);
 }
 
 void free_device(BacDevice2* device, char need_to_un_subscribe)
 {
-    BacObject* object = device->objects_header;
-    BacObject* old_object = NULL;
-    while(object)
+    int i = 0;
+    for(i = 0; i < device->objects.num; i++)
     {
+        BacObject* object = &device->objects.objects[i];
         if(need_to_un_subscribe == 1
             && object->support_cov == SUBSCRIBED
             && s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
@@ -310,86 +300,265 @@ void free_device(BacDevice2* device, char need_to_un_subscribe)
             // un-subscribe
             cancel_cov_subscribe(device, object);
         }
-        old_object = object;
-        object = old_object->next;
-        free(old_object);
     }
+    free_objects(&device->objects);
     clean_request(device);
     free(device);
 }
 
-int free_invoke_id()
+BacDevice2* get_device_by_instance_number(uint32_t instance_number)
 {
-    // to get a invoke id, we must delete a device
-    BacDevice2** header = s_vars->g_all_devices.devices_header;
-    int index = 1;
-    time_t last_iam_time = header[index]->last_iam_time;
-    int i = 0;
-    for(i = index + 1; i <= s_vars->g_all_devices.devices_num; i++)
+    return find_device(&s_vars->g_all_devices, instance_number);
+}
+
+// the device that a reply from src with invoke_id answers, NULL if unknown.
+// request is the request of the device's request list it answers, if any
+BacDevice2* get_device_by_reply(BACNET_ADDRESS* src, uint8_t invoke_id, REQUEST_DATA** request)
+{
+    uint32_t instance_number = 0;
+    *request = NULL;
+    if(!finish_transaction(src, invoke_id, &instance_number, request))
     {
-        if (header[i]->last_iam_time < last_iam_time)
-        {
-            last_iam_time = header[i]->last_iam_time;
-            index = i;
-        }
+        return NULL;
     }
+    BacDevice2* device = get_device_by_instance_number(instance_number);
+    if(device == NULL)
+    {
+        free_request(*request);
+        *request = NULL;
+    }
+    return device;
+}
 
-    free_device(header[index], 1);
-    header[index] = NULL;
+// how many requests a device may have in flight, a device accepting larger
+// apdus is most likely on ip and quick to answer, a small one on ms/tp
+static int max_window_for_apdu(unsigned max_apdu)
+{
+    if(max_apdu >= 1476)
+    {
+        return TSM_REQUEST_WINDOW;
+    }
+    if(max_apdu >= 480)
+    {
+        return 2;
+    }
+    return 1;
+}
 
-    return index;
+// what the device told in its i-am about the apdus it takes
+static void update_device_apdu(BacDevice2* device, unsigned max_apdu, int segmentation)
+{
+    device->max_apdu = max_apdu;
+    device->segmentation = segmentation;
+    device->window_max = max_window_for_apdu(max_apdu);
+    if(device->window > device->window_max)
+    {
+        device->window = device->window_max;
+    }
 }
 
-int get_invoke_id()
+// a request of the window is over. the window grows by one after a window
+// of replies, and halves when the device seems overwhelmed
+static void finish_request(BacDevice2* device, REQUEST_DATA* request, char overwhelmed)
 {
-    if (s_vars->g_all_devices.devices_num < DEVICE_NUM_MAX)
+    device->in_flight--;
+    if(overwhelmed)
     {
-        s_vars->g_all_devices.devices_num++;
-        return s_vars->g_all_devices.devices_num;
+        device->window = device->window > 1 ? device->window / 2 : 1;
+        device->window_acks = 0;
     }
-    else
+    else if(++device->window_acks >= device->window && device->window < device->window_max)
     {
-        return free_invoke_id();
+        device->window++;
+        device->window_acks = 0;
     }
+    free_request(request);
+    send_next_request(device);
 }
 
-BacDevice2* is_device_exist(uint32_t instance_number)
+// the encoded size of the value of a property in a rpm ack, or a guess
+// for the properties of unknown size
+static int estimate_value_size(BACNET_OBJECT_TYPE type, BACNET_PROPERTY_ID property)
 {
-    BacDevice2** device = s_vars->g_all_devices.devices_header;
-    int i = 0;
-    for(i = 1; i <= s_vars->g_all_devices.devices_num; i++)
+    if(property != PROP_PRESENT_VALUE)
+    {
+        return 32;
+    }
+    switch(type)
     {
-        if (device[i] != NULL && device[i]->instanceNumber == instance_number)
+        case OBJECT_ANALOG_INPUT:
+        case OBJECT_ANALOG_OUTPUT:
+        case OBJECT_ANALOG_VALUE:
+            return 5;    // real
+        case OBJECT_BINARY_INPUT:
+        case OBJECT_BINARY_OUTPUT:
+        case OBJECT_BINARY_VALUE:
+            return 2;    // enumerated
+        default:
+            return 5;    // unsigned, at most
+    }
+}
+
+// the encoded size of an object in a rpm, and in its ack
+static void estimate_rpm_object(BACNET_READ_ACCESS_DATA* object, int* request_size,
+    int* reply_size)
+{
+    // the object identifier, and the opening and closing tags of the list
+    *request_size = 7;
+    *reply_size = 7;
+    BACNET_PROPERTY_REFERENCE* property = object->listOfProperties;
+    while(property)
+    {
+        int size = property->propertyIdentifier > 255 ? 3 : 2;
+        if(property->propertyArrayIndex != BACNET_ARRAY_ALL)
         {
-            return device[i];
+            size += 3;
         }
+        *request_size += size;
+        // the value, or the error class and code in its place, in opening
+        // and closing tags
+        int value_size = estimate_value_size(object->object_type,
+            property->propertyIdentifier);
+        *reply_size += size + 2 + (value_size > 4 ? value_size : 4);
+        property = property->next;
     }
-    return NULL;
 }
 
-BacDevice2* get_device_by_instance_number(uint32_t instance_number)
+// the bytes a rpm may take for the device. the segments a device accepts
+// aren't in its i-am, so a rpm is kept to one apdu
+static int rpm_request_budget(BacDevice2* device)
 {
-    return is_device_exist(instance_number);
+    int max_apdu = device->max_apdu < MAX_APDU ? device->max_apdu : MAX_APDU;
+    // the header of a confirmed request
+    return max_apdu - 4;
 }
 
-BacDevice2* get_device_by_invoke_id(uint8_t invoke_id)
+// the bytes the ack of a rpm may take, in segments if the device sends them
+static int rpm_reply_budget(BacDevice2* device)
 {
-    if(invoke_id <= 0 || invoke_id > DEVICE_NUM_MAX)
+    int max_apdu = device->max_apdu < MAX_APDU ? device->max_apdu : MAX_APDU;
+    if(device->segmentation == SEGMENTATION_BOTH || device->segmentation == SEGMENTATION_TRANSMIT)
     {
-        return NULL;
+        // the header of a segment of a complex ack
+        return MAX_SEGMENTS_ACCEPTED * (max_apdu - 5);
+    }
+    // the header of a complex ack
+    return max_apdu - 3;
+}
+
+typedef struct
+{
+    BACNET_READ_ACCESS_DATA* header;
+    int objects;
+    int request_size;
+    int reply_size;
+} RpmBatch;
+
+static void flush_rpm_batch(RpmBatch* batch, REQUEST_DATA** request)
+{
+    if(batch->header == NULL)
+    {
+        return;
+    }
+    REQUEST_DATA* req = calloc(1, sizeof(REQUEST_DATA));
+    req->request = (void*) batch->header;
+    req->type = RPM_REQUEST;
+    req->next = *request;
+    *request = req;
+    memset(batch, 0, sizeof(RpmBatch));
+}
+
+// add an object to the rpm being packed, when it's too large for the
+// device with the object, it's added to request and a new one is started
+static void add_to_rpm_batch(BacDevice2* device, RpmBatch* batch,
+    BACNET_READ_ACCESS_DATA* object, REQUEST_DATA** request)
+{
+    int request_size = 0;
+    int reply_size = 0;
+    estimate_rpm_object(object, &request_size, &reply_size);
+    if(batch->objects >= device->rpm_max_objects
+        || batch->request_size + request_size > rpm_request_budget(device)
+        || batch->reply_size + reply_size > rpm_reply_budget(device))
+    {
+        flush_rpm_batch(batch, request);
+    }
+    object->next = batch->header;
+    batch->header = object;
+    batch->objects++;
+    batch->request_size += request_size;
+    batch->reply_size += reply_size;
+}
+
+static int count_rpm_objects(BACNET_READ_ACCESS_DATA* header)
+{
+    int count = 0;
+    while(header)
+    {
+        count++;
+        header = header->next;
+    }
+    return count;
+}
+
+// a rpm of the device was answered, after enough full ones try larger ones
+static void rpm_answered(BacDevice2* device, REQUEST_DATA* request)
+{
+    if(count_rpm_objects(request->request) < device->rpm_max_objects)
+    {
+        return;
+    }
+    if(++device->rpm_streak >= RPM_GROW_STREAK && device->rpm_max_objects < RPM_OBJECTS_MAX)
+    {
+        device->rpm_max_objects += device->rpm_max_objects / 4 + 1;
+        if(device->rpm_max_objects > RPM_OBJECTS_MAX)
+        {
+            device->rpm_max_objects = RPM_OBJECTS_MAX;
+        }
+        device->rpm_streak = 0;
+        LOG_DEBUG("device %d reads up to %d objects per rpm", device->instanceNumber,
+            device->rpm_max_objects);
     }
-    return s_vars->g_all_devices.devices_header[invoke_id];
 }
 
-void handle_for_unexpected(uint8_t invoke_id)
+// a rpm of the device was too large for it, or its ack. the device gets at
+// most half the objects per rpm from now on, and the rpm is sent again in
+// two halves. return 0 if it can't be split
+static int split_rpm(BacDevice2* device, REQUEST_DATA* request)
+{
+    BACNET_READ_ACCESS_DATA* header = request->request;
+    int count = count_rpm_objects(header);
+    if(count < 2)
+    {
+        return 0;
+    }
+    if(device->rpm_max_objects > count / 2)
+    {
+        device->rpm_max_objects = count / 2;
+    }
+    device->rpm_streak = 0;
+    LOG_INFO("device %d can't take a rpm of %d objects, reads up to %d from now on",
+        device->instanceNumber, count, device->rpm_max_objects);
+
+    BACNET_READ_ACCESS_DATA* middle = header;
+    int i = 0;
+    for(i = 1; i < count / 2; i++)
+    {
+        middle = middle->next;
+    }
+    REQUEST_DATA* second = calloc(1, sizeof(REQUEST_DATA));
+    second->request = (void*) middle->next;
+    second->type = RPM_REQUEST;
+    middle->next = NULL;
+
+    requeue_request(device, second);
+    requeue_request(device, request);
+    return 1;
+}
+
+void handle_for_unexpected(BacDevice2* device)
 {
-    BacDevice2* device = get_device_by_invoke_id(invoke_id);
     if(device == NULL)
     {
-        snprintf(s_log_buff, BUFF_LEN,
-            "handle_for_unexpected : get unexpected message from unknow device (invoke_id is %d)",
-            invoke_id);
-        log_debug(s_log_buff);
         return;
     }
     device->last_ack_time = time(NULL);
@@ -407,38 +576,39 @@ void handle_for_unexpected(uint8_t invoke_id)
     }
     else if(device->current_state == SUBSCRIBE_ALL_OBJECT)
     {
-        if(device->handle_next_object != NULL)
+        if(device->handle_next_object >= 0)
         {
+            BacObject* object = &device->objects.objects[device->handle_next_object];
             if(s_vars->g_interval.subscribe_type == SUBSCRIBE_PORPERTY
                 || s_vars->g_interval.subscribe_type == SUBSCRIBE_PROPERTY_WITH_COV_INCREMENT)
             {
                 // un-support subscribe property
-                if(device->handle_next_object->un_support_state == UN_SUPPORT_SUB_OBJECT)
+                if(object->un_support_state == UN_SUPPORT_SUB_OBJECT)
                 {
                     // both object and property are un-support
-                    device->handle_next_object->support_cov = UN_SUPPORT_SUB;
+                    object->support_cov = UN_SUPPORT_SUB;
                 }
                 else
                 {
                     // maybe support subscribe object
-                    device->handle_next_object->support_cov = SUPPORT_SUB;
-                    device->handle_next_object->un_support_state = UN_SUPPORT_SUB_PROPERTY;
+                    object->support_cov = SUPPORT_SUB;
+                    object->un_support_state = UN_SUPPORT_SUB_PROPERTY;
                 }
                 
             }
             else if(s_vars->g_interval.subscribe_type == SUBSCRIBE_OBJECT)
             {
                 // un-support subscribe object
-                if(device->handle_next_object->un_support_state == UN_SUPPORT_SUB_PROPERTY)
+                if(object->un_support_state == UN_SUPPORT_SUB_PROPERTY)
                 {
                     // both object and property are un-support
-                    device->handle_next_object->support_cov = UN_SUPPORT_SUB;
+                    object->support_cov = UN_SUPPORT_SUB;
                 }
                 else
                 {
                     // maybe support subscribe property
-                    device->handle_next_object->support_cov = SUPPORT_SUB;
-                    device->handle_next_object->un_support_state = UN_SUPPORT_SUB_OBJECT;
+                    object->support_cov = SUPPORT_SUB;
+                    object->un_support_state = UN_SUPPORT_SUB_OBJECT;
                 }
             }
         }
@@ -451,11 +621,98 @@ void handle_for_unexpected(uint8_t invoke_id)
     }
     else
     {
-        device->send_next = 1;
         send_next_request(device);
     }
 }
 
+void handle_unexpected_reply(BACNET_ADDRESS* src, uint8_t invoke_id, char overwhelmed)
+{
+    REQUEST_DATA* request = NULL;
+    BacDevice2* device = get_device_by_reply(src, invoke_id, &request);
+    if(device == NULL)
+    {
+        LOG_DEBUG("handle_for_unexpected : get unexpected message from unknow device (invoke_id is %d)",
+            invoke_id);
+        return;
+    }
+    if(request != NULL)
+    {
+        device->last_ack_time = time(NULL);
+        finish_request(device, request, overwhelmed);
+        return;
+    }
+    handle_for_unexpected(device);
+}
+
+// a request, or its reply, didn't fit in what the device takes. a rpm is
+// split and sent again, the other requests are given up
+static void handle_oversized_reply(BACNET_ADDRESS* src, uint8_t invoke_id)
+{
+    REQUEST_DATA* request = NULL;
+    BacDevice2* device = get_device_by_reply(src, invoke_id, &request);
+    if(device == NULL)
+    {
+        return;
+    }
+    if(request == NULL)
+    {
+        handle_for_unexpected(device);
+        return;
+    }
+    device->last_ack_time = time(NULL);
+    if(request->type == RPM_REQUEST && split_rpm(device, request))
+    {
+        request = NULL;
+    }
+    finish_request(device, request, 0);
+}
+
+// the stack had no buffer left for the segmented ack of a request. that's
+// not the device's fault, the request goes back to the list as it is and
+// the worker sends it again
+static void request_no_buffer(uint32_t instance_number, REQUEST_DATA* request)
+{
+    BacDevice2* device = get_device_by_instance_number(instance_number);
+    if(device == NULL)
+    {
+        free_request(request);
+        return;
+    }
+    device->last_ack_time = time(NULL);
+    if(request == NULL)
+    {
+        handle_for_unexpected(device);
+        return;
+    }
+    device->in_flight--;
+    requeue_request(device, request);
+}
+
+// no reply came, after the stack sent the request apdu retries times more
+static void request_expired(uint32_t instance_number, REQUEST_DATA* request)
+{
+    BacDevice2* device = get_device_by_instance_number(instance_number);
+    if(device == NULL)
+    {
+        free_request(request);
+        return;
+    }
+    if(request == NULL)
+    {
+        handle_for_unexpected(device);
+        return;
+    }
+
+    LOG_WARN("device %d didn't answer a request after %d retries", instance_number,
+        apdu_retries());
+    finish_request(device, request, 1);
+}
+
+void expire_requests()
+{
+    expire_transactions();
+}
+
 void set_global_vars(GlobalVar* pVars)
 {
     s_vars = pVars;
@@ -468,13 +725,12 @@ static void my_error_handler(
     BACNET_ERROR_CODE error_code)
 {
 
-    log_debug("my_error_handler");
-    snprintf(s_log_buff, BUFF_LEN, "BACnet Error: %s: %s\r\n",
+    LOG_DEBUG("my_error_handler");
+    LOG_WARN("BACnet Error: %s: %s",
         bactext_error_class_name((int) error_class),
         bactext_error_code_name((int) error_code));
-    log_debug(s_log_buff);
 
-    handle_for_unexpected(invoke_id);
+    handle_unexpected_reply(src, invoke_id, 0);
 }
 
 void my_abort_handler(
@@ -484,12 +740,17 @@ void my_abort_handler(
     bool server)
 {
     (void) server;
-    log_debug("my_abort_handler");
-    snprintf(s_log_buff, BUFF_LEN, "BACnet Abort: %s\r\n",
+    LOG_DEBUG("my_abort_handler");
+    LOG_WARN("BACnet Abort: %s",
         bactext_abort_reason_name((int) abort_reason));
-    log_debug(s_log_buff);
 
-    handle_for_unexpected(invoke_id);
+    if(abort_reason == ABORT_REASON_SEGMENTATION_NOT_SUPPORTED
+        || abort_reason == ABORT_REASON_BUFFER_OVERFLOW)
+    {
+        handle_oversized_reply(src, invoke_id);
+        return;
+    }
+    handle_unexpected_reply(src, invoke_id, 1);
 }
 
 void my_reject_handler(
@@ -497,12 +758,16 @@ void my_reject_handler(
     uint8_t invoke_id,
     uint8_t reject_reason)
 {
-    log_debug("my_reject_handler");
-    snprintf(s_log_buff, BUFF_LEN, "BACnet Reject: %s\r\n",
+    LOG_DEBUG("my_reject_handler");
+    LOG_WARN("BACnet Reject: %s",
         bactext_reject_reason_name((int) reject_reason));
-    log_debug(s_log_buff);
 
-    handle_for_unexpected(invoke_id);
+    if(reject_reason == REJECT_REASON_BUFFER_OVERFLOW)
+    {
+        handle_oversized_reply(src, invoke_id);
+        return;
+    }
+    handle_unexpected_reply(src, invoke_id, 0);
 }
 
 int is_support_object(BACNET_OBJECT_TYPE type)
@@ -549,12 +814,12 @@ void my_read_property_ack_handler(
 {
     int len = 0;
     BACNET_READ_PROPERTY_DATA data;
-    log_debug("my_read_property_ack_handler");
+    LOG_DEBUG("my_read_property_ack_handler");
     len = rp_ack_decode_service_request(service_request, service_len, &data);
     if (len > 0)
     {
-        uint8_t invoke_id = service_data->invoke_id;
-        BacDevice2* device = s_vars->g_all_devices.devices_header[invoke_id];
+        REQUEST_DATA* request = NULL;
+        BacDevice2* device = get_device_by_reply(src, service_data->invoke_id, &request);
         if(device == NULL)
         {
             return;
@@ -566,16 +831,8 @@ void my_read_property_ack_handler(
             if(device->update_objects == 1)
             {
                 // clean up objects
-                device->handle_next_object = NULL;
-                BacObject* object = device->objects_header;
-                BacObject* old_object = NULL;
-                while(object)
-                {
-                    old_object = object;
-                    object = old_object->next;
-                    free(old_object);
-                }
-                device->objects_header = NULL;
+                device->handle_next_object = -1;
+                clear_objects(&device->objects);
                 clean_request(device);
                 device->update_objects = 0;
                 device->objects_size = 0;
@@ -606,12 +863,9 @@ void my_read_property_ack_handler(
                             if(is_support_object(object_id.type))
                             {
                                 // save new object
-                                BacObject* new_object = new_bac_object();
-                                new_object->objectType = object_id.type;
-                                new_object->objectInstance = object_id.instance;
-                                new_object->next = device->objects_header;
+                                BacObject* new_object = add_object(&device->objects,
+                                        object_id.type, object_id.instance);
                                 new_object->support_cov = NEED_TO_SUB;
-                                device->objects_header = new_object;
                             }
                         }
                     }
@@ -619,25 +873,24 @@ void my_read_property_ack_handler(
                     if(data.array_index < device->objects_size)
                     {
                         device->next_index = data.array_index + 1;
-                        my_tsm_logic_invokeID_set(device->invokeId);
-                        Send_Read_Property_Request(device->instanceNumber,
-                                        data.object_type, data.object_instance,
-                                        data.object_property, data.array_index + 1);
+                        track_transaction(device->instanceNumber,
+                                Send_Read_Property_Request(device->instanceNumber,
+                                            data.object_type, data.object_instance,
+                                            data.object_property, data.array_index + 1));
                     }
                     else
                     {
                         if(s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
                         {
-                            device->handle_next_object = NULL;
+                            device->handle_next_object = -1;
                             device->current_state = SUBSCRIBE_ALL_OBJECT;
                             subscribe_if_need(device);
                         }
                         else
                         {
                             device->current_state = ENTER_MAIN_LOOP;
-                            device->handle_next_object = device->objects_header;
+                            device->handle_next_object = -1;
                             device->disable = 0;
-                            device->send_next = 1;
                         }
                     }
         
@@ -661,6 +914,27 @@ void my_read_property_ack_handler(
     }
 }
 
+// the stack hands over a segmented ack once it's reassembled, while the
+// receive buffer only holds the last segment. the ack is published as if
+// it came unsegmented: the npdu header received, the header of an
+// unsegmented complex ack, and the whole service data
+static uint8_t* rebuild_complex_ack(uint8_t* service_request, uint16_t service_len,
+    uint8_t invoke_id, uint8_t service_choice, int* len)
+{
+    BACNET_ADDRESS dest;
+    BACNET_NPDU_DATA npdu_data;
+    int npdu_len = npdu_decode(&g_rx_buf1[0], &dest, NULL, &npdu_data);
+    *len = npdu_len + 3 + service_len;
+    uint8_t* pdu = malloc((*len + 1) * sizeof(uint8_t));
+    memcpy(pdu, g_rx_buf1, npdu_len);
+    pdu[npdu_len] = PDU_TYPE_COMPLEX_ACK;
+    pdu[npdu_len + 1] = invoke_id;
+    pdu[npdu_len + 2] = service_choice;
+    memcpy(&pdu[npdu_len + 3], service_request, service_len);
+    pdu[*len] = '\0';
+    return pdu;
+}
+
 /** Handler for a ReadPropertyMultiple ACK.
  * @ingroup DSRPM
  * For each read property, print out the ACK'd data,
@@ -678,30 +952,38 @@ void my_read_property_multiple_ack_handler(
     BACNET_ADDRESS * src,
     BACNET_CONFIRMED_SERVICE_ACK_DATA * service_data)
 {
-    log_debug("my_read_property_multiple_ack_handler");
-    BacDevice2* device = get_device_by_invoke_id(service_data->invoke_id);
+    LOG_DEBUG("my_read_property_multiple_ack_handler");
+    REQUEST_DATA* request = NULL;
+    BacDevice2* device = get_device_by_reply(src, service_data->invoke_id, &request);
     if(device == NULL)
     {
-        log_debug("get a rpm_ack from unknow device");
+        LOG_DEBUG("get a rpm_ack from unknow device");
         return;
     }
     time_t now_time = time(NULL);
     device->last_iam_time = now_time;
 
     // just publish to cloud
-    int len = g_pdu_len + 1;
-    uint8_t* original_apdu = malloc(len*sizeof(uint8_t));
-    int i = 0;
-    for(i = 0; i < g_pdu_len; i++)
+    if(service_data->segmented_message)
     {
-        original_apdu[i] = g_rx_buf1[i];
+        int pdu_len = 0;
+        uint8_t* original_apdu = rebuild_complex_ack(service_request, service_len,
+            service_data->invoke_id, SERVICE_CONFIRMED_READ_PROP_MULTIPLE, &pdu_len);
+        mqtt_send_rpmack_data(original_apdu, pdu_len, s_vars, device);
+    }
+    else
+    {
+        mqtt_send_rpmack(g_rx_packet, s_vars, device);
     }
-    original_apdu[g_pdu_len] = '\0';
-
-    mqtt_send_rpmack(original_apdu, g_pdu_len, s_vars, device->instanceNumber);
     device->last_ack_time = now_time;
-    device->send_next = 1;
-    send_next_request(device);
+    if(request != NULL)
+    {
+        if(request->type == RPM_REQUEST)
+        {
+            rpm_answered(device, request);
+        }
+        finish_request(device, request, 0);
+    }
 }
 
 void my_unconfirmed_cov_notification_handler(
@@ -709,7 +991,7 @@ void my_unconfirmed_cov_notification_handler(
     uint16_t service_len,
     BACNET_ADDRESS * src)
 {
-    log_debug("my_unconfirmed_cov_notification_handler");
+    LOG_DEBUG("my_unconfirmed_cov_notification_handler");
 
     // decode
     BACNET_COV_DATA cov_data;
@@ -739,7 +1021,7 @@ void my_unconfirmed_cov_notification_handler(
         BacDevice2* device = get_device_by_instance_number(cov_data.initiatingDeviceIdentifier);
         if (device == NULL)
         {
-            log_debug("get a ucov_notification from unknow device");
+            LOG_DEBUG("get a ucov_notification from unknow device");
             return;
         }
         
@@ -748,30 +1030,15 @@ void my_unconfirmed_cov_notification_handler(
         device->last_iam_time = now_time;
     
         // just publish to cloud
-        int len = g_pdu_len + 1;
-        uint8_t* original_apdu = malloc(len*sizeof(uint8_t));
-        int i = 0;
-        for(i = 0; i < g_pdu_len; i++)
-        {
-            original_apdu[i] = g_rx_buf1[i];
-        }
-        original_apdu[g_pdu_len] = '\0';
-    
-        mqtt_send_ucovnotifica(original_apdu, g_pdu_len, s_vars, device->instanceNumber);
+        mqtt_send_ucovnotifica(g_rx_packet, s_vars, device);
 
         // update the last_read_time of those object
         uint16_t object_type = cov_data.monitoredObjectIdentifier.type;
         uint32_t object_instance = cov_data.monitoredObjectIdentifier.instance;
-        BacObject* device_objects = device->objects_header;
-        while(device_objects)
+        BacObject* device_object = find_object(&device->objects, object_type, object_instance);
+        if(device_object != NULL)
         {
-            if (device_objects->objectType == object_type
-                && device_objects->objectInstance == object_instance)
-            {
-                device_objects->last_read_time = now_time;
-                break;
-            }
-            device_objects = device_objects->next;
+            device_object->last_read_time = now_time;
         }
     }
 }
@@ -781,19 +1048,10 @@ void my_iam_handler(
     uint16_t service_len,
     BACNET_ADDRESS * src)
 {
-    log_debug("my_iam_handler");
-    // publish original apdu
-    int len = g_pdu_len + 1;
-    uint8_t* original_apdu = malloc(len*sizeof(uint8_t));
-    int i = 0;
-    for(i = 0; i < g_pdu_len; i++)
-    {
-        original_apdu[i] = g_rx_buf1[i];
-    }
-    original_apdu[g_pdu_len] = '\0';
+    LOG_DEBUG("my_iam_handler");
 
     // decode
-    len = 0;
+    int len = 0;
     uint32_t device_id = 0;
     unsigned max_apdu = 0;
     int segmentation = 0;
@@ -805,19 +1063,17 @@ void my_iam_handler(
         &segmentation, &vendor_id);
     if (len > 0) {
         time_t now_time = time(NULL);
-        BacDevice2* device = is_device_exist(device_id);
+        BacDevice2* device = get_device_by_instance_number(device_id);
         if(device == NULL)
         {
-            printf("found a new device : %d\n", device_id);
-            mqtt_send_iam(original_apdu, g_pdu_len, s_vars);
+            LOG_INFO("found a new device : %d", device_id);
+            // publish original apdu
+            mqtt_send_iam(g_rx_packet, s_vars, device_id);
             // if this device is not be found
             // save it
             if (max_apdu <= 0) {
-                char log_buff[BUFF_LEN] = {0};
-                snprintf(log_buff, BUFF_LEN,
-                    "detected device %d with max_apdu=%d, reseting to %d \r\n",
+                LOG_DEBUG("detected device %d with max_apdu=%d, reseting to %d",
                     device_id, max_apdu, MAX_APDU);
-                log_debug(log_buff);
                 max_apdu = MAX_APDU;
             }
             bool bind_result = address_bind_request(device_id, &max_apdu, src);
@@ -828,11 +1084,12 @@ void my_iam_handler(
 
             BacDevice2* new_device = new_bac_device2();
             new_device->instanceNumber = device_id;
+            new_device->topics = get_device_topics(s_vars, device_id);
             new_device->last_discover_time = now_time;
             new_device->last_iam_time = now_time;
             new_device->last_ack_time = now_time;
-            new_device->invokeId = get_invoke_id();
-            s_vars->g_all_devices.devices_header[new_device->invokeId] = new_device;
+            update_device_apdu(new_device, max_apdu, segmentation);
+            add_device(&s_vars->g_all_devices, new_device);
 
             // get all properties of this device
             send_read_struct_list(new_device);
@@ -840,36 +1097,58 @@ void my_iam_handler(
         else
         {
             if (max_apdu <= 0) {
-                char log_buff[BUFF_LEN] = {0};
-                snprintf(log_buff, BUFF_LEN,
-                    "detected device %d with max_apdu=%d, reseting to %d \r\n",
+                LOG_DEBUG("detected device %d with max_apdu=%d, reseting to %d",
                     device_id, max_apdu, MAX_APDU);
-                log_debug(log_buff);
                 max_apdu = MAX_APDU;
             }
             // update address
             address_add_binding(device_id, max_apdu, src);
             // if device has be found, update it`s last_iam_time
             device->last_iam_time = now_time;
+            update_device_apdu(device, max_apdu, segmentation);
         }
     }
 }
 
+static BacObject* find_subscribed_object(
+    BacDevice2* device,
+    BACNET_SUBSCRIBE_COV_DATA* cov_data
+)
+{
+    BACNET_OBJECT_ID target_object = cov_data->monitoredObjectIdentifier;
+    return find_object(&device->objects, target_object.type, target_object.instance);
+}
+
 void my_subscribe_simple_ack_handler(
     BACNET_ADDRESS * src,
     uint8_t invoke_id)
 {
-    log_debug("my_subscribe_simple_ack_handler");
-    BacDevice2* device = get_device_by_invoke_id(invoke_id);
+    LOG_DEBUG("my_subscribe_simple_ack_handler");
+    REQUEST_DATA* request = NULL;
+    BacDevice2* device = get_device_by_reply(src, invoke_id, &request);
     if(device == NULL)
     {
-        log_debug("get a subscribe_ack from unknow device");
+        LOG_DEBUG("get a subscribe_ack from unknow device");
         return;
     }
 
-    if(device->current_state == SUBSCRIBE_ALL_OBJECT)
+    if(request != NULL)
     {
-        device->handle_next_object->support_cov = SUBSCRIBED;
+        // a subscribe of the main loop
+        BacObject* object = find_subscribed_object(device, request->request);
+        if(object != NULL)
+        {
+            object->support_cov = SUBSCRIBED;
+        }
+        device->last_ack_time = time(NULL);
+        finish_request(device, request, 0);
+    }
+    else if(device->current_state == SUBSCRIBE_ALL_OBJECT)
+    {
+        if(device->handle_next_object >= 0)
+        {
+            device->objects.objects[device->handle_next_object].support_cov = SUBSCRIBED;
+        }
         subscribe_if_need(device);
     }
     else if(device->current_state == CANCEL_SUBSCRIBE_OBJECT
@@ -877,13 +1156,6 @@ void my_subscribe_simple_ack_handler(
     {
         cancel_subscribe_object_if_need(device);
     }
-    else
-    {
-        device->last_ack_time = time(NULL);
-        device->send_next = 1;
-        device->handle_next_object->support_cov = SUBSCRIBED;
-        send_next_request(device);
-    }
 }
 
 void my_whois_handler(
@@ -892,21 +1164,24 @@ void my_whois_handler(
     BACNET_ADDRESS * src)
 {
     // do nothing
-    log_debug("receive who_is request");
+    LOG_DEBUG("receive who_is request");
 }
 
 void my_write_property_multiple_ack_handler(
     BACNET_ADDRESS * src,
     uint8_t invoke_id)
 {
-    BacDevice2* device = get_device_by_invoke_id(invoke_id);
+    REQUEST_DATA* request = NULL;
+    BacDevice2* device = get_device_by_reply(src, invoke_id, &request);
     if(device == NULL)
     {
         return;
     }
     device->last_ack_time = time(NULL);
-    device->send_next = 1;
-    send_next_request(device);
+    if(request != NULL)
+    {
+        finish_request(device, request, 0);
+    }
 }
 
 static void Init_Service_Handlers(void)
@@ -958,11 +1233,14 @@ static void Init_Service_Handlers(void)
     apdu_set_error_handler(SERVICE_CONFIRMED_SUBSCRIBE_COV_PROPERTY, my_error_handler);
     apdu_set_abort_handler(my_abort_handler);
     apdu_set_reject_handler(my_reject_handler);
+
+    // the requests that get no reply
+    init_transactions(request_expired, request_no_buffer);
 }
 
 int start_local_bacnet_device(Bac2mqttConfig* pconfig)
 {
-    log_debug("start_local_bacnet_device");
+    LOG_DEBUG("start_local_bacnet_device");
     Device_Set_Object_Instance_Number(pconfig->device.instanceNumber);
     address_init();
     Init_Service_Handlers();
@@ -975,47 +1253,45 @@ int start_local_bacnet_device(Bac2mqttConfig* pconfig)
 
     dlenv_init();
     atexit(datalink_cleanup);
+    start_receiver();
 
     send_whois_immediately();
 
     return 0;
 }
 
-void receive_and_handle()
+void receive_and_handle(unsigned timeout)
 {
-    BACNET_ADDRESS src =
-    {
-        0
-    };  /* address where message came from */
-    unsigned timeout = 2;     /* milliseconds */
-
     // use a while loop to quick handle the bacnet packages
     int cap = 100;
-    do {
-        /* returns 0 bytes on timeout */
-        g_pdu_len = datalink_receive(&src, &g_rx_buf1[0], MAX_MPDU, timeout);
-        /* process */
-        if (g_pdu_len)
-        {
-            snprintf(s_log_buff, BUFF_LEN, "datalink_receive returned %d bytes", g_pdu_len);
-            log_debug(s_log_buff);
-            npdu_handler(&src, &g_rx_buf1[0], g_pdu_len);
-        }
-    } while (g_pdu_len > 0 && cap-- > 0);
+    Packet* packet = NULL;
+    while (cap-- > 0 && (packet = take_packet(timeout)) != NULL)
+    {
+        g_rx_packet = packet;
+        g_rx_buf1 = &packet->pdu[0];
+        g_pdu_len = packet->len;
+        LOG_DEBUG("received %d bytes", g_pdu_len);
+        npdu_handler(&packet->src, &g_rx_buf1[0], g_pdu_len);
+        release_packet(packet);
+        g_rx_packet = NULL;
+        g_rx_buf1 = NULL;
+        // only wait for the first one
+        timeout = 0;
+    }
 }
 
 void send_whois_immediately()
 {
-    log_debug("send whois request immediately");
+    LOG_DEBUG("send whois request immediately");
     Send_WhoIs(-1, -1);
 }
 
 void send_rpm_immediately(cJSON* root)
 {
-    log_debug("send rpm request immediately");
+    LOG_DEBUG("send rpm request immediately");
     if (!cJSON_HasObjectItem(root, "targetInstanceNumber"))
     {
-        log_debug("send_rpm_immediately failed : can`t get the target instance number");
+        LOG_DEBUG("send_rpm_immediately failed : can`t get the target instance number");
         return;
     }
     uint32_t target_instance_number = (uint32_t) json_int(root, "targetInstanceNumber");
@@ -1023,11 +1299,8 @@ void send_rpm_immediately(cJSON* root)
     BacDevice2* device = get_device_by_instance_number(target_instance_number);
     if(device == NULL)
     {
-        char log_buff[BUFF_LEN] = {0};
-        snprintf(log_buff, BUFF_LEN,
-            "send_rpm_immediately failed : can`t find this device by intance number %d",
+        LOG_DEBUG("send_rpm_immediately failed : can`t find this device by intance number %d",
             target_instance_number);
-        log_debug(log_buff);
         return;
     }
 
@@ -1036,8 +1309,7 @@ void send_rpm_immediately(cJSON* root)
     if (properties_len > 0)
     {
         REQUEST_DATA* request = NULL;
-        BACNET_READ_ACCESS_DATA* header = NULL;
-        char rpm_object_number = 0;
+        RpmBatch batch = {0};
         int i = 0;
         for(i = 0; i < properties_len; i++)
         {
@@ -1061,31 +1333,9 @@ void send_rpm_immediately(cJSON* root)
 
             rpm_object->listOfProperties = rpm_property;
 
-            rpm_object->next = header;
-            header = rpm_object;
-
-            rpm_object_number++;
-            if (rpm_object_number >= s_rpm_object_num_max && header)
-            {
-                REQUEST_DATA* req = calloc(1, sizeof(REQUEST_DATA));
-                req->request = (void*) header;
-                req->type = RPM_REQUEST;
-                req->next = request;
-                request = req;
-
-                header = NULL;
-                rpm_object_number = 0;
-            }
-        }
-
-        if (header)
-        {
-            REQUEST_DATA* req = calloc(1, sizeof(REQUEST_DATA));
-            req->request = (void*) header;
-            req->type = RPM_REQUEST;
-            req->next = request;
-            request = req;
+            add_to_rpm_batch(device, &batch, rpm_object, &request);
         }
+        flush_rpm_batch(&batch, &request);
 
         if(request != NULL)
         {
@@ -1096,10 +1346,10 @@ void send_rpm_immediately(cJSON* root)
 
 void send_wpm_immediately(cJSON* root)
 {
-    log_debug("send wpm request immediately");
+    LOG_DEBUG("send wpm request immediately");
     if (!cJSON_HasObjectItem(root, "targetInstanceNumber"))
     {
-        log_debug("send_wpm_immediately failed : can`t get the target instance number");
+        LOG_DEBUG("send_wpm_immediately failed : can`t get the target instance number");
         return;
     }
     uint32_t target_instance_number = (uint32_t) json_int(root, "targetInstanceNumber");
@@ -1107,11 +1357,8 @@ void send_wpm_immediately(cJSON* root)
     BacDevice2* device = get_device_by_instance_number(target_instance_number);
     if(device == NULL)
     {
-        char log_buff[BUFF_LEN] = {0};
-        snprintf(log_buff, BUFF_LEN,
-            "send_wpm_immediately failed : can`t find this device by instance number -> %d",
+        LOG_DEBUG("send_wpm_immediately failed : can`t find this device by instance number -> %d",
             target_instance_number);
-        log_debug(log_buff);
         return;
     }
 
@@ -1150,11 +1397,8 @@ void send_wpm_immediately(cJSON* root)
             bool status = bacapp_parse_application_data(tag, present_value, &(wpm_property->value));
             if(!status)
             {
-                char log_buff[BUFF_LEN] = {0};
-                snprintf(log_buff, BUFF_LEN,
-                    "bacapp_parse_application_data failed, tag = %d, value = \"%s\" ",
+                LOG_DEBUG("bacapp_parse_application_data failed, tag = %d, value = \"%s\" ",
                     tag, present_value);
-                log_debug(log_buff);
                 free(wpm_object);
                 free(wpm_property);
             }
@@ -1169,7 +1413,7 @@ void send_wpm_immediately(cJSON* root)
                 header = wpm_object;
 
                 rpm_object_number++;
-                if (rpm_object_number >= s_rpm_object_num_max && header)
+                if (rpm_object_number >= s_wpm_object_num_max && header)
                 {
                     REQUEST_DATA* req = calloc(1, sizeof(REQUEST_DATA));
                     req->request = (void*) header;
@@ -1233,23 +1477,23 @@ void subscribe_unconfirmed(BacDevice2* device, BacObject* object)
     cov_data->lifetime = s_vars->g_interval.subscribe_duration;
     cov_data->next = NULL;
     add_property_message_if_need(cov_data);
-    my_tsm_logic_invokeID_set(device->invokeId);
     if(s_vars->g_interval.subscribe_type == SUBSCRIBE_OBJECT)
     {
-        Send_COV_Subscribe(device->instanceNumber, cov_data);
+        track_transaction(device->instanceNumber,
+                Send_COV_Subscribe(device->instanceNumber, cov_data));
     }
     else
     {
-        Send_COV_Subscribe_Property(device->instanceNumber, cov_data);
+        track_transaction(device->instanceNumber,
+                Send_COV_Subscribe_Property(device->instanceNumber, cov_data));
     }
     free(cov_data);
 }
 
 void send_read_struct_list(BacDevice2* device)
 {
-    log_debug("send_read_struct_list");
+    LOG_DEBUG("send_read_struct_list");
     
-    device->send_next = 0;
     device->update_objects = 1;
     device->disable = 1;
     device->current_state = READ_OBJECT_LIST;
@@ -1260,10 +1504,10 @@ void send_read_struct_list(BacDevice2* device)
     BACNET_PROPERTY_ID property_id = PROP_OBJECT_LIST;
     int32_t object_index = 0;
 
-    my_tsm_logic_invokeID_set(device->invokeId);
-    Send_Read_Property_Request(instance_number,
-                    object_type, object_instance,
-                    property_id, object_index);
+    track_transaction(device->instanceNumber,
+            Send_Read_Property_Request(instance_number,
+                        object_type, object_instance,
+                        property_id, object_index));
 }
 
 void add_request(BacDevice2* device, REQUEST_DATA* request)
@@ -1301,11 +1545,11 @@ void add_request_if_need(BacDevice2* device)
         return;
     }
     
-    BacObject* objects = device->objects_header;
-    BACNET_READ_ACCESS_DATA* header = NULL;
+    // only the objects marked by the worker need a look
+    BacObject* objects = NULL;
+    RpmBatch batch = {0};
     REQUEST_DATA* request = NULL;
-    char rpm_object_number = 0;
-    while(objects)
+    while((objects = next_marked_object(&device->objects)) != NULL)
     {
         if (objects->support_cov == NEED_TO_SUB
             && s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
@@ -1313,7 +1557,6 @@ void add_request_if_need(BacDevice2* device)
             if(!is_need_to_subscribe(objects))
             {
                 objects->support_cov = SUPPORT_SUB;
-                objects = objects->next;
                 continue;
             }
 
@@ -1354,54 +1597,71 @@ void add_request_if_need(BacDevice2* device)
             next_data_property->next = NULL;
 
             next_data->listOfProperties = next_data_property;
-            next_data->next = header;
-            header = next_data;
+            add_to_rpm_batch(device, &batch, next_data, &request);
             
             objects->need_to_read = 0;
-            rpm_object_number++;
-            if(rpm_object_number >= s_rpm_object_num_max)
-            {
-                REQUEST_DATA* req = calloc(1, sizeof(REQUEST_DATA));
-                req->request = (void*) header;
-                req->type = RPM_REQUEST;
-                req->next = request;
-                request = req;
-
-                header = NULL;
-                rpm_object_number = 0;
-            }
         }
-        objects = objects->next;
-    }
-    if(header)
-    {
-        REQUEST_DATA* req = calloc(1, sizeof(REQUEST_DATA));
-        req->request = (void*) header;
-        req->type = RPM_REQUEST;
-        req->next = request;
-        request = req;
     }
+    flush_rpm_batch(&batch, &request);
 
     add_request(device, request);
 }
 
-void mark_object_for_subscribe(
-    BacDevice2* device,
-    BACNET_SUBSCRIBE_COV_DATA* cov_data
-)
+// put a request back to the head of the request list, to be sent first
+void requeue_request(BacDevice2* device, REQUEST_DATA* request)
 {
-    BacObject* object = device->objects_header;
-    BACNET_OBJECT_ID target_object = cov_data->monitoredObjectIdentifier;
-    while(object)
+    Thread_lock_mutex(device->request_list_mutex);
+    request->next = device->request_list.head;
+    if(device->request_list.head == NULL)
     {
-        if (object->objectType == target_object.type
-                && object->objectInstance == target_object.instance)
-        {
-            device->handle_next_object = object;
+        device->request_list.tail = request;
+    }
+    device->request_list.head = request;
+    Thread_unlock_mutex(device->request_list_mutex);
+}
+
+// send a request of the request list, return the invoke id or 0 if not sent
+static uint8_t send_request(BacDevice2* device, REQUEST_DATA* request)
+{
+    uint8_t invoke_id = 0;
+    switch(request->type)
+    {
+        case RPM_REQUEST :
+            {
+                BACNET_READ_ACCESS_DATA* header = request->request;
+                uint8_t buffer[MAX_PDU] = {0};
+                LOG_DEBUG("Send Read Property Multiple Request");
+                invoke_id = Send_Read_Property_Multiple_Request(&buffer[0],
+                                 sizeof(buffer), device->instanceNumber,
+                                 header);
+            }
+            break;
+        case WPM_REQUEST :
+            {
+                BACNET_WRITE_ACCESS_DATA* header = request->request;
+                LOG_DEBUG("send wpm request immediately");
+                invoke_id = Send_Write_Property_Multiple_Request_Data(
+                                device->instanceNumber,
+                                header);
+            }
+            break;
+        case SUBSCRIBE_OBJECT_REQUEST :
+            if(s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
+            {
+                invoke_id = Send_COV_Subscribe(device->instanceNumber, request->request);
+            }
+            break;
+        case SUBSCRIBE_PROPERTY_REQUEST :
+            if(s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
+            {
+                invoke_id = Send_COV_Subscribe_Property(device->instanceNumber,
+                        request->request);
+            }
+            break;
+        default :
             break;
-        }
-        object = object->next;
     }
+    return invoke_id;
 }
 
 void send_next_request(BacDevice2* device)
@@ -1411,74 +1671,74 @@ void send_next_request(BacDevice2* device)
         return;
     }
 
-    REQUEST_DATA* request = NULL;
-    Thread_lock_mutex(device->request_list_mutex);
-    if(device->request_list.head != NULL)
+    while(device->in_flight < device->window)
     {
-        request = device->request_list.head;
-        device->request_list.head = request->next;
-    }
-    Thread_unlock_mutex(device->request_list_mutex);
+        // no invoke id left, the requests wait for the next round
+        if(!tsm_transaction_available())
+        {
+            return;
+        }
 
-    if(request != NULL)
-    {
-        device->send_next = 0;
-        switch(request->type)
+        REQUEST_DATA* request = NULL;
+        Thread_lock_mutex(device->request_list_mutex);
+        if(device->request_list.head != NULL)
         {
-            case RPM_REQUEST :
-                {
-                    BACNET_READ_ACCESS_DATA* header = request->request;
-                    uint8_t buffer[MAX_PDU] = {0};
-                    log_debug("Send Read Property Multiple Request");
-                    my_tsm_logic_invokeID_set(device->invokeId);
-                    Send_Read_Property_Multiple_Request(&buffer[0],
-                                         sizeof(buffer), device->instanceNumber,
-                                         header);
-                    cleanup_read_access_data(header);
-                }
-                break;
-            case WPM_REQUEST :
-                {
-                    BACNET_WRITE_ACCESS_DATA* header = request->request;
-                    log_debug("send wpm request immediately");
-                    my_tsm_logic_invokeID_set(device->invokeId);
-                    Send_Write_Property_Multiple_Request_Data(
-                                        device->instanceNumber,
-                                        header);
-                    cleanup_write_access_data(header);
-                }
-                break;
-            case SUBSCRIBE_OBJECT_REQUEST :
-                {
-                    BACNET_SUBSCRIBE_COV_DATA* cov_data = request->request;
-                    if(s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
-                    {
-                        mark_object_for_subscribe(device, cov_data);
-                        my_tsm_logic_invokeID_set(device->invokeId);
-                        Send_COV_Subscribe(device->instanceNumber, cov_data);
-                    }
-                    free(cov_data);
-                }
-                break;
-            case SUBSCRIBE_PROPERTY_REQUEST :
-                {
-                    BACNET_SUBSCRIBE_COV_DATA* cov_data = request->request;
-                    if(s_vars->g_interval.subscribe_type != NO_SUBSCRIBE)
-                    {
-                        mark_object_for_subscribe(device, cov_data);
-                        my_tsm_logic_invokeID_set(device->invokeId);
-                        Send_COV_Subscribe_Property(device->instanceNumber, cov_data);
-                    }
-                    free(cov_data);
-                }
-                break;
-            default :
-                break;
+            request = device->request_list.head;
+            device->request_list.head = request->next;
+        }
+        Thread_unlock_mutex(device->request_list_mutex);
+
+        if(request == NULL)
+        {
+            return;
+        }
+        request->next = NULL;
+
+        if(track_request(device->instanceNumber, send_request(device, request), request))
+        {
+            device->in_flight++;
+        }
+        else
+        {
+            free_request(request);
         }
-        free(request);
     }
 }
 
+void free_request(REQUEST_DATA* request)
+{
+    if(request == NULL)
+    {
+        return;
+    }
+
+    switch(request->type)
+    {
+        case RPM_REQUEST :
+            {
+                BACNET_READ_ACCESS_DATA* header = request->request;
+                cleanup_read_access_data(header);
+            }
+            break;
+        case WPM_REQUEST :
+            {
+                BACNET_WRITE_ACCESS_DATA* header = request->request;
+                cleanup_write_access_data(header);
+            }
+            break;
+        case SUBSCRIBE_OBJECT_REQUEST :
+        case SUBSCRIBE_PROPERTY_REQUEST :
+            {
+                BACNET_SUBSCRIBE_COV_DATA* cov_data = request->request;
+                free(cov_data);
+            }
+            break;
+        default :
+            break;
+    }
+    free(request);
+}
+
 void clean_request(BacDevice2* device)
 {
     if(device == NULL)
@@ -1491,33 +1751,9 @@ void clean_request(BacDevice2* device)
     REQUEST_DATA* old_request = NULL;
     while(request)
     {
-        switch(request->type)
-        {
-            case RPM_REQUEST :
-                {
-                    BACNET_READ_ACCESS_DATA* header = request->request;
-                    cleanup_read_access_data(header);
-                }
-                break;
-            case WPM_REQUEST :
-                {
-                    BACNET_WRITE_ACCESS_DATA* header = request->request;
-                    cleanup_write_access_data(header);
-                }
-                break;
-            case SUBSCRIBE_OBJECT_REQUEST :
-            case SUBSCRIBE_PROPERTY_REQUEST :
-                {
-                    BACNET_SUBSCRIBE_COV_DATA* cov_data = request->request;
-                    free(cov_data);
-                }
-                break;
-            default :
-                break;
-        }
         old_request = request;
         request = old_request->next;
-        free(old_request);
+        free_request(old_request);
     }
     device->request_list.head = NULL;
     device->request_list.tail = NULL;
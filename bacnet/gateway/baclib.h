@@ -11,7 +11,9 @@ int start_local_bacnet_device(Bac2mqttConfig* pconfig);
 // pass the global variables pointer into this lib
 void set_global_vars(GlobalVar* pVars);
 
-void receive_and_handle();
+// wait up to timeout milliseconds for a packet from the receiver, then
+// handle the packets already there
+void receive_and_handle(unsigned timeout);
 
 void free_device(BacDevice2* device, char need_to_un_subscribe);
 
@@ -27,7 +29,10 @@ void send_wpm_immediately(cJSON* root);
 
 void send_read_struct_list(BacDevice2* device);
 
-void handle_for_unexpected(uint8_t invoke_id);
+void handle_for_unexpected(BacDevice2* device);
+
+// give up on the requests not replied in time
+void expire_requests();
 
 void subscribe_unconfirmed(BacDevice2* device, BacObject* object);
 
@@ -39,8 +44,13 @@ void add_request(BacDevice2* device, REQUEST_DATA* request);
 
 void add_request_if_need(BacDevice2* device);
 
+// send the requests of the request list, while the device's window allows
 void send_next_request(BacDevice2* device);
 
+void requeue_request(BacDevice2* device, REQUEST_DATA* request);
+
+void free_request(REQUEST_DATA* request);
+
 void clean_request(BacDevice2* device);
 
 typedef struct BacValueOutput_t
@@ -2,8 +2,6 @@
 #include <string.h>
 #include "common.h"
 
-static char s_log_buff[BUFF_LEN] = {0};
-
 BACNET_OBJECT_TYPE str2_bac_object_type(char* str)
 {
     if (strcmp("ANALOG_INPUT", str) == 0)
@@ -59,8 +57,7 @@ BACNET_OBJECT_TYPE str2_bac_object_type(char* str)
         return OBJECT_POSITIVE_INTEGER_VALUE;
     }
 
-    snprintf(s_log_buff, BUFF_LEN, "Unsupported object type: %s", str);
-    log_debug(s_log_buff);
+    LOG_DEBUG("Unsupported object type: %s", str);
     // NOT SUPPORTED TYPE
     return MAX_BACNET_OBJECT_TYPE;
 }
@@ -132,7 +129,6 @@ BACNET_PROPERTY_ID str2_property_id(char* str)
         return PROP_PROTOCOL_REVISION;
     }
 
-    snprintf(s_log_buff, BUFF_LEN, "Unsupported property id: %s", str);
-    log_debug(s_log_buff);
+    LOG_DEBUG("Unsupported property id: %s", str);
     return MAX_BACNET_PROPERTY_ID;
 }
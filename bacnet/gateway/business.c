@@ -9,15 +9,27 @@
 #include "baclib.h"
 #include "data.h"
 #include "bactext.h"
+#include "registry.h"
+#include "objecttable.h"
+#include "receiver.h"
 
 const char* const CONFIG_FILE = "gwconfig-bacnet.txt";
 const char* const POLICY_CACHE = "policyCache-bacnet.txt";
 
 GlobalVar g_vars;
 char g_buff[BUFF_LEN];
+static int g_log_level = LOG_LEVEL_INFO;
+static int g_log_format = LOG_FORMAT_TEXT;
 int g_stop_worker = 0;
 int g_worker_is_running = 0;
 
+// the longest the worker sleeps in the receive, so the requests queued by
+// the mqtt thread and the config changes are picked up in time
+enum
+{
+    WORKER_WAIT_MAX_MS = 200
+};
+
 char g_cov_increment_change = 0;
 char g_subscribe_type_change = 0;
 SUBSCRIBE_STATE g_cancel_type = UN_NEED_TO_CANCEL;
@@ -39,11 +51,28 @@ void load_mqtt_config(const char* file, MqttInfo* pInfo)
 
     json2_mqtt_info(content, pInfo);
 
+    // logLevel, 0 debug, 1 info, 2 warn, 3 error; logFormat, "text" or "json"
+    cJSON* root = cJSON_Parse(content);
+    if (root != NULL)
+    {
+        if (cJSON_HasObjectItem(root, "logLevel"))
+        {
+            g_log_level = json_int(root, "logLevel");
+        }
+        if (cJSON_HasObjectItem(root, "logFormat"))
+        {
+            char* format = json_string(root, "logFormat");
+            g_log_format = format != NULL && strcmp(format, "json") == 0
+                    ? LOG_FORMAT_JSON : LOG_FORMAT_TEXT;
+        }
+        cJSON_Delete(root);
+    }
+    free(content);
 }
 
 void connection_lost(void* context, char* cause)
 {
-    printf("\nConnection lost, caused by %s, will reconnect later\n", cause);
+    LOG_WARN("Connection lost, caused by %s, will reconnect later", cause);
     // Thread_lock_mutex((g_vars.g_gateway_mutex));
     g_vars.g_gateway_connected = 0;
     // Thread_unlock_mutex((g_vars.g_gateway_mutex));
@@ -51,7 +80,7 @@ void connection_lost(void* context, char* cause)
 
 void delivered(void* context, MQTTClient_deliveryToken dt)
 {
-    printf("Message with token value %d delivery confirmed\n", dt);
+    LOG_DEBUG("Message with token value %d delivery confirmed", dt);
 }
 
 void msg_arrived_config(cJSON* root)
@@ -196,54 +225,52 @@ int msg_arrived(void* context, char* topicName, int topicLen, MQTTClient_message
 
     if (is_string_valid_json(buf) == 0)
     {
+        LOG_ERROR("received invalid json config:%s", buf);
         free(buf);
         MQTTClient_free(topicName);
-        printf("received invalid json config:%s\n", buf);
         return 0;
     }
 
     cJSON* root = cJSON_Parse(buf);
-    free(buf);
     if(root == NULL)
     {
-        printf("the config string is not a valid json object, content=%s\n", buf);
+        LOG_ERROR("the config string is not a valid json object, content=%s", buf);
+        free(buf);
         MQTTClient_free(topicName);
         return 0;
     }
+    free(buf);
 
     if (strcmp(g_vars.g_mqtt_info.sub_config, topicName) == 0)
     {
         // the parameters of interval
-        log_debug("got message with the parameters of interval from \"config\" topic");
+        LOG_DEBUG("got message with the parameters of interval from \"config\" topic");
         // TODO
         msg_arrived_config(root);
     }
     else if (strcmp(g_vars.g_mqtt_info.sub_whois, topicName) == 0)
     {
         // sent who-is immediately
-        log_debug("got message from \"whois\" topic and will be sent who-is immediately");
+        LOG_DEBUG("got message from \"whois\" topic and will be sent who-is immediately");
         // TODO
         send_whois_immediately();
     }
     else if (strcmp(g_vars.g_mqtt_info.sub_rpm, topicName) == 0)
     {
         // sent rpm immediately
-        log_debug("got message from \"rpm\" topic and will be sent rpm immediately");
+        LOG_DEBUG("got message from \"rpm\" topic and will be sent rpm immediately");
         // TODO
         send_rpm_immediately(root);
     }
     else if (strcmp(g_vars.g_mqtt_info.sub_wp, topicName) == 0)
     {
-        log_debug("got message from \"wp\" topic and will be sent wpm immediately");
+        LOG_DEBUG("got message from \"wp\" topic and will be sent wpm immediately");
         send_wpm_immediately(root);
     }
     else
     {
-        char buff[BUFF_LEN];
-        snprintf(buff, BUFF_LEN,
-                "received unrelevant message in command topic, skipping it. topic=%s, payload=%s"
-                , topicName, payloadptr);
-        log_debug(buff);
+        LOG_DEBUG("received unrelevant message in command topic, skipping it. topic=%s",
+                topicName);
     }
 
     cJSON_Delete(root);
@@ -267,7 +294,7 @@ void load_pull_policy(const char* file, Bac2mqttConfig* pconfig)
 
     if (filesize <= 0)
     {
-        printf("failed to open policy cache file %s, skipping policy cache loading\n",
+        LOG_WARN("failed to open policy cache file %s, skipping policy cache loading",
                file);
 
         return;
@@ -300,10 +327,7 @@ void init_global_vars(GlobalVar* vars)
     vars->g_config.rtDeviceStarted = 0;	// this bacnet device not started yet
     vars->g_config.policyHeader.next = NULL;
 
-    vars->g_all_devices.devices_num = 0;
-    // device index from 1 to DEVICE_NUM_MAX
-    vars->g_all_devices.devices_header = 
-        (BacDevice2**) malloc((DEVICE_NUM_MAX + 1) * sizeof(BacDevice2*));
+    init_devices(&vars->g_all_devices);
 
     vars->g_interval.poll_interval = 30;
     vars->g_interval.poll_interval_cov = 300;
@@ -325,7 +349,7 @@ void list_devices()
     BacDevice2** device = g_vars.g_all_devices.devices_header;
     printf("Instance\t\tObjectCount\r\n");
     int i = 0;
-    for(i = 1; i <= g_vars.g_all_devices.devices_num; i++)
+    for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
     {
         printf("%d\t\t%d\r\n", device[i]->instanceNumber, device[i]->objects_size);
     }
@@ -337,7 +361,7 @@ void list_devices_debug()
     BacDevice2** device = g_vars.g_all_devices.devices_header;
     printf("Instance\t\tObjectCount\t\tLastDiscoverTime\t\tReadObject\t\tDisabled\r\n");
     int i = 0;
-    for(i = 1; i <= g_vars.g_all_devices.devices_num; i++)
+    for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
     {
         printf("%d\t\t%d\t\t%ld\t\t%d\t\t%d\r\n", device[i]->instanceNumber, 
             device[i]->objects_size, 
@@ -351,21 +375,19 @@ void list_objects(int instance) {
     BacDevice2** devices = g_vars.g_all_devices.devices_header;
     int i = 0;
     char found = 0;
-    for(i = 1; i <= g_vars.g_all_devices.devices_num; i++)
+    for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
     {
         if (inst == devices[i]->instanceNumber)
         {
             found = 1;
             printf("ObjectType\t\tObjectInstance\t\tCovEnabled\t\tLastReadTime\r\n");
-            BacObject* object = devices[i]->objects_header;
             int cnt = 0;
-            while(object)
+            for(cnt = 0; cnt < devices[i]->objects.num; cnt++)
             {
+                BacObject* object = &devices[i]->objects.objects[cnt];
                 printf("%s\t\t%d\t\t%d\t\t%ld\r\n", bactext_object_type_name(object->objectType),
                     object->objectInstance, 
                     object->support_cov, object->last_read_time);
-                cnt++;
-                object = object->next;
             }
             printf("Total:%d\r\n", cnt);
             break;
@@ -381,23 +403,21 @@ void list_objects_debug(int instance) {
     BacDevice2** devices = g_vars.g_all_devices.devices_header;
     int i = 0;
     char found = 0;
-    for(i = 1; i <= g_vars.g_all_devices.devices_num; i++)
+    for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
     {
         if (inst == devices[i]->instanceNumber)
         {
             found = 1;
             printf("ObjectType\t\tObjectInstance\t\tCovEnabled\t\tLastReadTime\t\t");
             printf("LasSubscribeTime\t\tNeedRead\r\n");
-            BacObject* object = devices[i]->objects_header;
             int cnt = 0;
-            while(object)
+            for(cnt = 0; cnt < devices[i]->objects.num; cnt++)
             {
+                BacObject* object = &devices[i]->objects.objects[cnt];
                 printf("%s\t\t%d\t\t%d\t\t%ld\t\t%ld\t\t%d\r\n", 
                     bactext_object_type_name(object->objectType), object->objectInstance, 
                     object->support_cov, object->last_read_time, object->subscribe_time, 
                     object->need_to_read);
-                cnt++;
-                object = object->next;
             }
             printf("Total:%d\r\n", cnt);
             break;
@@ -497,6 +517,115 @@ void insert_slave_policy(PullPolicy* policy)
     itr->next = policy;
 }
 
+// the polls and subscribes of the objects due by now_time. each object is
+// given back to the table with the time it's due again
+static void poll_due_objects(BacDevice2* device, time_t now_time)
+{
+    Interval* interval = &g_vars.g_interval;
+    BacObject* object = NULL;
+    while((object = next_due_object(&device->objects, now_time)) != NULL)
+    {
+        char subscribed = object->support_cov == SUBSCRIBED
+            && interval->subscribe_type != NO_SUBSCRIBE;
+        if(object->need_to_read == 0)
+        {
+            if(subscribed)
+            {
+                if(now_time - object->subscribe_time
+                        >= interval->subscribe_duration)
+                { 
+                    // need to re-subscribe
+                    object->support_cov = NEED_TO_SUB;
+                    object->subscribe_time = now_time;
+                }
+                if(now_time - object->last_read_time
+                        >= interval->poll_interval_cov)
+                {
+                    // read object supported COV with a low frequency
+                    object->need_to_read = 1;
+                    object->last_read_time = now_time;
+                }
+            }
+            else
+            {
+                if(now_time - object->last_read_time
+                        >= interval->poll_interval)
+                {
+                    // read object un-supported COV with a proper frequency
+                    object->need_to_read = 1;
+                    object->last_read_time = now_time;
+                }
+            }
+        }
+
+        if(object->need_to_read
+            || (object->support_cov == NEED_TO_SUB && interval->subscribe_type != NO_SUBSCRIBE))
+        {
+            mark_object(&device->objects, object);
+        }
+
+        // a cov notification only moves last_read_time, the object is put
+        // off when it comes due
+        time_t due = object->last_read_time + interval->poll_interval;
+        if(subscribed)
+        {
+            due = object->last_read_time + interval->poll_interval_cov;
+            if(object->subscribe_time + interval->subscribe_duration < due)
+            {
+                due = object->subscribe_time + interval->subscribe_duration;
+            }
+        }
+        schedule_object(&device->objects, object, due > now_time ? due : now_time + 1);
+    }
+}
+
+// the objects of all devices are due again once the intervals change
+static void reschedule_if_need(time_t now_time)
+{
+    static Interval scheduled = {0};
+    Interval* interval = &g_vars.g_interval;
+    if(interval->poll_interval == scheduled.poll_interval
+        && interval->poll_interval_cov == scheduled.poll_interval_cov
+        && interval->subscribe_duration == scheduled.subscribe_duration
+        && interval->subscribe_type == scheduled.subscribe_type)
+    {
+        return;
+    }
+    scheduled = *interval;
+
+    BacDevice2** device = g_vars.g_all_devices.devices_header;
+    int i = 0;
+    for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
+    {
+        reschedule_objects(&device[i]->objects, now_time);
+    }
+}
+
+static void earliest(time_t* next_time, time_t deadline)
+{
+    if(deadline < *next_time)
+    {
+        *next_time = deadline;
+    }
+}
+
+// sleep in the receive until the first deadline, or the first transaction
+// timer of the stack, runs out
+static void receive_until(time_t now_time, time_t next_time)
+{
+    long long wait_ms = (long long) (next_time - now_time) * 1000;
+    int expiry_ms = next_expiry_ms();
+    if(expiry_ms >= 0 && expiry_ms < wait_ms)
+    {
+        wait_ms = expiry_ms;
+    }
+    if(wait_ms > WORKER_WAIT_MAX_MS)
+    {
+        wait_ms = WORKER_WAIT_MAX_MS;
+    }
+    receive_and_handle(wait_ms > 0 ? (unsigned) wait_ms : 0);
+}
+
 //TODO: fire up a few more workers, and precess in parallel, to speed up.
 thread_return_type worker_func(void* arg)
 {
@@ -508,7 +637,7 @@ thread_return_type worker_func(void* arg)
     {
         if (g_vars.g_gateway_connected == 0)
         {
-            log_debug("going to connect the mqtt client");
+            LOG_DEBUG("going to connect the mqtt client");
             start_mqtt_client(&g_vars, connection_lost, msg_arrived, delivered);
         }
 
@@ -526,6 +655,9 @@ thread_return_type worker_func(void* arg)
             mqtt_send_heartbeat(&g_vars);
             g_vars.g_mqtt_info.last_heartbeat_time = now_time;
         }
+        // the first of the deadlines below
+        time_t next_time = g_vars.g_mqtt_info.last_heartbeat_time
+            + g_vars.g_interval.heart_beat_interval;
 
         if (g_vars.g_config.rtConfLoaded)
         {
@@ -549,29 +681,31 @@ thread_return_type worker_func(void* arg)
                 send_whois_immediately();
                 last_whois_time = now_time;
             }
+            earliest(&next_time, last_whois_time + g_vars.g_interval.who_is_interval);
 
             // iterate the devices
             if(g_vars.g_config.rtDeviceStarted == 1)
             {
                 BacDevice2** device = g_vars.g_all_devices.devices_header;
                 int i = 0;
+                reschedule_if_need(now_time);
                 if((g_cov_increment_change == 1
                     && g_vars.g_interval.subscribe_type == SUBSCRIBE_PROPERTY_WITH_COV_INCREMENT)
                     || g_subscribe_type_change == 1)
                 {
-                    for(i = 1; i <= g_vars.g_all_devices.devices_num; i++)
+                    for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
                     {
                         if(device[i]->current_state != READ_OBJECT_LIST)
                         {
                             // re-subscribe or cancel subscribe
-                            device[i]->handle_next_object = NULL;
+                            device[i]->handle_next_object = -1;
                             device[i]->disable = 1;
-                            device[i]->send_next = 0;
                             device[i]->last_ack_time = now_time;
-                            BacObject* object = device[i]->objects_header;
                             device[i]->current_state = CANCEL_SUBSCRIBE_OBJECT;
-                            while(object)
+                            int j = 0;
+                            for(j = 0; j < device[i]->objects.num; j++)
                             {
+                                BacObject* object = &device[i]->objects.objects[j];
                                 if(object->support_cov != UN_SUPPORT_SUB)
                                 {
                                     if(g_subscribe_type_change)
@@ -599,8 +733,9 @@ thread_return_type worker_func(void* arg)
                                         }
                                     }
                                 }
-                                object = object->next;
                             }
+                            // every object has to be looked at again
+                            reschedule_objects(&device[i]->objects, now_time);
                             if(g_vars.g_interval.subscribe_type == NO_SUBSCRIBE)
                             {
                                 device[i]->current_state = CANCEL_SUBSCRIBE_OBJECT;
@@ -617,7 +752,7 @@ thread_return_type worker_func(void* arg)
                     g_cancel_type = UN_NEED_TO_CANCEL;
                 }
 
-                for(i = 1; i <= g_vars.g_all_devices.devices_num; i++)
+                for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
                 {
                     if(now_time - device[i]->last_ack_time
                         >= g_vars.g_interval.poll_interval)
@@ -626,15 +761,14 @@ thread_return_type worker_func(void* arg)
                         {
                             if(device[i]->disable == 0)
                             {
-                                // lost rpmack, reset
-                                device[i]->send_next = 1;
+                                // nothing answered for a while, try again
                                 device[i]->last_ack_time = now_time;
                                 send_next_request(device[i]);
                             }
                         }
                         else
                         {
-                            handle_for_unexpected(i);
+                            handle_for_unexpected(device[i]);
                         }
                     }
 
@@ -649,59 +783,36 @@ thread_return_type worker_func(void* arg)
                         }
                         else
                         {
-                            // iterate the object
-                            BacObject* object = device[i]->objects_header;
-                            while(object)
-                            {
-                                if(object->need_to_read == 0)
-                                {
-                                    if(object->support_cov == SUBSCRIBED
-                                        && g_vars.g_interval.subscribe_type != NO_SUBSCRIBE)
-                                    {
-                                        if(now_time - object->subscribe_time
-                                                >= g_vars.g_interval.subscribe_duration)
-                                        { 
-                                            // need to re-subscribe
-                                            object->support_cov = NEED_TO_SUB;
-                                            object->subscribe_time = now_time;
-                                        }
-                                        if(now_time - object->last_read_time
-                                                >= g_vars.g_interval.poll_interval_cov)
-                                        {
-                                            // read object supported COV with a low frequency
-                                            object->need_to_read = 1;
-                                            object->last_read_time = now_time;
-                                        }
-                                    }
-                                    else
-                                    {
-                                        if(now_time - object->last_read_time
-                                                >= g_vars.g_interval.poll_interval)
-                                        {
-                                            // read object un-supported COV with a proper frequency
-                                            object->need_to_read = 1;
-                                            object->last_read_time = now_time;
-                                        }
-                                    }
-                                }
-                                object = object->next;
-                            }
+                            poll_due_objects(device[i], now_time);
                             add_request_if_need(device[i]);
-                            if(device[i]->send_next)
-                            {
-                                send_next_request(device[i]);
-                            }
+                            send_next_request(device[i]);
+                        }
+                    }
+
+                    if(device[i]->current_state != ENTER_MAIN_LOOP || device[i]->disable == 0)
+                    {
+                        earliest(&next_time,
+                                device[i]->last_ack_time + g_vars.g_interval.poll_interval);
+                    }
+                    time_t due = 0;
+                    if(device[i]->disable == 0)
+                    {
+                        earliest(&next_time, device[i]->last_discover_time
+                                + g_vars.g_interval.object_discover_interval);
+                        if(first_due_time(&device[i]->objects, &due))
+                        {
+                            earliest(&next_time, due);
                         }
                     }
                 }
             }
         }
 
-        receive_and_handle();
+        receive_until(now_time, next_time);
+        expire_requests();
         last_time = now_time;
-        sleep_ms(5);
     }
-    log_debug("exiting worker thread...\n");
+    LOG_DEBUG("exiting worker thread...");
     g_worker_is_running = 0;
     return NULL;
 }
@@ -718,8 +829,10 @@ void init_and_start()
     init_global_vars(&g_vars);
 
     load_mqtt_config(CONFIG_FILE, &(g_vars.g_mqtt_info));
+    start_logger(g_log_level, g_log_format);
 
     start_mqtt_client(&g_vars, connection_lost, msg_arrived, delivered);
+    start_publisher(&g_vars);
 
     // lets sleep 1 second, in case any config sent with retain=true
     sleep_ms(1000);
@@ -741,12 +854,13 @@ void cleanup_device(char need_to_un_subscribe)
     // clean up all devices
     BacDevice2** device = g_vars.g_all_devices.devices_header;
     int i = 0;
-    for(i = 1; i <= g_vars.g_all_devices.devices_num; i++)
+    for(i = 0; i < g_vars.g_all_devices.devices_num; i++)
     {
         free_device(device[i], need_to_un_subscribe);
     }
     device = NULL;
-    g_vars.g_all_devices.devices_num = 0;
+    clear_devices(&g_vars.g_all_devices);
+    clear_transactions(free_request);
 }
 
 void cleanup_data()
@@ -755,6 +869,8 @@ void cleanup_data()
     cleanup_device(1);
     free(g_vars.g_all_devices.devices_header);
     g_vars.g_all_devices.devices_header = NULL;
+    free(g_vars.g_all_devices.buckets);
+    g_vars.g_all_devices.buckets = NULL;
     
     // close the mqtt connection
     mqtt_cleanup(&g_vars);
@@ -785,12 +901,14 @@ void clean_and_exit()
     {
         sleep_ms(1000);
     }
+    stop_receiver();
     cleanup_data();
+    stop_logger();
 }
 
 void reset_gateway()
 {
-    printf("Gateway is being reset from cloud\n");
+    LOG_INFO("Gateway is being reset from cloud");
     // clean up all devices
     cleanup_device(0);
     // send who_is
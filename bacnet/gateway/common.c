@@ -26,6 +26,121 @@ void sleep_ms(int milliseconds) // cross-platform sleep function
 #endif
 }
 
+long long now_ms()
+{
+#ifdef WIN32
+    return (long long) GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+#ifdef WIN32
+struct Event_t
+{
+    HANDLE handle;
+};
+
+Event* create_event()
+{
+    Event* event = (Event*) malloc(sizeof(Event));
+    event->handle = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return event;
+}
+
+void signal_event(Event* event)
+{
+    SetEvent(event->handle);
+}
+
+int wait_event(Event* event, int timeout)
+{
+    return WaitForSingleObject(event->handle, timeout) == WAIT_OBJECT_0;
+}
+
+void destroy_event(Event* event)
+{
+    CloseHandle(event->handle);
+    free(event);
+}
+#else
+struct Event_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int signaled;
+};
+
+Event* create_event()
+{
+    Event* event = (Event*) malloc(sizeof(Event));
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&event->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&event->mutex, NULL);
+    event->signaled = 0;
+    return event;
+}
+
+void signal_event(Event* event)
+{
+    pthread_mutex_lock(&event->mutex);
+    event->signaled = 1;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+}
+
+int wait_event(Event* event, int timeout)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&event->mutex);
+    int rc = 0;
+    while (!event->signaled && rc == 0)
+    {
+        rc = pthread_cond_timedwait(&event->cond, &event->mutex, &ts);
+    }
+    int signaled = event->signaled;
+    event->signaled = 0;
+    pthread_mutex_unlock(&event->mutex);
+    return signaled;
+}
+
+void destroy_event(Event* event)
+{
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+    free(event);
+}
+#endif
+
+long long epoch_ms()
+{
+#ifdef WIN32
+    // 100 nanoseconds since 1601
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    unsigned long long t = ((unsigned long long) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (long long) (t / 10000 - 11644473600000ULL);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 // common function section
 long read_file_as_string(char const* path, char** buf)
 {
@@ -79,6 +194,7 @@ int g_debug = 0;
 void toggle_debug()
 {
     g_debug = g_debug == 0 ? 1 : 0;
+    set_log_debug(g_debug);
     if (g_debug == 1)
     {
         printf("debug info is on\n");
@@ -89,15 +205,6 @@ void toggle_debug()
     }
 }
 
-void log_debug(char* msg)
-{
-    if (g_debug == 1)
-    {
-        time_t now = time(NULL);
-        printf("%s %s\n", ctime(&now), msg);
-    }
-}
-
 void mystrncpy(char* desc, const char* src, int len)
 {
     snprintf(desc, len, "%s", src);
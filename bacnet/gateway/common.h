@@ -2,6 +2,7 @@
 #define INF_BCE_IOT_BAC2MQTT_COMMON_H
 
 #include "data.h"
+#include "logger.h"
 #include <cjson/cJSON.h>
 
 // common function section
@@ -9,8 +10,6 @@ long read_file_as_string(char const* path, char** buf);
 
 void toggle_debug();
 
-void log_debug(char* msg);
-
 void mystrncpy(char* desc, const char* src, int len);
 
 int json_bool(cJSON* root, char* item);
@@ -23,6 +22,25 @@ char* json_string(cJSON* root, char* item);
 
 void sleep_ms(int ms);
 
+// milliseconds of a clock that doesn't go back
+long long now_ms();
+
+// milliseconds since the epoch, of the wall clock
+long long epoch_ms();
+
+// wakes up a thread waiting for it, a signal nobody waits for yet is kept
+// for the next wait
+typedef struct Event_t Event;
+
+Event* create_event();
+
+void signal_event(Event* event);
+
+// return 1 if the event was signaled, 0 after timeout milliseconds
+int wait_event(Event* event, int timeout);
+
+void destroy_event(Event* event);
+
 char* create_topic(const char* topic_prefix, const char* topic_suffix);
 
 #endif
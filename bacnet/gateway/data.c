@@ -1,5 +1,6 @@
 #include "data.h"
 #include "thread.h"
+#include "objecttable.h"
 
 PullPolicy* new_pull_policy()
 {
@@ -18,23 +19,29 @@ BacProperty* new_bac_property()
     return ret;
 }
 
-BacObject* new_bac_object()
+void init_bac_object(BacObject* object)
 {
-    BacObject* ret = (BacObject*) malloc(sizeof(BacObject));
-    ret->need_to_read = 0;
-    ret->support_cov = UN_SUPPORT_SUB;
-    ret->un_support_state = UN_SUPPORT_SUB;
-    ret->subscribe_time = 0;
-    ret->last_read_time = 0;
-    ret->next = NULL;
-    return ret;
+    object->need_to_read = 0;
+    object->support_cov = UN_SUPPORT_SUB;
+    object->un_support_state = UN_SUPPORT_SUB;
+    object->subscribe_time = 0;
+    object->last_read_time = 0;
+    object->due = 0;
+    object->marked = 0;
 }
 
 BacDevice2* new_bac_device2()
 {
     BacDevice2* ret = (BacDevice2*) malloc(sizeof(BacDevice2));
     ret->disable = 1;
-    ret->send_next = 1;
+    ret->in_flight = 0;
+    ret->window = 1;
+    ret->window_max = 1;
+    ret->window_acks = 0;
+    ret->max_apdu = MAX_APDU;
+    ret->segmentation = SEGMENTATION_NONE;
+    ret->rpm_max_objects = RPM_OBJECTS_MAX;
+    ret->rpm_streak = 0;
     ret->update_objects = 0;
     ret->objects_size = 0;
     ret->next_index = 0;
@@ -43,7 +50,9 @@ BacDevice2* new_bac_device2()
     ret->request_list.tail = NULL;
     ret->request_list_mutex = Thread_create_mutex();
     ret->current_state = INIT_STATE;
-    ret->objects_header = NULL;
-    ret->handle_next_object = NULL;
+    init_objects(&ret->objects);
+    ret->handle_next_object = -1;
+    ret->topics = NULL;
+    ret->hash_next = NULL;
     return ret;
 }
\ No newline at end of file
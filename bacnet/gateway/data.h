@@ -11,8 +11,6 @@
 #include "thread.h"
 #include "requestlist.h"
 
-#define DEVICE_NUM_MAX 255
-
 // constants
 enum
 {
@@ -21,6 +19,14 @@ enum
     MAX_PROPERTY_PER_MQTT_MSG = 50
 };
 
+// how the messages of a topic are put together into one publish, see
+// mqttutil.h
+typedef struct
+{
+    int max_bytes;	// a batch is sent once it's this large, 0: a publish per message
+    int max_delay;	// in milliseconds, a batch is sent this late after its first message
+} BatchPolicy;
+
 typedef struct
 {
     char* endpoint;
@@ -36,6 +42,10 @@ typedef struct
     char* user;
     char* password;
 
+    BatchPolicy batch_iam;
+    BatchPolicy batch_rpmack;
+    BatchPolicy batch_covnotice;
+
     time_t last_heartbeat_time;
 } MqttInfo;
 
@@ -121,10 +131,29 @@ typedef struct BacObject_t
     // if support_cov is true , when get a COV notification , it will be updated
     time_t last_read_time;
 
-    struct BacObject_t* next;
+    time_t due;	// when the worker looks at the object again
+    char marked;	// in the marked list of the table, see objecttable.h
 } BacObject;
 
-BacObject* new_bac_object();
+void init_bac_object(BacObject* object);
+
+// the objects of a device, in one array, hashed by type and instance, with
+// a heap of the objects by due time, see objecttable.h
+typedef struct
+{
+    BacObject* objects;
+    int num;
+    int cap;
+
+    int* slots;	// index + 1 of the objects, 0 if empty
+    int slots_cap;
+
+    int* due;
+    int due_num;
+
+    int* marked;
+    int marked_num;
+} ObjectTable;
 
 typedef enum {
     INIT_STATE = 0,
@@ -135,6 +164,9 @@ typedef enum {
     ENTER_MAIN_LOOP = 5
 } DEVICE_CURRENT_STATE;
 
+// objects in a rpm, whatever the apdu
+#define RPM_OBJECTS_MAX 255
+
 typedef struct BacDevice2_t
 {
     uint32_t instanceNumber;
@@ -146,29 +178,55 @@ typedef struct BacDevice2_t
     DEVICE_CURRENT_STATE current_state;
 
     char disable;
-    char send_next;
-    // invokeId also is the index of this device in devices_header
-    uint8_t invokeId;
+
+    // requests of the request list sent and not answered yet, at most window.
+    // the window grows up to window_max, from the max apdu of the device, as
+    // the device answers, and halves on timeouts and aborts
+    int in_flight;
+    int window;
+    int window_max;
+    int window_acks;
+
+    // from the i-am of the device
+    unsigned max_apdu;
+    int segmentation;
+
+    // objects per rpm, on top of what fits in max_apdu. halves when the
+    // device aborts a rpm as too large, grows after a streak of full ones
+    int rpm_max_objects;
+    int rpm_streak;
+
     time_t last_iam_time;
     time_t last_ack_time;
 
     mutex_type request_list_mutex;
     REQUEST_LIST request_list;
 
-    BacObject* objects_header;
+    ObjectTable objects;
+
+    // index of the object being subscribed or cancelled, -1 before the first
+    int handle_next_object;
 
-    BacObject* handle_next_object;
+    const struct DeviceTopics_t* topics;	// see mqttutil.h
+
+    struct BacDevice2_t* hash_next;	// next device in the same bucket of the registry
 } BacDevice2;
 
 BacDevice2* new_bac_device2();
 
-// all bacnet devices
+// all bacnet devices, as many as memory allows
 typedef struct
 {
     int devices_num;
+    int devices_cap;
 
-    // actaully an array of pointer to BacDevice2_t, eg BacDevice2_t* devices_header[]
+    // actaully an array of pointer to BacDevice2_t, eg BacDevice2_t* devices_header[],
+    // from 0 to devices_num - 1, grows as devices are found
     struct BacDevice2_t** devices_header;
+
+    // the same devices hashed by instance number, see registry.h
+    struct BacDevice2_t** buckets;
+    mutex_type devices_lock;
 } AllDevices;
 
 typedef enum {
@@ -39,6 +39,32 @@ void copy_str_value_from_json(char** dest, cJSON* json, char* key, int maxLen)
 
 }
 
+static void json2_batch_policy(cJSON* batch, char* key, BatchPolicy* policy)
+{
+    policy->max_bytes = 0;
+    policy->max_delay = 0;
+    if (batch == NULL || !cJSON_HasObjectItem(batch, key))
+    {
+        return;
+    }
+    cJSON* item = cJSON_GetObjectItem(batch, key);
+    if (cJSON_HasObjectItem(item, "maxBytes"))
+    {
+        policy->max_bytes = json_int(item, "maxBytes");
+    }
+    policy->max_delay = 1000;
+    if (cJSON_HasObjectItem(item, "maxDelayMs"))
+    {
+        policy->max_delay = json_int(item, "maxDelayMs");
+    }
+    if (policy->max_bytes < 0 || policy->max_delay < 0)
+    {
+        printf("WARN:invalid batch setting of %s, not batching\n", key);
+        policy->max_bytes = 0;
+        policy->max_delay = 0;
+    }
+}
+
 void json2_mqtt_info(const char* str, MqttInfo* info)
 {
     if (str == NULL)
@@ -74,6 +100,12 @@ void json2_mqtt_info(const char* str, MqttInfo* info)
     copy_str_value_from_json(&info->user, root, "username", MAX_LEN);
     copy_str_value_from_json(&info->password, root, "password", MAX_LEN);
 
+    // optional, e.g. "batch": {"covnotice": {"maxBytes": 8192, "maxDelayMs": 200}}
+    cJSON* batch = cJSON_GetObjectItem(root, "batch");
+    json2_batch_policy(batch, "iam", &info->batch_iam);
+    json2_batch_policy(batch, "rpmack", &info->batch_rpmack);
+    json2_batch_policy(batch, "covnotice", &info->batch_covnotice);
+
     cJSON_Delete(root);
 }
 
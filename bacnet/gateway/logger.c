@@ -0,0 +1,264 @@
+#include "logger.h"
+#include "common.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 1024    // power of 2
+#define LOG_MSG_LEN 256
+#define LOG_SITE_RATE 20    // messages per second of a call site
+#define LOG_WRITER_NAP 50    // in milliseconds, between two drains of the ring
+
+typedef struct
+{
+    volatile unsigned long seq;    // the slot is readable when seq == position + 1
+    time_t time;
+    int level;
+    const char* file;
+    int line;
+    int suppressed;
+    char msg[LOG_MSG_LEN];
+} LogEntry;
+
+static const char* const LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static LogEntry g_log_ring[LOG_RING_SIZE];
+static volatile unsigned long g_log_enqueue_pos = 0;
+static unsigned long g_log_dequeue_pos = 0;    // the writer thread only
+static volatile int g_log_dropped = 0;
+static int g_log_level = LOG_LEVEL_INFO;
+static int g_log_started_level = LOG_LEVEL_INFO;
+static int g_log_format = LOG_FORMAT_TEXT;
+static volatile int g_log_running = 0;
+static volatile int g_log_stop = 0;
+static thread_type g_log_thread;
+
+static void write_json_string(FILE* out, const char* str)
+{
+    fputc('"', out);
+    for (; *str != '\0'; str++)
+    {
+        unsigned char c = (unsigned char) *str;
+        if (c == '"' || c == '\\')
+        {
+            fputc('\\', out);
+            fputc(c, out);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(out, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_entry(const LogEntry* entry)
+{
+    char time_str[32];
+    struct tm* tm = localtime(&entry->time);    // only the writer formats time
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm);
+
+    // trailing new lines of the printf style messages
+    char msg[LOG_MSG_LEN];
+    snprintf(msg, LOG_MSG_LEN, "%s", entry->msg);
+    size_t len = strlen(msg);
+    while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r'))
+    {
+        msg[--len] = '\0';
+    }
+
+    if (g_log_format == LOG_FORMAT_JSON)
+    {
+        fprintf(stdout, "{\"time\":\"%s\",\"level\":\"%s\",\"file\":", time_str,
+                LEVEL_NAMES[entry->level]);
+        write_json_string(stdout, entry->file);
+        fprintf(stdout, ",\"line\":%d,\"msg\":", entry->line);
+        write_json_string(stdout, msg);
+        if (entry->suppressed > 0)
+        {
+            fprintf(stdout, ",\"suppressed\":%d", entry->suppressed);
+        }
+        fprintf(stdout, "}\n");
+    }
+    else
+    {
+        fprintf(stdout, "%s %-5s %s:%d %s", time_str, LEVEL_NAMES[entry->level],
+                entry->file, entry->line, msg);
+        if (entry->suppressed > 0)
+        {
+            fprintf(stdout, " (%d similar messages suppressed)", entry->suppressed);
+        }
+        fprintf(stdout, "\n");
+    }
+}
+
+// write out everything in the ring, return the number of messages
+static int drain_log_ring()
+{
+    int count = 0;
+    while (1)
+    {
+        LogEntry* entry = &g_log_ring[g_log_dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != g_log_dequeue_pos + 1)
+        {
+            break;
+        }
+        write_entry(entry);
+        __atomic_store_n(&entry->seq, g_log_dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        g_log_dequeue_pos++;
+        count++;
+    }
+
+    int dropped = __sync_lock_test_and_set(&g_log_dropped, 0);
+    if (dropped > 0)
+    {
+        fprintf(stdout, "%d log messages dropped, the log buffer is full\n", dropped);
+        count++;
+    }
+    if (count > 0)
+    {
+        fflush(stdout);
+    }
+    return count;
+}
+
+static thread_return_type log_writer_func(void* arg)
+{
+    while (!g_log_stop)
+    {
+        if (drain_log_ring() == 0)
+        {
+            sleep_ms(LOG_WRITER_NAP);
+        }
+    }
+    drain_log_ring();
+    g_log_running = 0;
+    return 0;
+}
+
+void start_logger(int level, int format)
+{
+    if (g_log_running)
+    {
+        return;
+    }
+    unsigned long i = 0;
+    for (i = 0; i < LOG_RING_SIZE; i++)
+    {
+        g_log_ring[i].seq = i;
+    }
+    g_log_enqueue_pos = 0;
+    g_log_dequeue_pos = 0;
+    g_log_level = g_log_started_level = level;
+    g_log_format = format;
+    g_log_stop = 0;
+    g_log_running = 1;
+    g_log_thread = Thread_start(log_writer_func, NULL);
+}
+
+void stop_logger()
+{
+    if (!g_log_running)
+    {
+        return;
+    }
+    g_log_stop = 1;
+    int count = 0;
+    while (g_log_running && ++count < 100)
+    {
+        sleep_ms(LOG_WRITER_NAP);
+    }
+}
+
+void set_log_debug(int on)
+{
+    g_log_level = on ? LOG_LEVEL_DEBUG : g_log_started_level;
+}
+
+void log_message(LogSite* site, int level, const char* file, int line, const char* fmt, ...)
+{
+    if (level < g_log_level || level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_ERROR)
+    {
+        return;
+    }
+
+    // rate limit of the call site, racing threads may let a few more through
+    time_t now = time(NULL);
+    if (site->second != (long) now)
+    {
+        site->second = (long) now;
+        site->count = 0;
+    }
+    if (__sync_add_and_fetch(&site->count, 1) > LOG_SITE_RATE)
+    {
+        __sync_fetch_and_add(&site->suppressed, 1);
+        return;
+    }
+    int suppressed = __sync_lock_test_and_set(&site->suppressed, 0);
+
+    const char* base = strrchr(file, '/');
+    file = base != NULL ? base + 1 : file;
+    base = strrchr(file, '\\');
+    file = base != NULL ? base + 1 : file;
+
+    va_list args;
+    if (!g_log_running)
+    {
+        LogEntry entry;
+        entry.time = now;
+        entry.level = level;
+        entry.file = file;
+        entry.line = line;
+        entry.suppressed = suppressed;
+        va_start(args, fmt);
+        vsnprintf(entry.msg, LOG_MSG_LEN, fmt, args);
+        va_end(args);
+        write_entry(&entry);
+        return;
+    }
+
+    // claim a slot, a bounded multi-producer queue: the slot at pos is free
+    // when its seq equals pos, and the writer releases it with pos + size
+    unsigned long pos = __atomic_load_n(&g_log_enqueue_pos, __ATOMIC_RELAXED);
+    LogEntry* entry = NULL;
+    while (1)
+    {
+        entry = &g_log_ring[pos & (LOG_RING_SIZE - 1)];
+        long diff = (long) (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&g_log_enqueue_pos, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // full, the writer is behind
+            __sync_fetch_and_add(&g_log_dropped, 1);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&g_log_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    entry->time = now;
+    entry->level = level;
+    entry->file = file;
+    entry->line = line;
+    entry->suppressed = suppressed;
+    va_start(args, fmt);
+    vsnprintf(entry->msg, LOG_MSG_LEN, fmt, args);
+    va_end(args);
+    __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,52 @@
+#ifndef INF_BCE_IOT_BAC2MQTT_LOGGER_H
+#define INF_BCE_IOT_BAC2MQTT_LOGGER_H
+
+// the logger formats a message into a slot of a lock-free ring buffer, and a
+// background thread writes the slots out, so logging from the bacnet or
+// mqtt threads never waits for the console. every call site is rate limited
+// to LOG_SITE_RATE messages per second, the rest are counted and reported
+// with the next message of the site. when the ring is full, messages are
+// dropped and counted, instead of blocking the caller
+
+enum {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+enum {
+    LOG_FORMAT_TEXT = 0,
+    LOG_FORMAT_JSON    // one json object per line
+};
+
+// rate limit state of a call site
+typedef struct
+{
+    volatile long second;
+    volatile int count;
+    volatile int suppressed;
+} LogSite;
+
+// start the writer thread, messages logged before are written synchronously
+void start_logger(int level, int format);
+
+// write out what's left, and stop the writer thread
+void stop_logger();
+
+// debug on lowers the level to LOG_LEVEL_DEBUG, off restores the started one
+void set_log_debug(int on);
+
+void log_message(LogSite* site, int level, const char* file, int line, const char* fmt, ...);
+
+#define LOG_AT(level, ...) do { \
+        static LogSite log_site_ = {0, 0, 0}; \
+        log_message(&log_site_, level, __FILE__, __LINE__, __VA_ARGS__); \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
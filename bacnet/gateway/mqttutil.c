@@ -6,22 +6,80 @@
 #include <time.h>
 
 #include "common.h"
+#include "thread.h"
+
+#define PUBLISH_RING_SIZE 1024    // power of 2
+#define PUBLISH_WAIT 1000    // in milliseconds, how often the thread looks at the stop flag
+#define TOPIC_BUCKETS 1024    // power of 2
+// the packets the queued messages may hold, a message past it gets a copy.
+// the rest of the pool is left to the receiver and the worker, so a slow
+// broker can't starve the decoding
+#define PUBLISH_HOLD_MAX (PACKET_POOL_SIZE / 4)
+#define BATCH_VERSION 1
+#define BATCH_HEADER_LEN 3    // version, record count
+#define BATCH_RECORD_HEADER_LEN 14    // instance number, receive time, frame length
+
+typedef enum {
+    MSG_IAM = 0,
+    MSG_RPMACK = 1,
+    MSG_COVNOTICE = 2,
+    MSG_HEARTBEAT = 3,
+    MSG_KINDS = 4
+} MSG_KIND;
 
 // cache at most 2048 messages, ring buffer
 enum {MSG_BUF_SIZE = 10240};
 typedef struct {
-    uint8_t* data;
+    uint8_t* data;    // in the packet if there's one, malloc'ed otherwise
     int data_len;
-    char* instance_number;
+    Packet* packet;
+    const char* topic;
+
+    MSG_KIND kind;
+    uint32_t instance_number;
+    long long time_ms;    // when the frame was received, see epoch_ms
 } DataToSend;
 DataToSend g_data_to_send[MSG_BUF_SIZE];
 int g_buff_head = 0;
 int g_buff_size = 0;
+
+// the messages for the publisher thread, a bounded multi-producer queue like
+// the one of the logger: the slot at pos is free when its seq equals pos,
+// and readable when it equals pos + 1
+typedef struct {
+    volatile unsigned long seq;
+    DataToSend msg;
+} PublishEntry;
+static PublishEntry g_publish_ring[PUBLISH_RING_SIZE];
+static volatile unsigned long g_publish_enqueue_pos = 0;
+static unsigned long g_publish_dequeue_pos = 0;    // the publisher thread only
+static volatile int g_publish_dropped = 0;
+static volatile int g_held_packets = 0;
+static Event* g_publish_event = NULL;
+static GlobalVar* g_publish_vars = NULL;
+static volatile int g_publisher_running = 0;
+static volatile int g_publisher_stop = 0;
+static thread_type g_publisher_thread;
+
+// the messages of a kind waiting to go out in one publish, the publisher
+// thread only
+typedef struct {
+    const BatchPolicy* policy;    // NULL if the kind isn't batched
+    char* topic;
+    uint8_t* buf;
+    int len;
+    int cap;
+    int count;
+    long long deadline;    // now_ms by when it's sent
+} Batch;
+static Batch g_batches[MSG_KINDS];
+
+static DeviceTopics* g_topic_buckets[TOPIC_BUCKETS];
+static mutex_type g_topics_lock = NULL;
+
 const char* const PEM_FILE = "root_cert.pem";
 MQTTClient_SSLOptions g_sslopts = MQTTClient_SSLOptions_initializer;
 
-char g_log_buff[BUFF_LEN] = {0};
-
 int is_buffer_full()
 {
     return g_buff_size >= MSG_BUF_SIZE;
@@ -32,26 +90,51 @@ int is_buffer_empty()
     return g_buff_size <= 0;
 }
 
-int put_buff_data(uint8_t* data, int data_len, char* instance_number)
+static void release_held_packet(Packet* packet)
+{
+    release_packet(packet);
+    __sync_sub_and_fetch(&g_held_packets, 1);
+}
+
+void free_data_to_send(DataToSend* msg)
+{
+    if (msg->packet != NULL)
+    {
+        release_held_packet(msg->packet);
+    }
+    else
+    {
+        free(msg->data);
+    }
+    msg->data = NULL;
+    msg->packet = NULL;
+}
+
+int put_buff_data(DataToSend msg)
 {
+    if (msg.packet != NULL)
+    {
+        // the cache may outlast the pool of packets, keep a copy
+        uint8_t* data = (uint8_t*) malloc(msg.data_len);
+        memcpy(data, msg.data, msg.data_len);
+        release_held_packet(msg.packet);
+        msg.data = data;
+        msg.packet = NULL;
+    }
+
     // if full, them overwrite the oldest one
     int idx = (g_buff_size + g_buff_head) % MSG_BUF_SIZE;
     if (is_buffer_full())
     {
-        free(g_data_to_send[idx].data);
-        free(g_data_to_send[idx].instance_number);
-        g_data_to_send[idx].data = data;
-        g_data_to_send[idx].data_len = data_len;
-        g_data_to_send[idx].instance_number = instance_number;
+        free_data_to_send(&g_data_to_send[idx]);
+        g_data_to_send[idx] = msg;
         g_buff_head = (g_buff_head + 1) % MSG_BUF_SIZE;
         g_buff_size = MSG_BUF_SIZE;
         return 0;
     }
     else
     {
-        g_data_to_send[idx].data = data;
-        g_data_to_send[idx].data_len = data_len;
-        g_data_to_send[idx].instance_number = instance_number;
+        g_data_to_send[idx] = msg;
         g_buff_size++;
         return 1;
     }
@@ -89,9 +172,8 @@ void start_mqtt_client(GlobalVar* vars,
                        msg_arrived_fun msg_arrived,
                        delivered_fun delivered)
 {
-    printf("connecting gateway to cloud...\n");
-    printf("endpoint:%s\n", vars->g_mqtt_info.endpoint);
-    printf("user:%s\n", vars->g_mqtt_info.user);
+    LOG_INFO("connecting gateway to cloud... endpoint:%s, user:%s", vars->g_mqtt_info.endpoint,
+             vars->g_mqtt_info.user);
 
     Thread_lock_mutex((vars->g_mqtt_client_mutex));
     MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
@@ -114,7 +196,7 @@ void start_mqtt_client(GlobalVar* vars,
     int rc = 0;
     if ((rc = MQTTClient_connect(vars->g_mqtt_client, &conn_opts)) != MQTTCLIENT_SUCCESS)
     {
-        printf("Failed to connect, return code %d\n", rc);
+        LOG_ERROR("Failed to connect, return code %d", rc);
         Thread_unlock_mutex((vars->g_mqtt_client_mutex));
 
         return;
@@ -126,78 +208,57 @@ void start_mqtt_client(GlobalVar* vars,
     vars->g_gateway_connected = 1;
     Thread_unlock_mutex((vars->g_mqtt_client_mutex));
 
-    printf("gateway started!\n");
+    LOG_INFO("gateway started!");
 }
 
 // return -1 if failed, 0 otherwise
-int send_message(uint8_t* data, int data_len, GlobalVar* vars, char* instance_number)
+int send_message(DataToSend* msg, GlobalVar* vars)
 {
     MQTTClient client = vars->g_mqtt_client;
 
-    char* topic = NULL;
-    switch((char)instance_number[0]) {
-        case '0' :
-            topic = create_topic(vars->g_mqtt_info.pub_iam, "");
-            break;
-        case '1' :
-            topic = create_topic(vars->g_mqtt_info.pub_rpmack, &instance_number[1]);
-            break;
-        case '2' :
-            topic = create_topic(vars->g_mqtt_info.pub_covnotice, &instance_number[1]);
-            break;
-        case '3' :
-            topic = create_topic(vars->g_mqtt_info.pub_heartbeat, "");
-            break;
-        default :
-            log_debug("unknow topic index, skip it simply");
-            return 0;
-    }
-
     MQTTClient_message pubmsg = MQTTClient_message_initializer;
     MQTTClient_deliveryToken delivery_token;
-    pubmsg.payload = data;
-    pubmsg.payloadlen = data_len;
+    pubmsg.payload = msg->data;
+    pubmsg.payloadlen = msg->data_len;
     pubmsg.qos = 0;
     pubmsg.retained = 0;
 
-    int rc = MQTTClient_publishMessage(client, topic, &pubmsg, &delivery_token);
+    int rc = MQTTClient_publishMessage(client, msg->topic, &pubmsg, &delivery_token);
     if (rc == MQTTCLIENT_SUCCESS)
     {
         vars->g_mqtt_info.last_heartbeat_time = time(NULL);
         MQTTClient_waitForCompletion(client, delivery_token, 1000L);
-        free(topic);
         return 0;
     }
     else
     {
 	// mark the gateway disconnected
 	vars->g_gateway_connected = 0;
-        free(topic);
         return -1; // failed to send
     }
 }
 
-int send_data(uint8_t* data, int data_len, GlobalVar* vars, char* instance_number)
+int send_data(DataToSend msg, GlobalVar* vars)
 {
     // if mqtt client is not in a good state, then cache the data for later send
-    if (data == NULL)
+    if (msg.data == NULL)
     {
         return -1;
     }
 
     if (vars == NULL || !MQTTClient_isConnected(vars->g_mqtt_client))
     {
-        put_buff_data(data, data_len, instance_number);
-        log_debug("mqtt client is not connected, caching the data");
+        put_buff_data(msg);
+        LOG_DEBUG("mqtt client is not connected, caching the data");
         return 0;
     }
 
     // send the data
 
-    int rc = send_message(data, data_len, vars, instance_number);
+    int rc = send_message(&msg, vars);
     if (rc == 0)
     {
-        free(data);
+        free_data_to_send(&msg);
 
         // send the buffered data if any
         DataToSend buff_data = {0};
@@ -205,36 +266,30 @@ int send_data(uint8_t* data, int data_len, GlobalVar* vars, char* instance_numbe
         while (rc == 0 && ! is_buffer_empty())
         {
             buff_data = get_buff_data();
-            rc = send_message(buff_data.data, buff_data.data_len, vars, buff_data.instance_number);
+            rc = send_message(&buff_data, vars);
             if (rc == 0)
             {
                 cnt++;
-                free(buff_data.data);
-                free(buff_data.instance_number);
-                buff_data.data = NULL;
-                buff_data.instance_number = NULL;
+                free_data_to_send(&buff_data);
             }
             else
             {
                 // send mqtt message failed
-                put_buff_data(buff_data.data, buff_data.data_len, buff_data.instance_number);
+                put_buff_data(buff_data);
                 break;
             }
         }
         if (cnt > 0)
         {
-            snprintf(g_log_buff, BUFF_LEN, "sent %d message from cache", cnt);
-            log_debug(g_log_buff);
+            LOG_DEBUG("sent %d message from cache", cnt);
         }
 
     }
     else
     {
         // cache the data, and mark the mqtt client need reconnect
-        snprintf(g_log_buff, BUFF_LEN,
-                 "failed to send a mqtt message, return code=%d. Caching it for later sending", rc);
-        log_debug(g_log_buff);
-        put_buff_data(data, data_len, instance_number);
+        LOG_WARN("failed to send a mqtt message, return code=%d. Caching it for later sending", rc);
+        put_buff_data(msg);
         Thread_lock_mutex( vars->g_gateway_mutex);
         vars->g_gateway_connected = 0;
         Thread_unlock_mutex( vars->g_gateway_mutex);
@@ -243,51 +298,368 @@ int send_data(uint8_t* data, int data_len, GlobalVar* vars, char* instance_numbe
     return 0;
 }
 
+static void put_uint(uint8_t* buf, unsigned long long value, int len)
+{
+    // big endian, like bacnet
+    int i = 0;
+    for (i = len - 1; i >= 0; i--)
+    {
+        buf[i] = (uint8_t) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static void flush_batch(Batch* batch)
+{
+    if (batch->count == 0)
+    {
+        return;
+    }
+    put_uint(&batch->buf[1], batch->count, 2);
+
+    DataToSend msg = {0};
+    msg.data = batch->buf;
+    msg.data_len = batch->len;
+    msg.topic = batch->topic;
+    send_data(msg, g_publish_vars);
+
+    // the buffer went with the message
+    batch->buf = NULL;
+    batch->len = 0;
+    batch->cap = 0;
+    batch->count = 0;
+}
+
+static void add_to_batch(Batch* batch, DataToSend* msg)
+{
+    int record_len = BATCH_RECORD_HEADER_LEN + msg->data_len;
+    if (batch->count > 0
+        && (batch->len + record_len > batch->policy->max_bytes || batch->count == 0xFFFF))
+    {
+        flush_batch(batch);
+    }
+    if (batch->count == 0)
+    {
+        batch->len = BATCH_HEADER_LEN;
+        batch->deadline = now_ms() + batch->policy->max_delay;
+    }
+    if (batch->len + record_len > batch->cap)
+    {
+        int cap = batch->cap > 0 ? batch->cap : batch->policy->max_bytes;
+        while (cap < batch->len + record_len)
+        {
+            cap *= 2;
+        }
+        batch->buf = (uint8_t*) realloc(batch->buf, cap);
+        batch->cap = cap;
+        batch->buf[0] = BATCH_VERSION;
+    }
+
+    uint8_t* record = &batch->buf[batch->len];
+    put_uint(&record[0], msg->instance_number, 4);
+    put_uint(&record[4], (unsigned long long) msg->time_ms, 8);
+    put_uint(&record[12], msg->data_len, 2);
+    memcpy(&record[BATCH_RECORD_HEADER_LEN], msg->data, msg->data_len);
+    batch->len += record_len;
+    batch->count++;
+
+    if (batch->len >= batch->policy->max_bytes)
+    {
+        flush_batch(batch);
+    }
+}
+
+// send the batches due by now, return the milliseconds until the next one
+// is due, at most PUBLISH_WAIT
+static int flush_due_batches(int all)
+{
+    long long now = now_ms();
+    long long wait = PUBLISH_WAIT;
+    int i = 0;
+    for (i = 0; i < MSG_KINDS; i++)
+    {
+        Batch* batch = &g_batches[i];
+        if (batch->count == 0)
+        {
+            continue;
+        }
+        if (all || batch->deadline <= now)
+        {
+            flush_batch(batch);
+        }
+        else if (batch->deadline - now < wait)
+        {
+            wait = batch->deadline - now;
+        }
+    }
+    return (int) wait;
+}
+
+// publish or batch everything in the queue, return the number of messages
+static int drain_publish_ring()
+{
+    int count = 0;
+    while (1)
+    {
+        PublishEntry* entry = &g_publish_ring[g_publish_dequeue_pos & (PUBLISH_RING_SIZE - 1)];
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != g_publish_dequeue_pos + 1)
+        {
+            break;
+        }
+        DataToSend msg = entry->msg;
+        __atomic_store_n(&entry->seq, g_publish_dequeue_pos + PUBLISH_RING_SIZE, __ATOMIC_RELEASE);
+        g_publish_dequeue_pos++;
+
+        Batch* batch = &g_batches[msg.kind];
+        if (batch->policy != NULL && batch->policy->max_bytes > 0 && msg.data_len <= 0xFFFF)
+        {
+            add_to_batch(batch, &msg);
+            free_data_to_send(&msg);
+        }
+        else
+        {
+            send_data(msg, g_publish_vars);
+        }
+        count++;
+    }
+
+    int dropped = __sync_lock_test_and_set(&g_publish_dropped, 0);
+    if (dropped > 0)
+    {
+        LOG_WARN("%d mqtt messages dropped, the publish queue is full", dropped);
+    }
+    return count;
+}
+
+static thread_return_type publisher_func(void* arg)
+{
+    while (!g_publisher_stop)
+    {
+        int count = drain_publish_ring();
+        int wait = flush_due_batches(0);
+        if (count == 0)
+        {
+            wait_event(g_publish_event, wait);
+        }
+    }
+    drain_publish_ring();
+    flush_due_batches(1);
+    g_publisher_running = 0;
+    return 0;
+}
+
+static void init_batch(Batch* batch, const BatchPolicy* policy, const char* topic)
+{
+    memset(batch, 0, sizeof(Batch));
+    batch->policy = policy;
+    batch->topic = create_topic(topic, "batch");
+}
+
+void start_publisher(GlobalVar* vars)
+{
+    if (g_publisher_running)
+    {
+        return;
+    }
+    unsigned long i = 0;
+    for (i = 0; i < PUBLISH_RING_SIZE; i++)
+    {
+        g_publish_ring[i].seq = i;
+    }
+    if (g_publish_event == NULL)
+    {
+        g_publish_event = create_event();
+    }
+    g_publish_enqueue_pos = 0;
+    g_publish_dequeue_pos = 0;
+    g_publish_vars = vars;
+    init_batch(&g_batches[MSG_IAM], &vars->g_mqtt_info.batch_iam, vars->g_mqtt_info.pub_iam);
+    init_batch(&g_batches[MSG_RPMACK], &vars->g_mqtt_info.batch_rpmack,
+            vars->g_mqtt_info.pub_rpmack);
+    init_batch(&g_batches[MSG_COVNOTICE], &vars->g_mqtt_info.batch_covnotice,
+            vars->g_mqtt_info.pub_covnotice);
+    g_publisher_stop = 0;
+    g_publisher_running = 1;
+    g_publisher_thread = Thread_start(publisher_func, NULL);
+}
+
+void stop_publisher()
+{
+    if (!g_publisher_running)
+    {
+        return;
+    }
+    g_publisher_stop = 1;
+    signal_event(g_publish_event);
+    int count = 0;
+    while (g_publisher_running && ++count < 100)
+    {
+        sleep_ms(100);
+    }
+    int i = 0;
+    for (i = 0; i < MSG_KINDS; i++)
+    {
+        free(g_batches[i].topic);
+        g_batches[i].topic = NULL;
+    }
+}
+
+// hand the message to the publisher thread, or send it here if there's none
+static void queue_data(DataToSend msg, GlobalVar* vars)
+{
+    if (!g_publisher_running)
+    {
+        send_data(msg, vars);
+        return;
+    }
+
+    unsigned long pos = __atomic_load_n(&g_publish_enqueue_pos, __ATOMIC_RELAXED);
+    PublishEntry* entry = NULL;
+    while (1)
+    {
+        entry = &g_publish_ring[pos & (PUBLISH_RING_SIZE - 1)];
+        long diff = (long) (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&g_publish_enqueue_pos, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // full, the broker is slower than the devices
+            __sync_fetch_and_add(&g_publish_dropped, 1);
+            free_data_to_send(&msg);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&g_publish_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    entry->msg = msg;
+    __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+    signal_event(g_publish_event);
+}
+
 void mqtt_cleanup(GlobalVar* vars)
 {
+    stop_publisher();
     MQTTClient_disconnect(vars->g_mqtt_client, 500);
     DataToSend buff_data = {0};
     while(! is_buffer_empty())
     {
         buff_data = get_buff_data();
-        free(buff_data.data);
-        buff_data.data = NULL;
-        free(buff_data.instance_number);
-        buff_data.instance_number = NULL;
+        free_data_to_send(&buff_data);
+    }
+
+    // nothing refers to the topics of the devices any more
+    int i = 0;
+    for (i = 0; i < TOPIC_BUCKETS; i++)
+    {
+        DeviceTopics* topics = g_topic_buckets[i];
+        while (topics != NULL)
+        {
+            DeviceTopics* next = topics->next;
+            free(topics->rpmack);
+            free(topics->covnotice);
+            free(topics);
+            topics = next;
+        }
+        g_topic_buckets[i] = NULL;
     }
 }
 
-void mqtt_send_iam(uint8_t* data, int data_len, GlobalVar* vars)
+const DeviceTopics* get_device_topics(GlobalVar* vars, uint32_t instance_number)
 {
-    char* instance_number_ptr = (char*)malloc(2*sizeof(char));
-    snprintf(instance_number_ptr, 2, "%d", 0);
+    if (g_topics_lock == NULL)
+    {
+        g_topics_lock = Thread_create_mutex();
+    }
+    Thread_lock_mutex(g_topics_lock);
+    unsigned int bucket = ((instance_number * 2654435761U) >> 22) & (TOPIC_BUCKETS - 1);
+    DeviceTopics* topics = g_topic_buckets[bucket];
+    while (topics != NULL && topics->instance_number != instance_number)
+    {
+        topics = topics->next;
+    }
+    if (topics == NULL)
+    {
+        char instance[16];
+        snprintf(instance, sizeof(instance), "%u", instance_number);
+        topics = (DeviceTopics*) malloc(sizeof(DeviceTopics));
+        topics->instance_number = instance_number;
+        topics->rpmack = create_topic(vars->g_mqtt_info.pub_rpmack, instance);
+        topics->covnotice = create_topic(vars->g_mqtt_info.pub_covnotice, instance);
+        topics->next = g_topic_buckets[bucket];
+        g_topic_buckets[bucket] = topics;
+    }
+    Thread_unlock_mutex(g_topics_lock);
+    return topics;
+}
 
-    send_data(data, data_len, vars, instance_number_ptr);
+static void queue_packet(Packet* packet, const char* topic, MSG_KIND kind,
+        uint32_t instance_number, GlobalVar* vars)
+{
+    DataToSend msg = {0};
+    if (__sync_add_and_fetch(&g_held_packets, 1) <= PUBLISH_HOLD_MAX)
+    {
+        hold_packet(packet);
+        msg.packet = packet;
+        msg.data = &packet->pdu[0];
+    }
+    else
+    {
+        // the broker is behind, don't take more of the pool
+        __sync_sub_and_fetch(&g_held_packets, 1);
+        msg.data = (uint8_t*) malloc(packet->len);
+        memcpy(msg.data, &packet->pdu[0], packet->len);
+    }
+    msg.data_len = packet->len;
+    msg.topic = topic;
+    msg.kind = kind;
+    msg.instance_number = instance_number;
+    msg.time_ms = packet->time_ms;
+    queue_data(msg, vars);
 }
 
-void mqtt_send_rpmack(uint8_t* data, int data_len, GlobalVar* vars, uint32_t instance_number)
+void mqtt_send_iam(Packet* packet, GlobalVar* vars, uint32_t instance_number)
 {
-    char* instance_number_ptr = (char*)malloc(13*sizeof(char));
-    snprintf(instance_number_ptr, 13, "%d%d", 1, instance_number);
+    queue_packet(packet, vars->g_mqtt_info.pub_iam, MSG_IAM, instance_number, vars);
+}
 
-    send_data(data, data_len, vars, instance_number_ptr);
+void mqtt_send_rpmack(Packet* packet, GlobalVar* vars, BacDevice2* device)
+{
+    queue_packet(packet, device->topics->rpmack, MSG_RPMACK, device->instanceNumber, vars);
 }
 
-void mqtt_send_ucovnotifica(uint8_t* data, int data_len, GlobalVar* vars, uint32_t instance_number)
+void mqtt_send_rpmack_data(uint8_t* data, int data_len, GlobalVar* vars, BacDevice2* device)
 {
-    char* instance_number_ptr = (char*)malloc(13*sizeof(char));
-    snprintf(instance_number_ptr, 13, "%d%d", 2, instance_number);
+    DataToSend msg = {0};
+    msg.data = data;
+    msg.data_len = data_len;
+    msg.topic = device->topics->rpmack;
+    msg.kind = MSG_RPMACK;
+    msg.instance_number = device->instanceNumber;
+    msg.time_ms = epoch_ms();
+    queue_data(msg, vars);
+}
 
-    send_data(data, data_len, vars, instance_number_ptr);
+void mqtt_send_ucovnotifica(Packet* packet, GlobalVar* vars, BacDevice2* device)
+{
+    queue_packet(packet, device->topics->covnotice, MSG_COVNOTICE, device->instanceNumber, vars);
 }
 
 void mqtt_send_heartbeat(GlobalVar* vars)
 {
-    uint8_t* heartbeat = calloc(2, sizeof(uint8_t));
-    snprintf((char*) heartbeat, 2, "%d", 0);
-
-    char* instance_number_ptr = (char*)malloc(2*sizeof(char));
-    snprintf(instance_number_ptr, 2, "%d", 3);
-
-    send_data(heartbeat, 1, vars, instance_number_ptr);
+    DataToSend msg = {0};
+    msg.data = calloc(2, sizeof(uint8_t));
+    snprintf((char*) msg.data, 2, "%d", 0);
+    msg.data_len = 1;
+    msg.topic = vars->g_mqtt_info.pub_heartbeat;
+    msg.kind = MSG_HEARTBEAT;
+    queue_data(msg, vars);
 }
@@ -5,6 +5,7 @@
 #include <MQTTClient.h>
 
 #include "data.h"
+#include "receiver.h"
 
 typedef void (*connection_lost_fun)(void*, char*);
 
@@ -17,14 +18,45 @@ void start_mqtt_client(GlobalVar* vars,
                        msg_arrived_fun msg_arrived,
                        delivered_fun delivered);
 
+// publish the messages below on a thread of their own, so a slow broker
+// doesn't hold up the worker. mqtt_cleanup stops it.
+//
+// the i-am, rpm-ack and cov notification frames may be batched, see
+// BatchPolicy. a batch goes to "<topic>/batch", e.g. "<dataTopic>/covnotice/batch",
+// big endian:
+//   version (1 byte, 1), record count (2 bytes), records
+// a record:
+//   device instance (4 bytes), receive time in milliseconds since the
+//   epoch (8 bytes), frame length (2 bytes), the frame as received
+void start_publisher(GlobalVar* vars);
+
+void stop_publisher();
+
 void mqtt_cleanup(GlobalVar* vars);
 
+// the topics a device publishes to, built once per instance number. they
+// are kept until mqtt_cleanup, the messages queued may outlive the device
+typedef struct DeviceTopics_t
+{
+    uint32_t instance_number;
+    char* rpmack;
+    char* covnotice;
+    struct DeviceTopics_t* next;
+} DeviceTopics;
+
+const DeviceTopics* get_device_topics(GlobalVar* vars, uint32_t instance_number);
+
 void mqtt_send_heartbeat(GlobalVar* vars);
 
-void mqtt_send_iam(uint8_t* data, int data_len, GlobalVar* vars);
+// the frames of the packets are published as received, the publisher holds
+// a reference to the packet until it's sent
+void mqtt_send_iam(Packet* packet, GlobalVar* vars, uint32_t instance_number);
+
+void mqtt_send_rpmack(Packet* packet, GlobalVar* vars, BacDevice2* device);
 
-void mqtt_send_rpmack(uint8_t* data, int data_len, GlobalVar* vars, uint32_t instance_number);
+// an ack put together from segments, data is freed once sent
+void mqtt_send_rpmack_data(uint8_t* data, int data_len, GlobalVar* vars, BacDevice2* device);
 
-void mqtt_send_ucovnotifica(uint8_t* data, int data_len, GlobalVar* vars, uint32_t instance_number);
+void mqtt_send_ucovnotifica(Packet* packet, GlobalVar* vars, BacDevice2* device);
 
 #endif
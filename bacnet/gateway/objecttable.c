@@ -0,0 +1,228 @@
+#include "objecttable.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+enum
+{
+    OBJECTS_MIN = 16,
+    SLOTS_MIN = 32    // power of 2
+};
+
+static unsigned int hash_object(BACNET_OBJECT_TYPE type, uint32_t instance)
+{
+    // an instance takes 22 bits
+    uint32_t key = ((uint32_t) type << 22) ^ instance;
+    key = (key ^ (key >> 16)) * 0x45d9f3bU;
+    key = (key ^ (key >> 16)) * 0x45d9f3bU;
+    return key ^ (key >> 16);
+}
+
+void init_objects(ObjectTable* table)
+{
+    memset(table, 0, sizeof(ObjectTable));
+}
+
+void clear_objects(ObjectTable* table)
+{
+    table->num = 0;
+    table->due_num = 0;
+    table->marked_num = 0;
+    if (table->slots != NULL)
+    {
+        memset(table->slots, 0, table->slots_cap * sizeof(int));
+    }
+}
+
+void free_objects(ObjectTable* table)
+{
+    free(table->objects);
+    free(table->slots);
+    free(table->due);
+    free(table->marked);
+    init_objects(table);
+}
+
+static void insert_slot(ObjectTable* table, int index)
+{
+    BacObject* object = &table->objects[index];
+    unsigned int slot = hash_object(object->objectType, object->objectInstance);
+    while (table->slots[slot & (table->slots_cap - 1)] != 0)
+    {
+        slot++;
+    }
+    table->slots[slot & (table->slots_cap - 1)] = index + 1;
+}
+
+static void grow_slots(ObjectTable* table)
+{
+    int i = 0;
+    free(table->slots);
+    table->slots_cap = table->slots_cap == 0 ? SLOTS_MIN : table->slots_cap * 2;
+    table->slots = (int*) calloc(table->slots_cap, sizeof(int));
+    for (i = 0; i < table->num; i++)
+    {
+        insert_slot(table, i);
+    }
+}
+
+static void grow_objects(ObjectTable* table)
+{
+    table->cap = table->cap == 0 ? OBJECTS_MIN : table->cap * 2;
+    table->objects = (BacObject*) realloc(table->objects, table->cap * sizeof(BacObject));
+    table->due = (int*) realloc(table->due, table->cap * sizeof(int));
+    table->marked = (int*) realloc(table->marked, table->cap * sizeof(int));
+}
+
+// the due heap, a binary min-heap of object indexes
+static int earlier(ObjectTable* table, int a, int b)
+{
+    return table->objects[table->due[a]].due < table->objects[table->due[b]].due;
+}
+
+static void swap_due(ObjectTable* table, int a, int b)
+{
+    int index = table->due[a];
+    table->due[a] = table->due[b];
+    table->due[b] = index;
+}
+
+static void push_due(ObjectTable* table, int index)
+{
+    int child = table->due_num++;
+    table->due[child] = index;
+    while (child > 0 && earlier(table, child, (child - 1) / 2))
+    {
+        swap_due(table, child, (child - 1) / 2);
+        child = (child - 1) / 2;
+    }
+}
+
+static int pop_due(ObjectTable* table)
+{
+    int index = table->due[0];
+    int parent = 0;
+    table->due[0] = table->due[--table->due_num];
+    for (;;)
+    {
+        int child = parent * 2 + 1;
+        if (child >= table->due_num)
+        {
+            break;
+        }
+        if (child + 1 < table->due_num && earlier(table, child + 1, child))
+        {
+            child++;
+        }
+        if (!earlier(table, child, parent))
+        {
+            break;
+        }
+        swap_due(table, child, parent);
+        parent = child;
+    }
+    return index;
+}
+
+BacObject* add_object(ObjectTable* table, BACNET_OBJECT_TYPE type, uint32_t instance)
+{
+    BacObject* object = find_object(table, type, instance);
+    if (object != NULL)
+    {
+        return object;
+    }
+    if (table->num == table->cap)
+    {
+        grow_objects(table);
+    }
+    if ((table->num + 1) * 2 > table->slots_cap)
+    {
+        grow_slots(table);
+    }
+
+    int index = table->num++;
+    object = &table->objects[index];
+    init_bac_object(object);
+    object->objectType = type;
+    object->objectInstance = instance;
+    insert_slot(table, index);
+    push_due(table, index);
+    return object;
+}
+
+BacObject* find_object(ObjectTable* table, BACNET_OBJECT_TYPE type, uint32_t instance)
+{
+    if (table->num == 0)
+    {
+        return NULL;
+    }
+    unsigned int slot = hash_object(type, instance);
+    int index = 0;
+    while ((index = table->slots[slot & (table->slots_cap - 1)]) != 0)
+    {
+        BacObject* object = &table->objects[index - 1];
+        if (object->objectType == type && object->objectInstance == instance)
+        {
+            return object;
+        }
+        slot++;
+    }
+    return NULL;
+}
+
+BacObject* next_due_object(ObjectTable* table, time_t now)
+{
+    if (table->due_num == 0 || table->objects[table->due[0]].due > now)
+    {
+        return NULL;
+    }
+    return &table->objects[pop_due(table)];
+}
+
+void schedule_object(ObjectTable* table, BacObject* object, time_t due)
+{
+    object->due = due;
+    push_due(table, (int) (object - table->objects));
+}
+
+int first_due_time(ObjectTable* table, time_t* due)
+{
+    if (table->due_num == 0)
+    {
+        return 0;
+    }
+    *due = table->objects[table->due[0]].due;
+    return 1;
+}
+
+void reschedule_objects(ObjectTable* table, time_t due)
+{
+    int i = 0;
+    for (i = 0; i < table->num; i++)
+    {
+        table->objects[i].due = due;
+        table->due[i] = i;
+    }
+    table->due_num = table->num;
+}
+
+void mark_object(ObjectTable* table, BacObject* object)
+{
+    if (object->marked)
+    {
+        return;
+    }
+    object->marked = 1;
+    table->marked[table->marked_num++] = (int) (object - table->objects);
+}
+
+BacObject* next_marked_object(ObjectTable* table)
+{
+    if (table->marked_num == 0)
+    {
+        return NULL;
+    }
+    BacObject* object = &table->objects[table->marked[--table->marked_num]];
+    object->marked = 0;
+    return object;
+}
@@ -0,0 +1,38 @@
+#ifndef INF_BCE_IOT_BAC2MQTT_OBJECTTABLE_H
+#define INF_BCE_IOT_BAC2MQTT_OBJECTTABLE_H
+
+#include "data.h"
+
+// the objects of a device, see ObjectTable. a BacObject* is only good until
+// the next add_object, which may move the objects
+void init_objects(ObjectTable* table);
+
+// forget all the objects, the memory is kept for the next ones
+void clear_objects(ObjectTable* table);
+
+void free_objects(ObjectTable* table);
+
+// the object of type and instance, added if it's not there yet. a new
+// object is due at once
+BacObject* add_object(ObjectTable* table, BACNET_OBJECT_TYPE type, uint32_t instance);
+
+BacObject* find_object(ObjectTable* table, BACNET_OBJECT_TYPE type, uint32_t instance);
+
+// take out the object due first if it's due by now, NULL if none is. the
+// caller gives it back with schedule_object
+BacObject* next_due_object(ObjectTable* table, time_t now);
+
+void schedule_object(ObjectTable* table, BacObject* object, time_t due);
+
+// when the object due first is due, return 0 if there's no object
+int first_due_time(ObjectTable* table, time_t* due);
+
+// make all the objects due at the same time, e.g. when the intervals change
+void reschedule_objects(ObjectTable* table, time_t due);
+
+// the objects to be read or subscribed by the next add_request_if_need
+void mark_object(ObjectTable* table, BacObject* object);
+
+BacObject* next_marked_object(ObjectTable* table);
+
+#endif
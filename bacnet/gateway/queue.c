@@ -0,0 +1,84 @@
+#include "queue.h"
+
+#include <stdlib.h>
+
+void init_queue(Queue* queue, unsigned long size)
+{
+    unsigned long i = 0;
+    queue->slots = (QueueSlot*) malloc(size * sizeof(QueueSlot));
+    for (i = 0; i < size; i++)
+    {
+        queue->slots[i].seq = i;
+        queue->slots[i].item = NULL;
+    }
+    queue->size = size;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+}
+
+void free_queue(Queue* queue)
+{
+    free(queue->slots);
+    queue->slots = NULL;
+    queue->size = 0;
+}
+
+int push_queue(Queue* queue, void* item)
+{
+    unsigned long pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    QueueSlot* slot = NULL;
+    while (1)
+    {
+        slot = &queue->slots[pos & (queue->size - 1)];
+        long diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void* pop_queue(Queue* queue)
+{
+    unsigned long pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    QueueSlot* slot = NULL;
+    while (1)
+    {
+        slot = &queue->slots[pos & (queue->size - 1)];
+        long diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    void* item = slot->item;
+    __atomic_store_n(&slot->seq, pos + queue->size, __ATOMIC_RELEASE);
+    return item;
+}
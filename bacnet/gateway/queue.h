@@ -0,0 +1,31 @@
+#ifndef INF_BCE_IOT_BAC2MQTT_QUEUE_H
+#define INF_BCE_IOT_BAC2MQTT_QUEUE_H
+
+// a bounded queue of pointers, any thread may push or pop without a lock.
+// the same as the ring of the logger: the slot at pos is free when its seq
+// equals pos, and holds an item when it equals pos + 1
+typedef struct
+{
+    volatile unsigned long seq;
+    void* item;
+} QueueSlot;
+
+typedef struct
+{
+    QueueSlot* slots;
+    unsigned long size;    // power of 2
+    volatile unsigned long enqueue_pos;
+    volatile unsigned long dequeue_pos;
+} Queue;
+
+void init_queue(Queue* queue, unsigned long size);
+
+void free_queue(Queue* queue);
+
+// return 0 if the queue is full
+int push_queue(Queue* queue, void* item);
+
+// NULL if the queue is empty
+void* pop_queue(Queue* queue);
+
+#endif
@@ -0,0 +1,127 @@
+#include "receiver.h"
+
+#include "common.h"
+#include "thread.h"
+#include "queue.h"
+
+#define RECEIVE_WAIT 100    // in milliseconds, how often the thread looks at the stop flag
+
+static Packet g_packet_pool[PACKET_POOL_SIZE];
+static Packet g_overflow;    // where packets go when the pool is used up
+static Queue g_free_packets;
+static Queue g_received_packets;
+static Event* g_packet_event = NULL;
+static volatile int g_receiver_running = 0;
+static volatile int g_receiver_stop = 0;
+static thread_type g_receiver_thread;
+
+static thread_return_type receiver_func(void* arg)
+{
+    int dropped = 0;
+    while (!g_receiver_stop)
+    {
+        Packet* packet = (Packet*) pop_queue(&g_free_packets);
+        if (packet == NULL)
+        {
+            packet = &g_overflow;
+        }
+
+        packet->len = datalink_receive(&packet->src, &packet->pdu[0], MAX_MPDU, RECEIVE_WAIT);
+        if (packet == &g_overflow)
+        {
+            // keep the socket drained, the worker or the publisher is behind
+            if (packet->len > 0)
+            {
+                dropped++;
+            }
+            continue;
+        }
+        if (packet->len == 0)
+        {
+            push_queue(&g_free_packets, packet);
+            continue;
+        }
+        if (dropped > 0)
+        {
+            LOG_WARN("%d bacnet packets dropped, the worker is behind", dropped);
+            dropped = 0;
+        }
+        packet->time_ms = epoch_ms();
+        packet->refs = 1;
+        push_queue(&g_received_packets, packet);
+        signal_event(g_packet_event);
+    }
+    g_receiver_running = 0;
+    return 0;
+}
+
+void start_receiver()
+{
+    if (g_receiver_running)
+    {
+        return;
+    }
+    if (g_packet_event == NULL)
+    {
+        g_packet_event = create_event();
+        init_queue(&g_free_packets, PACKET_POOL_SIZE);
+        init_queue(&g_received_packets, PACKET_POOL_SIZE);
+        int i = 0;
+        for (i = 0; i < PACKET_POOL_SIZE; i++)
+        {
+            push_queue(&g_free_packets, &g_packet_pool[i]);
+        }
+    }
+    g_receiver_stop = 0;
+    g_receiver_running = 1;
+    g_receiver_thread = Thread_start(receiver_func, NULL);
+}
+
+void stop_receiver()
+{
+    if (!g_receiver_running)
+    {
+        return;
+    }
+    g_receiver_stop = 1;
+    int count = 0;
+    while (g_receiver_running && ++count < 100)
+    {
+        sleep_ms(RECEIVE_WAIT);
+    }
+}
+
+Packet* take_packet(unsigned timeout)
+{
+    if (g_packet_event == NULL)
+    {
+        // nothing to receive from yet
+        sleep_ms(timeout);
+        return NULL;
+    }
+    long long deadline = now_ms() + timeout;
+    Packet* packet = NULL;
+    while ((packet = (Packet*) pop_queue(&g_received_packets)) == NULL)
+    {
+        // the event may be left from a packet taken already
+        long long left = deadline - now_ms();
+        if (left <= 0 || !wait_event(g_packet_event, (int) left))
+        {
+            return NULL;
+        }
+    }
+    return packet;
+}
+
+void hold_packet(Packet* packet)
+{
+    __sync_add_and_fetch(&packet->refs, 1);
+}
+
+void release_packet(Packet* packet)
+{
+    if (__sync_sub_and_fetch(&packet->refs, 1) == 0)
+    {
+        push_queue(&g_free_packets, packet);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef INF_BCE_IOT_BAC2MQTT_RECEIVER_H
+#define INF_BCE_IOT_BAC2MQTT_RECEIVER_H
+
+#include "bacdef.h"
+#include "datalink.h"
+
+#define PACKET_POOL_SIZE 1024    // power of 2
+
+// a frame from the bacnet socket, from a pool allocated up front. whoever
+// holds a reference may read it, the last release gives it back to the pool
+typedef struct
+{
+    BACNET_ADDRESS src;
+    uint16_t len;
+    uint8_t pdu[MAX_MPDU];
+    long long time_ms;	// when it was received, see epoch_ms
+    volatile int refs;
+} Packet;
+
+// drain the bacnet socket on a thread of its own, into packets of the
+// pool. the datalink must be initialized. only the worker takes the
+// packets
+void start_receiver();
+
+void stop_receiver();
+
+// the oldest packet received, waiting up to timeout milliseconds for one.
+// NULL if none came. the caller holds a reference
+Packet* take_packet(unsigned timeout);
+
+// one more reference to the packet, e.g. for the publisher to send it
+// as it is
+void hold_packet(Packet* packet);
+
+void release_packet(Packet* packet);
+
+#endif
@@ -0,0 +1,201 @@
+#include "registry.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "address.h"
+#include "tsm.h"
+#include "common.h"
+
+enum
+{
+    DEVICE_BUCKETS = 1024    // power of 2
+};
+
+// what a transaction of the stack is tracked with
+typedef struct
+{
+    uint32_t instance_number;
+    REQUEST_DATA* request;
+} Transaction;
+
+static void (*s_expired)(uint32_t instance_number, REQUEST_DATA* request) = NULL;
+static void (*s_no_buffer)(uint32_t instance_number, REQUEST_DATA* request) = NULL;
+static void (*s_dropped)(REQUEST_DATA* request) = NULL;
+static long long s_last_tick = 0;
+
+static unsigned int hash_instance(uint32_t instance_number)
+{
+    return (instance_number * 2654435761U) >> 22;
+}
+
+void init_devices(AllDevices* all)
+{
+    all->devices_num = 0;
+    all->devices_cap = 64;
+    all->devices_header = (BacDevice2**) malloc(all->devices_cap * sizeof(BacDevice2*));
+    all->buckets = (BacDevice2**) calloc(DEVICE_BUCKETS, sizeof(BacDevice2*));
+    all->devices_lock = Thread_create_mutex();
+}
+
+BacDevice2* find_device(AllDevices* all, uint32_t instance_number)
+{
+    if (all->buckets == NULL)
+    {
+        return NULL;
+    }
+    Thread_lock_mutex(all->devices_lock);
+    BacDevice2* device = all->buckets[hash_instance(instance_number) & (DEVICE_BUCKETS - 1)];
+    while (device != NULL && device->instanceNumber != instance_number)
+    {
+        device = device->hash_next;
+    }
+    Thread_unlock_mutex(all->devices_lock);
+    return device;
+}
+
+void add_device(AllDevices* all, BacDevice2* device)
+{
+    Thread_lock_mutex(all->devices_lock);
+    if (all->devices_num == all->devices_cap)
+    {
+        all->devices_cap *= 2;
+        all->devices_header = (BacDevice2**) realloc(all->devices_header,
+                all->devices_cap * sizeof(BacDevice2*));
+    }
+    all->devices_header[all->devices_num++] = device;
+    unsigned int bucket = hash_instance(device->instanceNumber) & (DEVICE_BUCKETS - 1);
+    device->hash_next = all->buckets[bucket];
+    all->buckets[bucket] = device;
+    Thread_unlock_mutex(all->devices_lock);
+}
+
+void clear_devices(AllDevices* all)
+{
+    if (all->buckets == NULL)
+    {
+        return;
+    }
+    Thread_lock_mutex(all->devices_lock);
+    all->devices_num = 0;
+    memset(all->buckets, 0, DEVICE_BUCKETS * sizeof(BacDevice2*));
+    Thread_unlock_mutex(all->devices_lock);
+}
+
+static void transaction_failed(BACNET_ADDRESS* peer, uint8_t invoke_id, void* context)
+{
+    Transaction* transaction = (Transaction*) context;
+    LOG_DEBUG("request %d to device %d got no reply", invoke_id, transaction->instance_number);
+    if (s_expired != NULL)
+    {
+        s_expired(transaction->instance_number, transaction->request);
+    }
+    free(transaction);
+}
+
+static void transaction_no_buffer(BACNET_ADDRESS* peer, uint8_t invoke_id, void* context)
+{
+    Transaction* transaction = (Transaction*) context;
+    LOG_DEBUG("no buffer for the ack of request %d to device %d", invoke_id,
+            transaction->instance_number);
+    if (s_no_buffer != NULL)
+    {
+        s_no_buffer(transaction->instance_number, transaction->request);
+    }
+    free(transaction);
+}
+
+void init_transactions(void (*expired)(uint32_t instance_number, REQUEST_DATA* request),
+        void (*no_buffer)(uint32_t instance_number, REQUEST_DATA* request))
+{
+    s_expired = expired;
+    s_no_buffer = no_buffer;
+    s_last_tick = now_ms();
+    tsm_set_failed_handler(transaction_failed);
+    tsm_set_no_buffer_handler(transaction_no_buffer);
+}
+
+void track_transaction(uint32_t instance_number, uint8_t invoke_id)
+{
+    track_request(instance_number, invoke_id, NULL);
+}
+
+int track_request(uint32_t instance_number, uint8_t invoke_id, REQUEST_DATA* request)
+{
+    BACNET_ADDRESS peer;
+    unsigned max_apdu = 0;
+    if (invoke_id == 0 || !address_get_by_device(instance_number, &max_apdu, &peer))
+    {
+        return 0;
+    }
+
+    Transaction* transaction = (Transaction*) malloc(sizeof(Transaction));
+    transaction->instance_number = instance_number;
+    transaction->request = request;
+    if (!tsm_set_context(&peer, invoke_id, transaction))
+    {
+        free(transaction);
+        return 0;
+    }
+    return 1;
+}
+
+int finish_transaction(BACNET_ADDRESS* src, uint8_t invoke_id, uint32_t* instance_number,
+        REQUEST_DATA** request)
+{
+    if (src == NULL)
+    {
+        return 0;
+    }
+    Transaction* transaction = (Transaction*) tsm_take_context(src, invoke_id);
+    if (transaction == NULL)
+    {
+        return 0;
+    }
+    *instance_number = transaction->instance_number;
+    *request = transaction->request;
+    free(transaction);
+    return 1;
+}
+
+void expire_transactions()
+{
+    long long now = now_ms();
+    long long elapsed = now - s_last_tick;
+    s_last_tick = now;
+    // the stack counts the time in 16 bits
+    while (elapsed > 0)
+    {
+        uint16_t step = elapsed > 60000 ? 60000 : (uint16_t) elapsed;
+        tsm_timer_milliseconds(step);
+        elapsed -= step;
+    }
+}
+
+int next_expiry_ms()
+{
+    uint16_t next = tsm_timer_next_expiry();
+    if (next == 0xFFFF)
+    {
+        return -1;
+    }
+    long long left = next - (now_ms() - s_last_tick);
+    return left > 0 ? (int) left : 0;
+}
+
+static void transaction_dropped(BACNET_ADDRESS* peer, uint8_t invoke_id, void* context)
+{
+    Transaction* transaction = (Transaction*) context;
+    if (s_dropped != NULL && transaction->request != NULL)
+    {
+        s_dropped(transaction->request);
+    }
+    free(transaction);
+}
+
+void clear_transactions(void (*dropped)(REQUEST_DATA* request))
+{
+    s_dropped = dropped;
+    tsm_free_all(transaction_dropped);
+    s_dropped = NULL;
+}
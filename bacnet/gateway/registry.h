@@ -0,0 +1,54 @@
+#ifndef INF_BCE_IOT_BAC2MQTT_REGISTRY_H
+#define INF_BCE_IOT_BAC2MQTT_REGISTRY_H
+
+#include "data.h"
+
+// the devices found by the gateway, in the order they're found, and hashed
+// by instance number. only the worker adds or removes devices, lookups may
+// come from the mqtt thread as well
+void init_devices(AllDevices* all);
+
+BacDevice2* find_device(AllDevices* all, uint32_t instance_number);
+
+void add_device(AllDevices* all, BacDevice2* device);
+
+// forget all the devices, the caller frees them
+void clear_devices(AllDevices* all);
+
+// the confirmed requests waiting for a reply, kept by the stack with the
+// peer and the invoke id the request was sent with. the stack sends a
+// request again until it's answered, or the apdu retries run out
+
+// call expired with the device and the request of each transaction that
+// gets no reply, and no_buffer for each whose segmented ack the stack had
+// no buffer to reassemble in, the request may be sent again as it is
+void init_transactions(void (*expired)(uint32_t instance_number, REQUEST_DATA* request),
+        void (*no_buffer)(uint32_t instance_number, REQUEST_DATA* request));
+
+// remember that the request with invoke_id went to the device. an
+// invoke_id of 0 means the request wasn't sent, and is ignored
+void track_transaction(uint32_t instance_number, uint8_t invoke_id);
+
+// the same for a request of the device's request list, which is kept with
+// the transaction until the reply. return 0 if it isn't tracked
+int track_request(uint32_t instance_number, uint8_t invoke_id, REQUEST_DATA* request);
+
+// the instance number of the device a reply from src with invoke_id is for,
+// and the request tracked with it if any. the stack frees the transaction
+// once the reply is handled. return 0 if it's not a known transaction
+int finish_transaction(BACNET_ADDRESS* src, uint8_t invoke_id, uint32_t* instance_number,
+        REQUEST_DATA** request);
+
+// run the timers of the transactions up to now, sending the requests
+// again or giving up on them
+void expire_transactions();
+
+// milliseconds until expire_transactions has something to do, -1 if no
+// transaction is waiting
+int next_expiry_ms();
+
+// forget all the transactions, and free their invoke ids. dropped is called
+// with the requests tracked
+void clear_transactions(void (*dropped)(REQUEST_DATA* request));
+
+#endif
@@ -78,9 +78,9 @@ fi
 echo "8, download and install paho.mqtt.c"
 PAHO_MQTT_VER=1.2.1
 
-if [ -f $OUTPUTDIR/lib/libpaho-mqtt3cs.dll ]
+if [ -f $OUTPUTDIR/lib/libpaho-mqtt3as.dll ]
 then
-    echo "$OUTPUTDIR/lib/libpaho-mqtt3cs.dll exist, skipping paho.mqtt.c compilation"
+    echo "$OUTPUTDIR/lib/libpaho-mqtt3as.dll exist, skipping paho.mqtt.c compilation"
 else
 
 cd $DEPSDIR
@@ -98,7 +98,7 @@ cp tmp src/CMakeFiles/paho-mqtt3cs.dir/link.txt
 sed '${s/$/ -lcrypt32/}' src/CMakeFiles/paho-mqtt3as.dir/link.txt > tmp
 cp tmp  src/CMakeFiles/paho-mqtt3as.dir/link.txt
 cmake --build .
-cp src/libpaho-mqtt3cs.dll src/libpaho-mqtt3as-static.a $OUTPUTDIR/lib
+cp src/libpaho-mqtt3as.dll src/libpaho-mqtt3as-static.a $OUTPUTDIR/lib
 cp ../paho.mqtt.c-$PAHO_MQTT_VER/src/MQTTAsync.h ../paho.mqtt.c-$PAHO_MQTT_VER/src/MQTTClient.h ../paho.mqtt.c-$PAHO_MQTT_VER/src/MQTTClientPersistence.h $OUTPUTDIR/include
 fi
 
@@ -108,7 +108,7 @@ fi
 cd $BASEDIR
 cp Makefile-win Makefile
 make LIBDIR=$OUTPUTDIR/lib INCDIR=$OUTPUTDIR/include CC=$G_CC
-cp $OUTPUTDIR/lib/libpaho-mqtt3cs.dll ../../
+cp $OUTPUTDIR/lib/libpaho-mqtt3as.dll ../../
 cp ../../bdModbusGateway.exe ../bin/win32
 echo "======================================="
 echo "SUCCESS, executable is located at ../../bdModbusGateway.exe"
@@ -78,9 +78,9 @@ fi
 # 8, download and install paho.mqtt.c
 echo "8, download and install paho.mqtt.c"
 PAHO_MQTT_VER=1.2.1
-if [ -f $OUTPUTDIR/lib/libpaho-mqtt3cs.dll ]
+if [ -f $OUTPUTDIR/lib/libpaho-mqtt3as.dll ]
 then
-    echo "$OUTPUTDIR/lib/libpaho-mqtt3cs.dll, skipping paho.mqtt.c compilation"
+    echo "$OUTPUTDIR/lib/libpaho-mqtt3as.dll, skipping paho.mqtt.c compilation"
 else
 cd $DEPSDIR
 wget https://github.com/ubyyj/paho.mqtt.c/archive/v$PAHO_MQTT_VER.tar.gz -O v$PAHO_MQTT_VER.tar.gz
@@ -97,7 +97,7 @@ cp tmp src/CMakeFiles/paho-mqtt3cs.dir/link.txt
 sed '${s/$/ -lcrypt32/}' src/CMakeFiles/paho-mqtt3as.dir/link.txt > tmp
 cp tmp  src/CMakeFiles/paho-mqtt3as.dir/link.txt
 cmake --build .
-cp src/libpaho-mqtt3cs.dll src/libpaho-mqtt3as-static.a $OUTPUTDIR/lib
+cp src/libpaho-mqtt3as.dll src/libpaho-mqtt3as-static.a $OUTPUTDIR/lib
 cp ../paho.mqtt.c-$PAHO_MQTT_VER/src/MQTTAsync.h ../paho.mqtt.c-$PAHO_MQTT_VER/src/MQTTClient.h ../paho.mqtt.c-$PAHO_MQTT_VER/src/MQTTClientPersistence.h $OUTPUTDIR/include
 fi
 
@@ -105,7 +105,7 @@ fi
 cd $BASEDIR
 cp Makefile-win Makefile
 make LIBDIR=$OUTPUTDIR/lib INCDIR=$OUTPUTDIR/include CC=$G_CC
-cp $OUTPUTDIR/lib/libpaho-mqtt3cs.dll ../../
+cp $OUTPUTDIR/lib/libpaho-mqtt3as.dll ../../
 cp ../../bdModbusGateway.exe ../bin/win64
 echo "======================================="
 echo "SUCCESS, executable is located at ../../bdModbusGateway.exe"
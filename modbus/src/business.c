@@ -22,14 +22,33 @@
 #include "common.h"
 #include "thread.h"
 #include "mqttsender.h"
+#include "modbuslib.h"
+#include "shadowserver.h"
+#include "policysnapshot.h"
+#include "logger.h"
+#include "spool.h"
+#include "historystore.h"
+#include "wakeup.h"
 
 #include <string.h>
 #include <stdlib.h>
+#if !defined(WIN32) && !defined(WIN64)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#endif
 
 const char* const PEM_FILE = "root_cert.pem";
 const char* const CONFIG_FILE = "gwconfig.txt";
 const char* const POLICY_CACHE = "policyCache.txt";
+const char* const POLICY_SNAPSHOT = "policyCache.bin";    // compiled from POLICY_CACHE
 const char* const DATA_CACHE = "data_cache.dat";
+const char* const SPOOL_DIR = "spool";    // from the shard processes to the uploader
+const char* const HISTORY_DIR = "history";    // the polled values, for local queries
+
+#define MAX_SHARDS 16
 
 // when worker is running, it should require this lock first
 // when policy loader is going to change policy, it also need to 
@@ -45,15 +64,56 @@ mutex_type g_gateway_mutex;
 
 GatewayConfig g_gateway_conf;
 cJSON* g_misc = NULL;   // extra info need to pub to cloud in every message, eg. imei
-char g_buff[BUFF_LEN];
 int g_stop_worker = 0;
 int g_worker_is_running = 0;
+// the worker sleeps on this until the next policy is due, it's signaled
+// when there is something to do earlier, e.g. policy updated, or exiting
+Wakeup g_worker_wakeup;
+// the command channel supervisor sleeps on this while connected, or backing
+// off, it's signaled when the connection is lost, or exiting
+Wakeup g_command_wakeup;
+int g_command_is_running = 0;
+static const int WORKER_IDLE_WAIT = 10;    // in seconds, when there is no policy
+static const int COMMAND_MAX_BACKOFF = 60;    // in seconds, between reconnecting the command channel
 static int g_mqttsender = -1;
 static int g_cache_size = 1024 * 1024 * 500;    // 500 MB,
-
-MQTTClient_SSLOptions g_sslopts = MQTTClient_SSLOptions_initializer;
-
-void set_ssl_option(MQTTClient_connectOptions* conn_opts, char* host)
+static int g_shadow_server_port = 0;    // 0 to disable the local modbus tcp shadow server
+static int g_live_share = 80;    // percentage of publishes reserved for live data during replay
+static int g_backlog_rate = 0;    // max cached messages replayed per second, 0 for no limit
+static int g_log_level = LOG_LEVEL_INFO;
+static int g_log_format = LOG_FORMAT_TEXT;
+static long g_history_size = 0;    // in bytes, 0 to keep no history
+static int g_history_days = 7;
+
+// with shards > 1, this process supervises that many shard processes, each
+// polls the links hashed to it and puts the messages in the spool, and this
+// process uploads them. otherwise this process polls all the links itself
+static int g_shards = 0;
+static int g_shard = -1;    // the shard this process polls, -1 if it's not a shard
+static Spool* g_spool = NULL;    // of a shard
+static SpoolDrain* g_spool_drain = NULL;    // of the supervisor, uploading what the shards spool
+static const int SHARD_RESPAWN_DELAY = 5;    // in seconds, before restarting a dead shard
+static const int SHARD_SUPERVISOR_NAP = 200;    // in milliseconds, when the spool is empty
+#if !defined(WIN32) && !defined(WIN64)
+static pid_t g_shard_pids[MAX_SHARDS];    // 0 if the shard is not running
+// guards the pids: a pid is only reaped under it, so it's not reused while
+// notify_shards, in the mqtt thread, signals it
+static mutex_type g_shard_lock = NULL;
+static time_t g_shard_respawn[MAX_SHARDS];
+static char g_self_path[MAX_LEN];
+static int g_shard_supervisor_is_running = 0;
+#endif
+
+MQTTAsync_SSLOptions g_sslopts = MQTTAsync_SSLOptions_initializer;
+
+// the command channel, NULL when it's not created
+static MQTTAsync g_command_client = NULL;
+static const int COMMAND_CONNECTING = 0;
+static const int COMMAND_CONNECTED = 1;
+static const int COMMAND_FAILED = 2;
+static volatile int g_command_state = 0;    // of the latest connect, set by the callbacks
+
+void set_ssl_option(MQTTAsync_connectOptions* conn_opts, char* host)
 {
     char* ssl = "ssl://";
     char* ssl_upper = "SSL://";
@@ -148,6 +208,65 @@ int load_gateway_config(GatewayConfig* conf)
         }
     }
 
+    // shadowServerPort, serve the latest polled values to local modbus tcp clients
+    if (cJSON_HasObjectItem(root, "shadowServerPort")) {
+        cJSON* shadowServerPort = cJSON_GetObjectItem(root, "shadowServerPort");
+        if (shadowServerPort != NULL) {
+            g_shadow_server_port = shadowServerPort->valueint;
+        }
+    }
+
+    // liveShare and backlogRate, how fresh data and the offline cache share the uplink
+    if (cJSON_HasObjectItem(root, "liveShare")) {
+        cJSON* liveShare = cJSON_GetObjectItem(root, "liveShare");
+        if (liveShare != NULL) {
+            g_live_share = liveShare->valueint;
+        }
+    }
+    if (cJSON_HasObjectItem(root, "backlogRate")) {
+        cJSON* backlogRate = cJSON_GetObjectItem(root, "backlogRate");
+        if (backlogRate != NULL) {
+            g_backlog_rate = backlogRate->valueint;
+        }
+    }
+
+    // historySize and historyDays, how much of the polled values to keep locally
+    if (cJSON_HasObjectItem(root, "historySize")) {
+        cJSON* historySize = cJSON_GetObjectItem(root, "historySize");
+        if (historySize != NULL) {
+            g_history_size = (long) historySize->valuedouble;
+        }
+    }
+    if (cJSON_HasObjectItem(root, "historyDays")) {
+        cJSON* historyDays = cJSON_GetObjectItem(root, "historyDays");
+        if (historyDays != NULL) {
+            g_history_days = historyDays->valueint;
+        }
+    }
+
+    // shards, the number of processes polling the links, see g_shards
+    if (cJSON_HasObjectItem(root, "shards")) {
+        cJSON* shards = cJSON_GetObjectItem(root, "shards");
+        if (shards != NULL) {
+            g_shards = shards->valueint;
+        }
+    }
+
+    // logLevel, 0 debug, 1 info, 2 warn, 3 error; logFormat, "text" or "json"
+    if (cJSON_HasObjectItem(root, "logLevel")) {
+        cJSON* logLevel = cJSON_GetObjectItem(root, "logLevel");
+        if (logLevel != NULL) {
+            g_log_level = logLevel->valueint;
+        }
+    }
+    if (cJSON_HasObjectItem(root, "logFormat")) {
+        cJSON* logFormat = cJSON_GetObjectItem(root, "logFormat");
+        if (logFormat != NULL && logFormat->valuestring != NULL) {
+            g_log_format = strcmp(logFormat->valuestring, "json") == 0
+                    ? LOG_FORMAT_JSON : LOG_FORMAT_TEXT;
+        }
+    }
+
     free(content);
     cJSON_Delete(root);
     return 1;
@@ -159,6 +278,9 @@ SlavePolicy* new_slave_policy()
     sp->nextRun = time(NULL);
     sp->next = NULL;
     sp->mqttClient = -1;
+    sp->file_number = 0;
+    sp->write_addr = 0;
+    sp->write_data[0] = 0;
 
     return sp;
 }
@@ -179,6 +301,7 @@ void destroy_slave_policy(SlavePolicy* sp)
     free(sp);
 }
 
+// NULL if the policy is invalid
 SlavePolicy* json_to_slave_poilicy(cJSON* root)
 {
     SlavePolicy* policy = new_slave_policy();
@@ -200,7 +323,34 @@ SlavePolicy* json_to_slave_poilicy(cJSON* root)
     mystrncpy(policy->pubChannel.password, json_string(cjch, "password"), MAX_LEN);
     policy->nextRun = time(NULL) + policy->interval;
 
-    if (policy->mode == RTU)
+    if (policy->functioncode == FC_READ_FILE_RECORD && cJSON_HasObjectItem(root, "file_number"))
+    {
+        policy->file_number = json_int(root, "file_number");
+    }
+    if (policy->functioncode == FC_READ_WRITE_REGISTERS)
+    {
+        if (cJSON_HasObjectItem(root, "write_addr"))
+        {
+            policy->write_addr = json_int(root, "write_addr");
+        }
+        // 1 to MODBUS_MAX_WR_WRITE_REGISTERS registers, 4 hex chars each
+        const char* write_data = NULL;
+        if (cJSON_HasObjectItem(root, "write_data"))
+        {
+            write_data = json_string(root, "write_data");
+        }
+        int len = write_data == NULL ? 0 : (int) strlen(write_data);
+        if (len == 0 || len % 4 != 0 || len / 4 > MODBUS_MAX_WR_WRITE_REGISTERS)
+        {
+            LOG_WARN("invalid write_data of slaveid=%d, functioncode=%d, ignoring the policy",
+                    policy->slaveid, policy->functioncode);
+            destroy_slave_policy(policy);
+            return NULL;
+        }
+        mystrncpy(policy->write_data, write_data, MAX_LEN);
+    }
+
+    if (policy->mode == RTU || policy->mode == ASCII)
     {
         policy->baud = json_int(root, "baud");
         policy->databits = json_int(root, "databits");
@@ -224,13 +374,25 @@ void cleanup_data()
     cleanup_shared_data();
 }
 
+// a shard polls the links, i.e. the tcp addresses or serial ports, hashed to it,
+// so a serial port is never opened by two processes
+static int is_policy_of_shard(const SlavePolicy* policy)
+{
+    if (g_shard < 0)
+    {
+        return 1;
+    }
+    unsigned int hash = policy_source_hash(policy->ip_com_addr, (long) strlen(policy->ip_com_addr));
+    return (int) (hash % g_shards) == g_shard;
+}
+
 int load_slave_policy_from_cache(SlavePolicy* header)
 {
     // in case gateway can't retrieve SlavePolicy from cloud immediately,
     // we should cache the polices in a local file. Whenever gateway startup,
     // it should load polices form this local cache first, and in the mean time
     // listen any policy change pushed from cloud.
-    log_debug("enter loadSlavePolicy");
+    LOG_DEBUG("enter loadSlavePolicy");
     int rc = -1;
     // anyway we will clear the flag that need reload policy
     rc = Thread_lock_mutex(g_policy_update_lock);
@@ -242,7 +404,7 @@ int load_slave_policy_from_cache(SlavePolicy* header)
     long filesize = read_file_as_string(POLICY_CACHE, &content);
     if (filesize <= 0)
     {
-        printf("failed to open policy cache file %s, skipping policy cache loading\n",
+        LOG_WARN("failed to open policy cache file %s, skipping policy cache loading",
                  POLICY_CACHE);
         rc = Thread_unlock_mutex(g_policy_update_lock);
         return 0;
@@ -253,42 +415,76 @@ int load_slave_policy_from_cache(SlavePolicy* header)
     }
 
     rc = Thread_unlock_mutex(g_policy_update_lock);
-    cJSON* fileroot = cJSON_Parse(content);
-    if (fileroot == NULL)
+
+    // build the new policy list before taking the policy lock, so polling
+    // goes on meanwhile. the snapshot saves parsing the json again, and the
+    // modbus connections are made by the first poll of each slave
+    SlavePolicy loaded;
+    loaded.next = NULL;
+    unsigned int source_hash = policy_source_hash(content, filesize);
+    int num = load_policy_snapshot(POLICY_SNAPSHOT, source_hash, &loaded);
+    if (num < 0)
     {
-        printf("invalid config detected from cache file %s, skipping policy cache loading\r\n", 
-                POLICY_CACHE);
-        free(content);
-        return 0;
+        cJSON* fileroot = cJSON_Parse(content);
+        if (fileroot == NULL)
+        {
+            LOG_ERROR("invalid config detected from cache file %s, skipping policy cache loading",
+                    POLICY_CACHE);
+            free(content);
+            return 0;
+        }
+        int size = cJSON_GetArraySize(fileroot);
+        int i = 0;
+        num = 0;
+        for(i = 0; i < size; i++)
+        {
+            cJSON* root = cJSON_GetArrayItem(fileroot, i);
+            SlavePolicy* policy = json_to_slave_poilicy(root);
+            if (policy == NULL)
+            {
+                continue;
+            }
+            num++;
+
+            // add the policy into list
+            policy->next = loaded.next;
+            loaded.next = policy;
+        }
+        cJSON_Delete(fileroot);
+        if (save_policy_snapshot(POLICY_SNAPSHOT, source_hash, &loaded) != 0)
+        {
+            LOG_WARN("failed to save policy snapshot %s", POLICY_SNAPSHOT);
+        }
     }
-    int num = cJSON_GetArraySize(fileroot);
-    if (num < 0)
+    free(content);
+    if (num <= 0)
     {
-        printf("no slave policy is loaded from cache file %s\r\n", POLICY_CACHE);
-        free(content);
-        return 1;
+        LOG_INFO("no slave policy is loaded from cache file %s", POLICY_CACHE);
+    }
+    SlavePolicy* itr = &loaded;
+    while (itr->next != NULL)
+    {
+        if (is_policy_of_shard(itr->next))
+        {
+            itr = itr->next;
+        }
+        else
+        {
+            SlavePolicy* other = itr->next;
+            itr->next = other->next;
+            destroy_slave_policy(other);
+        }
     }
 
     rc = Thread_lock_mutex(g_policy_lock);
 
     // clear all the existing data 
     cleanup_data();
-
-    int i = 0;
-    for(i = 0; i < num; i++)
-    {
-        cJSON* root = cJSON_GetArrayItem(fileroot, i);
-        SlavePolicy* policy = json_to_slave_poilicy(root);
-        init_modbus_context(policy);
-
-        // add the policy into list
-        policy->next = g_slave_header.next;
-        g_slave_header.next = policy;
-    }
+    g_slave_header.next = loaded.next;
+    // values of the old policies mustn't be served for the new set
+    cleanup_shadow();
     rc = Thread_unlock_mutex(g_policy_lock);
-
-    cJSON_Delete(fileroot);
-    free(content);
+    return 1;
 }
 
 void insert_slave_policy(SlavePolicy* policy)
@@ -313,12 +509,73 @@ void insert_slave_policy(SlavePolicy* policy)
     itr->next = policy;
 }
 
-void delivered(void* context, MQTTClient_deliveryToken dt)
+void wakeup_worker()
+{
+    signal_wakeup(&g_worker_wakeup);
+}
+
+void wakeup_command_supervisor()
 {
-    printf("Message with token value %d delivery confirmed\r\n", dt);
+    signal_wakeup(&g_command_wakeup);
 }
 
-int msg_arrived(void* context, char* topicName, int topicLen, MQTTClient_message* message)
+// take the generation before checking the state waited for, see Wakeup
+static void wait_command_event(unsigned int generation, int seconds)
+{
+    wait_wakeup(&g_command_wakeup, generation, seconds);
+}
+
+// sleep until the first policy is due, or someone wakes up the worker
+static void wait_next_run()
+{
+    unsigned int generation = wakeup_generation(&g_worker_wakeup);
+    int seconds = WORKER_IDLE_WAIT;
+    Thread_lock_mutex(g_policy_lock);
+    if (g_slave_header.next != NULL)
+    {
+        seconds = (int) (g_slave_header.next->nextRun - time(NULL));
+    }
+    Thread_unlock_mutex(g_policy_lock);
+
+    if (seconds <= 0 || g_policy_updated || g_stop_worker)
+    {
+        return;
+    }
+    if (g_spool != NULL)
+    {
+        // the spool seals in time, and signals are noticed
+        seconds = 1;
+    }
+    wait_wakeup(&g_worker_wakeup, generation, seconds);
+}
+
+// tell the shards to reload the policies
+static void notify_shards()
+{
+#if !defined(WIN32) && !defined(WIN64)
+    if (g_shard >= 0 || g_shard_lock == NULL)
+    {
+        return;
+    }
+    int i = 0;
+    Thread_lock_mutex(g_shard_lock);
+    for (i = 0; i < g_shards && i < MAX_SHARDS; i++)
+    {
+        if (g_shard_pids[i] > 0)
+        {
+            kill(g_shard_pids[i], SIGHUP);
+        }
+    }
+    Thread_unlock_mutex(g_shard_lock);
+#endif
+}
+
+void delivered(void* context, MQTTAsync_token dt)
+{
+    LOG_DEBUG("Message with token value %d delivery confirmed", dt);
+}
+
+int msg_arrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
 {
     // sometime we receive strange message with topic name like "\300\005@\267"
     // let's filter those message that with topic other than expected
@@ -332,19 +589,17 @@ int msg_arrived(void* context, char* topicName, int topicLen, MQTTClient_message
         && strcmp(g_gateway_conf.backControlTopic, topicName) == 0) {
         return handle_back_control_msg(context, topicName, topicLen, message);
     } else {
-        snprintf(g_buff, BUFF_LEN, 
-                "received unrelevant message in command topic, skipping it. topic=%s, payload=", 
+        LOG_DEBUG("received unrelevant message in command topic, skipping it. topic=%s",
                 topicName);
-        log_debug(g_buff);
     
-        MQTTClient_freeMessage(&message);
-        MQTTClient_free(topicName);
+        MQTTAsync_freeMessage(&message);
+        MQTTAsync_free(topicName);
 
         return 1;
     }
 }
 
-int handle_back_control_msg(void* context, char* topicName, int topicLen, MQTTClient_message* message) {
+int handle_back_control_msg(void* context, char* topicName, int topicLen, MQTTAsync_message* message) {
     int i = 1;
     char* payloadptr = NULL;
 
@@ -357,13 +612,13 @@ int handle_back_control_msg(void* context, char* topicName, int topicLen, MQTTCl
         buf[i] = payloadptr[i];
     }
 
-    MQTTClient_freeMessage(&message);
-    MQTTClient_free(topicName);
+    MQTTAsync_freeMessage(&message);
+    MQTTAsync_free(topicName);
     cJSON* root = cJSON_Parse(buf);
     if (root == NULL)
     {
+        LOG_ERROR("received invalid json config for writing modbus:%s", buf);
         free(buf);
-        printf("received invalid json config for writing modbus:%s\r\n", buf);
         return 1;
     }
     
@@ -399,7 +654,7 @@ int handle_back_control_msg(void* context, char* topicName, int topicLen, MQTTCl
     return 1;
 }
 
-int handle_config_msg(void* context, char* topicName, int topicLen, MQTTClient_message* message) {
+int handle_config_msg(void* context, char* topicName, int topicLen, MQTTAsync_message* message) {
     int i = 0;
     char* payloadptr = NULL;
 
@@ -412,13 +667,13 @@ int handle_config_msg(void* context, char* topicName, int topicLen, MQTTClient_m
         buf[i] = payloadptr[i];
     }
 
-    MQTTClient_freeMessage(&message);
-    MQTTClient_free(topicName);
+    MQTTAsync_freeMessage(&message);
+    MQTTAsync_free(topicName);
     cJSON* root = cJSON_Parse(buf);
     if (root == NULL)
     {
+        LOG_ERROR("received invalid json config:%s", buf);
         free(buf);
-        printf("received invalid json config:%s\r\n", buf);
         return 1;
     }
     cJSON_Delete(root);
@@ -427,44 +682,70 @@ int handle_config_msg(void* context, char* topicName, int topicLen, MQTTClient_m
     if (! fp)
     {
         free(buf);
-        snprintf(g_buff, BUFF_LEN, "failed to open %s for write", POLICY_CACHE);
-        log_debug(g_buff);
+        LOG_ERROR("failed to open %s for write", POLICY_CACHE);
         Thread_unlock_mutex(g_policy_update_lock);
         return 0;
     }
     fprintf(fp, "%s", buf);
     fclose(fp);
-    printf("received gateway config from cloud\r\n");
+    LOG_INFO("received gateway config from cloud");
     free(buf);
 
     g_policy_updated = 1;
     Thread_unlock_mutex(g_policy_update_lock);
+    wakeup_worker();
+    notify_shards();
     return 1;
 }
 
 void connection_lost(void* context, char* cause)
 {
-    printf("\nConnection lost, caused by %s, will reconnect later\r\n", cause);
-    MQTTClient client = (MQTTClient) context;
-    MQTTClient_destroy(&client);
+    // the client is destroyed when reconnecting, not in its own callback
+    LOG_WARN("Connection lost, caused by %s, will reconnect later", cause);
     Thread_lock_mutex(g_gateway_mutex);
     g_gateway_connected = 0;
     Thread_unlock_mutex(g_gateway_mutex);
+    wakeup_command_supervisor();
 }
 
-void start_listen_command()
+void on_command_connected(void* context, MQTTAsync_successData* response)
 {
-    printf("connecting gateway to cloud...\r\n");
+    g_command_state = COMMAND_CONNECTED;
+    wakeup_command_supervisor();
+}
+
+void on_command_connect_failed(void* context, MQTTAsync_failureData* response)
+{
+    LOG_ERROR("Failed to connect, return code %d", response != NULL ? response->code : 0);
+    g_command_state = COMMAND_FAILED;
+    wakeup_command_supervisor();
+}
+
+// connect the command channel and subscribe, return 1 on success
+int start_listen_command()
+{
+    LOG_INFO("connecting gateway to cloud...");
     Thread_lock_mutex(g_gateway_mutex);
+    if (g_command_client != NULL)
+    {
+        // the previous connection is lost
+        MQTTAsync_destroy(&g_command_client);
+    }
     // sub to config mqtt topic, to receive slave policy from cloud
-    MQTTClient client;
-    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+    MQTTAsync client;
+    MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
     int rc = 0;
-    int ch = 0;
 
     char clientid[MAX_LEN];
-    snprintf(clientid, MAX_LEN, "modbusGW%lld", (long long)time(NULL));
-    MQTTClient_create(&client, g_gateway_conf.endpoint, clientid,
+    if (g_shard >= 0)
+    {
+        snprintf(clientid, MAX_LEN, "modbusGW%lld-%d", (long long)time(NULL), g_shard);
+    }
+    else
+    {
+        snprintf(clientid, MAX_LEN, "modbusGW%lld", (long long)time(NULL));
+    }
+    MQTTAsync_create(&client, g_gateway_conf.endpoint, clientid,
         MQTTCLIENT_PERSISTENCE_NONE, NULL);
 
     conn_opts.keepAliveInterval = 20;
@@ -472,32 +753,101 @@ void start_listen_command()
     conn_opts.username = g_gateway_conf.user;
     conn_opts.password = g_gateway_conf.password;
     conn_opts.connectTimeout = 5;
+    conn_opts.onSuccess = on_command_connected;
+    conn_opts.onFailure = on_command_connect_failed;
     set_ssl_option(&conn_opts, g_gateway_conf.endpoint);
 
-    MQTTClient_setCallbacks(client, client, connection_lost, msg_arrived, delivered);
+    MQTTAsync_setCallbacks(client, NULL, connection_lost, msg_arrived, delivered);
 
-    if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS)
+    g_command_state = COMMAND_CONNECTING;
+    if ((rc = MQTTAsync_connect(client, &conn_opts)) != MQTTASYNC_SUCCESS)
     {
-        MQTTClient_destroy(&client);
-        printf("Failed to connect, return code %d\r\n", rc);
+        MQTTAsync_destroy(&client);
+        LOG_ERROR("Failed to connect, return code %d", rc);
         Thread_unlock_mutex(g_gateway_mutex);
 
-        return;
+        return 0;
+    }
+
+    // the callbacks tell the result, within the connect timeout
+    time_t deadline = time(NULL) + conn_opts.connectTimeout + 1;
+    unsigned int generation = 0;
+    for (generation = wakeup_generation(&g_command_wakeup);
+        g_command_state == COMMAND_CONNECTING && time(NULL) < deadline;
+        generation = wakeup_generation(&g_command_wakeup))
+    {
+        wait_command_event(generation, 1);
     }
-    if (strlen(g_gateway_conf.backControlTopic) > 0) {
+    if (g_command_state != COMMAND_CONNECTED)
+    {
+        MQTTAsync_destroy(&client);
+        Thread_unlock_mutex(g_gateway_mutex);
+        return 0;
+    }
+
+    // the policies come to the supervisor, the writes go to the shards,
+    // which hold the modbus connections
+    if (g_shard >= 0) {
+        MQTTAsync_subscribe(client, g_gateway_conf.backControlTopic, 0, NULL);
+    } else if (strlen(g_gateway_conf.backControlTopic) > 0 && g_shards <= 1) {
         char* topics[2];
         topics[0] = g_gateway_conf.topic;
         topics[1] = g_gateway_conf.backControlTopic;
         int qoss[2];
         qoss[0] = 0;
         qoss[1] = 0;
-        MQTTClient_subscribeMany(client, 2, topics, qoss);
+        MQTTAsync_subscribeMany(client, 2, topics, qoss, NULL);
     } else {
-        MQTTClient_subscribe(client, g_gateway_conf.topic, 0);
+        MQTTAsync_subscribe(client, g_gateway_conf.topic, 0, NULL);
     }
 
+    g_command_client = client;
     g_gateway_connected = 1;
     Thread_unlock_mutex(g_gateway_mutex);
+    return 1;
+}
+
+// keeps the command channel connected, in its own thread, so the acquisition
+// worker never waits for the cloud. it backs off 1, 2, 4 ... up to
+// COMMAND_MAX_BACKOFF seconds while the cloud is unreachable
+thread_return_type command_supervisor_func(void* arg)
+{
+    int backoff = 1;
+    unsigned int generation = 0;
+    g_command_is_running = 1;
+    for (generation = wakeup_generation(&g_command_wakeup); g_stop_worker != 1;
+        generation = wakeup_generation(&g_command_wakeup))
+    {
+        if (g_gateway_connected == 0)
+        {
+            if (start_listen_command())
+            {
+                backoff = 1;
+            }
+            else
+            {
+                time_t retry = time(NULL) + backoff;
+                backoff = backoff * 2 < COMMAND_MAX_BACKOFF ? backoff * 2 : COMMAND_MAX_BACKOFF;
+                for (; g_stop_worker != 1 && time(NULL) < retry;
+                    generation = wakeup_generation(&g_command_wakeup))
+                {
+                    wait_command_event(generation, (int) (retry - time(NULL)));
+                }
+                continue;
+            }
+        }
+        // nothing to do until the connection is lost
+        wait_command_event(generation, WORKER_IDLE_WAIT);
+    }
+    g_command_is_running = 0;
+    return 0;
+}
+
+thread_type g_command_thread;
+
+void start_command_supervisor()
+{
+    g_command_thread = Thread_start(command_supervisor_func, (void*) NULL);
 }
 
 void pack_pub_msg(SlavePolicy* policy, char* raw, char* dest)
@@ -515,8 +865,28 @@ void pack_pub_msg(SlavePolicy* policy, char* raw, char* dest)
     cJSON_AddNumberToObject(request, "slaveid", policy->slaveid);
     cJSON_AddNumberToObject(request, "startAddr", policy->start_addr);
     cJSON_AddNumberToObject(request, "length", policy->length);
+    if (policy->functioncode == FC_READ_FILE_RECORD)
+    {
+        cJSON_AddNumberToObject(request, "fileNumber", policy->file_number);
+    }
+    else if (policy->functioncode == FC_READ_WRITE_REGISTERS)
+    {
+        cJSON_AddNumberToObject(request, "writeAddr", policy->write_addr);
+        cJSON_AddStringToObject(request, "writeData", policy->write_data);
+    }
     
     cJSON_AddStringToObject(modbus, "response", raw);
+
+    // device identification read at connect, if the slave supports it
+    const DeviceIdentification* devid = get_device_identification(policy->slaveid);
+    if (devid != NULL)
+    {
+        cJSON* deviceId = NULL;
+        cJSON_AddItemToObject(modbus, "deviceId", deviceId = cJSON_CreateObject());
+        cJSON_AddStringToObject(deviceId, "vendorName", devid->vendor_name);
+        cJSON_AddStringToObject(deviceId, "productCode", devid->product_code);
+        cJSON_AddStringToObject(deviceId, "revision", devid->revision);
+    }
     
     time_t now = time(NULL);
     char timestamp[40];
@@ -563,15 +933,30 @@ void execute_policy(SlavePolicy* policy)
     {
         char msgcontent[BUFF_LEN];
         pack_pub_msg(policy, payload, msgcontent);
-        mqtt_send(g_mqttsender, 
-                    policy->pubChannel.endpoint, 
-                    policy->pubChannel.user,
-                    policy->pubChannel.password,
-                    policy->pubChannel.topic,
-                    msgcontent,
-                    strlen(msgcontent),
-                    0,
-                    PEM_FILE); 
+        if (g_spool != NULL)
+        {
+            SpoolRecord record;
+            record.endpoint = policy->pubChannel.endpoint;
+            record.user = policy->pubChannel.user;
+            record.password = policy->pubChannel.password;
+            record.topic = policy->pubChannel.topic;
+            record.payload = msgcontent;
+            record.payloadlen = (int) strlen(msgcontent);
+            record.retain = 0;
+            spool_append(g_spool, &record);
+        }
+        else
+        {
+            mqtt_send(g_mqttsender, 
+                        policy->pubChannel.endpoint, 
+                        policy->pubChannel.user,
+                        policy->pubChannel.password,
+                        policy->pubChannel.topic,
+                        msgcontent,
+                        strlen(msgcontent),
+                        0,
+                        PEM_FILE); 
+        }
     }
     if (rc != -1) {
         on_modbus_read();
@@ -590,11 +975,6 @@ static thread_return_type worker_func(void* arg)
             load_slave_policy_from_cache(&g_slave_header);
         }
         
-        if (g_gateway_connected == 0)
-        {
-            start_listen_command();
-        }
-
         // iterate from the beginning of the policy list
         // and pick those whose nextRun is due, and execute them, 
         // calculate the new next run, and insert into the list
@@ -612,10 +992,11 @@ static thread_return_type worker_func(void* arg)
             }
         }
         rc = Thread_unlock_mutex(g_policy_lock);    
+        spool_tick(g_spool);
 
-        sleep(1);
+        wait_next_run();
     }
-    log_debug("exiting worker thread...\r\n");
+    LOG_DEBUG("exiting worker thread...");
     g_worker_is_running = 0;
 }
 
@@ -631,8 +1012,247 @@ void init_static_data()
     g_policy_lock = Thread_create_mutex();
     g_policy_update_lock = Thread_create_mutex();
     g_gateway_mutex = Thread_create_mutex();
+    init_wakeup(&g_worker_wakeup);
+    init_wakeup(&g_command_wakeup);
     
     init_modbus_ctxs();
+    init_shadow();
+}
+
+#if !defined(WIN32) && !defined(WIN64)
+static void spawn_shard(int shard)
+{
+    // prepared before fork, the child only execs
+    char arg[16];
+    snprintf(arg, sizeof(arg), "%d", shard);
+    char* args[4];
+    args[0] = g_self_path;
+    args[1] = "--shard";
+    args[2] = arg;
+    args[3] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // the shard goes down with the supervisor
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        execv(g_self_path, args);
+        _exit(127);
+    }
+    if (pid < 0)
+    {
+        LOG_ERROR("failed to start shard %d", shard);
+        g_shard_respawn[shard] = time(NULL) + SHARD_RESPAWN_DELAY;
+        return;
+    }
+    Thread_lock_mutex(g_shard_lock);
+    g_shard_pids[shard] = pid;
+    Thread_unlock_mutex(g_shard_lock);
+    LOG_INFO("started shard %d, pid=%d", shard, (int) pid);
+}
+
+// restart the shards which died, the segment a dead shard was writing is
+// sealed, so what it spooled is still uploaded
+static void reap_shards()
+{
+    time_t now = time(NULL);
+    int i = 0;
+    for (i = 0; i < g_shards; i++)
+    {
+        int status = 0;
+        Thread_lock_mutex(g_shard_lock);
+        int exited = g_shard_pids[i] > 0
+            && waitpid(g_shard_pids[i], &status, WNOHANG) == g_shard_pids[i];
+        if (exited)
+        {
+            g_shard_pids[i] = 0;
+        }
+        Thread_unlock_mutex(g_shard_lock);
+        if (exited)
+        {
+            LOG_WARN("shard %d exited, status=%d, restarting it in %d seconds", i, status,
+                    SHARD_RESPAWN_DELAY);
+            seal_spool_orphan(SPOOL_DIR, i);
+            g_shard_respawn[i] = now + SHARD_RESPAWN_DELAY;
+        }
+        if (g_shard_pids[i] == 0 && now >= g_shard_respawn[i])
+        {
+            spawn_shard(i);
+        }
+    }
+}
+
+// return -1 if the sender can't take the record now, it stays in the spool
+static int upload_spool_record(const SpoolRecord* record)
+{
+    char rc = mqtt_send(g_mqttsender, record->endpoint, record->user, record->password,
+            record->topic, record->payload, record->payloadlen, record->retain, PEM_FILE);
+    if (rc == MQTT_SEND_REFUSED)
+    {
+        // the broker refused us for good, nothing to keep it for
+        return 0;
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+static unsigned long spool_taken()
+{
+    return mqtt_queued(g_mqttsender);
+}
+
+// a segment is removed once the sender acked or cached its messages
+static unsigned long spool_settled()
+{
+    return mqtt_settled(g_mqttsender);
+}
+
+// keeps the shards running, and uploads what they spool
+static thread_return_type shard_supervisor_func(void* arg)
+{
+    g_shard_supervisor_is_running = 1;
+    while (g_stop_worker != 1)
+    {
+        reap_shards();
+        if (drain_spool(g_spool_drain) == 0)
+        {
+            usleep(SHARD_SUPERVISOR_NAP * 1000);
+        }
+    }
+    g_shard_supervisor_is_running = 0;
+    return 0;
+}
+
+static void start_shards()
+{
+    g_shard_lock = Thread_create_mutex();
+    ssize_t len = readlink("/proc/self/exe", g_self_path, MAX_LEN - 1);
+    g_self_path[len > 0 ? len : 0] = '\0';
+    int i = 0;
+    for (i = 0; i < g_shards; i++)
+    {
+        // what the shards of the previous run left open
+        seal_spool_orphan(SPOOL_DIR, i);
+        g_shard_pids[i] = 0;
+        g_shard_respawn[i] = 0;
+    }
+    SpoolSink sink;
+    sink.take = upload_spool_record;
+    sink.taken = spool_taken;
+    sink.settled = spool_settled;
+    g_spool_drain = open_spool_drain(SPOOL_DIR, &sink);
+    Thread_start(shard_supervisor_func, (void*) NULL);
+}
+
+static void stop_shards()
+{
+    int count = 0;
+    while (g_shard_supervisor_is_running == 1 && ++count < 10) {
+        sleep(1);
+    }
+    int i = 0;
+    Thread_lock_mutex(g_shard_lock);
+    for (i = 0; i < g_shards; i++)
+    {
+        if (g_shard_pids[i] > 0)
+        {
+            kill(g_shard_pids[i], SIGTERM);
+        }
+    }
+    Thread_unlock_mutex(g_shard_lock);
+    // a shard stops within a few seconds, the modbus timeouts
+    for (i = 0; i < g_shards; i++)
+    {
+        count = 0;
+        Thread_lock_mutex(g_shard_lock);
+        while (g_shard_pids[i] > 0 && waitpid(g_shard_pids[i], NULL, WNOHANG) == 0 && ++count < 10)
+        {
+            Thread_unlock_mutex(g_shard_lock);
+            sleep(1);
+            Thread_lock_mutex(g_shard_lock);
+        }
+        if (g_shard_pids[i] > 0 && count >= 10)
+        {
+            kill(g_shard_pids[i], SIGKILL);
+            waitpid(g_shard_pids[i], NULL, 0);
+        }
+        g_shard_pids[i] = 0;
+        Thread_unlock_mutex(g_shard_lock);
+        seal_spool_orphan(SPOOL_DIR, i);
+    }
+    // hand the rest to the sender, it caches what it can't publish. what it
+    // hasn't settled in a while is left in the spool, and uploaded again
+    // after the restart
+    while (drain_spool(g_spool_drain) > 0)
+    {
+    }
+    count = 0;
+    while (spool_unsettled(g_spool_drain) > 0 && ++count < 10)
+    {
+        sleep(1);
+        drain_spool(g_spool_drain);
+    }
+    close_spool_drain(g_spool_drain);
+    g_spool_drain = NULL;
+}
+
+static void on_shard_signal(int sig)
+{
+    if (sig == SIGHUP)
+    {
+        g_policy_updated = 1;
+    }
+    else
+    {
+        g_stop_worker = 1;
+    }
+}
+#endif
+
+// the shard processes run this, instead of init_and_start, see g_shards
+int run_shard(int shard)
+{
+#if defined(WIN32) || defined(WIN64)
+    printf("shards are not supported on windows\r\n");
+    return 1;
+#else
+    init_static_data();
+    load_gateway_config(&g_gateway_conf);
+    start_logger(g_log_level, g_log_format);
+    if (shard < 0 || shard >= g_shards || (g_spool = open_spool(SPOOL_DIR, shard)) == NULL)
+    {
+        LOG_ERROR("failed to start shard %d of %d shards", shard, g_shards);
+        stop_logger();
+        return 1;
+    }
+    g_shard = shard;
+    g_shadow_server_port = 0;
+    init_history(HISTORY_DIR, shard, g_history_size / g_shards, g_history_days);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_shard_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    g_slave_header.next = NULL;
+    load_slave_policy_from_cache(&g_slave_header);
+    start_worker();
+    if (strlen(g_gateway_conf.backControlTopic) > 0)
+    {
+        start_command_supervisor();
+    }
+
+    while (g_stop_worker != 1)
+    {
+        sleep(1);
+    }
+    wakeup_worker();
+    wakeup_command_supervisor();
+    clean_and_exit();
+    return 0;
+#endif
 }
 
 void init_and_start()
@@ -655,15 +1275,51 @@ void init_and_start()
     {
         printf("failed to load gateway configuration from file %s\r\n", CONFIG_FILE);
     }
+    start_logger(g_log_level, g_log_format);
     
     g_mqttsender = new_mqtt_sender(DATA_CACHE, g_cache_size);         
+    set_mqtt_sender_lanes(g_mqttsender, g_live_share, g_backlog_rate);
+
+    if (g_shards > MAX_SHARDS)
+    {
+        LOG_WARN("at most %d shards are supported", MAX_SHARDS);
+        g_shards = MAX_SHARDS;
+    }
+#if defined(WIN32) || defined(WIN64)
+    if (g_shards > 1)
+    {
+        LOG_WARN("shards are not supported on windows, polling in one process");
+        g_shards = 0;
+    }
+#else
+    if (g_shards > 1)
+    {
+        // the shards poll, this process uploads, and handles the policies
+        if (g_shadow_server_port > 0)
+        {
+            LOG_WARN("the shadow server is not supported with shards");
+            g_shadow_server_port = 0;
+        }
+        start_shards();
+        start_command_supervisor();
+        return;
+    }
+#endif
+
+    init_history(HISTORY_DIR, 0, g_history_size, g_history_days);
 
     // 2 receive device(slave) polling config from cloud, or local cache
     g_slave_header.next = NULL;
     load_slave_policy_from_cache(&g_slave_header);
 
-    start_listen_command();
+    // polling starts right away, the command channel connects in background
     start_worker();
+    start_command_supervisor();
+
+    if (g_shadow_server_port > 0)
+    {
+        start_shadow_server(g_shadow_server_port);
+    }
 }
 
 void wait_user_input()
@@ -681,6 +1337,8 @@ void wait_user_input()
         }
     } while(ch!='Q' && ch != 'q'); 
     g_stop_worker = 1;
+    wakeup_worker();
+    wakeup_command_supervisor();
     printf("exiting...\n");
 }
 
@@ -691,7 +1349,67 @@ void clean_and_exit()
     while (g_worker_is_running == 1 && ++count < 10) {
         sleep(1);
     }
+    count = 0;
+    while (g_command_is_running == 1 && ++count < 10) {
+        sleep(1);
+    }
 
+    if (g_shadow_server_port > 0)
+    {
+        stop_shadow_server();
+    }
+#if !defined(WIN32) && !defined(WIN64)
+    if (g_shards > 1 && g_shard < 0)
+    {
+        stop_shards();
+    }
+#endif
+    close_spool(g_spool);
+    g_spool = NULL;
     close_mqtt_sender(g_mqttsender);
+    if (g_command_client != NULL)
+    {
+        MQTTAsync_destroy(&g_command_client);
+    }
     cleanup_data();
+    cleanup_shadow();
+    cleanup_history();
+    stop_logger();
+}
+
+static void print_history_point(const HistoryPoint* point)
+{
+    if (point->count == 1)
+    {
+        printf("{\"time\":%lld,\"value\":%g}\n", (long long) point->time, point->avg);
+    }
+    else
+    {
+        printf("{\"time\":%lld,\"min\":%g,\"max\":%g,\"avg\":%g,\"count\":%d}\n",
+                (long long) point->time, point->min, point->max, point->avg, point->count);
+    }
+}
+
+int print_history(int argc, char* argv[])
+{
+    if (argc < 5)
+    {
+        printf("usage: --history <slaveid> <functioncode> <address> <from> <to> [step]\r\n");
+        return 1;
+    }
+    // from and to <= 0 are relative to now, e.g. -3600 0 for the last hour
+    time_t now = time(NULL);
+    time_t from = (time_t) atoll(argv[3]);
+    time_t to = (time_t) atoll(argv[4]);
+    from = from <= 0 ? now + from : from;
+    to = to <= 0 ? now + to : to;
+    int step = argc > 5 ? atoi(argv[5]) : 0;
+    int rc = query_history(HISTORY_DIR, atoi(argv[0]), atoi(argv[1]), atoi(argv[2]), from, to,
+            step, print_history_point);
+    if (rc < 0)
+    {
+        printf("invalid history query\r\n");
+        return 1;
+    }
+    return 0;
 }
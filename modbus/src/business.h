@@ -26,4 +26,12 @@ void wait_user_input();
 
 void clean_and_exit();
 
+// run as shard number shard of a sharded gateway, return the exit code
+int run_shard(int shard);
+
+// print the history of a register or coil as json lines, the arguments are
+// slaveid, functioncode, address, from, to, and optionally step in seconds.
+// return the exit code
+int print_history(int argc, char* argv[]);
+
 #endif
@@ -0,0 +1,37 @@
+// cachedict.c
+
+#include "cachedict.h"
+
+// version 1, the strings every cached message looks alike
+static const char CACHE_DICT_V1[] =
+	".mqtt.iot.gz.baidubce.com:1884ssl://tcp://root_cert.pem"
+	"{\"bdModbusVer\":1,\"gatewayid\":\"\",\"trantable\":\"\",\"modbus\":{\"request\":"
+	"{\"functioncode\":3,\"slaveid\":1,\"startAddr\":0,\"length\":\"fileNumber\":"
+	"\"writeAddr\":\"writeData\":\"},\"response\":\"0000000000000000\",\"deviceId\":"
+	"{\"vendorName\":\"\",\"productCode\":\"\",\"revision\":\"\"}},\"timestamp\":\"15";
+
+typedef struct CacheDict_t
+{
+	const char* dict;
+	size_t len;
+} CacheDict;
+
+// indexed by the version, never edit or remove an entry
+static const CacheDict g_dicts[] =
+{
+	{NULL, 0},	// no version 0 was ever written
+	{CACHE_DICT_V1, sizeof(CACHE_DICT_V1) - 1},
+};
+
+const char* cacheDict(int version, size_t* len)
+{
+	if (version <= 0 || version >= (int) (sizeof(g_dicts) / sizeof(g_dicts[0])))
+	{
+		return NULL;
+	}
+	if (len != NULL)
+	{
+		*len = g_dicts[version].len;
+	}
+	return g_dicts[version].dict;
+}
@@ -0,0 +1,20 @@
+/*
+ Preset dictionaries of the compressed records in the mqtt cache file.
+ Every record carries the version of the dictionary it was compressed
+ with, and the records outlive the gateway binary across upgrades, so a
+ published dictionary is never edited: a new one is appended under the
+ next version instead, and the old ones stay to read the old records.
+*/
+
+#ifndef _CACHE_DICT_H_
+#define _CACHE_DICT_H_
+#include <stddef.h>
+
+// the version new records are compressed with
+#define CACHE_DICT_VERSION 1
+
+// the dictionary of the version and its length
+// return NULL if the version is unknown, e.g. written by a newer gateway
+const char* cacheDict(int version, size_t* len);
+
+#endif
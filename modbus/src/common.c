@@ -18,9 +18,9 @@
  */
 
 #include "common.h"
+#include "logger.h"
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
 #include <stdlib.h>
 
 // common function section
@@ -76,6 +76,7 @@ int g_debug = 0;
 void toggle_debug()
 {
     g_debug = g_debug == 0 ? 1 : 0;
+    set_log_debug(g_debug);
     if (g_debug == 1)
     {
         printf("debug info is on\n");
@@ -86,15 +87,6 @@ void toggle_debug()
     }
 }
 
-void log_debug(char* msg)
-{
-    if (g_debug == 1)
-    {
-        time_t now = time(NULL);
-        printf("%s %s\n", ctime(&now), msg);
-    } 
-}
-
 void mystrncpy(char* desc, const char* src, int len)
 {
     snprintf(desc, len, "%s", src);
@@ -179,13 +171,13 @@ void channel_to_json(Channel* ch, int maxlen, char* dest)
 };
 
 // convert "00ff1234" to 0x00ff, 0x1234, ...
-// return the number of data converted
-int char2uint16(uint16_t* dest, const char* src)
+// return the number of data converted, at most max
+int char2uint16(uint16_t* dest, int max, const char* src)
 {
     int len = strlen(src);
     int i = 0 ;
     int cnt = 0;
-    for (i = 0; i < len / 4; i++)
+    for (i = 0; i < len / 4 && cnt < max; i++)
     {
         uint16_t data = 0;
         data |= char2dec(src[4 * i]) << 12;
@@ -199,13 +191,13 @@ int char2uint16(uint16_t* dest, const char* src)
 }
 
 // convert "00ff" to 0x00, 0xff, ....
-// return the number of data converted
-int char2uint8(uint8_t* dest, const char* src)
+// return the number of data converted, at most max
+int char2uint8(uint8_t* dest, int max, const char* src)
 {
     int len = strlen(src);
     int i = 0 ;
     int cnt = 0;
-    for (i = 0; i < len / 2; i++)
+    for (i = 0; i < len / 2 && cnt < max; i++)
     {
         uint8_t data = 0;
         data |= char2dec(src[2 * i]) << 4;
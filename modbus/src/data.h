@@ -21,7 +21,7 @@
 #define INF_BCE_IOT_MODBUS_SDK_C_DATA_H
 
 #include <time.h>
-#include <MQTTClient.h>
+#include <MQTTAsync.h>
 
 // constants
 enum {
@@ -32,7 +32,18 @@ enum {
     BUFF_LEN = 2018,
     ADDR_LEN = 64,
     MAX_MODBUS_DATA_TO_WRITE = 123,
-    WIN_COM_COUNT = 255
+    WIN_COM_COUNT = 255,
+    DEVICE_ID_LEN = 64,
+    MAX_FILE_RECORD_LEN = 124    // registers of one file record that fit in a response PDU
+};
+
+// modbus function codes that libmodbus has no dedicated api for
+enum {
+    FC_READ_FILE_RECORD = 0x14,
+    FC_WRITE_FILE_RECORD = 0x15,
+    FC_READ_WRITE_REGISTERS = 0x17,
+    FC_ENCAPSULATED_INTERFACE = 0x2B,
+    MEI_READ_DEVICE_ID = 0x0E
 };
 
 // types
@@ -40,7 +51,8 @@ typedef enum
 {
     TCP = 0,
     RTU,
-    ASCII
+    ASCII,
+    RTU_OVER_TCP    // rtu frames over a tcp connection, e.g. behind a serial-to-ethernet converter
 } ModbusMode;
 
 typedef struct
@@ -79,6 +91,18 @@ typedef struct SlavePolicy_t
     int databits;
     char parity;
     int stopbits;
+    int file_number;                // FC20, the file to read records from, start_addr is the record number
+    int write_addr;                 // FC23, the first register to write before reading
+    char write_data[MAX_LEN];       // FC23, data to write, e.g "00ff1234"
 } SlavePolicy;
 
+// result of FC43/14 read device identification, cached per slave
+typedef struct
+{
+    int status;    // 0: not queried yet, 1: loaded, -1: not supported by the slave
+    char vendor_name[DEVICE_ID_LEN];
+    char product_code[DEVICE_ID_LEN];
+    char revision[DEVICE_ID_LEN];
+} DeviceIdentification;
+
 #endif 
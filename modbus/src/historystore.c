@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "historystore.h"
+#include "data.h"
+#include "common.h"
+#include "thread.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <modbus/modbus.h>
+#if defined(_WIN32) || defined(WIN64)
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+#define HISTORY_CHUNK_SECONDS 3600    // a chunk file holds an hour of samples
+#define HISTORY_BLOCK_SAMPLES 4096    // samples buffered before they're written
+#define HISTORY_FLUSH_INTERVAL 10    // in seconds, the longest a sample is buffered
+#define HISTORY_CHUNKS_STEP 256    // chunk files the listing grows by
+#define HISTORY_MAX_POINTS (4 * 1024 * 1024)    // samples a query collects at most
+
+static const char BLOCK_MAGIC[4] = {'M', 'B', 'T', 'S'};
+
+// a block is followed by its columns: count series keys, count time offsets
+// from base_time, and count values
+typedef struct
+{
+    char magic[4];
+    uint32_t count;
+    int64_t base_time;
+    uint32_t checksum;    // of the columns
+    uint32_t reserved;
+} BlockHeader;
+
+typedef struct
+{
+    long long bucket;
+    int writer;
+    long size;
+} ChunkFile;
+
+typedef struct
+{
+    time_t time;
+    uint16_t value;
+} Sample;
+
+static int g_history_enabled = 0;
+static mutex_type g_history_lock;
+static char g_history_dir[MAX_LEN];
+static int g_history_writer = 0;
+static long g_history_max_size = 0;
+static int g_history_max_days = 0;
+
+// the block being filled
+static uint32_t g_block_series[HISTORY_BLOCK_SAMPLES];
+static uint16_t g_block_offsets[HISTORY_BLOCK_SAMPLES];
+static uint16_t g_block_values[HISTORY_BLOCK_SAMPLES];
+static int g_block_count = 0;
+static time_t g_block_base = 0;
+
+static uint32_t fnv1a(uint32_t hash, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    size_t i = 0;
+    for (i = 0; i < len; i++)
+    {
+        hash = (hash ^ p[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static long long bucket_of(time_t t)
+{
+    return (long long) (t - t % HISTORY_CHUNK_SECONDS);
+}
+
+// FC23 reads the holding registers, like FC3
+static int series_key(int slaveid, int function, int addr, uint32_t* key)
+{
+    if (function == FC_READ_WRITE_REGISTERS)
+    {
+        function = MODBUS_FC_READ_HOLDING_REGISTERS;
+    }
+    if (slaveid < 0 || slaveid >= MODBUS_DATA_COUNT || function < MODBUS_FC_READ_COILS
+            || function > MODBUS_FC_READ_INPUT_REGISTERS || addr < 0 || addr > 0xFFFF)
+    {
+        return -1;
+    }
+    *key = ((uint32_t) slaveid << 24) | ((uint32_t) function << 16) | (uint32_t) addr;
+    return 0;
+}
+
+// all the chunk files of the writer, or of all the writers if writer is -1,
+// sorted by bucket. the caller should free *chunks.
+// return the number of files, -1 if it runs out of memory, as a partial
+// list isn't the oldest chunks
+static int list_chunks(const char* dir, int writer, ChunkFile** chunks)
+{
+    *chunks = NULL;
+    DIR* d = opendir(dir);
+    if (d == NULL)
+    {
+        return 0;
+    }
+    ChunkFile* list = NULL;
+    int num = 0;
+    int cap = 0;
+    struct dirent* entry = NULL;
+    while ((entry = readdir(d)) != NULL)
+    {
+        long long bucket = 0;
+        int chunk_writer = 0;
+        if (sscanf(entry->d_name, "%lld-%d.chk", &bucket, &chunk_writer) != 2
+                || (writer != -1 && chunk_writer != writer))
+        {
+            continue;
+        }
+        char path[MAX_LEN];
+        snprintf(path, MAX_LEN, "%s/%s", dir, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0)
+        {
+            continue;
+        }
+        if (num == cap)
+        {
+            ChunkFile* bigger = (ChunkFile*) realloc(list,
+                    (cap + HISTORY_CHUNKS_STEP) * sizeof(ChunkFile));
+            if (bigger == NULL)
+            {
+                free(list);
+                closedir(d);
+                return -1;
+            }
+            list = bigger;
+            cap += HISTORY_CHUNKS_STEP;
+        }
+        list[num].bucket = bucket;
+        list[num].writer = chunk_writer;
+        list[num].size = (long) st.st_size;
+        num++;
+    }
+    closedir(d);
+
+    // insertion sort, the names come mostly in order
+    int i = 0;
+    for (i = 1; i < num; i++)
+    {
+        ChunkFile chunk = list[i];
+        int j = i - 1;
+        while (j >= 0 && list[j].bucket > chunk.bucket)
+        {
+            list[j + 1] = list[j];
+            j--;
+        }
+        list[j + 1] = chunk;
+    }
+    *chunks = list;
+    return num;
+}
+
+static void chunk_path(char* path, const char* dir, long long bucket, int writer)
+{
+    snprintf(path, MAX_LEN, "%s/%010lld-%02d.chk", dir, bucket, writer);
+}
+
+// remove the oldest chunks of the writer, while it's over the size or age
+static void enforce_retention()
+{
+    ChunkFile* chunks = NULL;
+    int num = list_chunks(g_history_dir, g_history_writer, &chunks);
+    if (num <= 0)
+    {
+        return;
+    }
+    long total = 0;
+    int i = 0;
+    for (i = 0; i < num; i++)
+    {
+        total += chunks[i].size;
+    }
+    long long oldest = bucket_of(time(NULL) - (time_t) g_history_max_days * 86400);
+    // the newest chunk is being written, it's kept
+    for (i = 0; i < num - 1; i++)
+    {
+        if (total <= g_history_max_size && chunks[i].bucket >= oldest)
+        {
+            break;
+        }
+        char path[MAX_LEN];
+        chunk_path(path, g_history_dir, chunks[i].bucket, chunks[i].writer);
+        remove(path);
+        total -= chunks[i].size;
+    }
+    free(chunks);
+}
+
+// caller should hold g_history_lock
+static void flush_block()
+{
+    if (g_block_count == 0)
+    {
+        return;
+    }
+    BlockHeader head;
+    memcpy(head.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC));
+    head.count = (uint32_t) g_block_count;
+    head.base_time = (int64_t) g_block_base;
+    head.checksum = fnv1a(2166136261U, g_block_series, g_block_count * sizeof(uint32_t));
+    head.checksum = fnv1a(head.checksum, g_block_offsets, g_block_count * sizeof(uint16_t));
+    head.checksum = fnv1a(head.checksum, g_block_values, g_block_count * sizeof(uint16_t));
+    head.reserved = 0;
+
+    char path[MAX_LEN];
+    chunk_path(path, g_history_dir, bucket_of(g_block_base), g_history_writer);
+    FILE* fp = fopen(path, "ab");
+    if (fp == NULL)
+    {
+        LOG_ERROR("failed to open history chunk %s", path);
+    }
+    else
+    {
+        int ok = fwrite(&head, sizeof(head), 1, fp) == 1
+                && fwrite(g_block_series, sizeof(uint32_t), g_block_count, fp) == (size_t) g_block_count
+                && fwrite(g_block_offsets, sizeof(uint16_t), g_block_count, fp) == (size_t) g_block_count
+                && fwrite(g_block_values, sizeof(uint16_t), g_block_count, fp) == (size_t) g_block_count;
+        if (fclose(fp) != 0 || !ok)
+        {
+            LOG_ERROR("failed to write history chunk %s", path);
+        }
+    }
+    g_block_count = 0;
+    enforce_retention();
+}
+
+// cut the block a killed writer left half written off the chunk, so the
+// blocks appended after it can be read
+static void repair_chunk(const char* path)
+{
+    char* content = NULL;
+    long size = read_file_as_string(path, &content);
+    if (size <= 0)
+    {
+        return;
+    }
+    long off = 0;
+    while (off + (long) sizeof(BlockHeader) <= size)
+    {
+        BlockHeader head;
+        memcpy(&head, content + off, sizeof(head));
+        long columns = (long) head.count * (sizeof(uint32_t) + 2 * sizeof(uint16_t));
+        if (memcmp(head.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) != 0 || head.count == 0
+                || head.count > HISTORY_BLOCK_SAMPLES || size - off - (long) sizeof(head) < columns)
+        {
+            break;
+        }
+        off += (long) sizeof(head) + columns;
+    }
+    free(content);
+    if (off < size)
+    {
+        LOG_WARN("truncating the half written block of history chunk %s", path);
+#if !defined(_WIN32) && !defined(WIN64)
+        truncate(path, off);
+#endif
+    }
+}
+
+void init_history(const char* dir, int writer, long max_size, int max_days)
+{
+    if (dir == NULL || max_size <= 0)
+    {
+        return;
+    }
+#if defined(_WIN32) || defined(WIN64)
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+    mystrncpy(g_history_dir, dir, MAX_LEN);
+    g_history_writer = writer;
+    g_history_max_size = max_size;
+    g_history_max_days = max_days > 0 ? max_days : 1;
+    g_block_count = 0;
+
+    ChunkFile* chunks = NULL;
+    int num = list_chunks(dir, writer, &chunks);
+    if (num > 0)
+    {
+        char path[MAX_LEN];
+        chunk_path(path, dir, chunks[num - 1].bucket, writer);
+        repair_chunk(path);
+    }
+    free(chunks);
+    g_history_lock = Thread_create_mutex();
+    g_history_enabled = 1;
+}
+
+void cleanup_history()
+{
+    if (!g_history_enabled)
+    {
+        return;
+    }
+    Thread_lock_mutex(g_history_lock);
+    flush_block();
+    g_history_enabled = 0;
+    Thread_unlock_mutex(g_history_lock);
+}
+
+// store nb values of a slave from addr, sampled at now
+static void append_samples(int slaveid, int function, int addr, int nb, const uint8_t* bits,
+        const uint16_t* registers)
+{
+    uint32_t key = 0;
+    if (!g_history_enabled || nb <= 0 || series_key(slaveid, function, addr, &key) != 0)
+    {
+        return;
+    }
+    time_t now = time(NULL);
+    Thread_lock_mutex(g_history_lock);
+    // a block holds the samples of one chunk, in the order of time
+    if (g_block_count > 0 && (bucket_of(now) != bucket_of(g_block_base) || now < g_block_base))
+    {
+        flush_block();
+    }
+    int i = 0;
+    for (i = 0; i < nb && addr + i <= 0xFFFF; i++)
+    {
+        if (g_block_count == 0)
+        {
+            g_block_base = now;
+        }
+        g_block_series[g_block_count] = key + (uint32_t) i;
+        g_block_offsets[g_block_count] = (uint16_t) (now - g_block_base);
+        g_block_values[g_block_count] = bits != NULL ? bits[i] : registers[i];
+        if (++g_block_count == HISTORY_BLOCK_SAMPLES)
+        {
+            flush_block();
+        }
+    }
+    if (g_block_count > 0 && now - g_block_base >= HISTORY_FLUSH_INTERVAL)
+    {
+        flush_block();
+    }
+    Thread_unlock_mutex(g_history_lock);
+}
+
+void history_append_bits(int slaveid, int function, int addr, int nb, const uint8_t* src)
+{
+    if (src != NULL)
+    {
+        append_samples(slaveid, function, addr, nb, src, NULL);
+    }
+}
+
+void history_append_registers(int slaveid, int function, int addr, int nb, const uint16_t* src)
+{
+    if (src != NULL)
+    {
+        append_samples(slaveid, function, addr, nb, NULL, src);
+    }
+}
+
+typedef struct
+{
+    Sample* samples;
+    int num;
+    int capacity;
+} SampleList;
+
+static int add_sample(SampleList* list, time_t t, uint16_t value)
+{
+    if (list->num == list->capacity)
+    {
+        if (list->capacity >= HISTORY_MAX_POINTS)
+        {
+            return -1;
+        }
+        int capacity = list->capacity > 0 ? list->capacity * 2 : 4096;
+        Sample* samples = (Sample*) realloc(list->samples, capacity * sizeof(Sample));
+        if (samples == NULL)
+        {
+            return -1;
+        }
+        list->samples = samples;
+        list->capacity = capacity;
+    }
+    list->samples[list->num].time = t;
+    list->samples[list->num].value = value;
+    list->num++;
+    return 0;
+}
+
+// collect the samples of key within [from, to] out of a chunk file
+static void scan_chunk(const char* path, uint32_t key, time_t from, time_t to, SampleList* list)
+{
+    char* content = NULL;
+    long size = read_file_as_string(path, &content);
+    if (size <= 0)
+    {
+        return;
+    }
+    long off = 0;
+    while (off + (long) sizeof(BlockHeader) <= size)
+    {
+        BlockHeader head;
+        memcpy(&head, content + off, sizeof(head));
+        long columns = (long) head.count * (sizeof(uint32_t) + 2 * sizeof(uint16_t));
+        if (memcmp(head.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) != 0 || head.count == 0
+                || head.count > HISTORY_BLOCK_SAMPLES || size - off - (long) sizeof(head) < columns)
+        {
+            // a writer was killed in the middle of a block
+            LOG_WARN("truncated block in history chunk %s, skipping the rest", path);
+            break;
+        }
+        const char* series = content + off + sizeof(head);
+        const char* offsets = series + head.count * sizeof(uint32_t);
+        const char* values = offsets + head.count * sizeof(uint16_t);
+        off += (long) sizeof(head) + columns;
+        if (fnv1a(2166136261U, series, columns) != head.checksum)
+        {
+            LOG_WARN("corrupted block in history chunk %s", path);
+            continue;
+        }
+
+        uint32_t i = 0;
+        for (i = 0; i < head.count; i++)
+        {
+            uint32_t k = 0;
+            memcpy(&k, series + i * sizeof(uint32_t), sizeof(k));
+            if (k != key)
+            {
+                continue;
+            }
+            uint16_t offset = 0;
+            memcpy(&offset, offsets + i * sizeof(uint16_t), sizeof(offset));
+            time_t t = (time_t) head.base_time + offset;
+            if (t < from || t > to)
+            {
+                continue;
+            }
+            uint16_t value = 0;
+            memcpy(&value, values + i * sizeof(uint16_t), sizeof(value));
+            if (add_sample(list, t, value) != 0)
+            {
+                LOG_WARN("too many samples in the query, at most %d", HISTORY_MAX_POINTS);
+                free(content);
+                return;
+            }
+        }
+    }
+    free(content);
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+    const Sample* x = (const Sample*) a;
+    const Sample* y = (const Sample*) b;
+    return x->time < y->time ? -1 : (x->time > y->time ? 1 : 0);
+}
+
+int query_history(const char* dir, int slaveid, int function, int addr, time_t from, time_t to,
+        int step, void (*handler)(const HistoryPoint* point))
+{
+    uint32_t key = 0;
+    if (dir == NULL || handler == NULL || from > to || step < 0
+            || series_key(slaveid, function, addr, &key) != 0)
+    {
+        return -1;
+    }
+    // what's still in the block of this process
+    if (g_history_enabled)
+    {
+        Thread_lock_mutex(g_history_lock);
+        flush_block();
+        Thread_unlock_mutex(g_history_lock);
+    }
+
+    ChunkFile* chunks = NULL;
+    int num_chunks = list_chunks(dir, -1, &chunks);
+    if (num_chunks < 0)
+    {
+        return -1;
+    }
+    SampleList list;
+    memset(&list, 0, sizeof(list));
+    int i = 0;
+    for (i = 0; i < num_chunks; i++)
+    {
+        if (chunks[i].bucket + HISTORY_CHUNK_SECONDS > (long long) from
+                && chunks[i].bucket <= (long long) to)
+        {
+            char path[MAX_LEN];
+            chunk_path(path, dir, chunks[i].bucket, chunks[i].writer);
+            scan_chunk(path, key, from, to, &list);
+        }
+    }
+    free(chunks);
+    // the writers of a chunk interleave
+    Sample* samples = list.samples;
+    int num = list.num;
+    if (num > 0)
+    {
+        qsort(samples, num, sizeof(Sample), compare_samples);
+    }
+
+    int points = 0;
+    HistoryPoint point;
+    memset(&point, 0, sizeof(point));
+    for (i = 0; i < num; i++)
+    {
+        double value = samples[i].value;
+        time_t t = step > 0 ? samples[i].time - (samples[i].time - from) % step : samples[i].time;
+        if (point.count > 0 && (step == 0 || t != point.time))
+        {
+            point.avg /= point.count;
+            handler(&point);
+            points++;
+            point.count = 0;
+        }
+        if (point.count == 0)
+        {
+            point.time = t;
+            point.min = value;
+            point.max = value;
+            point.avg = 0;
+        }
+        point.min = value < point.min ? value : point.min;
+        point.max = value > point.max ? value : point.max;
+        point.avg += value;
+        point.count++;
+    }
+    if (point.count > 0)
+    {
+        point.avg /= point.count;
+        handler(&point);
+        points++;
+    }
+    free(samples);
+    return points;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INF_BCE_IOT_MODBUS_SDK_C_HISTORYSTORE_H
+#define INF_BCE_IOT_MODBUS_SDK_C_HISTORYSTORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+// the history store keeps the polled values of every (slave id, function
+// code, address) on the local disk, so they can be queried without the
+// cloud. samples are buffered into blocks of three columns, series, time
+// and value, and the blocks are appended to a chunk file per hour. the
+// oldest chunks are removed when the store is over its size, or its age.
+// several writers, e.g. the shards, may share a directory, each writes its
+// own chunk files
+
+typedef struct
+{
+    time_t time;    // the first second of the step, or of the sample
+    double min;
+    double max;
+    double avg;
+    int count;    // samples in the step, 1 for raw samples
+} HistoryPoint;
+
+// start storing into dir as writer, up to max_size bytes and max_days days
+// of the writer's chunks. the store is disabled when max_size is 0
+void init_history(const char* dir, int writer, long max_size, int max_days);
+
+// write out the buffered samples, and disable the store
+void cleanup_history();
+
+// store nb bits (one per byte, as modbus_read_bits returns) read with FC1/FC2
+void history_append_bits(int slaveid, int function, int addr, int nb, const uint8_t* src);
+
+// store nb registers read with FC3/FC4 (FC23 counts as FC3)
+void history_append_registers(int slaveid, int function, int addr, int nb, const uint16_t* src);
+
+// pass the samples of a register, or coil, within [from, to] to handler in
+// the order of time. with step > 0, the samples are downsampled to one point
+// per step seconds. return the number of points, or -1 on error
+int query_history(const char* dir, int slaveid, int function, int addr, time_t from, time_t to,
+        int step, void (*handler)(const HistoryPoint* point));
+
+#endif
@@ -0,0 +1,246 @@
+#include "lzcompress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static size_t hash4(const uint8_t* p)
+{
+	uint32_t v = 0;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// write a length of a token nibble, 15 means more bytes follow
+static int putLength(uint8_t** op, const uint8_t* end, size_t len)
+{
+	while (len >= 255)
+	{
+		if (*op >= end)
+		{
+			return -1;
+		}
+		*(*op)++ = 255;
+		len -= 255;
+	}
+	if (*op >= end)
+	{
+		return -1;
+	}
+	*(*op)++ = (uint8_t) len;
+	return 0;
+}
+
+static int getLength(const uint8_t** ip, const uint8_t* end, size_t* len)
+{
+	uint8_t b = 255;
+	while (b == 255)
+	{
+		if (*ip >= end)
+		{
+			return -1;
+		}
+		b = *(*ip)++;
+		*len += b;
+	}
+	return 0;
+}
+
+// one sequence: token, literals, and a match unless it's the last one
+static int putSequence(uint8_t** op, const uint8_t* end, const uint8_t* literals,
+		size_t litLen, size_t offset, size_t matchLen)
+{
+	if (*op >= end)
+	{
+		return -1;
+	}
+	uint8_t* token = (*op)++;
+	*token = (uint8_t) ((litLen >= 15 ? 15 : litLen) << 4);
+	if (litLen >= 15 && putLength(op, end, litLen - 15) == -1)
+	{
+		return -1;
+	}
+	if ((size_t) (end - *op) < litLen)
+	{
+		return -1;
+	}
+	memcpy(*op, literals, litLen);
+	*op += litLen;
+
+	if (matchLen == 0)
+	{
+		return 0;
+	}
+	if (end - *op < 2)
+	{
+		return -1;
+	}
+	*(*op)++ = offset & 0xFF;
+	*(*op)++ = offset >> 8;
+	matchLen -= MIN_MATCH;
+	*token |= matchLen >= 15 ? 15 : matchLen;
+	if (matchLen >= 15 && putLength(op, end, matchLen - 15) == -1)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+size_t lzCompressBound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+size_t lzCompress(const void* src, size_t len, const void* dict, size_t dictLen,
+		void* dst, size_t cap)
+{
+	if (src == NULL || dst == NULL)
+	{
+		return 0;
+	}
+	if (dict == NULL)
+	{
+		dictLen = 0;
+	}
+
+	// matches may refer to the dictionary, which logically precedes the input
+	size_t total = dictLen + len;
+	uint8_t* buf = (uint8_t*) malloc(total + 1);
+	int* table = (int*) malloc(sizeof(int) << HASH_BITS);
+	if (buf == NULL || table == NULL)
+	{
+		free(buf);
+		free(table);
+		return 0;
+	}
+	if (dictLen > 0)
+	{
+		memcpy(buf, dict, dictLen);
+	}
+	memcpy(buf + dictLen, src, len);
+	memset(table, 0xFF, sizeof(int) << HASH_BITS);
+
+	size_t pos = 0;
+	for (pos = 0; pos + MIN_MATCH <= dictLen; pos++)
+	{
+		table[hash4(buf + pos)] = (int) pos;
+	}
+
+	uint8_t* op = (uint8_t*) dst;
+	const uint8_t* end = op + cap;
+	size_t anchor = dictLen;
+	size_t ip = dictLen;
+	int failed = 0;
+	while (!failed && ip + MIN_MATCH <= total)
+	{
+		size_t h = hash4(buf + ip);
+		int ref = table[h];
+		table[h] = (int) ip;
+		if (ref < 0 || ip - ref > MAX_OFFSET || memcmp(buf + ref, buf + ip, MIN_MATCH) != 0)
+		{
+			ip++;
+			continue;
+		}
+
+		size_t matchLen = MIN_MATCH;
+		while (ip + matchLen < total && buf[ref + matchLen] == buf[ip + matchLen])
+		{
+			matchLen++;
+		}
+		failed = putSequence(&op, end, buf + anchor, ip - anchor, ip - ref, matchLen) == -1;
+		ip += matchLen;
+		anchor = ip;
+	}
+	if (!failed)
+	{
+		failed = putSequence(&op, end, buf + anchor, total - anchor, 0, 0) == -1;
+	}
+
+	free(buf);
+	free(table);
+	return failed ? 0 : (size_t) (op - (uint8_t*) dst);
+}
+
+int lzDecompress(const void* src, size_t len, const void* dict, size_t dictLen,
+		void* dst, size_t rawLen)
+{
+	if (src == NULL || dst == NULL)
+	{
+		return -1;
+	}
+	if (dict == NULL)
+	{
+		dictLen = 0;
+	}
+
+	uint8_t* buf = (uint8_t*) malloc(dictLen + rawLen + 1);
+	if (buf == NULL)
+	{
+		return -1;
+	}
+	if (dictLen > 0)
+	{
+		memcpy(buf, dict, dictLen);
+	}
+
+	const uint8_t* ip = (const uint8_t*) src;
+	const uint8_t* ipEnd = ip + len;
+	size_t op = dictLen;
+	size_t opEnd = dictLen + rawLen;
+	int rc = -1;
+	while (ip < ipEnd)
+	{
+		uint8_t token = *ip++;
+		size_t litLen = token >> 4;
+		if (litLen == 15 && getLength(&ip, ipEnd, &litLen) == -1)
+		{
+			break;
+		}
+		if ((size_t) (ipEnd - ip) < litLen || opEnd - op < litLen)
+		{
+			break;
+		}
+		memcpy(buf + op, ip, litLen);
+		ip += litLen;
+		op += litLen;
+		if (op == opEnd)
+		{
+			// the last sequence has no match
+			rc = ip == ipEnd ? 0 : -1;
+			break;
+		}
+
+		if (ipEnd - ip < 2)
+		{
+			break;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t matchLen = token & 0x0F;
+		if (matchLen == 15 && getLength(&ip, ipEnd, &matchLen) == -1)
+		{
+			break;
+		}
+		matchLen += MIN_MATCH;
+		if (offset == 0 || offset > op || opEnd - op < matchLen)
+		{
+			break;
+		}
+		// byte by byte, the match may overlap with itself
+		size_t i = 0;
+		for (i = 0; i < matchLen; i++, op++)
+		{
+			buf[op] = buf[op - offset];
+		}
+	}
+
+	if (rc == 0)
+	{
+		memcpy(dst, buf + dictLen, rawLen);
+	}
+	free(buf);
+	return rc;
+}
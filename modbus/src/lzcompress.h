@@ -0,0 +1,25 @@
+/*
+ A small LZ77 block compressor, in the spirit of the LZ4 block format.
+ A preset dictionary may be given, so that short records which share
+ the same shape (e.g. the json keys of every modbus message) compress
+ well even on their own. The same dictionary must be used to decompress.
+*/
+
+#ifndef _LZ_COMPRESS_H_
+#define _LZ_COMPRESS_H_
+#include <stddef.h>
+
+// the max compressed size of len bytes
+size_t lzCompressBound(size_t len);
+
+// compress len bytes of src into dst, which has cap bytes
+// return the compressed size, or 0 if dst is too small
+size_t lzCompress(const void* src, size_t len, const void* dict, size_t dictLen,
+		void* dst, size_t cap);
+
+// decompress exactly rawLen bytes into dst
+// return 0 on success, -1 if the data is corrupted
+int lzDecompress(const void* src, size_t len, const void* dict, size_t dictLen,
+		void* dst, size_t rawLen);
+
+#endif
@@ -19,8 +19,22 @@
 
 #include "business.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 int main(int argc, char* argv[])
 {
+    // the supervisor starts the shards with "--shard <n>"
+    if (argc == 3 && strcmp(argv[1], "--shard") == 0)
+    {
+        return run_shard(atoi(argv[2]));
+    }
+    // a local query of the history store, see README
+    if (argc >= 2 && strcmp(argv[1], "--history") == 0)
+    {
+        return print_history(argc - 2, argv + 2);
+    }
+
     init_and_start();
 
     wait_user_input();
@@ -0,0 +1,534 @@
+#include "modbus-raw-helper.h"
+#include "common.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(WIN64)
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+#define RAW_RESPONSE_TIMEOUT_MS 1000
+#define MBAP_LEN 6
+#define ASCII_MAX_FRAME_LEN 513
+
+int modbus_raw_pdu_length(const uint8_t* pdu, int have)
+{
+    if (have < 2)
+    {
+        return 0;
+    }
+
+    uint8_t function = pdu[0];
+    if (function & 0x80)
+    {
+        // exception: function code + exception code
+        return 2;
+    }
+
+    switch (function)
+    {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+        case MODBUS_FC_REPORT_SLAVE_ID:
+        case FC_READ_FILE_RECORD:
+        case FC_WRITE_FILE_RECORD:
+        case FC_READ_WRITE_REGISTERS:
+            // function code + byte count + data
+            return 2 + pdu[1];
+
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return 5;
+
+        case FC_ENCAPSULATED_INTERFACE:
+        {
+            // fc, mei type, read code, conformity, more follows, next id, number of objects,
+            // then the objects as (id, len, value)
+            if (have < 7)
+            {
+                return 0;
+            }
+            int pos = 7;
+            int i = 0;
+            for (i = 0; i < pdu[6]; i++)
+            {
+                if (pos + 2 > have)
+                {
+                    return 0;
+                }
+                pos += 2 + pdu[pos + 1];
+            }
+            return pos;
+        }
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+uint16_t modbus_raw_crc16(const uint8_t* buf, int len)
+{
+    uint16_t crc = 0xFFFF;
+    int i = 0;
+    int j = 0;
+    for (i = 0; i < len; i++)
+    {
+        crc ^= buf[i];
+        for (j = 0; j < 8; j++)
+        {
+            crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+uint8_t modbus_raw_lrc(const uint8_t* buf, int len)
+{
+    uint8_t lrc = 0;
+    int i = 0;
+    for (i = 0; i < len; i++)
+    {
+        lrc += buf[i];
+    }
+    return (uint8_t) -lrc;
+}
+
+static int is_socket_mode(ModbusMode mode)
+{
+    return mode == TCP || mode == RTU_OVER_TCP;
+}
+
+static int wait_and_read(int fd, ModbusMode mode, uint8_t* buf, int len)
+{
+    fd_set rset;
+    struct timeval tv;
+    FD_ZERO(&rset);
+    FD_SET(fd, &rset);
+    tv.tv_sec = RAW_RESPONSE_TIMEOUT_MS / 1000;
+    tv.tv_usec = (RAW_RESPONSE_TIMEOUT_MS % 1000) * 1000;
+
+    int rc = select(fd + 1, &rset, NULL, NULL, &tv);
+    if (rc <= 0)
+    {
+        return -1;    // timeout or error
+    }
+
+    if (is_socket_mode(mode))
+    {
+        rc = recv(fd, (char*) buf, len, 0);
+    }
+    else
+    {
+#if defined(_WIN32) || defined(WIN64)
+        return -1;
+#else
+        rc = read(fd, buf, len);
+#endif
+    }
+    return rc > 0 ? rc : -1;
+}
+
+static int write_all(int fd, ModbusMode mode, const uint8_t* buf, int len)
+{
+    int sent = 0;
+    while (sent < len)
+    {
+        int rc = -1;
+        if (is_socket_mode(mode))
+        {
+            rc = send(fd, (const char*) buf + sent, len - sent, 0);
+        }
+        else
+        {
+#if !defined(_WIN32) && !defined(WIN64)
+            rc = write(fd, buf + sent, len - sent);
+#endif
+        }
+        if (rc <= 0)
+        {
+            return -1;
+        }
+        sent += rc;
+    }
+    return sent;
+}
+
+// frame the request for the modes libmodbus doesn't know, and send it
+static int send_request(modbus_t* ctx, ModbusMode mode, const uint8_t* req, int req_len)
+{
+    if (mode == TCP || mode == RTU)
+    {
+        return modbus_send_raw_request(ctx, (uint8_t*) req, req_len);
+    }
+
+    // drop any stale bytes of a previous, timed out transaction
+    modbus_flush(ctx);
+
+    int fd = modbus_get_socket(ctx);
+    uint8_t adu[ASCII_MAX_FRAME_LEN + 2];
+    int len = 0;
+    if (mode == RTU_OVER_TCP)
+    {
+        if (req_len + 2 > MODBUS_RTU_MAX_ADU_LENGTH)
+        {
+            return -1;
+        }
+        memcpy(adu, req, req_len);
+        uint16_t crc = modbus_raw_crc16(req, req_len);
+        adu[req_len] = crc & 0xFF;
+        adu[req_len + 1] = crc >> 8;
+        len = req_len + 2;
+    }
+    else
+    {
+        // ':' + hex of (req + lrc) + "\r\n"
+        if (1 + (req_len + 1) * 2 + 2 > ASCII_MAX_FRAME_LEN)
+        {
+            return -1;
+        }
+        int i = 0;
+        adu[len++] = ':';
+        for (i = 0; i <= req_len; i++)
+        {
+            uint8_t b = i < req_len ? req[i] : modbus_raw_lrc(req, req_len);
+            char2hex((char) b, (char*) &adu[len], (char*) &adu[len + 1]);
+            len += 2;
+        }
+        adu[len++] = '\r';
+        adu[len++] = '\n';
+    }
+    return write_all(fd, mode, adu, len);
+}
+
+// receive an ascii frame, and decode it into slave id + pdu + lrc
+static int receive_ascii(int fd, uint8_t* frame, int max_frame)
+{
+    uint8_t c = 0;
+    char started = 0;
+    char hex[ASCII_MAX_FRAME_LEN];
+    int hexlen = 0;
+    while (1)
+    {
+        if (wait_and_read(fd, ASCII, &c, 1) == -1)
+        {
+            return -1;
+        }
+        if (c == ':')
+        {
+            started = 1;
+            hexlen = 0;
+            continue;
+        }
+        if (!started || c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            break;
+        }
+        if (hexlen >= (int) sizeof(hex) - 1)
+        {
+            return -1;
+        }
+        hex[hexlen++] = (char) c;
+    }
+
+    if (hexlen % 2 != 0 || hexlen / 2 > max_frame || hexlen < 6)
+    {
+        return -1;
+    }
+    hex[hexlen] = '\0';
+    int len = char2uint8(frame, max_frame, hex);
+    if (modbus_raw_lrc(frame, len) != 0)
+    {
+        // the lrc makes the sum of all the bytes zero
+        return -1;
+    }
+    return len;
+}
+
+int modbus_raw_transaction(modbus_t* ctx, ModbusMode mode, const uint8_t* req, int req_len,
+        uint8_t* pdu, int max_pdu)
+{
+    if (ctx == NULL || req == NULL || req_len < 2 || pdu == NULL)
+    {
+        return -1;
+    }
+
+#if defined(_WIN32) || defined(WIN64)
+    if (!is_socket_mode(mode))
+    {
+        LOG_ERROR("function code %d is not supported on windows serial ports", req[1]);
+        return -1;
+    }
+#endif
+
+    if (send_request(ctx, mode, req, req_len) == -1)
+    {
+        return -1;
+    }
+
+    int fd = modbus_get_socket(ctx);
+    uint8_t adu[ASCII_MAX_FRAME_LEN];
+    int header = mode == TCP ? MBAP_LEN + 1 : 1;
+    int checksum = mode == TCP ? 0 : 2;
+    int have = 0;
+    int pdu_len = 0;
+
+    if (mode == ASCII)
+    {
+        have = receive_ascii(fd, adu, sizeof(adu));
+        if (have == -1)
+        {
+            LOG_ERROR("failed to receive ascii response of function code %d, slaveid=%d",
+                    req[1], req[0]);
+            return -1;
+        }
+        checksum = 1;
+        pdu_len = have - header - checksum;
+    }
+    else
+    {
+        int expected = header + 2;
+        while (have < expected)
+        {
+            int rc = wait_and_read(fd, mode, adu + have, expected - have);
+            if (rc == -1)
+            {
+                LOG_ERROR("failed to receive response of function code %d, slaveid=%d",
+                        req[1], req[0]);
+                return -1;
+            }
+            have += rc;
+
+            if (mode == TCP && have >= MBAP_LEN)
+            {
+                // the mbap header tells the length of unit id + pdu
+                expected = MBAP_LEN + ((adu[4] << 8) | adu[5]);
+                pdu_len = expected - header;
+            }
+            else if (mode != TCP)
+            {
+                pdu_len = modbus_raw_pdu_length(adu + header, have - header);
+                expected = pdu_len > 0 ? header + pdu_len + checksum : have + 1;
+            }
+
+            if (expected > MODBUS_TCP_MAX_ADU_LENGTH)
+            {
+                LOG_ERROR("response of function code %d is too long, slaveid=%d",
+                        req[1], req[0]);
+                modbus_flush(ctx);
+                return -1;
+            }
+        }
+
+        if (checksum > 0)
+        {
+            uint16_t crc = modbus_raw_crc16(adu, have - checksum);
+            if ((adu[have - 2] | (adu[have - 1] << 8)) != crc)
+            {
+                LOG_ERROR("crc error in response of function code %d, slaveid=%d",
+                        req[1], req[0]);
+                return -1;
+            }
+        }
+    }
+
+    if (adu[header - 1] != req[0])
+    {
+        LOG_ERROR("response from unexpected slave %d, expecting %d",
+                adu[header - 1], req[0]);
+        return -1;
+    }
+
+    if (pdu_len <= 0 || pdu_len > max_pdu)
+    {
+        return -1;
+    }
+    memcpy(pdu, adu + header, pdu_len);
+    return pdu_len;
+}
+
+// check the response is not an exception, and has the expected function code
+static int check_response(const uint8_t* req, const uint8_t* rsp, int len)
+{
+    if (len < 2)
+    {
+        return -1;
+    }
+    if (rsp[0] != req[1])
+    {
+        LOG_ERROR("modbus exception %d for function code %d, slaveid=%d",
+                rsp[1], req[1], req[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int modbus_raw_read_bits(modbus_t* ctx, ModbusMode mode, int slaveid, int function,
+        int addr, int nb, uint8_t* dest)
+{
+    if (nb <= 0 || nb > MODBUS_MAX_READ_BITS)
+    {
+        return -1;
+    }
+    uint8_t req[6] = {slaveid, function, addr >> 8, addr & 0xFF, nb >> 8, nb & 0xFF};
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int len = modbus_raw_transaction(ctx, mode, req, sizeof(req), rsp, sizeof(rsp));
+    if (check_response(req, rsp, len) == -1 || rsp[1] != (nb + 7) / 8 || len < 2 + rsp[1])
+    {
+        return -1;
+    }
+    int i = 0;
+    for (i = 0; i < nb; i++)
+    {
+        dest[i] = (rsp[2 + i / 8] >> (i % 8)) & 0x01;
+    }
+    return nb;
+}
+
+int modbus_raw_read_registers(modbus_t* ctx, ModbusMode mode, int slaveid, int function,
+        int addr, int nb, uint16_t* dest)
+{
+    if (nb <= 0 || nb > MODBUS_MAX_READ_REGISTERS)
+    {
+        return -1;
+    }
+    uint8_t req[6] = {slaveid, function, addr >> 8, addr & 0xFF, nb >> 8, nb & 0xFF};
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int len = modbus_raw_transaction(ctx, mode, req, sizeof(req), rsp, sizeof(rsp));
+    if (check_response(req, rsp, len) == -1 || rsp[1] != nb * 2 || len < 2 + rsp[1])
+    {
+        return -1;
+    }
+    int i = 0;
+    for (i = 0; i < nb; i++)
+    {
+        dest[i] = (rsp[2 + 2 * i] << 8) | rsp[3 + 2 * i];
+    }
+    return nb;
+}
+
+int modbus_raw_write_and_read_registers(modbus_t* ctx, ModbusMode mode, int slaveid,
+        int write_addr, int write_nb, const uint16_t* src, int read_addr, int read_nb,
+        uint16_t* dest)
+{
+    if (write_nb <= 0 || write_nb > MODBUS_MAX_WR_WRITE_REGISTERS
+        || read_nb <= 0 || read_nb > MODBUS_MAX_WR_READ_REGISTERS)
+    {
+        return -1;
+    }
+    uint8_t req[11 + 2 * MODBUS_MAX_WR_WRITE_REGISTERS];
+    int len = 0;
+    req[len++] = slaveid;
+    req[len++] = FC_READ_WRITE_REGISTERS;
+    req[len++] = read_addr >> 8;
+    req[len++] = read_addr & 0xFF;
+    req[len++] = read_nb >> 8;
+    req[len++] = read_nb & 0xFF;
+    req[len++] = write_addr >> 8;
+    req[len++] = write_addr & 0xFF;
+    req[len++] = write_nb >> 8;
+    req[len++] = write_nb & 0xFF;
+    req[len++] = write_nb * 2;
+    int i = 0;
+    for (i = 0; i < write_nb; i++)
+    {
+        req[len++] = src[i] >> 8;
+        req[len++] = src[i] & 0xFF;
+    }
+
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int rsp_len = modbus_raw_transaction(ctx, mode, req, len, rsp, sizeof(rsp));
+    if (check_response(req, rsp, rsp_len) == -1 || rsp[1] != read_nb * 2 || rsp_len < 2 + rsp[1])
+    {
+        return -1;
+    }
+    for (i = 0; i < read_nb; i++)
+    {
+        dest[i] = (rsp[2 + 2 * i] << 8) | rsp[3 + 2 * i];
+    }
+    return read_nb;
+}
+
+int modbus_raw_write_bits(modbus_t* ctx, ModbusMode mode, int slaveid, int addr, int nb,
+        const uint8_t* src)
+{
+    if (nb <= 0 || nb > MAX_MODBUS_DATA_TO_WRITE)
+    {
+        return -1;
+    }
+    uint8_t req[7 + (MAX_MODBUS_DATA_TO_WRITE + 7) / 8];
+    int bytes = (nb + 7) / 8;
+    int len = 0;
+    req[len++] = slaveid;
+    req[len++] = MODBUS_FC_WRITE_MULTIPLE_COILS;
+    req[len++] = addr >> 8;
+    req[len++] = addr & 0xFF;
+    req[len++] = nb >> 8;
+    req[len++] = nb & 0xFF;
+    req[len++] = bytes;
+    memset(req + len, 0, bytes);
+    int i = 0;
+    for (i = 0; i < nb; i++)
+    {
+        if (src[i])
+        {
+            req[len + i / 8] |= 1 << (i % 8);
+        }
+    }
+    len += bytes;
+
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int rsp_len = modbus_raw_transaction(ctx, mode, req, len, rsp, sizeof(rsp));
+    if (check_response(req, rsp, rsp_len) == -1)
+    {
+        return -1;
+    }
+    return nb;
+}
+
+int modbus_raw_write_registers(modbus_t* ctx, ModbusMode mode, int slaveid, int addr, int nb,
+        const uint16_t* src)
+{
+    if (nb <= 0 || nb > MAX_MODBUS_DATA_TO_WRITE)
+    {
+        return -1;
+    }
+    uint8_t req[7 + 2 * MAX_MODBUS_DATA_TO_WRITE];
+    int len = 0;
+    req[len++] = slaveid;
+    req[len++] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+    req[len++] = addr >> 8;
+    req[len++] = addr & 0xFF;
+    req[len++] = nb >> 8;
+    req[len++] = nb & 0xFF;
+    req[len++] = nb * 2;
+    int i = 0;
+    for (i = 0; i < nb; i++)
+    {
+        req[len++] = src[i] >> 8;
+        req[len++] = src[i] & 0xFF;
+    }
+
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int rsp_len = modbus_raw_transaction(ctx, mode, req, len, rsp, sizeof(rsp));
+    if (check_response(req, rsp, rsp_len) == -1)
+    {
+        return -1;
+    }
+    return nb;
+}
@@ -0,0 +1,50 @@
+
+#ifndef MODBUS_RAW_HELPER_H
+#define MODBUS_RAW_HELPER_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "data.h"
+
+// libmodbus only knows how to frame the responses of the function codes
+// it has an api for, so function codes like FC20 and FC43 are sent by
+// modbus_send_raw_request, and the response is received here.
+// it also frames the requests of the modes libmodbus doesn't support:
+// RTU_OVER_TCP sends rtu frames (with crc) over a tcp socket, and ASCII
+// sends ':' + hex + lrc + "\r\n" over the serial port.
+//
+// req: slave id + function code + data, as modbus_send_raw_request expects
+// pdu: receives the response pdu, starting from the function code
+// return the length of the response pdu, or -1 on communication error.
+// an exception response is returned as is, the caller should check pdu[0]
+int modbus_raw_transaction(modbus_t* ctx, ModbusMode mode, const uint8_t* req, int req_len,
+        uint8_t* pdu, int max_pdu);
+
+// return the length of the pdu if it can be determined from the first
+// 'have' bytes, otherwise 0
+int modbus_raw_pdu_length(const uint8_t* pdu, int have);
+
+uint16_t modbus_raw_crc16(const uint8_t* buf, int len);
+
+uint8_t modbus_raw_lrc(const uint8_t* buf, int len);
+
+// the counterparts of modbus_read_bits/modbus_read_registers etc., for the
+// modes that libmodbus can't talk. function is FC1/FC2 for bits, and FC3/FC4
+// for registers. return the number of bits/registers, or -1 on error
+int modbus_raw_read_bits(modbus_t* ctx, ModbusMode mode, int slaveid, int function,
+        int addr, int nb, uint8_t* dest);
+
+int modbus_raw_read_registers(modbus_t* ctx, ModbusMode mode, int slaveid, int function,
+        int addr, int nb, uint16_t* dest);
+
+int modbus_raw_write_and_read_registers(modbus_t* ctx, ModbusMode mode, int slaveid,
+        int write_addr, int write_nb, const uint16_t* src, int read_addr, int read_nb,
+        uint16_t* dest);
+
+int modbus_raw_write_bits(modbus_t* ctx, ModbusMode mode, int slaveid, int addr, int nb,
+        const uint8_t* src);
+
+int modbus_raw_write_registers(modbus_t* ctx, ModbusMode mode, int slaveid, int addr, int nb,
+        const uint16_t* src);
+
+#endif  /* MODBUS_RAW_HELPER_H */
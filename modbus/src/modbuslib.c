@@ -18,6 +18,11 @@
  */
 
 #include "modbuslib.h"
+#include "modbus-raw-helper.h"
+#include "shadowserver.h"
+#include "historystore.h"
+#include "common.h"
+#include "logger.h"
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -26,6 +31,42 @@
 
 modbus_t* g_modbus_ctxs[MODBUS_DATA_COUNT];
 ctx_share_helper_t* g_modbus_share_ctxs[WIN_COM_COUNT];
+DeviceIdentification g_device_ids[MODBUS_DATA_COUNT];
+ModbusMode g_modbus_modes[MODBUS_DATA_COUNT];
+
+// true if libmodbus can't frame the requests of this mode by itself
+static int is_raw_mode(ModbusMode mode)
+{
+    return mode == RTU_OVER_TCP || mode == ASCII;
+}
+
+static int read_bits(modbus_t* ctx, SlavePolicy* policy, int function, uint8_t* dest)
+{
+    if (is_raw_mode(policy->mode))
+    {
+        return modbus_raw_read_bits(ctx, policy->mode, policy->slaveid, function,
+                policy->start_addr, policy->length, dest);
+    }
+    if (function == MODBUS_FC_READ_COILS)
+    {
+        return modbus_read_bits(ctx, policy->start_addr, policy->length, dest);
+    }
+    return modbus_read_input_bits(ctx, policy->start_addr, policy->length, dest);
+}
+
+static int read_registers(modbus_t* ctx, SlavePolicy* policy, int function, uint16_t* dest)
+{
+    if (is_raw_mode(policy->mode))
+    {
+        return modbus_raw_read_registers(ctx, policy->mode, policy->slaveid, function,
+                policy->start_addr, policy->length, dest);
+    }
+    if (function == MODBUS_FC_READ_HOLDING_REGISTERS)
+    {
+        return modbus_read_registers(ctx, policy->start_addr, policy->length, dest);
+    }
+    return modbus_read_input_registers(ctx, policy->start_addr, policy->length, dest);
+}
 
 void init_modbus_context(SlavePolicy* policy)
 {
@@ -40,51 +81,73 @@ void init_modbus_context(SlavePolicy* policy)
     }
 
     modbus_t* ctx = NULL;
-    if (policy->mode == TCP)
+    if (policy->mode == TCP || policy->mode == RTU_OVER_TCP)
     {
-        char ip[256];
-        mystrncpy(ip, policy->ip_com_addr, ADDR_LEN);
-        int len = strlen(ip);
-        int i = 0;
-        while (i < len && ip[i] != ':')
-        {
-            i++;
-        }
-
-        int port = 502;
-        if (i < len)
-        {
-            ip[i] = '\0';
-            i++;
-            if (i < len)
-            {
-                port = atoi(ip + i);
-            }
-        }
-        ctx = modbus_new_tcp(ip, port);
-        if (modbus_connect(ctx) == -1) 
-        {
-            fprintf(stderr, "Failed to connect modbus slave: %s, ip=%s, port=%d\n",
-                    modbus_strerror(errno), ip, port);
-            modbus_free(ctx);
-            ctx = NULL ;
-        }
+        // RTU_OVER_TCP only differs in framing, the connection is a plain tcp one
+        ctx = init_tcp(policy);
     }
     else if (policy->mode == RTU)
     {
         ctx = init_rtu(policy);
     }
+    else if (policy->mode == ASCII)
+    {
+        // libmodbus has no ascii backend, borrow the rtu one to open and
+        // configure the serial port, the frames are built by modbus-raw-helper
+#if defined(_WIN32) || defined(WIN64)
+        LOG_ERROR("modbus ASCII is not supported on windows");
+#else
+        ctx = init_rtu_internal(policy);
+#endif
+    }
     else
     {
-        fprintf(stderr, "Not supported modbus mode %d, only support modbus TCP and RTU now\n",
-                 (int)policy->mode);
+        LOG_ERROR("Not supported modbus mode %d, only support modbus TCP, RTU, ASCII"
+                " and RTU over TCP now", (int)policy->mode);
     }
     
     if (ctx != NULL)
     {
         modbus_set_slave(ctx, policy->slaveid);
+        if (g_device_ids[policy->slaveid].status == 0)
+        {
+            load_device_identification(policy, ctx);
+        }
     }
     g_modbus_ctxs[policy->slaveid] = ctx;
+    g_modbus_modes[policy->slaveid] = policy->mode;
+}
+
+modbus_t* init_tcp(SlavePolicy* policy)
+{
+    char ip[256];
+    mystrncpy(ip, policy->ip_com_addr, ADDR_LEN);
+    int len = strlen(ip);
+    int i = 0;
+    while (i < len && ip[i] != ':')
+    {
+        i++;
+    }
+
+    int port = 502;
+    if (i < len)
+    {
+        ip[i] = '\0';
+        i++;
+        if (i < len)
+        {
+            port = atoi(ip + i);
+        }
+    }
+    modbus_t* ctx = modbus_new_tcp(ip, port);
+    if (modbus_connect(ctx) == -1) 
+    {
+        LOG_ERROR("Failed to connect modbus slave: %s, ip=%s, port=%d",
+                modbus_strerror(errno), ip, port);
+        modbus_free(ctx);
+        ctx = NULL ;
+    }
+    return ctx;
 }
 
 modbus_t* init_rtu(SlavePolicy* policy)
@@ -111,7 +174,7 @@ modbus_t* init_rtu(SlavePolicy* policy)
         else
         {
             // error
-            fprintf(stderr, "Failed to connect modbus slave: %s, parameter error: required same parameter(baud, data_bit ,stop_bit ,parity) when use same COM.",
+            LOG_ERROR("Failed to connect modbus slave: %s, parameter error: required same parameter(baud, data_bit ,stop_bit ,parity) when use same COM.",
                     modbus_strerror(errno));
             return NULL;
         }
@@ -145,8 +208,8 @@ modbus_t* init_rtu_internal(SlavePolicy* policy)
             policy->databits, policy->stopbits);
     if (modbus_connect(ctx) == -1)
     {
-        fprintf(stderr, "Failed to connect modbus slave: %s, serial port=%s, baud=%d"
-                " parity=%c, databits=%d, stopbits=%d\n",
+        LOG_ERROR("Failed to connect modbus slave: %s, serial port=%s, baud=%d"
+                " parity=%c, databits=%d, stopbits=%d",
                 modbus_strerror(errno), policy->ip_com_addr, policy->baud, policy->parity,
                 policy->databits, policy->stopbits);
         modbus_free(ctx);
@@ -159,7 +222,7 @@ int read_modbus(SlavePolicy* policy, char* payload)
 {
     if (policy == NULL)
     {
-        fprintf(stderr, "NULL policy in read_modbus\n");
+        LOG_ERROR("NULL policy in read_modbus");
         return -1;
     }
 
@@ -168,10 +231,11 @@ int read_modbus(SlavePolicy* policy, char* payload)
     modbus_t* ctx = g_modbus_ctxs[policy->slaveid];
     if (ctx == NULL)
     {
-        // slave could be offline when we initialize the modbus context,
-        // we need to recover this, by trying to re-connect
-        fprintf(stderr, 
-            "modbus context is NULL in execution phase, trying to reconnect slaveid=%d\n", 
+        // the context is made by the first poll of the slave, so loading the
+        // policies doesn't wait for the connections. the slave could also be
+        // offline when we initialize the modbus context, we need to recover
+        // this, by trying to re-connect
+        LOG_INFO("modbus context is NULL in execution phase, trying to connect slaveid=%d",
             policy->slaveid);
         init_modbus_context(policy);
     
@@ -181,7 +245,7 @@ int read_modbus(SlavePolicy* policy, char* payload)
     ctx = g_modbus_ctxs[policy->slaveid];
     if (ctx == NULL)
     {
-        fprintf(stderr, "can't make connection to modbus slave#%d\n", policy->slaveid);
+        LOG_ERROR("can't make connection to modbus slave#%d", policy->slaveid);
         return -1;
     }
 
@@ -202,10 +266,10 @@ int read_modbus(SlavePolicy* policy, char* payload)
             // just store every bit as a byte, for easy of use
             tab_rq_bits = (uint8_t*) malloc(nb * sizeof(uint8_t));
             memset(tab_rq_bits, 0, nb * sizeof(uint8_t));
-            rc = modbus_read_bits(ctx, start_addr, nb, tab_rq_bits);
+            rc = read_bits(ctx, policy, MODBUS_FC_READ_COILS, tab_rq_bits);
             if (rc != nb) 
             {
-                printf("ERROR modbus_read_bits (%d) slaveid=%d, will reconnect\n",
+                LOG_ERROR("modbus_read_bits (%d) slaveid=%d, will reconnect",
                      rc, policy->slaveid);
                 need_reconnect_modbus = 1;
                 break;
@@ -216,10 +280,10 @@ int read_modbus(SlavePolicy* policy, char* payload)
         case MODBUS_FC_READ_DISCRETE_INPUTS:
             tab_rq_bits = (uint8_t*) malloc(nb * sizeof(uint8_t));
             memset(tab_rq_bits, 0, nb * sizeof(uint8_t));
-            rc = modbus_read_input_bits(ctx, start_addr, nb, tab_rq_bits);
+            rc = read_bits(ctx, policy, MODBUS_FC_READ_DISCRETE_INPUTS, tab_rq_bits);
             if (rc != nb)
             {
-                printf("ERROR modbus_read_input_bits (%d) slaveid=%d, will reconnect\n",
+                LOG_ERROR("modbus_read_input_bits (%d) slaveid=%d, will reconnect",
                      rc, policy->slaveid);
                 need_reconnect_modbus = 1;
                 break;
@@ -230,10 +294,10 @@ int read_modbus(SlavePolicy* policy, char* payload)
         case MODBUS_FC_READ_HOLDING_REGISTERS:
             tab_rq_registers = (uint16_t*) malloc(nb * sizeof(uint16_t));
             memset(tab_rq_registers, 0, nb * sizeof(uint16_t));
-            rc = modbus_read_registers(ctx, start_addr, nb, tab_rq_registers);
+            rc = read_registers(ctx, policy, MODBUS_FC_READ_HOLDING_REGISTERS, tab_rq_registers);
             if (rc != nb)
             {
-                printf("ERROR modbus_read_registers (%d) slaveid=%d, will reconnect\n",
+                LOG_ERROR("modbus_read_registers (%d) slaveid=%d, will reconnect",
                      rc, policy->slaveid);
                 need_reconnect_modbus = 1;
                 break;
@@ -244,21 +308,93 @@ int read_modbus(SlavePolicy* policy, char* payload)
         case MODBUS_FC_READ_INPUT_REGISTERS:
             tab_rq_registers = (uint16_t*) malloc(nb * sizeof(uint16_t));
             memset(tab_rq_registers, 0, nb * sizeof(uint16_t));
-            rc = modbus_read_input_registers(ctx, start_addr, nb, tab_rq_registers);
+            rc = read_registers(ctx, policy, MODBUS_FC_READ_INPUT_REGISTERS,
+                    tab_rq_registers);
+            if (rc != nb)
+            {
+                LOG_ERROR("modbus_read_input_registers (%d) slaveid=%d, will reconnect",
+                     rc, policy->slaveid);
+                need_reconnect_modbus = 1;
+                break;
+            }
+            short_arr_to_array(payload, tab_rq_registers, nb);
+            break;
+
+        case FC_READ_FILE_RECORD:
+            tab_rq_registers = (uint16_t*) malloc(nb * sizeof(uint16_t));
+            memset(tab_rq_registers, 0, nb * sizeof(uint16_t));
+            rc = read_file_record(policy, ctx, tab_rq_registers);
+            if (rc != nb)
+            {
+                LOG_ERROR("read_file_record (%d) slaveid=%d, will reconnect",
+                     rc, policy->slaveid);
+                need_reconnect_modbus = 1;
+                break;
+            }
+            short_arr_to_array(payload, tab_rq_registers, nb);
+            break;
+
+        case FC_READ_WRITE_REGISTERS:
+        {
+            // write then read back in one frame
+            // json_to_slave_poilicy has checked write_data
+            uint16_t data16[MODBUS_MAX_WR_WRITE_REGISTERS];
+            int write_nb = char2uint16(data16, MODBUS_MAX_WR_WRITE_REGISTERS, policy->write_data);
+            tab_rq_registers = (uint16_t*) malloc(nb * sizeof(uint16_t));
+            memset(tab_rq_registers, 0, nb * sizeof(uint16_t));
+            if (is_raw_mode(policy->mode))
+            {
+                rc = modbus_raw_write_and_read_registers(ctx, policy->mode, policy->slaveid,
+                        policy->write_addr, write_nb, data16, start_addr, nb, tab_rq_registers);
+            }
+            else
+            {
+                rc = modbus_write_and_read_registers(ctx, policy->write_addr, write_nb, data16,
+                        start_addr, nb, tab_rq_registers);
+            }
             if (rc != nb)
             {
-                printf("ERROR modbus_read_input_registers (%d) slaveid=%d, will reconnect\n",
+                LOG_ERROR("modbus_write_and_read_registers (%d) slaveid=%d, will reconnect",
                      rc, policy->slaveid);
                 need_reconnect_modbus = 1;
                 break;
             }
             short_arr_to_array(payload, tab_rq_registers, nb);
             break;
+        }
+
+        case FC_ENCAPSULATED_INTERFACE:
+            // refresh the cached device identification, and upload it
+            g_device_ids[policy->slaveid].status = 0;
+            load_device_identification(policy, ctx);
+            if (g_device_ids[policy->slaveid].status != 1)
+            {
+                LOG_ERROR("read device identification slaveid=%d", policy->slaveid);
+                rc = -1;
+                break;
+            }
+            rc = device_identification_to_hex(&g_device_ids[policy->slaveid], payload);
+            break;
 
         default:
-            fprintf(stderr, "not supported function code:%d\n", policy->functioncode);
+            LOG_ERROR("not supported function code:%d", policy->functioncode);
             break;
     }
+    // keep the latest values for the local shadow server, and the history
+    if (rc == nb && tab_rq_bits != NULL)
+    {
+        shadow_update_bits(policy->slaveid, policy->functioncode, start_addr, nb,
+                policy->interval, tab_rq_bits);
+        history_append_bits(policy->slaveid, policy->functioncode, start_addr, nb, tab_rq_bits);
+    }
+    else if (rc == nb && tab_rq_registers != NULL && policy->functioncode != FC_READ_FILE_RECORD)
+    {
+        shadow_update_registers(policy->slaveid, policy->functioncode, start_addr, nb,
+                policy->interval, tab_rq_registers);
+        history_append_registers(policy->slaveid, policy->functioncode, start_addr, nb,
+                tab_rq_registers);
+    }
+
     if (tab_rq_bits != NULL)
     {
         free(tab_rq_bits);
@@ -277,6 +413,148 @@ int read_modbus(SlavePolicy* policy, char* payload)
     return rc;
 }
 
+// FC20, read policy->length registers of record policy->start_addr in file policy->file_number
+// return the number of registers read, -1 on error
+int read_file_record(SlavePolicy* policy, modbus_t* ctx, uint16_t* dest)
+{
+    int nb = policy->length;
+    if (nb <= 0 || nb > MAX_FILE_RECORD_LEN)
+    {
+        LOG_ERROR("invalid file record length %d, max is %d", nb, MAX_FILE_RECORD_LEN);
+        return -1;
+    }
+
+    uint8_t req[10];
+    req[0] = policy->slaveid;
+    req[1] = FC_READ_FILE_RECORD;
+    req[2] = 7;    // byte count of one sub-request
+    req[3] = 6;    // reference type
+    req[4] = policy->file_number >> 8;
+    req[5] = policy->file_number & 0xFF;
+    req[6] = policy->start_addr >> 8;
+    req[7] = policy->start_addr & 0xFF;
+    req[8] = nb >> 8;
+    req[9] = nb & 0xFF;
+
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int len = modbus_raw_transaction(ctx, policy->mode, req, sizeof(req), rsp, sizeof(rsp));
+    if (len < 4 || rsp[0] != FC_READ_FILE_RECORD)
+    {
+        return -1;
+    }
+    // fc, response data length, file response length, reference type, record data
+    if (rsp[2] != 1 + 2 * nb || rsp[3] != 6 || len < 4 + 2 * nb)
+    {
+        LOG_ERROR("unexpected file record response, slaveid=%d", policy->slaveid);
+        return -1;
+    }
+
+    int i = 0;
+    for (i = 0; i < nb; i++)
+    {
+        dest[i] = (rsp[4 + 2 * i] << 8) | rsp[5 + 2 * i];
+    }
+    return nb;
+}
+
+void load_device_identification(SlavePolicy* policy, modbus_t* ctx)
+{
+    if (policy == NULL || ctx == NULL)
+    {
+        return;
+    }
+    DeviceIdentification* devid = &g_device_ids[policy->slaveid];
+
+    uint8_t req[5];
+    req[0] = policy->slaveid;
+    req[1] = FC_ENCAPSULATED_INTERFACE;
+    req[2] = MEI_READ_DEVICE_ID;
+    req[3] = 1;    // basic device identification
+    req[4] = 0;    // start from the first object
+
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int cap = 3;    // the basic objects may be split into a few responses
+    while (cap-- > 0)
+    {
+        int len = modbus_raw_transaction(ctx, policy->mode, req, sizeof(req), rsp, sizeof(rsp));
+        if (len < 2)
+        {
+            // no response, try again at next connect
+            return;
+        }
+        if (rsp[0] != FC_ENCAPSULATED_INTERFACE || len < 7)
+        {
+            // exception, the slave doesn't support it
+            devid->status = -1;
+            return;
+        }
+
+        int pos = 7;
+        int i = 0;
+        for (i = 0; i < rsp[6] && pos + 2 <= len; i++)
+        {
+            int id = rsp[pos];
+            int objlen = rsp[pos + 1];
+            char* dest = NULL;
+            if (pos + 2 + objlen > len)
+            {
+                break;
+            }
+            switch (id)
+            {
+                case 0: dest = devid->vendor_name; break;
+                case 1: dest = devid->product_code; break;
+                case 2: dest = devid->revision; break;
+                default: break;
+            }
+            if (dest != NULL)
+            {
+                int n = objlen < DEVICE_ID_LEN - 1 ? objlen : DEVICE_ID_LEN - 1;
+                memcpy(dest, rsp + pos + 2, n);
+                dest[n] = '\0';
+            }
+            pos += 2 + objlen;
+        }
+        devid->status = 1;
+
+        // more follows?
+        if (rsp[4] != 0xFF)
+        {
+            break;
+        }
+        req[4] = rsp[5];
+    }
+}
+
+// encode the cached objects as they are in a FC43/14 response: (id, len, value)...
+// return the number of objects encoded
+int device_identification_to_hex(const DeviceIdentification* devid, char* payload)
+{
+    const char* objects[3] = {devid->vendor_name, devid->product_code, devid->revision};
+    char raw[3 * (DEVICE_ID_LEN + 2)];
+    int len = 0;
+    int i = 0;
+    for (i = 0; i < 3; i++)
+    {
+        int objlen = strlen(objects[i]);
+        raw[len++] = (char) i;
+        raw[len++] = (char) objlen;
+        memcpy(raw + len, objects[i], objlen);
+        len += objlen;
+    }
+    byte_arr_to_hex(payload, raw, len);
+    return 3;
+}
+
+const DeviceIdentification* get_device_identification(int slaveid)
+{
+    if (slaveid < 0 || slaveid >= MODBUS_DATA_COUNT || g_device_ids[slaveid].status != 1)
+    {
+        return NULL;
+    }
+    return &g_device_ids[slaveid];
+}
+
 void handle_read_modbus_error(SlavePolicy* policy)
 {
 #if defined(_WIN32) || defined(WIN64)
@@ -334,8 +612,8 @@ void init_modbus_context_win32_rtu(SlavePolicy* policy)
     if (modbus_connect(ctx) == -1)
     {
         // device is closed
-        fprintf(stderr, "Failed to connect modbus slave: %s, serial port=%s, baud=%d"
-                    " parity=%c, databits=%d, stopbits=%d\n",
+        LOG_ERROR("Failed to connect modbus slave: %s, serial port=%s, baud=%d"
+                    " parity=%c, databits=%d, stopbits=%d",
                     modbus_strerror(errno), policy->ip_com_addr, policy->baud, policy->parity,
                     policy->databits, policy->stopbits);
         modbus_free(ctx);
@@ -395,6 +673,10 @@ void cleanup_modbus_ctxs()
             g_modbus_ctxs[i] = NULL;
         }
     }
+    for (i = 0; i < MODBUS_DATA_COUNT; i++)
+    {
+        g_device_ids[i].status = 0;
+    }
     for (i = 0; i < WIN_COM_COUNT; i++)
     {
         release_ctx_share_helper(g_modbus_share_ctxs[i]);
@@ -408,6 +690,8 @@ void init_modbus_ctxs()
     for (i = 0; i < MODBUS_DATA_COUNT; i++)
     {
         g_modbus_ctxs[i] = NULL;
+        g_modbus_modes[i] = TCP;
+        memset(&g_device_ids[i], 0, sizeof(DeviceIdentification));
     }
     for (i = 0; i < WIN_COM_COUNT; i++)
     {
@@ -454,14 +738,22 @@ int write_modbus(int slaveid, int startAddress, char* data)
     if (startAddress >= 1 && startAddress < 9999)
     {        
         uint8_t data8[MAX_MODBUS_DATA_TO_WRITE];
-        int num = char2uint8(data8, data);
+        int num = char2uint8(data8, MAX_MODBUS_DATA_TO_WRITE, data);
         int startOffset = startAddress - 1;
         if (num > 0)
         {
-            rc = modbus_write_bits(ctx, startOffset, num, data8);
+            if (is_raw_mode(g_modbus_modes[slaveid]))
+            {
+                rc = modbus_raw_write_bits(ctx, g_modbus_modes[slaveid], slaveid, startOffset,
+                        num, data8);
+            }
+            else
+            {
+                rc = modbus_write_bits(ctx, startOffset, num, data8);
+            }
             if (rc == -1)
             {
-                printf("write bits failed, slaveid=%d, address=%d, data=%s\n", slaveid, startAddress, data);
+                LOG_ERROR("write bits failed, slaveid=%d, address=%d, data=%s", slaveid, startAddress, data);
                 return -1;
             }
         }
@@ -470,14 +762,22 @@ int write_modbus(int slaveid, int startAddress, char* data)
     else if (startAddress >= 40001 && startAddress < 49999)
     {
         uint16_t data16[MAX_MODBUS_DATA_TO_WRITE];
-        int num = char2uint16(data16, data);
+        int num = char2uint16(data16, MAX_MODBUS_DATA_TO_WRITE, data);
         int startOffset = startAddress - 40001;
         if (num > 0)
         {
-            rc = modbus_write_registers(ctx, startOffset, num, data16);
+            if (is_raw_mode(g_modbus_modes[slaveid]))
+            {
+                rc = modbus_raw_write_registers(ctx, g_modbus_modes[slaveid], slaveid, startOffset,
+                        num, data16);
+            }
+            else
+            {
+                rc = modbus_write_registers(ctx, startOffset, num, data16);
+            }
             if (rc == -1)
             {
-                printf("write registers failed, slaveid=%d, address=%d, data=%s\n", slaveid, startAddress, data);
+                LOG_ERROR("write registers failed, slaveid=%d, address=%d, data=%s", slaveid, startAddress, data);
                 return -1;
             }
         }
@@ -485,7 +785,7 @@ int write_modbus(int slaveid, int startAddress, char* data)
     } 
     else {
         // invalid start address
-        printf("unsupported address for write:%d\n", startAddress);
+        LOG_WARN("unsupported address for write:%d", startAddress);
     }
 
     return -1;
@@ -27,6 +27,8 @@
 // store the context in g_modbus_ctxs
 void init_modbus_context(SlavePolicy* policy);
 
+modbus_t* init_tcp(SlavePolicy* policy);
+
 modbus_t* init_rtu(SlavePolicy* policy);
 
 modbus_t* init_rtu_internal(SlavePolicy* policy);
@@ -43,6 +45,18 @@ void init_modbus_context_win32_rtu(SlavePolicy* policy);
 // and auto reconnect if necessary
 int read_modbus(SlavePolicy* policy, char* payload);
 
+// FC20, read file record, return the number of registers read, -1 on error
+int read_file_record(SlavePolicy* policy, modbus_t* ctx, uint16_t* dest);
+
+// issue FC43/14 read device identification to the slave and cache
+// the basic objects; called once right after the slave is connected
+void load_device_identification(SlavePolicy* policy, modbus_t* ctx);
+
+// return the cached device identification of the slave, NULL if unknown
+const DeviceIdentification* get_device_identification(int slaveid);
+
+int device_identification_to_hex(const DeviceIdentification* devid, char* payload);
+
 void cleanup_modbus_ctxs();
 
 void init_modbus_ctxs();
@@ -2,30 +2,60 @@
 
 #include "mqttsender.h"
 #include "ringbufi.h"
+#include "lzcompress.h"
+#include "cachedict.h"
 #include "thread.h"
+#include "logger.h"
+#include "wakeup.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <MQTTClient.h>
+#if !defined(WIN32) && !defined(WIN64)
+#include <unistd.h>
+#endif
+#include <MQTTAsync.h>
 
 #define MAX_SENDER 64
 #define WORKER_NOT_STARTED 0
 #define WORKER_RUNNING 1
 #define WORKER_REQUEST_STOP 2
 #define WORKER_STOPPED 3
+#define ACK_COMMIT_BATCH 32	// acks of cached records that share one meta write
+#define CACHE_BLOCK_LIMIT (64 * 1024)	// raw bytes of messages compressed as one record
+#define IDLE_WAIT 5	// seconds to wait for a message when there is nothing to send
+#define DEFAULT_LIVE_SHARE 80	// percentage of publishes reserved for live messages
+#define MAX_INFLIGHT 32	// publishes waiting for the broker's ack, across all brokers
+#define PUB_TIMEOUT 10	// seconds to wait for the ack of a publish
+#define PUB_SENT 0
+#define PUB_DROPPED 1
+#define PUB_PENDING 2	// the broker is still connecting, try again later
+#define PUB_FAILED -1
+#define SLOT_WAITING 0
+#define SLOT_ACKED 1
+#define SLOT_FAILED 2
+#define BROKER_BUCKETS 64
+#define BROKER_HEALTHY 0
+#define BROKER_BACKOFF 1
+#define BROKER_BAD 2	// refused our credentials, messages to it are dropped
+#define LINK_DOWN 0
+#define LINK_CONNECTING 1
+#define LINK_UP 2
+#define MAX_BACKOFF 60	// seconds
 #define MAX_LEN 256
+#define INCOMING_SIZE 4096	// messages mqtt_send may queue ahead of the worker, power of 2
+#define INCOMING_FULL_WAIT 1000	// milliseconds mqtt_send waits for room, before dropping the message
+#define INCOMING_NAP 10	// milliseconds
 
-static MQTTClient_SSLOptions g_sslopts = MQTTClient_SSLOptions_initializer;
+static MQTTAsync_SSLOptions g_sslopts = MQTTAsync_SSLOptions_initializer;
 
-typedef struct MqttBrokerId_t
-{
-	char* endpoint;
-	char* user;
-	char* password;
-	MQTTClient client;
-	struct MqttBrokerId_t* next;
-} MqttBrokerId;
+// marks a compressed block of messages in the cache file, followed by the
+// version of its dictionary and the raw length; records written by older
+// versions start with the endpoint length instead, which never matches
+static const char CACHE_MAGIC[3] = {(char) 0xFF, 'L', 'Z'};
+#define CACHE_HEAD_LEN (sizeof(CACHE_MAGIC) + 1 + sizeof(size_t))
+
+struct MqttSender_t;
 
 typedef struct MqttMessageToPub_t
 {
@@ -37,18 +67,76 @@ typedef struct MqttMessageToPub_t
 	char* payload;
 	int payloadlen;
 	char* certfile;
+	unsigned long seq;	// position in the incoming ring, live messages only
 	struct MqttMessageToPub_t* next;
 } MqttMessageToPub;
 
-typedef struct 
+// one entry per distinct channel (endpoint + user + password) in the pool,
+// shared by all the policies publishing to it
+typedef struct MqttBrokerId_t
+{
+	char* endpoint;
+	char* user;
+	char* password;
+	unsigned int hash;
+	MQTTAsync client;	// NULL if not connected
+	volatile char linkState;	// LINK_DOWN, LINK_CONNECTING or LINK_UP, set by the callbacks
+	int connectRc;	// why the last connect failed
+	char state;	// BROKER_HEALTHY, BROKER_BACKOFF or BROKER_BAD
+	int failures;	// consecutive connection failures
+	time_t nextRetry;	// don't try to connect before this, when in backoff
+	MqttMessageToPub* parked;	// live messages waiting for the connection, the worker only
+	MqttMessageToPub* parkedTail;
+	struct MqttSender_t* sender;	// the owner, for the callbacks
+	struct MqttBrokerId_t* next;	// next entry in the same bucket
+} MqttBrokerId;
+
+// a cell of the incoming ring, readable by the worker when seq == position + 1,
+// free for the producers when seq == position
+typedef struct
+{
+	volatile unsigned long seq;
+	MqttMessageToPub* msg;
+} IncomingCell;
+
+// a publish handed to the client library, until the broker acks it
+typedef struct
+{
+	struct MqttSender_t* sender;
+	MqttMessageToPub* msg;	// NULL if the slot is free
+	MqttBrokerId* broker;
+	char fromBacklog;
+	volatile char state;	// SLOT_WAITING, SLOT_ACKED or SLOT_FAILED
+	MQTTAsync_token token;
+	time_t deadline;
+} InFlight;
+
+typedef struct MqttSender_t
 {
 	mutex_type lock;
 	RingBuFi* ringbuf;
-	MqttBrokerId* mqttClients;
-	MqttBrokerId* badBrokers;
+	MqttBrokerId* brokers[BROKER_BUCKETS];	// the connection pool, hashed by channel
+	mutex_type brokerLock;	// the producer checks broker state as well
 	volatile char status;
 	thread_type worker;
-	MqttMessageToPub incomingQueue;	// just the header, real msg start from next
+	Wakeup wakeup;	// signaled when a message is queued, a publish or connect completes, or stop is requested
+	IncomingCell* incoming;	// bounded ring from the producers to the worker, no lock
+	volatile unsigned long incomingHead;	// the next position to claim, by the producers
+	unsigned long incomingTail;	// the next position to take, the worker only
+	volatile unsigned long incomingQueued;
+	volatile unsigned long incomingWaited;	// messages that found the ring full, and waited for room
+	volatile unsigned long incomingDropped;	// still full after INCOMING_FULL_WAIT
+	unsigned long incomingDropsLogged;
+	volatile unsigned long settled;	// the live messages queued before this are acked, in the file, or dropped
+	time_t settledAt;
+	InFlight inflight[MAX_INFLIGHT];	// guarded by lock, the callbacks update the state
+	int inflightCount;
+	int liveShare;	// percentage of publishes for the live lane, while the backlog lane competes
+	int backlogRate;	// max backlog messages per second, 0 for no limit
+	unsigned long liveSent;
+	unsigned long backlogSent;
+	time_t backlogSecond;
+	int backlogInSecond;
 } MqttSender;
 
 
@@ -61,33 +149,89 @@ static size_t messageLen(const MqttMessageToPub* msg);
 static void freeMsg(MqttMessageToPub* msg);
 static size_t serializeMsg(const MqttMessageToPub* msg, void** output);
 static MqttMessageToPub* deserializeMsg(const void* data);
-static MQTTClient findExistingClient(const MqttSender* sender, const char* endpoint, const char* user);
+static MqttBrokerId* findBroker(MqttSender* sender, const char* endpoint, const char* user,
+		const char* password, char create);
 static void freeBroker(MqttBrokerId* broker);
-static void removeExistingClient(MqttSender* sender, MQTTClient client);
-static char isKnownBadBroker(const MqttSender* sender, const char* endpoint, 
+static void brokerFailed(MqttSender* sender, MqttBrokerId* broker, char bad);
+static char isKnownBadBroker(MqttSender* sender, const char* endpoint, 
 		const char* user, const char* password);
-static void set_ssl_option(MQTTClient_connectOptions* conn_opts, const char* host, const char* pem);
-static int makeMqttConnection(MQTTClient* client, const char* endpoint, const char* user,
-		const char* password, const char* certfile);
+static void set_ssl_option(MQTTAsync_connectOptions* conn_opts, const char* host, const char* pem);
+static int connectBroker(MqttBrokerId* broker, const char* certfile);
 static thread_return_type worker_func(void* arg);
+static void wakeupWorker(MqttSender* sender);
+static void waitForWakeup(MqttSender* sender, unsigned int generation, int seconds);
+static void takeIncoming(MqttSender* sender, MqttMessageToPub* queue);
+static void flushIncomingQueueToFile(MqttSender* sender);
 static void byte_copy(void** dest, const void* src, int len, char padnull);
 
-static void delivered(void* context, MQTTClient_deliveryToken dt)
+// the callbacks run in the client library's thread, they only record the
+// outcome and wake the worker up, which does the rest
+
+static int msg_arrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	LOG_DEBUG("MqttSender msg_arrived topic=%s", topicName);
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+static void connection_lost(void* context, char* cause)
 {
-    // printf("Message with token value %d delivery confirmed\n", dt);
+	LOG_WARN("MqttSender Connection lost, caused by %s, will reconnect later", cause);
+	MqttBrokerId* broker = (MqttBrokerId*) context;
+	MqttSender* sender = broker->sender;
+	Thread_lock_mutex(sender->brokerLock);
+	broker->linkState = LINK_DOWN;
+	broker->connectRc = 0;
+	Thread_unlock_mutex(sender->brokerLock);
+	wakeupWorker(sender);
 }
 
-static int msg_arrived(void* context, char* topicName, int topicLen, MQTTClient_message* message)
+static void on_connected(void* context, MQTTAsync_successData* response)
 {
-    printf("MqttSender msg_arrived topic=%s\n", topicName);
+	MqttBrokerId* broker = (MqttBrokerId*) context;
+	MqttSender* sender = broker->sender;
+	Thread_lock_mutex(sender->brokerLock);
+	broker->linkState = LINK_UP;
+	broker->state = BROKER_HEALTHY;
+	broker->failures = 0;
+	Thread_unlock_mutex(sender->brokerLock);
+	wakeupWorker(sender);
 }
 
+static void on_connect_failed(void* context, MQTTAsync_failureData* response)
+{
+	MqttBrokerId* broker = (MqttBrokerId*) context;
+	MqttSender* sender = broker->sender;
+	Thread_lock_mutex(sender->brokerLock);
+	broker->linkState = LINK_DOWN;
+	broker->connectRc = response != NULL ? response->code : 0;
+	Thread_unlock_mutex(sender->brokerLock);
+	wakeupWorker(sender);
+}
 
-static void connection_lost(void* context, char* cause)
+static void completePublish(InFlight* slot, MQTTAsync_token token, char state)
+{
+	MqttSender* sender = slot->sender;
+	Thread_lock_mutex(sender->lock);
+	// the token is 0 while sendMessage hasn't returned yet
+	if (slot->msg != NULL && slot->state == SLOT_WAITING
+		&& (slot->token == 0 || token == 0 || slot->token == token))
+	{
+		slot->state = state;
+	}
+	Thread_unlock_mutex(sender->lock);
+	wakeupWorker(sender);
+}
+
+static void on_published(void* context, MQTTAsync_successData* response)
+{
+	completePublish((InFlight*) context, response != NULL ? response->token : 0, SLOT_ACKED);
+}
+
+static void on_publish_failed(void* context, MQTTAsync_failureData* response)
 {
-    printf("MqttSender Connection lost, caused by %s, will reconnect later\n", cause);
-    // MQTTClient client = (MQTTClient) context;
-    // MQTTClient_destroy(&client);
+	completePublish((InFlight*) context, response != NULL ? response->token : 0, SLOT_FAILED);
 }
 
 size_t messageLen(const MqttMessageToPub* msg)
@@ -295,12 +439,40 @@ int new_mqtt_sender(const char* cacheFile, int cacheSize)
 	MqttSender* sender = (MqttSender*) malloc(sizeof(MqttSender));
 	sender->lock = Thread_create_mutex();
 	sender->ringbuf = buf;
-	sender->mqttClients = NULL;
-	sender->badBrokers = NULL;
+	memset(sender->brokers, 0, sizeof(sender->brokers));
+	sender->brokerLock = Thread_create_mutex();
 	sender->status = WORKER_NOT_STARTED;
+	sender->incoming = (IncomingCell*) malloc(INCOMING_SIZE * sizeof(IncomingCell));
+	int k = 0;
+	for (k = 0; k < INCOMING_SIZE; k++)
+	{
+		sender->incoming[k].seq = k;
+		sender->incoming[k].msg = NULL;
+	}
+	sender->incomingHead = 0;
+	sender->incomingTail = 0;
+	sender->incomingQueued = 0;
+	sender->incomingWaited = 0;
+	sender->incomingDropped = 0;
+	sender->incomingDropsLogged = 0;
+	sender->settled = 0;
+	sender->settledAt = 0;
+	memset(sender->inflight, 0, sizeof(sender->inflight));
+	int j = 0;
+	for (j = 0; j < MAX_INFLIGHT; j++)
+	{
+		sender->inflight[j].sender = sender;
+	}
+	sender->inflightCount = 0;
+	sender->liveShare = DEFAULT_LIVE_SHARE;
+	sender->backlogRate = 0;
+	sender->liveSent = 0;
+	sender->backlogSent = 0;
+	sender->backlogSecond = 0;
+	sender->backlogInSecond = 0;
+	init_wakeup(&sender->wakeup);
 	sender->worker = Thread_start(worker_func, (void*) sender);
 	sender->status = WORKER_RUNNING;
-	sender->incomingQueue.next = NULL;
 	Thread_lock_mutex(sender_lock);
 	int i = 0; 
 	int ret = -1;
@@ -326,48 +498,136 @@ void close_mqtt_sender(int handle)
 	{
 		MqttSender* sender = SENDERS[handle];
 		Thread_lock_mutex(sender_lock);
-		SENDERS[handle]->status = WORKER_REQUEST_STOP;
-		closeRingBuFi(SENDERS[handle]->ringbuf);
 		SENDERS[handle] = NULL;
 		Thread_unlock_mutex(sender_lock);
 
-		// wait for the worker thread to exit
-		int cap = 10;
-		while (cap-- > 0 && sender->status == WORKER_REQUEST_STOP)
+		// the worker saves what isn't acked yet into the file before it
+		// exits, nothing else touches the file or the queues until then
+		sender->status = WORKER_REQUEST_STOP;
+		wakeupWorker(sender);
+		while (1)
 		{
-			sleep(1);
+			unsigned int generation = wakeup_generation(&sender->wakeup);
+			if (sender->status == WORKER_STOPPED)
+			{
+				break;
+			}
+			wait_wakeup(&sender->wakeup, generation, 1);
 		}
 
+		// queued by a producer racing with the stop
+		flushIncomingQueueToFile(sender);
+		closeRingBuFi(sender->ringbuf);
+
 		// close mqtt connections
-		MqttBrokerId* broker = sender->mqttClients;
-		while (broker != NULL)
+		int i = 0;
+		for (i = 0; i < BROKER_BUCKETS; i++)
 		{
-			MQTTClient_disconnect(broker->client, 3000);
-			MqttBrokerId* next = broker->next;
-			freeBroker(broker);
-			broker = next;
+			MqttBrokerId* broker = sender->brokers[i];
+			while (broker != NULL)
+			{
+				if (broker->client != NULL)
+				{
+					MQTTAsync_disconnectOptions options = MQTTAsync_disconnectOptions_initializer;
+					options.timeout = 3000;
+					MQTTAsync_disconnect(broker->client, &options);
+					MQTTAsync_destroy(&broker->client);
+				}
+				MqttBrokerId* next = broker->next;
+				freeBroker(broker);
+				broker = next;
+			}
+			sender->brokers[i] = NULL;
 		}
 	}
 }
 
-MQTTClient findExistingClient(const MqttSender* sender, const char* endpoint, const char* user)
+unsigned long mqtt_queued(int handle)
 {
-	if (sender == NULL || endpoint == NULL)
+	if (handle < 0 || handle >= MAX_SENDER || SENDERS[handle] == NULL)
+	{
+		return 0;
+	}
+	return __atomic_load_n(&SENDERS[handle]->incomingHead, __ATOMIC_ACQUIRE);
+}
+
+unsigned long mqtt_settled(int handle)
+{
+	if (handle < 0 || handle >= MAX_SENDER || SENDERS[handle] == NULL)
+	{
+		return 0;
+	}
+	return __atomic_load_n(&SENDERS[handle]->settled, __ATOMIC_ACQUIRE);
+}
+
+void set_mqtt_sender_lanes(int handle, int liveShare, int backlogRate)
+{
+	if (handle < 0 || handle >= MAX_SENDER || SENDERS[handle] == NULL)
+	{
+		return;
+	}
+	if (liveShare < 0 || liveShare > 100)
+	{
+		LOG_WARN("invalid live share %d, it should be within 0-100", liveShare);
+		return;
+	}
+	SENDERS[handle]->liveShare = liveShare;
+	SENDERS[handle]->backlogRate = backlogRate < 0 ? 0 : backlogRate;
+}
+
+static unsigned int hashString(unsigned int hash, const char* str)
+{
+	// FNV-1a
+	for (; *str != '\0'; str++)
+	{
+		hash = (hash ^ (unsigned char) *str) * 16777619U;
+	}
+	return hash;
+}
+
+// the pool entry of the channel, NULL if not found and create is 0
+// caller should hold sender->brokerLock
+MqttBrokerId* findBroker(MqttSender* sender, const char* endpoint, const char* user,
+		const char* password, char create)
+{
+	if (sender == NULL || endpoint == NULL || user == NULL || password == NULL)
 	{
 		return NULL;
 	}
 
-	MqttBrokerId* broker = sender->mqttClients;
+	unsigned int hash = hashString(hashString(hashString(2166136261U, endpoint), user), password);
+	MqttBrokerId* broker = sender->brokers[hash % BROKER_BUCKETS];
 	while (broker != NULL)
 	{
-		if (strcmp(endpoint, broker->endpoint) == 0 && strcmp(user, broker->user) == 0)
+		if (broker->hash == hash && strcmp(endpoint, broker->endpoint) == 0
+			&& strcmp(user, broker->user) == 0 && strcmp(password, broker->password) == 0)
 		{
-			return broker->client;
+			return broker;
 		}
 		broker = broker->next;
 	}
+	if (!create)
+	{
+		return NULL;
+	}
 
-	return NULL;
+	broker = (MqttBrokerId*) malloc(sizeof(MqttBrokerId));
+	byte_copy((void**)&broker->endpoint, endpoint, strlen(endpoint) + 1, 1);
+	byte_copy((void**)&broker->user, user, strlen(user) + 1, 1);
+	byte_copy((void**)&broker->password, password, strlen(password) + 1, 1);
+	broker->hash = hash;
+	broker->client = NULL;
+	broker->linkState = LINK_DOWN;
+	broker->connectRc = 0;
+	broker->state = BROKER_HEALTHY;
+	broker->failures = 0;
+	broker->nextRetry = 0;
+	broker->parked = NULL;
+	broker->parkedTail = NULL;
+	broker->sender = sender;
+	broker->next = sender->brokers[hash % BROKER_BUCKETS];
+	sender->brokers[hash % BROKER_BUCKETS] = broker;
+	return broker;
 }
 
 void freeBroker(MqttBrokerId* broker)
@@ -393,38 +653,49 @@ void freeBroker(MqttBrokerId* broker)
 	}
 }
 
-void removeExistingClient(MqttSender* sender, MQTTClient client)
+// drop the connection of the broker, and back off before reconnecting:
+// 1, 2, 4 ... up to MAX_BACKOFF seconds. bad means it refused us for good.
+// only the worker calls this
+void brokerFailed(MqttSender* sender, MqttBrokerId* broker, char bad)
 {
-	if (sender == NULL)
+	Thread_lock_mutex(sender->brokerLock);
+	MQTTAsync client = broker->client;
+	broker->client = NULL;
+	broker->linkState = LINK_DOWN;
+	if (bad)
 	{
-		return ;
+		broker->state = BROKER_BAD;
 	}
+	else
+	{
+		int backoff = broker->failures < 6 ? 1 << broker->failures : MAX_BACKOFF;
+		broker->failures++;
+		broker->state = BROKER_BACKOFF;
+		broker->nextRetry = time(NULL) + (backoff < MAX_BACKOFF ? backoff : MAX_BACKOFF);
+	}
+	Thread_unlock_mutex(sender->brokerLock);
 
-	MqttBrokerId* broker = sender->mqttClients;
-	if (broker != NULL && broker->client == client)
+	if (client != NULL)
 	{
-		sender->mqttClients = broker->next;
-		return;
+		// no callback of the client comes after this
+		MQTTAsync_destroy(&client);
 	}
-	MqttBrokerId* pre = broker;
-	broker = broker->next;
-	while (broker != NULL)
+
+	// what's still in flight to the broker will never be acknowledged
+	int i = 0;
+	Thread_lock_mutex(sender->lock);
+	for (i = 0; i < MAX_INFLIGHT; i++)
 	{
-		if (broker->client == client)
+		InFlight* slot = &sender->inflight[i];
+		if (slot->msg != NULL && slot->broker == broker && slot->state == SLOT_WAITING)
 		{
-			pre->next = broker->next;
-			broker->next = NULL;
-			freeBroker(broker);
-			break;
+			slot->state = SLOT_FAILED;
 		}
-		pre = broker;
-		broker = broker->next;
 	}
-
+	Thread_unlock_mutex(sender->lock);
 }
 
-
-char isKnownBadBroker(const MqttSender* sender, const char* endpoint, 
+char isKnownBadBroker(MqttSender* sender, const char* endpoint, 
 		const char* user, const char* password)
 {
 	if (sender == NULL || endpoint == NULL)
@@ -432,22 +703,14 @@ char isKnownBadBroker(const MqttSender* sender, const char* endpoint,
 		return 0;
 	}
 
-	MqttBrokerId* broker = sender->badBrokers;
-	while (broker != NULL)
-	{
-		if (strcmp(endpoint, broker->endpoint) == 0 
-			&& strcmp(user, broker->user) == 0
-			&& strcmp(password, broker->password))
-		{
-			return 1;
-		}
-		broker = broker->next;
-	}
-
-	return 0;
+	Thread_lock_mutex(sender->brokerLock);
+	MqttBrokerId* broker = findBroker(sender, endpoint, user, password, 0);
+	char bad = broker != NULL && broker->state == BROKER_BAD;
+	Thread_unlock_mutex(sender->brokerLock);
+	return bad;
 }
 
-void set_ssl_option(MQTTClient_connectOptions* conn_opts, const char* host, const char* pem)
+void set_ssl_option(MQTTAsync_connectOptions* conn_opts, const char* host, const char* pem)
 {
     char* ssl = "ssl://";
     char* ssl_upper = "SSL://";
@@ -460,47 +723,299 @@ void set_ssl_option(MQTTClient_connectOptions* conn_opts, const char* host, cons
     }
 }
 
-int makeMqttConnection(MQTTClient* client, const char* endpoint, const char* user,
-		const char* password, const char* certfile)
+// start connecting to the broker, on_connected or on_connect_failed tells the result
+int connectBroker(MqttBrokerId* broker, const char* certfile)
 {
-
 	char clientid[256];
     snprintf(clientid, MAX_LEN, "MqttSender%lld", (long long)time(NULL));
-	int rc = MQTTClient_create(client, endpoint,
+	MQTTAsync client = NULL;
+	int rc = MQTTAsync_create(&client, broker->endpoint,
              clientid, MQTTCLIENT_PERSISTENCE_NONE, NULL);
-	MQTTClient_connectOptions connect_options = MQTTClient_connectOptions_initializer;
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		return rc;
+	}
+	MQTTAsync_connectOptions connect_options = MQTTAsync_connectOptions_initializer;
     connect_options.keepAliveInterval = 20;  // Alive interval
     connect_options.cleansession = 1;
-    connect_options.username = user;
-    connect_options.password = password;
+    connect_options.username = broker->user;
+    connect_options.password = broker->password;
     connect_options.connectTimeout = 5;
-    set_ssl_option(&connect_options, endpoint, certfile);
-	MQTTClient_setCallbacks(*client, *client, connection_lost, msg_arrived, delivered);
-    rc = MQTTClient_connect(*client, &connect_options);
-    return rc;
+    connect_options.maxInflight = MAX_INFLIGHT;
+    connect_options.onSuccess = on_connected;
+    connect_options.onFailure = on_connect_failed;
+    connect_options.context = broker;
+    set_ssl_option(&connect_options, broker->endpoint, certfile);
+	MQTTAsync_setCallbacks(client, broker, connection_lost, msg_arrived, NULL);
+
+	Thread_lock_mutex(broker->sender->brokerLock);
+	broker->client = client;
+	broker->linkState = LINK_CONNECTING;
+	Thread_unlock_mutex(broker->sender->brokerLock);
+    return MQTTAsync_connect(client, &connect_options);
 }
 
-static flushIncomingQueueToFile(MqttSender* sender)
+// save the messages into the file, and free them. the messages are packed as
+// [len][msg][len][msg]..., compressed and put as one record, up to
+// CACHE_BLOCK_LIMIT bytes per record, so similar messages compress well
+static void saveMsgsToFile(MqttSender* sender, MqttMessageToPub* tosave)
 {
-	if (sender != NULL && sender->incomingQueue.next != NULL)
+	while (tosave != NULL)
 	{
-		Thread_lock_mutex(sender->lock);
-		MqttMessageToPub* tosave = sender->incomingQueue.next;
-		sender->incomingQueue.next = NULL;
-		Thread_unlock_mutex(sender->lock);
-		while (tosave != NULL)
+		size_t rawLen = 0;
+		MqttMessageToPub* last = tosave;
+		for (; last != NULL; last = last->next)
 		{
-			void* bytes;
+			size_t len = sizeof(size_t) + messageLen(last);
+			if (rawLen > 0 && rawLen + len > CACHE_BLOCK_LIMIT)
+			{
+				break;
+			}
+			rawLen += len;
+		}
+
+		char* raw = (char*) malloc(rawLen);
+		size_t idx = 0;
+		while (tosave != last)
+		{
+			void* bytes = NULL;
 			size_t msg_len = serializeMsg(tosave, &bytes);
-			if (bytes != NULL && msg_len > 0) 
+			if (bytes != NULL && msg_len > 0)
 			{
-				putRingBuFiRecord(sender->ringbuf, bytes, msg_len);
+				memcpy(raw + idx, (void*) &msg_len, sizeof(size_t));
+				idx += sizeof(size_t);
+				memcpy(raw + idx, bytes, msg_len);
+				idx += msg_len;
 				free(bytes);
 			}
 			MqttMessageToPub* todel = tosave;
 			tosave = tosave->next;
 			freeMsg(todel);
 		}
+
+		size_t dictLen = 0;
+		const char* dict = cacheDict(CACHE_DICT_VERSION, &dictLen);
+		size_t cap = CACHE_HEAD_LEN + lzCompressBound(idx);
+		char* record = (char*) malloc(cap);
+		memcpy(record, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+		record[sizeof(CACHE_MAGIC)] = CACHE_DICT_VERSION;
+		memcpy(record + sizeof(CACHE_MAGIC) + 1, (void*) &idx, sizeof(size_t));
+		size_t len = lzCompress(raw, idx, dict, dictLen, record + CACHE_HEAD_LEN,
+				cap - CACHE_HEAD_LEN);
+		if (len > 0)
+		{
+			putRingBuFiRecord(sender->ringbuf, record, CACHE_HEAD_LEN + len);
+		}
+		free(record);
+		free(raw);
+	}
+	commitRingBuFi(sender->ringbuf);
+}
+
+// restore the messages of a record in the file, a compressed block, or
+// a single message written by older versions. return NULL if it's corrupted
+static MqttMessageToPub* parseCacheRecord(const void* data, size_t len)
+{
+	if (len < CACHE_HEAD_LEN || memcmp(data, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)
+	{
+		return deserializeMsg(data);
+	}
+
+	int version = ((const unsigned char*) data)[sizeof(CACHE_MAGIC)];
+	size_t dictLen = 0;
+	const char* dict = cacheDict(version, &dictLen);
+	if (dict == NULL)
+	{
+		LOG_WARN("cache record of unknown dictionary version %d", version);
+		return NULL;
+	}
+	size_t rawLen = 0;
+	memcpy((void*) &rawLen, data + sizeof(CACHE_MAGIC) + 1, sizeof(size_t));
+	if (rawLen > (len - CACHE_HEAD_LEN) * 256)
+	{
+		return NULL;	// more than the compressor could ever gain
+	}
+	char* raw = (char*) malloc(rawLen);
+	if (raw == NULL || lzDecompress(data + CACHE_HEAD_LEN, len - CACHE_HEAD_LEN, dict,
+			dictLen, raw, rawLen) != 0)
+	{
+		free(raw);
+		return NULL;
+	}
+
+	MqttMessageToPub header;
+	header.next = NULL;
+	MqttMessageToPub* tail = &header;
+	size_t idx = 0;
+	while (idx + sizeof(size_t) <= rawLen)
+	{
+		size_t msg_len = 0;
+		memcpy((void*) &msg_len, raw + idx, sizeof(size_t));
+		idx += sizeof(size_t);
+		if (msg_len > rawLen - idx)
+		{
+			break;
+		}
+		tail->next = deserializeMsg(raw + idx);
+		tail = tail->next;
+		idx += msg_len;
+	}
+	free(raw);
+	return header.next;
+}
+
+// put msg into the incoming ring, return 0, or -1 if the ring is full.
+// the producers claim a cell by moving incomingHead, no lock is taken
+static int pushIncoming(MqttSender* sender, MqttMessageToPub* msg)
+{
+	unsigned long pos = __atomic_load_n(&sender->incomingHead, __ATOMIC_RELAXED);
+	while (1)
+	{
+		IncomingCell* cell = &sender->incoming[pos & (INCOMING_SIZE - 1)];
+		long diff = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&sender->incomingHead, &pos, pos + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				msg->seq = pos;
+				cell->msg = msg;
+				__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+				return 0;
+			}
+		}
+		else if (diff < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&sender->incomingHead, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static char hasIncoming(MqttSender* sender)
+{
+	IncomingCell* cell = &sender->incoming[sender->incomingTail & (INCOMING_SIZE - 1)];
+	return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == sender->incomingTail + 1;
+}
+
+// move the queued messages to the end of queue, in order. the worker only
+static void takeIncoming(MqttSender* sender, MqttMessageToPub* queue)
+{
+	MqttMessageToPub* tail = queue;
+	while (tail->next != NULL)
+	{
+		tail = tail->next;
+	}
+	while (hasIncoming(sender))
+	{
+		IncomingCell* cell = &sender->incoming[sender->incomingTail & (INCOMING_SIZE - 1)];
+		tail->next = cell->msg;
+		tail = cell->msg;
+		tail->next = NULL;
+		cell->msg = NULL;
+		__atomic_store_n(&cell->seq, sender->incomingTail + INCOMING_SIZE, __ATOMIC_RELEASE);
+		sender->incomingTail++;
+	}
+}
+
+static void flushIncomingQueueToFile(MqttSender* sender)
+{
+	if (sender != NULL && hasIncoming(sender))
+	{
+		MqttMessageToPub tosave;
+		tosave.next = NULL;
+		takeIncoming(sender, &tosave);
+		saveMsgsToFile(sender, tosave.next);
+	}
+}
+
+static void logIncomingDrops(MqttSender* sender)
+{
+	unsigned long dropped = __atomic_load_n(&sender->incomingDropped, __ATOMIC_RELAXED);
+	if (dropped != sender->incomingDropsLogged)
+	{
+		LOG_WARN("MqttSender dropped %lu messages, the send queue was full (%lu queued, %lu waited)",
+				dropped - sender->incomingDropsLogged,
+				__atomic_load_n(&sender->incomingQueued, __ATOMIC_RELAXED),
+				__atomic_load_n(&sender->incomingWaited, __ATOMIC_RELAXED));
+		sender->incomingDropsLogged = dropped;
+	}
+}
+
+static char sameChannel(const MqttMessageToPub* a, const MqttMessageToPub* b)
+{
+	return strcmp(a->endpoint, b->endpoint) == 0 && strcmp(a->user, b->user) == 0
+		&& strcmp(a->password, b->password) == 0;
+}
+
+// messages taken from the incoming queue only live in memory. when the broker
+// of the head of the queue is unreachable, save its messages of the queue into
+// the file, so they survive a restart, and are retried with the cached ones.
+// the messages of the other brokers stay, and go on
+static void spillBrokerMsgs(MqttSender* sender, MqttMessageToPub* sendingQueue)
+{
+	MqttMessageToPub* failed = sendingQueue->next;
+	MqttMessageToPub tosave;
+	tosave.next = NULL;
+	MqttMessageToPub* tail = &tosave;
+	MqttMessageToPub* prev = sendingQueue;
+	while (prev->next != NULL)
+	{
+		MqttMessageToPub* msg = prev->next;
+		if (msg == failed || sameChannel(msg, failed))
+		{
+			prev->next = msg->next;
+			msg->next = NULL;
+			tail->next = msg;
+			tail = msg;
+		}
+		else
+		{
+			prev = msg;
+		}
+	}
+	saveMsgsToFile(sender, tosave.next);
+}
+
+void wakeupWorker(MqttSender* sender)
+{
+	signal_wakeup(&sender->wakeup);
+}
+
+// the generation is taken before looking at the state, see Wakeup
+void waitForWakeup(MqttSender* sender, unsigned int generation, int seconds)
+{
+	if (sender->status == WORKER_REQUEST_STOP)
+	{
+		return;
+	}
+	wait_wakeup(&sender->wakeup, generation, seconds);
+}
+
+// whether a publish is answered, or a queued message may be sent right away
+static char hasWork(MqttSender* sender)
+{
+	char work = hasIncoming(sender) && sender->inflightCount < MAX_INFLIGHT;
+	int i = 0;
+	Thread_lock_mutex(sender->lock);
+	for (i = 0; i < MAX_INFLIGHT && !work; i++)
+	{
+		work = sender->inflight[i].msg != NULL && sender->inflight[i].state != SLOT_WAITING;
+	}
+	Thread_unlock_mutex(sender->lock);
+	return work;
+}
+
+// block until mqtt_send queues a message, the broker answers, or the timeout,
+// instead of polling
+static void waitForEvent(MqttSender* sender, unsigned int generation, int seconds)
+{
+	if (!hasWork(sender))
+	{
+		waitForWakeup(sender, generation, seconds);
 	}
 }
 
@@ -512,144 +1027,625 @@ static void on_mqtt_sent() {
     }
 }
 
+// tear down the connections the callbacks reported lost, or failed to connect
+static void dropDeadLinks(MqttSender* sender)
+{
+	int i = 0;
+	for (i = 0; i < BROKER_BUCKETS; i++)
+	{
+		MqttBrokerId* broker = sender->brokers[i];
+		for (; broker != NULL; broker = broker->next)
+		{
+			if (broker->client != NULL && broker->linkState == LINK_DOWN)
+			{
+				char bad = broker->connectRc == 1	// Unacceptable protocol version
+					|| broker->connectRc == 4	// Bad user name or password
+					|| broker->connectRc == 5;	// Not authorized
+				if (bad)
+				{
+					LOG_ERROR("Found a bad broker %s, return code %d", broker->endpoint,
+							broker->connectRc);
+				}
+				brokerFailed(sender, broker, bad);
+			}
+		}
+	}
+}
 
-static thread_return_type worker_func(void* arg)
+static InFlight* freeSlot(MqttSender* sender)
 {
-	// peek a record if any
-	// establish mqtt connection if need
-	// send the record and remove from buf
-	MqttSender* sender = (MqttSender*) arg;
-	MqttMessageToPub sendingQueue;
-	sendingQueue.next = NULL;
-	MqttMessageToPub* msg = NULL;
-	while (sender != NULL && sender->status != WORKER_REQUEST_STOP)
+	int i = 0;
+	for (i = 0; i < MAX_INFLIGHT; i++)
 	{
-		if (sendingQueue.next != NULL)
+		if (sender->inflight[i].msg == NULL)
 		{
-			// 1, save incoming queue into file
-			flushIncomingQueueToFile(sender);
+			return &sender->inflight[i];
 		}
-		else
+	}
+	return NULL;
+}
+
+// hand the message to the client library, connect to the broker first if needed.
+// the slot tracks it until the broker acks it
+// return PUB_SENT, PUB_DROPPED if the broker refuses us, PUB_PENDING if it's
+// still connecting, or PUB_FAILED
+static int publishMsg(MqttSender* sender, MqttMessageToPub* msg, InFlight* slot, char fromBacklog)
+{
+	// it's known bad broker?
+	if (isKnownBadBroker(sender, msg->endpoint, msg->user, msg->password))
+	{
+		LOG_WARN("got msg of an known bad broker");
+		return PUB_DROPPED;
+	}
+
+	// the worker is the only one connecting, the lock guards the pool against
+	// the producer's lookups and the callbacks
+	Thread_lock_mutex(sender->brokerLock);
+	MqttBrokerId* broker = findBroker(sender, msg->endpoint, msg->user, msg->password, 1);
+	MQTTAsync mqttClient = broker->client;
+	char linkState = broker->linkState;
+	char inBackoff = broker->state == BROKER_BACKOFF && time(NULL) < broker->nextRetry;
+	Thread_unlock_mutex(sender->brokerLock);
+
+	if (mqttClient == NULL)
+	{
+		if (inBackoff)
+		{
+			return PUB_FAILED;
+		}
+
+		// let's make a connection
+		if (connectBroker(broker, msg->certfile) != MQTTASYNC_SUCCESS)
 		{
-			// if buffer is not empty, save incoming queue to buffer 
-			// and fetch data from buffer
-			// otherwise try to get from incoming queue
-			if (! isRingBuFiEmpty(sender->ringbuf))
+			brokerFailed(sender, broker, 0);
+			return PUB_FAILED;
+		}
+		return PUB_PENDING;
+	}
+	if (linkState != LINK_UP)
+	{
+		return PUB_PENDING;
+	}
+
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+	pubmsg.payload = msg->payload;
+	pubmsg.payloadlen = msg->payloadlen;
+	pubmsg.qos = 1;
+	pubmsg.retained = msg->retain;
+
+	MQTTAsync_responseOptions options = MQTTAsync_responseOptions_initializer;
+	options.onSuccess = on_published;
+	options.onFailure = on_publish_failed;
+	options.context = slot;
+
+	Thread_lock_mutex(sender->lock);
+	slot->msg = msg;
+	slot->broker = broker;
+	slot->fromBacklog = fromBacklog;
+	slot->state = SLOT_WAITING;
+	slot->token = 0;
+	slot->deadline = time(NULL) + PUB_TIMEOUT;
+	Thread_unlock_mutex(sender->lock);
+
+	int rc = MQTTAsync_sendMessage(mqttClient, msg->topic, &pubmsg, &options);
+
+	Thread_lock_mutex(sender->lock);
+	if (rc == MQTTASYNC_SUCCESS)
+	{
+		slot->token = options.token;
+	}
+	else
+	{
+		slot->msg = NULL;
+	}
+	Thread_unlock_mutex(sender->lock);
+
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		brokerFailed(sender, broker, 0);
+		return PUB_FAILED;
+	}
+	sender->inflightCount++;
+	return PUB_SENT;
+}
+
+// whether the backlog lane is still under its rate limit in this second
+static char backlogAllowed(MqttSender* sender)
+{
+	if (sender->backlogRate <= 0)
+	{
+		return 1;
+	}
+	time_t now = time(NULL);
+	if (now != sender->backlogSecond)
+	{
+		sender->backlogSecond = now;
+		sender->backlogInSecond = 0;
+	}
+	return sender->backlogInSecond < sender->backlogRate;
+}
+
+// pick the lane to publish next, NULL if neither lane may send now.
+// live messages go first, the backlog gets (100 - liveShare)% of the
+// publishes while both lanes have data
+static MqttMessageToPub* pickLane(MqttSender* sender, MqttMessageToPub* liveQueue,
+		MqttMessageToPub* backlogQueue, char backlogReady)
+{
+	char hasLive = liveQueue->next != NULL;
+	char hasBacklog = backlogQueue->next != NULL && backlogReady && backlogAllowed(sender);
+	if (!hasLive || !hasBacklog)
+	{
+		// the share only counts while the lanes compete
+		sender->liveSent = 0;
+		sender->backlogSent = 0;
+		return hasLive ? liveQueue : (hasBacklog ? backlogQueue : NULL);
+	}
+
+	if (sender->backlogSent * sender->liveShare < sender->liveSent * (100 - sender->liveShare))
+	{
+		return backlogQueue;
+	}
+	return liveQueue;
+}
+
+// the backlog lane replays one record (a block of messages) of the file at
+// a time, the record is kept in the file until all of its messages are acked
+typedef struct
+{
+	MqttMessageToPub queue;	// not sent yet, just the header
+	char open;	// a record is being replayed
+	size_t seq;	// of the record in the file
+	int pending;	// messages in flight
+	char failed;	// some message failed, replay the record again
+	time_t retryAt;	// don't replay before this, the broker of a record is backing off
+	MqttBrokerId* waitingFor;	// the broker of the next message, while it connects
+	int uncommittedAcks;
+} BacklogLane;
+
+// stop replaying the record, it's replayed again from its first message
+static void failBacklogRecord(BacklogLane* backlog)
+{
+	while (backlog->queue.next != NULL)
+	{
+		MqttMessageToPub* todel = backlog->queue.next;
+		backlog->queue.next = todel->next;
+		freeMsg(todel);
+	}
+	backlog->failed = 1;
+}
+
+// once nothing of the record is left to send or in flight
+static void finishBacklogRecord(MqttSender* sender, BacklogLane* backlog)
+{
+	if (!backlog->open || backlog->queue.next != NULL || backlog->pending > 0)
+	{
+		return;
+	}
+	backlog->open = 0;
+	if (backlog->failed)
+	{
+		backlog->failed = 0;
+		return;
+	}
+
+	// commit after ack, a few acks share one meta write
+	ackRingBuFiRecord(sender->ringbuf, backlog->seq);
+	if (++backlog->uncommittedAcks >= ACK_COMMIT_BATCH)
+	{
+		commitRingBuFi(sender->ringbuf);
+		backlog->uncommittedAcks = 0;
+	}
+}
+
+// when the broker of the message may be tried again, at least a second from now
+static time_t brokerRetryTime(MqttSender* sender, const MqttMessageToPub* msg)
+{
+	time_t retry = time(NULL) + 1;
+	Thread_lock_mutex(sender->brokerLock);
+	MqttBrokerId* broker = findBroker(sender, msg->endpoint, msg->user, msg->password, 0);
+	if (broker != NULL && broker->state == BROKER_BACKOFF && broker->nextRetry > retry)
+	{
+		retry = broker->nextRetry;
+	}
+	Thread_unlock_mutex(sender->brokerLock);
+	return retry;
+}
+
+// the pool entry of the message's channel, NULL if it has none yet
+static MqttBrokerId* brokerOf(MqttSender* sender, const MqttMessageToPub* msg)
+{
+	Thread_lock_mutex(sender->brokerLock);
+	MqttBrokerId* broker = findBroker(sender, msg->endpoint, msg->user, msg->password, 0);
+	Thread_unlock_mutex(sender->brokerLock);
+	return broker;
+}
+
+// a live message waits aside while its broker connects, so the messages to
+// the other brokers aren't held up
+static void parkMsg(MqttBrokerId* broker, MqttMessageToPub* msg)
+{
+	msg->next = NULL;
+	if (broker->parked == NULL)
+	{
+		broker->parked = msg;
+	}
+	else
+	{
+		broker->parkedTail->next = msg;
+	}
+	broker->parkedTail = msg;
+}
+
+// put the parked messages of the connected brokers back at the head of the
+// live lane, they're older than the rest. the ones of a broker which failed
+// to connect are kept in the file instead, or dropped if it refused us
+static void unparkMsgs(MqttSender* sender, MqttMessageToPub* liveQueue)
+{
+	int i = 0;
+	for (i = 0; i < BROKER_BUCKETS; i++)
+	{
+		MqttBrokerId* broker = sender->brokers[i];
+		for (; broker != NULL; broker = broker->next)
+		{
+			if (broker->parked == NULL)
 			{
-				flushIncomingQueueToFile(sender);
+				continue;
+			}
+			Thread_lock_mutex(sender->brokerLock);
+			char up = broker->client != NULL && broker->linkState == LINK_UP;
+			char connecting = broker->client != NULL && broker->linkState == LINK_CONNECTING;
+			char bad = broker->state == BROKER_BAD;
+			Thread_unlock_mutex(sender->brokerLock);
+			if (connecting)
+			{
+				continue;
+			}
 
-				// fetch one record from buffer
-				void* data = NULL;
-				size_t len = 0;
-				peekRingBuFiRecord(sender->ringbuf, &data, &len);
-				popRingBuFiRecord(sender->ringbuf);
-				if (data != NULL && len > 0)
+			MqttMessageToPub* parked = broker->parked;
+			broker->parked = NULL;
+			if (up)
+			{
+				broker->parkedTail->next = liveQueue->next;
+				liveQueue->next = parked;
+			}
+			else if (bad)
+			{
+				while (parked != NULL)
 				{
-					sendingQueue.next = deserializeMsg(data);
-					free(data);
+					MqttMessageToPub* todel = parked;
+					parked = parked->next;
+					freeMsg(todel);
 				}
 			}
 			else
 			{
-				// get data from incoming queue directory
-				if (sender->incomingQueue.next != NULL)
-				{
-					Thread_lock_mutex(sender->lock);
-					sendingQueue.next = sender->incomingQueue.next;
-					sender->incomingQueue.next = NULL;
-					Thread_unlock_mutex(sender->lock);
-				}
+				saveMsgsToFile(sender, parked);
 			}
+			broker->parkedTail = NULL;
+		}
+	}
+}
+
+// the backlog lane waits while the broker of its next message connects,
+// the live lane goes on meanwhile
+static char backlogWaiting(MqttSender* sender, BacklogLane* backlog)
+{
+	if (backlog->waitingFor == NULL)
+	{
+		return 0;
+	}
+	Thread_lock_mutex(sender->brokerLock);
+	char connecting = backlog->waitingFor->client != NULL
+		&& backlog->waitingFor->linkState == LINK_CONNECTING;
+	Thread_unlock_mutex(sender->brokerLock);
+	if (!connecting)
+	{
+		backlog->waitingFor = NULL;
+	}
+	return connecting;
+}
+
+// handle the publishes the brokers answered, or we gave up waiting for
+static void reapInflight(MqttSender* sender, BacklogLane* backlog)
+{
+	MqttMessageToPub failedQueue;
+	failedQueue.next = NULL;
+	MqttMessageToPub* failedTail = &failedQueue;
+	time_t now = time(NULL);
+	int i = 0;
+	for (i = 0; i < MAX_INFLIGHT; i++)
+	{
+		InFlight* slot = &sender->inflight[i];
+		if (slot->msg != NULL && slot->state == SLOT_WAITING && now >= slot->deadline)
+		{
+			LOG_WARN("MqttSender publish timeout, will reconnect");
+			brokerFailed(sender, slot->broker, 0);
+		}
+	}
+
+	for (i = 0; i < MAX_INFLIGHT; i++)
+	{
+		InFlight* slot = &sender->inflight[i];
+		Thread_lock_mutex(sender->lock);
+		MqttMessageToPub* msg = slot->state != SLOT_WAITING ? slot->msg : NULL;
+		char acked = slot->state == SLOT_ACKED;
+		if (msg != NULL)
+		{
+			slot->msg = NULL;
+		}
+		Thread_unlock_mutex(sender->lock);
+		if (msg == NULL)
+		{
+			continue;
 		}
 
-		if (sendingQueue.next == NULL)
+		sender->inflightCount--;
+		if (acked)
+		{
+			on_mqtt_sent();
+		}
+		if (slot->fromBacklog)
+		{
+			freeMsg(msg);
+			backlog->pending--;
+			if (!acked)
+			{
+				failBacklogRecord(backlog);
+			}
+			finishBacklogRecord(sender, backlog);
+		}
+		else if (acked)
 		{
-			// no date to send, sleep for a while
-			sleep(1);
+			freeMsg(msg);
 		}
 		else
 		{
-			msg = sendingQueue.next;
-			// it's known bad broker?
-			if (isKnownBadBroker(sender, msg->endpoint, msg->user, msg->password))
+			msg->next = NULL;
+			failedTail->next = msg;
+			failedTail = msg;
+		}
+	}
+
+	// keep them on disk, they're retried with the cached ones
+	if (failedQueue.next != NULL)
+	{
+		saveMsgsToFile(sender, failedQueue.next);
+	}
+}
+
+// the worker is asked to stop: everything it holds which isn't acked yet is
+// kept in the file, and sent after the restart. an in-flight publish may
+// still be acked by the broker, it's sent twice then, rather than lost
+static void saveUnacked(MqttSender* sender, MqttMessageToPub* liveQueue, BacklogLane* backlog)
+{
+	// the answered ones first
+	reapInflight(sender, backlog);
+
+	MqttMessageToPub tosave;
+	tosave.next = NULL;
+	MqttMessageToPub* tail = &tosave;
+	int i = 0;
+	for (i = 0; i < MAX_INFLIGHT; i++)
+	{
+		InFlight* slot = &sender->inflight[i];
+		Thread_lock_mutex(sender->lock);
+		MqttMessageToPub* msg = slot->msg;
+		slot->msg = NULL;
+		Thread_unlock_mutex(sender->lock);
+		if (msg == NULL)
+		{
+			continue;
+		}
+		sender->inflightCount--;
+		if (slot->fromBacklog)
+		{
+			// its record is still in the file, it isn't acked
+			freeMsg(msg);
+			continue;
+		}
+		msg->next = NULL;
+		tail->next = msg;
+		tail = msg;
+	}
+
+	for (i = 0; i < BROKER_BUCKETS; i++)
+	{
+		MqttBrokerId* broker = sender->brokers[i];
+		for (; broker != NULL; broker = broker->next)
+		{
+			if (broker->parked != NULL)
 			{
-				// discord this message and continue
-				sendingQueue.next = sendingQueue.next->next;
-				freeMsg(msg);
-				printf("got msg of an known bad broker\n");
+				tail->next = broker->parked;
+				tail = broker->parkedTail;
+				broker->parked = NULL;
+				broker->parkedTail = NULL;
+			}
+		}
+	}
+
+	tail->next = liveQueue->next;
+	liveQueue->next = NULL;
+	takeIncoming(sender, &tosave);
+	failBacklogRecord(backlog);
+	saveMsgsToFile(sender, tosave.next);
+	commitRingBuFi(sender->ringbuf);
+}
+
+static void settleBefore(unsigned long* mark, const MqttMessageToPub* msg)
+{
+	for (; msg != NULL; msg = msg->next)
+	{
+		if ((long) (msg->seq - *mark) < 0)
+		{
+			*mark = msg->seq;
+		}
+	}
+}
+
+// commit the file, and publish the position of the oldest live message still
+// held in memory: the ones before it are acked, in the file, or dropped
+static void publishSettled(MqttSender* sender, MqttMessageToPub* liveQueue, BacklogLane* backlog)
+{
+	commitRingBuFi(sender->ringbuf);
+	backlog->uncommittedAcks = 0;
+
+	unsigned long mark = sender->incomingTail;
+	settleBefore(&mark, liveQueue->next);
+	int i = 0;
+	for (i = 0; i < BROKER_BUCKETS; i++)
+	{
+		MqttBrokerId* broker = sender->brokers[i];
+		for (; broker != NULL; broker = broker->next)
+		{
+			settleBefore(&mark, broker->parked);
+		}
+	}
+	Thread_lock_mutex(sender->lock);
+	for (i = 0; i < MAX_INFLIGHT; i++)
+	{
+		const InFlight* slot = &sender->inflight[i];
+		if (slot->msg != NULL && !slot->fromBacklog && (long) (slot->msg->seq - mark) < 0)
+		{
+			mark = slot->msg->seq;
+		}
+	}
+	Thread_unlock_mutex(sender->lock);
+	__atomic_store_n(&sender->settled, mark, __ATOMIC_RELEASE);
+	sender->settledAt = time(NULL);
+}
+
+static thread_return_type worker_func(void* arg)
+{
+	// two lanes: the live lane sends what mqtt_send queued just now, the
+	// backlog lane replays the file, so fresh data isn't stuck behind hours
+	// of history after an outage. the messages keep the timestamps they
+	// were sampled with, whichever lane they take.
+	// publishing doesn't block: up to MAX_INFLIGHT messages, to any of the
+	// brokers, wait for their acks at the same time
+	MqttSender* sender = (MqttSender*) arg;
+	MqttMessageToPub liveQueue;
+	liveQueue.next = NULL;
+	BacklogLane backlog;
+	memset(&backlog, 0, sizeof(backlog));
+	while (sender != NULL && sender->status != WORKER_REQUEST_STOP)
+	{
+		// what happens from here on ends the wait below at once
+		unsigned int generation = wakeup_generation(&sender->wakeup);
+		dropDeadLinks(sender);
+		reapInflight(sender, &backlog);
+		unparkMsgs(sender, &liveQueue);
+		logIncomingDrops(sender);
+		if (time(NULL) != sender->settledAt)
+		{
+			// at least once a second under load, for mqtt_settled
+			publishSettled(sender, &liveQueue, &backlog);
+		}
+
+		if (liveQueue.next == NULL)
+		{
+			takeIncoming(sender, &liveQueue);
+		}
+
+		if (!backlog.open && ! isRingBuFiEmpty(sender->ringbuf) && time(NULL) >= backlog.retryAt)
+		{
+			// fetch one record (a block of messages) from buffer
+			void* data = NULL;
+			size_t len = 0;
+			backlog.seq = headRingBuFiSeq(sender->ringbuf);
+			peekRingBuFiRecord(sender->ringbuf, &data, &len);
+			if (data != NULL && len > 0)
+			{
+				backlog.queue.next = parseCacheRecord(data, len);
+				free(data);
+			}
+			if (backlog.queue.next == NULL)
+			{
+				// unreadable record, skip it
+				popRingBuFiRecord(sender->ringbuf);
 				continue;
 			}
+			backlog.open = 1;
+		}
 
-			MQTTClient mqttClient = findExistingClient(sender, msg->endpoint, msg->user);
-			if (mqttClient == NULL)
+		InFlight* slot = freeSlot(sender);
+		MqttMessageToPub* queue = slot != NULL ? pickLane(sender, &liveQueue, &backlog.queue,
+				!backlogWaiting(sender, &backlog)) : NULL;
+		if (queue == NULL)
+		{
+			// no date to send, the backlog is throttled, or too many in
+			// flight. commit the pending acks, and wait for something to do
+			if (liveQueue.next == NULL)
+			{
+				publishSettled(sender, &liveQueue, &backlog);
+			}
+			else
 			{
-				// let's make a connection
-				MQTTClient newClient;
-				int rc = makeMqttConnection(&newClient, msg->endpoint, msg->user, msg->password,
-				 msg->certfile);
+				commitRingBuFi(sender->ringbuf);
+				backlog.uncommittedAcks = 0;
+			}
+			char busy = sender->inflightCount > 0 || backlog.open || ! isRingBuFiEmpty(sender->ringbuf);
+			waitForEvent(sender, generation, busy ? 1 : IDLE_WAIT);
+			continue;
+		}
 
-				if (rc != MQTTCLIENT_SUCCESS)
-				{
-					MQTTClient_destroy(&newClient);
-					if (rc == 1 	// Unacceptable protocol version
-						|| rc == 4	// Bad user name or password
-						|| rc == 5)	// Not authorized
-					{
-						MqttBrokerId* badBroker = (MqttBrokerId*) malloc(sizeof(MqttBrokerId));
-						byte_copy((void**)&badBroker->endpoint, msg->endpoint, strlen(msg->endpoint) + 1, 1);
-						byte_copy((void**)&badBroker->user, msg->user, strlen(msg->user) + 1, 1);
-						byte_copy((void**)&badBroker->password, msg->password, strlen(msg->password) + 1, 1);
-						badBroker->next = sender->badBrokers;
-						sender->badBrokers = badBroker;
-						printf("Found a bad broker\n");
-					}
-					sleep(1);
-					continue;
-				}
+		MqttMessageToPub* msg = queue->next;
+		char fromBacklog = queue == &backlog.queue;
+		int rc = publishMsg(sender, msg, slot, fromBacklog);
+		if (rc == PUB_PENDING && fromBacklog)
+		{
+			// replayed in order, the lane waits for the connection
+			backlog.waitingFor = brokerOf(sender, msg);
+			continue;
+		}
+		if (rc == PUB_PENDING)
+		{
+			queue->next = msg->next;
+			parkMsg(brokerOf(sender, msg), msg);
+			continue;
+		}
+		if (rc == PUB_FAILED && fromBacklog)
+		{
+			// the record stays at the head of the file, and is replayed once
+			// its broker may be tried again. the live lane goes on meanwhile
+			backlog.retryAt = brokerRetryTime(sender, msg);
+			failBacklogRecord(&backlog);
+			finishBacklogRecord(sender, &backlog);
+			continue;
+		}
+		if (rc == PUB_FAILED)
+		{
+			// keep the broker's messages on disk while it's unreachable
+			spillBrokerMsgs(sender, &liveQueue);
+			continue;
+		}
 
-				mqttClient = newClient;
-				MqttBrokerId* broker = (MqttBrokerId *) malloc(sizeof(MqttBrokerId));
-				byte_copy((void**)&broker->endpoint, msg->endpoint, strlen(msg->endpoint) + 1, 1);
-				byte_copy((void**)&broker->user, msg->user, strlen(msg->user) + 1, 1);
-				byte_copy((void**)&broker->password, msg->password, strlen(msg->password) + 1, 1);
-				
-				broker->client = mqttClient;
-				broker->next = sender->mqttClients;
-				sender->mqttClients = broker;
-			}
+		queue->next = msg->next;
+		msg->next = NULL;
+		if (rc == PUB_DROPPED)
+		{
+			freeMsg(msg);
+		}
+		if (!fromBacklog)
+		{
+			sender->liveSent++;
+			continue;
+		}
 
-			MQTTClient_message pubmsg = MQTTClient_message_initializer;
-	        MQTTClient_deliveryToken delivery_token;
-	        
-	        pubmsg.payload = msg->payload;
-	        pubmsg.payloadlen = msg->payloadlen;
-	        pubmsg.qos = 1;
-	        pubmsg.retained = msg->retain;
-
-	        int rc = MQTTClient_publishMessage(mqttClient,
-	                 msg->topic, &pubmsg, &delivery_token);
-	        
-	        if (rc == MQTTCLIENT_SUCCESS)
-	        {
-	        	int waitrc = MQTTClient_waitForCompletion(mqttClient, delivery_token, 10000L);
-	        	if (waitrc == MQTTCLIENT_SUCCESS)
-	        	{
-	        		sendingQueue.next = sendingQueue.next->next;
-					freeMsg(msg);
-					on_mqtt_sent();
-				}
-	        }
-	        else
-	        {
-	        	removeExistingClient(sender, mqttClient);
-	        	MQTTClient_disconnect(mqttClient, 3000);
-	        	MQTTClient_destroy(&mqttClient);
-	        	sleep(1);
-	        }
-	    }
-	    					
+		sender->backlogSent++;
+		sender->backlogInSecond++;
+		if (rc == PUB_SENT)
+		{
+			backlog.pending++;
+		}
+		finishBacklogRecord(sender, &backlog);
+	}
+	if (sender != NULL)
+	{
+		saveUnacked(sender, &liveQueue, &backlog);
+		__atomic_store_n(&sender->settled, sender->incomingTail, __ATOMIC_RELEASE);
+		sender->status = WORKER_STOPPED;
+		wakeupWorker(sender);
 	}
-	sender->status = WORKER_STOPPED;
 }
 
 char mqtt_send(int handle, 
@@ -670,7 +1666,7 @@ char mqtt_send(int handle,
 
 	// 1, check if it's a bad broker
 	if (isKnownBadBroker(SENDERS[handle], endpoint, username, password) == 1) {
-		return -1;
+		return MQTT_SEND_REFUSED;
 	}
 
 	// add to ring buffer
@@ -704,15 +1700,35 @@ char mqtt_send(int handle,
 	}
 
 
+	// constant time, and no lock shared with the other producers or the
+	// worker. while the ring is full, wait a while for the worker to make
+	// room, it spills the queue into the file when the broker is
+	// unreachable; after that drop the message, rather than stall polling
 	MqttSender* sender = SENDERS[handle];
-	Thread_lock_mutex(sender->lock);
-	MqttMessageToPub* list = &(sender->incomingQueue);
-	while (list->next != NULL)
+	int waited = 0;
+	while (pushIncoming(sender, msg) != 0)
 	{
-		list = list->next;
+		if (waited == 0)
+		{
+			__sync_fetch_and_add(&sender->incomingWaited, 1);
+		}
+		if (waited >= INCOMING_FULL_WAIT || sender->status != WORKER_RUNNING)
+		{
+			__sync_fetch_and_add(&sender->incomingDropped, 1);
+			freeMsg(msg);
+			return -1;
+		}
+		wakeupWorker(sender);
+#if defined(WIN32) || defined(WIN64)
+		Sleep(INCOMING_NAP);
+#else
+		usleep(INCOMING_NAP * 1000);
+#endif
+		waited += INCOMING_NAP;
 	}
-	list->next = msg;
-	Thread_unlock_mutex(sender->lock);
+	__sync_fetch_and_add(&sender->incomingQueued, 1);
+	wakeupWorker(sender);
+	return 0;
 }
 
 void byte_copy(void** dest, const void* src, int len, char padnull)
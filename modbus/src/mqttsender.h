@@ -10,11 +10,28 @@ int new_mqtt_sender(const char* cacheFile, int cacheSize);
 // close the mqtt sender
 void close_mqtt_sender(int handle);
 
+// split the publishes between fresh messages and the cached backlog:
+// while both have messages, liveShare percent of the publishes go to the
+// fresh ones; the backlog is further limited to backlogRate messages per
+// second, 0 for no limit. by default liveShare is 80, backlogRate is 0
+void set_mqtt_sender_lanes(int handle, int liveShare, int backlogRate);
+
+// positions of the messages mqtt_send queued: mqtt_queued is the one after
+// the last queued message, the ones before mqtt_settled are acked by the
+// broker, saved in the cache file, or dropped. take mqtt_queued after some
+// messages are sent, they're safe once mqtt_settled reaches it
+unsigned long mqtt_queued(int handle);
+unsigned long mqtt_settled(int handle);
+
+
+#define MQTT_SEND_REFUSED ((char) -2)
 
 // try to send a mqtt message
 // data will be cached if mqtt connection
 // is disconnected. order will be reserved
-// return 0 on success, -1 on error
+// return 0 on success, MQTT_SEND_REFUSED if the broker refused our
+// credentials before and the message is dropped, -1 on other errors, e.g.
+// the queue stayed full
 char mqtt_send(int handle, 
 	const char* endpoint, 
 	const char* username,
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "policysnapshot.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if !defined(_WIN32) && !defined(WIN64)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char SNAPSHOT_MAGIC[4] = {'M', 'B', 'P', 'S'};
+static const uint32_t SNAPSHOT_VERSION = 2;    // 2: FC23 write_data is checked
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;    // sizeof(SlavePolicy), rejects snapshots of other builds
+    uint32_t count;
+    uint32_t source_hash;    // of the json the policies are compiled from
+    uint32_t checksum;    // of the policy records
+} SnapshotHeader;
+
+static uint32_t fnv1a(uint32_t hash, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    size_t i = 0;
+    for (i = 0; i < len; i++)
+    {
+        hash = (hash ^ p[i]) * 16777619U;
+    }
+    return hash;
+}
+
+unsigned int policy_source_hash(const char* content, long len)
+{
+    if (content == NULL || len <= 0)
+    {
+        return 0;
+    }
+    return fnv1a(2166136261U, content, (size_t) len);
+}
+
+// check the snapshot in data and build the policy list from it
+static int parse_snapshot(const char* data, size_t len, uint32_t source_hash, SlavePolicy* header)
+{
+    SnapshotHeader head;
+    if (len < sizeof(head))
+    {
+        return -1;
+    }
+    memcpy(&head, data, sizeof(head));
+    if (memcmp(head.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+        || head.version != SNAPSHOT_VERSION || head.record_size != sizeof(SlavePolicy)
+        || head.source_hash != source_hash
+        || (len - sizeof(head)) / sizeof(SlavePolicy) != head.count
+        || (len - sizeof(head)) % sizeof(SlavePolicy) != 0)
+    {
+        return -1;
+    }
+    const char* records = data + sizeof(head);
+    if (fnv1a(2166136261U, records, len - sizeof(head)) != head.checksum)
+    {
+        LOG_WARN("policy snapshot checksum mismatch, ignoring it");
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    SlavePolicy* tail = header;
+    uint32_t i = 0;
+    for (i = 0; i < head.count; i++)
+    {
+        SlavePolicy* policy = (SlavePolicy*) malloc(sizeof(SlavePolicy));
+        memcpy(policy, records + i * sizeof(SlavePolicy), sizeof(SlavePolicy));
+        policy->nextRun = now + policy->interval;
+        policy->next = NULL;
+        tail->next = policy;
+        tail = policy;
+    }
+    return (int) head.count;
+}
+
+int load_policy_snapshot(const char* path, unsigned int source_hash, SlavePolicy* header)
+{
+    if (path == NULL || header == NULL)
+    {
+        return -1;
+    }
+    int count = -1;
+#if !defined(_WIN32) && !defined(WIN64)
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            count = parse_snapshot((const char*) data, (size_t) st.st_size, source_hash, header);
+            munmap(data, (size_t) st.st_size);
+        }
+    }
+    close(fd);
+#else
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    long size = 0;
+    if (fseek(fp, 0L, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0L, SEEK_SET) == 0)
+    {
+        char* data = (char*) malloc(size);
+        if (data != NULL && fread(data, 1, size, fp) == (size_t) size)
+        {
+            count = parse_snapshot(data, (size_t) size, source_hash, header);
+        }
+        free(data);
+    }
+    fclose(fp);
+#endif
+    return count;
+}
+
+int save_policy_snapshot(const char* path, unsigned int source_hash, const SlavePolicy* header)
+{
+    if (path == NULL || header == NULL)
+    {
+        return -1;
+    }
+
+    SnapshotHeader head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    head.version = SNAPSHOT_VERSION;
+    head.record_size = sizeof(SlavePolicy);
+    head.source_hash = source_hash;
+    head.checksum = 2166136261U;
+    const SlavePolicy* policy = header->next;
+    for (; policy != NULL; policy = policy->next)
+    {
+        head.count++;
+        head.checksum = fnv1a(head.checksum, policy, sizeof(SlavePolicy));
+    }
+
+    // write to a temp file then rename, a crash never leaves a half snapshot.
+    // the temp file is per process, the shards may save the snapshot at once
+    char tmp[MAX_LEN];
+#if !defined(_WIN32) && !defined(WIN64)
+    snprintf(tmp, MAX_LEN, "%s.%d.tmp", path, (int) getpid());
+#else
+    snprintf(tmp, MAX_LEN, "%s.tmp", path);
+#endif
+    FILE* fp = fopen(tmp, "wb");
+    if (fp == NULL)
+    {
+        LOG_ERROR("failed to open %s for write", tmp);
+        return -1;
+    }
+    int ok = fwrite(&head, sizeof(head), 1, fp) == 1;
+    for (policy = header->next; ok && policy != NULL; policy = policy->next)
+    {
+        ok = fwrite(policy, sizeof(SlavePolicy), 1, fp) == 1;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (!ok)
+    {
+        remove(tmp);
+        return -1;
+    }
+    remove(path);    // rename doesn't replace an existing file on windows
+    return rename(tmp, path) == 0 ? 0 : -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INF_BCE_IOT_MODBUS_SDK_C_POLICYSNAPSHOT_H
+#define INF_BCE_IOT_MODBUS_SDK_C_POLICYSNAPSHOT_H
+
+#include "data.h"
+
+// the policy snapshot is a binary copy of the slave policies compiled from
+// the json policy cache, so a restart doesn't parse the json again. it
+// records the hash of the json it's compiled from, and a checksum of the
+// policies, a stale or corrupted snapshot is ignored
+
+// hash of the json policy cache content
+unsigned int policy_source_hash(const char* content, long len);
+
+// load the policies of the snapshot into the list after header, in the
+// order they were saved. return the number of policies, or -1 if the
+// snapshot is missing, corrupted, or not compiled from source_hash
+int load_policy_snapshot(const char* path, unsigned int source_hash, SlavePolicy* header);
+
+// save the policies following header, return 0 on success, -1 otherwise
+int save_policy_snapshot(const char* path, unsigned int source_hash, const SlavePolicy* header);
+
+#endif
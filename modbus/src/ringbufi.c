@@ -32,6 +32,8 @@ RingBuFi* newRingBuFi(const char* file, size_t sizeLimit) {
 		pBuf->head = pBuf->next;
 		pBuf->nomanland = pBuf->next;
 		pBuf->blockCnt = 0;
+		pBuf->headSeq = 0;
+		pBuf->dirty = 0;
 		// init the file
 		saveMeta(pBuf);
 	} else {
@@ -41,6 +43,9 @@ RingBuFi* newRingBuFi(const char* file, size_t sizeLimit) {
 		fread((void*)&pBuf->blockCnt, sizeof(pBuf->blockCnt), 1, fp);
 		fread((void*)&pBuf->sizeLimit, sizeof(pBuf->sizeLimit), 1, fp);
 		pBuf->fp = fp;
+		pBuf->headSeq = 0;
+		pBuf->dirty = 0;
+		pBuf->diskHead = pBuf->head;
 	}
 	return pBuf;
 }
@@ -54,6 +59,14 @@ void saveMeta(RingBuFi* pBuf) {
 		fwrite((const void*)&pBuf->blockCnt, sizeof(pBuf->blockCnt), 1, pBuf->fp);
 		fwrite((const void*)&pBuf->sizeLimit, sizeof(pBuf->sizeLimit), 1, pBuf->fp);
 		fflush(pBuf->fp);
+		pBuf->dirty = 0;
+		pBuf->diskHead = pBuf->head;
+	}
+}
+
+void commitRingBuFi(RingBuFi* pBuf) {
+	if (pBuf != NULL && pBuf->dirty) {
+		saveMeta(pBuf);
 	}
 }
 
@@ -74,6 +87,7 @@ size_t eraseEnoughSpaceOrEof(RingBuFi* pBuf, size_t bytesFreed, size_t byteToFre
 		size_t recordLen = readSizet(pBuf->fp, pBuf->head);
 		bytesFreedTotal += recordLen + sizeof(size_t);
 		pBuf->head += recordLen + sizeof(size_t);
+		pBuf->headSeq++;
 		increaseBlockCnt(pBuf, -1); // pBuf->blockCnt--;
 	}
 
@@ -89,7 +103,15 @@ int putRingBuFiRecord(RingBuFi* pBuf, const void* pBytes, size_t len) {
 		return 0; 	// limit is too small
 	}
 
+	if (pBuf->head != pBuf->diskHead)
+	{
+		// acked records aren't committed yet: a crash would replay them from
+		// the old head, so their space mustn't be written over before that
+		saveMeta(pBuf);
+	}
+
 	size_t sizeToWrite = sizeof(size_t) + len;
+	size_t headSeq = pBuf->headSeq;
 	if (pBuf->blockCnt <= 0)
 	{
 		// the buf is empty, start from the beginning
@@ -123,7 +145,7 @@ int putRingBuFiRecord(RingBuFi* pBuf, const void* pBytes, size_t len) {
 				pBuf->head = metaLen();
 			}
 			pBuf->next = sizeToWrite + metaLen();
-			saveMeta(pBuf);
+			pBuf->dirty = 1;
 		} else {
 			// just put the block to the end of file
 			size_t newNext = pBuf->next + sizeToWrite; 
@@ -132,7 +154,7 @@ int putRingBuFiRecord(RingBuFi* pBuf, const void* pBytes, size_t len) {
 			increaseBlockCnt(pBuf, 1); // pBuf->blockCnt++;
 			pBuf->next = newNext;
 			pBuf->nomanland = pBuf->next;
-			saveMeta(pBuf);
+			pBuf->dirty = 1;
 		}
 			
 	} else { // if (pBuf->next <= pBuf->head) {
@@ -172,6 +194,7 @@ int putRingBuFiRecord(RingBuFi* pBuf, const void* pBytes, size_t len) {
 				else
 				{
 					// every thing will be erased
+					pBuf->headSeq += pBuf->blockCnt;
 					pBuf->next = metaLen();
 					pBuf->head = pBuf->next;
 					pBuf->nomanland = pBuf->next;
@@ -187,6 +210,12 @@ int putRingBuFiRecord(RingBuFi* pBuf, const void* pBytes, size_t len) {
 		{
 			pBuf->nomanland = pBuf->next;
 		}
+		pBuf->dirty = 1;
+	}
+
+	if (pBuf->headSeq != headSeq)
+	{
+		// old records are overwritten, the meta on disk must not point to them
 		saveMeta(pBuf);
 	}
 	
@@ -207,7 +236,9 @@ int peekRingBuFiRecord(const RingBuFi* pBuf, void** ppBytes, size_t* pLen) {
 	return 1;
 }
 
-int popRingBuFiRecord(RingBuFi* pBuf) {
+// remove the head record, the meta is only written when the buffer becomes
+// empty, since the file is truncated then
+static int removeHeadRecord(RingBuFi* pBuf) {
 	if (pBuf == NULL || pBuf->fp == NULL || pBuf->blockCnt == 0) {
 		return 0;
 	}
@@ -220,23 +251,46 @@ int popRingBuFiRecord(RingBuFi* pBuf) {
 		pBuf->head = metaLen();
 	}
 	pBuf->blockCnt--;
+	pBuf->headSeq++;
+	pBuf->dirty = 1;
 	if (pBuf->blockCnt <= 0)
 	{
 		pBuf->next = metaLen();
 		pBuf->head = pBuf->next;
 		pBuf->nomanland = pBuf->next;
 		pBuf->blockCnt = 0;
+		// the meta must not point beyond the file once it's truncated
+		saveMeta(pBuf);
 		// truncate the file to minimize the disk usage
 		if (ftruncate(fileno(pBuf->fp), metaLen()) != 0)
 		{
 			printf("[WARN] failed to shorten the file size by ftruncate, no functional impact\r\n");
 		}
 	}
-	saveMeta(pBuf);
+	return 1;
+}
+
+int popRingBuFiRecord(RingBuFi* pBuf) {
+	int rc = removeHeadRecord(pBuf);
+	commitRingBuFi(pBuf);
+	return rc;
+}
+
+size_t headRingBuFiSeq(const RingBuFi* pBuf) {
+	return pBuf == NULL ? 0 : pBuf->headSeq;
+}
+
+int ackRingBuFiRecord(RingBuFi* pBuf, size_t seq) {
+	if (pBuf == NULL || pBuf->headSeq != seq) {
+		// the peeked record has been overwritten already
+		return 0;
+	}
+	return removeHeadRecord(pBuf);
 }
 
 void closeRingBuFi(RingBuFi* pBuf) {
 	if (pBuf != NULL && pBuf->fp != NULL) {
+		commitRingBuFi(pBuf);
 		fclose(pBuf->fp);
 	}
 }
@@ -255,7 +309,6 @@ size_t readSizet(FILE* fp, size_t offset) {
 size_t writeBytesAt(FILE* fp, size_t offset, const void* pBytes, size_t len) {
 	fseek(fp, offset, SEEK_SET);
 	size_t ret = fwrite(pBytes, len, 1, fp);
-	fflush(fp);
 	return ret;
 }
 
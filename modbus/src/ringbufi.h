@@ -17,6 +17,9 @@ typedef struct {
 	size_t next;	// file offset for the next record
 	size_t head;		// file offset of the first (eldest) record
 	size_t nomanland;	// stop reading after this offset
+	size_t headSeq;	// records removed from head since opened, identifies the head record
+	char dirty;	// meta changed in memory, but not committed to the file yet
+	size_t diskHead;	// the head in the meta of the file, behind head while acks aren't committed
 } RingBuFi;
 
 
@@ -39,6 +42,21 @@ int peekRingBuFiRecord(const RingBuFi* pBuf, void** ppBytes, size_t* pLen);
 // return 0 on success, otherwise -1
 int popRingBuFiRecord(RingBuFi* pBuf);
 
+// the sequence of the head record, take it before peek, and pass it to ack
+size_t headRingBuFiSeq(const RingBuFi* pBuf);
+
+// acknowledge the head record peeked with seq has been delivered, and remove it.
+// unlike pop, the meta is not written until commitRingBuFi, so a few acks can
+// share one write; a crash before the commit replays them (at least once).
+// a put commits the pending acks first, the space they freed is still the
+// head of the file until then.
+// if the record has been overwritten since peek (the buffer was full), nothing
+// is removed. return 1 if a record is removed, otherwise 0
+int ackRingBuFiRecord(RingBuFi* pBuf, size_t seq);
+
+// write the meta to the file, if there are changes not committed yet
+void commitRingBuFi(RingBuFi* pBuf);
+
 void closeRingBuFi(RingBuFi* pBuf);
 #endif
 
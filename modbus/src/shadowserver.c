@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "shadowserver.h"
+#include "data.h"
+#include "common.h"
+#include "thread.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <modbus/modbus.h>
+
+#if defined(_WIN32) || defined(WIN64)
+#include <winsock2.h>
+#define close_socket closesocket
+#else
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#define close_socket close
+#endif
+
+enum {
+    SHADOW_TABLE_COUNT = 4,    // coils, discrete inputs, holding registers, input registers
+    SHADOW_MAX_CLIENTS = 16,
+    SHADOW_STALE_INTERVALS = 3,    // a block is stale after missing this many polls
+    SHADOW_MIN_MAX_AGE = 10,       // in seconds, so a 1s policy isn't flapping on a slow bus
+    MBAP_LEN = 7               // mbap header including the unit id
+};
+
+// modbus exception codes
+enum {
+    EX_ILLEGAL_FUNCTION = 0x01,
+    EX_ILLEGAL_DATA_ADDRESS = 0x02,
+    EX_ILLEGAL_DATA_VALUE = 0x03,
+    EX_GATEWAY_TARGET_FAILED = 0x0B
+};
+
+// a run of consecutive bits/registers, as one policy reads them
+typedef struct ShadowBlock_t
+{
+    int addr;
+    int nb;
+    uint16_t* values;    // bits are stored as 0/1 as well
+    time_t expires;      // values read after this are no longer trusted
+    struct ShadowBlock_t* next;
+} ShadowBlock;
+
+static ShadowBlock* g_shadow[MODBUS_DATA_COUNT][SHADOW_TABLE_COUNT];
+static mutex_type g_shadow_lock;
+
+static int g_stop_shadow_server = 0;
+static int g_shadow_server_is_running = 0;
+static int g_shadow_server_port = 0;
+
+// map the function code to the table it reads, -1 if it's not a read
+static int table_of(int function)
+{
+    switch (function)
+    {
+        case MODBUS_FC_READ_COILS:
+            return 0;
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return 1;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case FC_READ_WRITE_REGISTERS:
+            return 2;
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return 3;
+        default:
+            break;
+    }
+    return -1;
+}
+
+void init_shadow()
+{
+    memset(g_shadow, 0, sizeof(g_shadow));
+    g_shadow_lock = Thread_create_mutex();
+}
+
+// forget the whole image, on exit and whenever the policy set is replaced,
+// so addresses no policy polls anymore aren't served forever
+void cleanup_shadow()
+{
+    Thread_lock_mutex(g_shadow_lock);
+    int i = 0;
+    int j = 0;
+    for (i = 0; i < MODBUS_DATA_COUNT; i++)
+    {
+        for (j = 0; j < SHADOW_TABLE_COUNT; j++)
+        {
+            ShadowBlock* block = g_shadow[i][j];
+            while (block != NULL)
+            {
+                ShadowBlock* next = block->next;
+                free(block->values);
+                free(block);
+                block = next;
+            }
+            g_shadow[i][j] = NULL;
+        }
+    }
+    Thread_unlock_mutex(g_shadow_lock);
+}
+
+// find the block for exactly this read, or create one
+// caller should hold g_shadow_lock
+static ShadowBlock* get_block(int slaveid, int table, int addr, int nb)
+{
+    ShadowBlock* block = g_shadow[slaveid][table];
+    while (block != NULL)
+    {
+        if (block->addr == addr && block->nb == nb)
+        {
+            return block;
+        }
+        block = block->next;
+    }
+
+    block = (ShadowBlock*) malloc(sizeof(ShadowBlock));
+    block->values = (uint16_t*) malloc(nb * sizeof(uint16_t));
+    if (block->values == NULL)
+    {
+        free(block);
+        return NULL;
+    }
+    block->addr = addr;
+    block->nb = nb;
+    block->next = g_shadow[slaveid][table];
+    g_shadow[slaveid][table] = block;
+    return block;
+}
+
+// values of a policy polled every interval seconds are stale when it missed
+// SHADOW_STALE_INTERVALS polls in a row, e.g. the slave stopped answering
+static time_t expire_time(int interval)
+{
+    int max_age = interval * SHADOW_STALE_INTERVALS;
+    if (max_age < SHADOW_MIN_MAX_AGE)
+    {
+        max_age = SHADOW_MIN_MAX_AGE;
+    }
+    return time(NULL) + max_age;
+}
+
+void shadow_update_bits(int slaveid, int function, int addr, int nb, int interval,
+        const uint8_t* src)
+{
+    int table = table_of(function);
+    if (slaveid < 0 || slaveid >= MODBUS_DATA_COUNT || table == -1 || nb <= 0 || src == NULL)
+    {
+        return;
+    }
+
+    Thread_lock_mutex(g_shadow_lock);
+    ShadowBlock* block = get_block(slaveid, table, addr, nb);
+    if (block != NULL)
+    {
+        int i = 0;
+        for (i = 0; i < nb; i++)
+        {
+            block->values[i] = src[i] ? 1 : 0;
+        }
+        block->expires = expire_time(interval);
+    }
+    Thread_unlock_mutex(g_shadow_lock);
+}
+
+void shadow_update_registers(int slaveid, int function, int addr, int nb, int interval,
+        const uint16_t* src)
+{
+    int table = table_of(function);
+    if (slaveid < 0 || slaveid >= MODBUS_DATA_COUNT || table == -1 || nb <= 0 || src == NULL)
+    {
+        return;
+    }
+
+    Thread_lock_mutex(g_shadow_lock);
+    ShadowBlock* block = get_block(slaveid, table, addr, nb);
+    if (block != NULL)
+    {
+        memcpy(block->values, src, nb * sizeof(uint16_t));
+        block->expires = expire_time(interval);
+    }
+    Thread_unlock_mutex(g_shadow_lock);
+}
+
+// copy nb values starting from addr out of the shadow image, the range may
+// span a few blocks, as long as every address is covered by a fresh one.
+// an address only stale blocks cover answers gateway target failed, as
+// the slave itself didn't answer the last polls.
+// return 0 on success, or the exception code to reply
+// caller should hold g_shadow_lock
+static int shadow_lookup(int slaveid, int table, int addr, int nb, uint16_t* dest)
+{
+    if (slaveid < 0 || slaveid >= MODBUS_DATA_COUNT)
+    {
+        return EX_GATEWAY_TARGET_FAILED;
+    }
+    if (g_shadow[slaveid][0] == NULL && g_shadow[slaveid][1] == NULL
+        && g_shadow[slaveid][2] == NULL && g_shadow[slaveid][3] == NULL)
+    {
+        // we never read anything from this slave
+        return EX_GATEWAY_TARGET_FAILED;
+    }
+
+    time_t now = time(NULL);
+    int i = 0;
+    for (i = 0; i < nb; i++)
+    {
+        int cur = addr + i;
+        int stale = 0;
+        ShadowBlock* block = g_shadow[slaveid][table];
+        while (block != NULL)
+        {
+            if (cur >= block->addr && cur < block->addr + block->nb)
+            {
+                if (now <= block->expires)
+                {
+                    break;
+                }
+                stale = 1;
+            }
+            block = block->next;
+        }
+        if (block == NULL)
+        {
+            return stale ? EX_GATEWAY_TARGET_FAILED : EX_ILLEGAL_DATA_ADDRESS;
+        }
+        dest[i] = block->values[cur - block->addr];
+    }
+    return 0;
+}
+
+static int send_all(int fd, const uint8_t* buf, int len)
+{
+    int sent = 0;
+    while (sent < len)
+    {
+        int rc = send(fd, (const char*) buf + sent, len - sent, 0);
+        if (rc <= 0)
+        {
+            return -1;
+        }
+        sent += rc;
+    }
+    return sent;
+}
+
+// build the response of the request in query, and send it back to fd
+static int reply(int fd, const uint8_t* query)
+{
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    uint16_t values[MODBUS_MAX_READ_BITS];
+    int slaveid = query[6];
+    int function = query[7];
+    int addr = (query[8] << 8) | query[9];
+    int nb = (query[10] << 8) | query[11];
+
+    int len = MBAP_LEN;
+    int ex = 0;
+    int table = function >= MODBUS_FC_READ_COILS && function <= MODBUS_FC_READ_INPUT_REGISTERS
+            ? table_of(function) : -1;
+    if (table == -1)
+    {
+        ex = EX_ILLEGAL_FUNCTION;
+    }
+    else if (nb < 1 || (table < 2 && nb > MODBUS_MAX_READ_BITS)
+        || (table >= 2 && nb > MODBUS_MAX_READ_REGISTERS))
+    {
+        ex = EX_ILLEGAL_DATA_VALUE;
+    }
+    else
+    {
+        Thread_lock_mutex(g_shadow_lock);
+        ex = shadow_lookup(slaveid, table, addr, nb, values);
+        Thread_unlock_mutex(g_shadow_lock);
+    }
+
+    if (ex != 0)
+    {
+        rsp[len++] = function | 0x80;
+        rsp[len++] = ex;
+    }
+    else if (table < 2)
+    {
+        int bytes = (nb + 7) / 8;
+        rsp[len++] = function;
+        rsp[len++] = bytes;
+        memset(rsp + len, 0, bytes);
+        int i = 0;
+        for (i = 0; i < nb; i++)
+        {
+            if (values[i])
+            {
+                rsp[len + i / 8] |= 1 << (i % 8);
+            }
+        }
+        len += bytes;
+    }
+    else
+    {
+        rsp[len++] = function;
+        rsp[len++] = nb * 2;
+        int i = 0;
+        for (i = 0; i < nb; i++)
+        {
+            rsp[len++] = values[i] >> 8;
+            rsp[len++] = values[i] & 0xFF;
+        }
+    }
+
+    // transaction id and protocol id are echoed, length covers unit id + pdu
+    rsp[0] = query[0];
+    rsp[1] = query[1];
+    rsp[2] = 0;
+    rsp[3] = 0;
+    rsp[4] = (len - 6) >> 8;
+    rsp[5] = (len - 6) & 0xFF;
+    rsp[6] = slaveid;
+    return send_all(fd, rsp, len);
+}
+
+static thread_return_type shadow_server_func(void* arg)
+{
+    g_shadow_server_is_running = 1;
+
+    modbus_t* ctx = modbus_new_tcp(NULL, g_shadow_server_port);
+    int server = ctx == NULL ? -1 : modbus_tcp_listen(ctx, SHADOW_MAX_CLIENTS);
+    if (server == -1)
+    {
+        LOG_ERROR("failed to listen on shadow server port %d: %s",
+                g_shadow_server_port, modbus_strerror(errno));
+        if (ctx != NULL)
+        {
+            modbus_free(ctx);
+        }
+        g_shadow_server_is_running = 0;
+        return 0;
+    }
+    LOG_INFO("modbus shadow server is listening on port %d", g_shadow_server_port);
+
+    int clients[SHADOW_MAX_CLIENTS];
+    int i = 0;
+    for (i = 0; i < SHADOW_MAX_CLIENTS; i++)
+    {
+        clients[i] = -1;
+    }
+
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+    while (g_stop_shadow_server != 1)
+    {
+        fd_set rset;
+        FD_ZERO(&rset);
+        FD_SET(server, &rset);
+        int maxfd = server;
+        for (i = 0; i < SHADOW_MAX_CLIENTS; i++)
+        {
+            if (clients[i] != -1)
+            {
+                FD_SET(clients[i], &rset);
+                maxfd = clients[i] > maxfd ? clients[i] : maxfd;
+            }
+        }
+
+        // wake up every second to check whether we should stop
+        struct timeval tv;
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (select(maxfd + 1, &rset, NULL, NULL, &tv) <= 0)
+        {
+            continue;
+        }
+
+        if (FD_ISSET(server, &rset))
+        {
+            int fd = modbus_tcp_accept(ctx, &server);
+            for (i = 0; fd != -1 && i < SHADOW_MAX_CLIENTS && clients[i] != -1; i++)
+            {
+            }
+            if (fd != -1 && i == SHADOW_MAX_CLIENTS)
+            {
+                LOG_WARN("too many shadow server clients, max is %d", SHADOW_MAX_CLIENTS);
+                close_socket(fd);
+            }
+            else if (fd != -1)
+            {
+                clients[i] = fd;
+            }
+        }
+
+        for (i = 0; i < SHADOW_MAX_CLIENTS; i++)
+        {
+            if (clients[i] == -1 || !FD_ISSET(clients[i], &rset))
+            {
+                continue;
+            }
+            modbus_set_socket(ctx, clients[i]);
+            int rc = modbus_receive(ctx, query);
+            if (rc > 0 && rc < MBAP_LEN + 5)
+            {
+                // not a read request, just report the function is not supported
+                memset(query + rc, 0, MBAP_LEN + 5 - rc);
+            }
+            if (rc == -1 || (rc > 0 && reply(clients[i], query) == -1))
+            {
+                // the client closed the connection, or it's broken
+                close_socket(clients[i]);
+                clients[i] = -1;
+            }
+        }
+    }
+
+    for (i = 0; i < SHADOW_MAX_CLIENTS; i++)
+    {
+        if (clients[i] != -1)
+        {
+            close_socket(clients[i]);
+        }
+    }
+    close_socket(server);
+    modbus_free(ctx);
+    LOG_DEBUG("exiting shadow server thread...");
+    g_shadow_server_is_running = 0;
+    return 0;
+}
+
+int start_shadow_server(int port)
+{
+    if (port <= 0 || port > 65535)
+    {
+        LOG_ERROR("invalid shadow server port %d", port);
+        return -1;
+    }
+    g_shadow_server_port = port;
+    g_stop_shadow_server = 0;
+    Thread_start(shadow_server_func, (void*) NULL);
+    return 0;
+}
+
+void stop_shadow_server()
+{
+    g_stop_shadow_server = 1;
+    int count = 0;
+    while (g_shadow_server_is_running == 1 && ++count < 10)
+    {
+        sleep(1);
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INF_BCE_IOT_MODBUS_SDK_C_SHADOWSERVER_H
+#define INF_BCE_IOT_MODBUS_SDK_C_SHADOWSERVER_H
+
+#include <stdint.h>
+
+// the shadow image keeps the latest result of every successful read_modbus,
+// keyed by (slave id, function code, address), and a local modbus tcp server
+// answers FC1-FC4 reads from it, so on-site HMI/SCADA doesn't need to poll
+// the field bus again. the server is read only, writes are rejected.
+
+void init_shadow();
+
+// forget every value, e.g. when the policy set is replaced
+void cleanup_shadow();
+
+// store nb bits (one per byte, as modbus_read_bits returns) read with
+// FC1/FC2 from addr of the slave, by a policy polling every interval seconds
+void shadow_update_bits(int slaveid, int function, int addr, int nb, int interval,
+        const uint8_t* src);
+
+// store nb registers read with FC3/FC4 (FC23 counts as FC3) from addr of the slave,
+// by a policy polling every interval seconds
+void shadow_update_registers(int slaveid, int function, int addr, int nb, int interval,
+        const uint16_t* src);
+
+// start serving the shadow image on the port, in a separated thread
+// return 0 on success, -1 otherwise
+int start_shadow_server(int port);
+
+// stop the server thread, and wait it to exit
+void stop_shadow_server();
+
+#endif
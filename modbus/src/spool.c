@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "spool.h"
+#include "common.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if defined(_WIN32) || defined(WIN64)
+#include <direct.h>
+#endif
+
+#define SPOOL_SEGMENT_SIZE (1024 * 1024)    // seal the open segment when it's this big
+#define SPOOL_SEAL_INTERVAL 1    // in seconds, seal the open segment when it's this old
+#define SPOOL_DRAIN_MAX 64    // segments passed to the sink and not settled yet, at most
+#define SPOOL_FIELDS 5    // endpoint, user, password, topic, payload
+
+struct Spool_t
+{
+    char dir[MAX_LEN];
+    int shard;
+    FILE* fp;    // the open segment, NULL until the first record
+    long size;
+    time_t opened;    // when the first record of the open segment was written
+    unsigned long seq;    // of the next sealed segment
+};
+
+// a segment passed to the sink, kept until the sink settles its records
+typedef struct
+{
+    int shard;
+    unsigned long seq;
+    long offset;    // passed up to here
+    long saved;    // the resume offset in the file
+    char done;    // passed in full
+    unsigned long mark;    // the position of the sink after the last record passed
+} HandedSegment;
+
+struct SpoolDrain_t
+{
+    char dir[MAX_LEN];
+    SpoolSink sink;
+    HandedSegment handed[SPOOL_DRAIN_MAX];
+    int num;
+    int next_shard;    // the shards take turns, this one starts the next call
+};
+
+typedef struct
+{
+    int shard;
+    unsigned long seq;
+} Candidate;
+
+static uint32_t fnv1a(const unsigned char* data, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    size_t i = 0;
+    for (i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static void open_segment_path(char* path, const char* dir, int shard)
+{
+    snprintf(path, MAX_LEN, "%s/%03d.open", dir, shard);
+}
+
+static void sealed_segment_path(char* path, const char* dir, int shard, unsigned long seq)
+{
+    snprintf(path, MAX_LEN, "%s/%03d-%010lu.seg", dir, shard, seq);
+}
+
+// whether name is a sealed segment, and of which shard and seq
+static int parse_segment_name(const char* name, int* shard, unsigned long* seq)
+{
+    int end = 0;
+    return sscanf(name, "%d-%lu.seg%n", shard, seq, &end) == 2 && end > 0 && name[end] == '\0';
+}
+
+// where a segment is drained from next, if draining it stopped halfway
+static void resume_path(char* path, const char* segment)
+{
+    snprintf(path, MAX_LEN, "%s.pos", segment);
+}
+
+// the seq following the last sealed segment of the shard
+static unsigned long next_segment_seq(const char* dir, int shard)
+{
+    unsigned long next = 0;
+    DIR* d = opendir(dir);
+    if (d == NULL)
+    {
+        return next;
+    }
+    struct dirent* entry = NULL;
+    while ((entry = readdir(d)) != NULL)
+    {
+        int seg_shard = 0;
+        unsigned long seq = 0;
+        if (parse_segment_name(entry->d_name, &seg_shard, &seq)
+                && seg_shard == shard && seq >= next)
+        {
+            next = seq + 1;
+        }
+    }
+    closedir(d);
+    return next;
+}
+
+static int seal_segment(const char* dir, int shard, unsigned long seq)
+{
+    char open_path[MAX_LEN];
+    char sealed_path[MAX_LEN];
+    open_segment_path(open_path, dir, shard);
+    sealed_segment_path(sealed_path, dir, shard, seq);
+    if (rename(open_path, sealed_path) != 0)
+    {
+        LOG_ERROR("failed to seal spool segment %s", open_path);
+        return -1;
+    }
+    return 0;
+}
+
+void seal_spool_orphan(const char* dir, int shard)
+{
+    char path[MAX_LEN];
+    open_segment_path(path, dir, shard);
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return;
+    }
+    if (st.st_size == 0)
+    {
+        remove(path);
+        return;
+    }
+    if (seal_segment(dir, shard, next_segment_seq(dir, shard)) == 0)
+    {
+        LOG_INFO("sealed the spool segment left open by shard %d", shard);
+    }
+}
+
+Spool* open_spool(const char* dir, int shard)
+{
+#if defined(_WIN32) || defined(WIN64)
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+    seal_spool_orphan(dir, shard);
+
+    Spool* spool = (Spool*) malloc(sizeof(Spool));
+    if (spool == NULL)
+    {
+        return NULL;
+    }
+    mystrncpy(spool->dir, dir, MAX_LEN);
+    spool->shard = shard;
+    spool->fp = NULL;
+    spool->size = 0;
+    spool->opened = 0;
+    spool->seq = next_segment_seq(dir, shard);
+    return spool;
+}
+
+static void seal_open_segment(Spool* spool)
+{
+    if (spool->fp == NULL)
+    {
+        return;
+    }
+    fclose(spool->fp);
+    spool->fp = NULL;
+    spool->size = 0;
+    if (seal_segment(spool->dir, spool->shard, spool->seq) == 0)
+    {
+        spool->seq++;
+    }
+}
+
+static unsigned char* put_field(unsigned char* p, const char* str, size_t len)
+{
+    uint32_t n = (uint32_t) len + 1;    // with the '\0', so the uploader can use it in place
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    if (len > 0)
+    {
+        memcpy(p, str, len);
+    }
+    p[len] = '\0';
+    return p + len + 1;
+}
+
+int spool_append(Spool* spool, const SpoolRecord* record)
+{
+    if (spool == NULL || record == NULL)
+    {
+        return -1;
+    }
+
+    // length and checksum of the body, then the body: retain, and each
+    // field prefixed by its length
+    const char* fields[SPOOL_FIELDS] = {record->endpoint, record->user, record->password,
+            record->topic, record->payload};
+    size_t lens[SPOOL_FIELDS];
+    size_t body_len = 1;
+    int i = 0;
+    for (i = 0; i < SPOOL_FIELDS; i++)
+    {
+        if (fields[i] == NULL)
+        {
+            fields[i] = "";
+        }
+        lens[i] = i == SPOOL_FIELDS - 1 ? (size_t) record->payloadlen : strlen(fields[i]);
+        body_len += sizeof(uint32_t) + lens[i] + 1;
+    }
+    unsigned char* buf = (unsigned char*) malloc(2 * sizeof(uint32_t) + body_len);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    unsigned char* body = buf + 2 * sizeof(uint32_t);
+    unsigned char* p = body;
+    *p++ = (unsigned char) record->retain;
+    for (i = 0; i < SPOOL_FIELDS; i++)
+    {
+        p = put_field(p, fields[i], lens[i]);
+    }
+    uint32_t head[2];
+    head[0] = (uint32_t) body_len;
+    head[1] = fnv1a(body, body_len);
+    memcpy(buf, head, sizeof(head));
+
+    if (spool->fp == NULL)
+    {
+        char path[MAX_LEN];
+        open_segment_path(path, spool->dir, spool->shard);
+        spool->fp = fopen(path, "ab");
+        if (spool->fp == NULL)
+        {
+            LOG_ERROR("failed to open spool segment %s", path);
+            free(buf);
+            return -1;
+        }
+        spool->opened = time(NULL);
+    }
+    size_t total = sizeof(head) + body_len;
+    // flushed record by record, a crash of the shard loses at most the one
+    // being written, which the checksum catches
+    int ok = fwrite(buf, 1, total, spool->fp) == total && fflush(spool->fp) == 0;
+    free(buf);
+    if (!ok)
+    {
+        LOG_ERROR("failed to write spool segment of shard %d", spool->shard);
+        return -1;
+    }
+    spool->size += (long) total;
+    if (spool->size >= SPOOL_SEGMENT_SIZE)
+    {
+        seal_open_segment(spool);
+    }
+    return 0;
+}
+
+void spool_tick(Spool* spool)
+{
+    if (spool != NULL && spool->fp != NULL && time(NULL) - spool->opened >= SPOOL_SEAL_INTERVAL)
+    {
+        seal_open_segment(spool);
+    }
+}
+
+void close_spool(Spool* spool)
+{
+    if (spool == NULL)
+    {
+        return;
+    }
+    seal_open_segment(spool);
+    free(spool);
+}
+
+static const unsigned char* get_field(const unsigned char* p, const unsigned char* end,
+        const char** str, size_t* len)
+{
+    uint32_t n = 0;
+    if (p == NULL || (size_t) (end - p) < sizeof(n))
+    {
+        return NULL;
+    }
+    memcpy(&n, p, sizeof(n));
+    p += sizeof(n);
+    if (n == 0 || (size_t) (end - p) < n || p[n - 1] != '\0')
+    {
+        return NULL;
+    }
+    *str = (const char*) p;
+    *len = n - 1;
+    return p + n;
+}
+
+static long read_resume_offset(const char* segment)
+{
+    char path[MAX_LEN];
+    resume_path(path, segment);
+    long offset = 0;
+    FILE* fp = fopen(path, "r");
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%ld", &offset) != 1)
+        {
+            offset = 0;
+        }
+        fclose(fp);
+    }
+    return offset;
+}
+
+static void save_resume_offset(const char* segment, long offset)
+{
+    char path[MAX_LEN];
+    resume_path(path, segment);
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        // the segment is drained from its start again, a few messages twice
+        LOG_WARN("failed to save the drain offset of spool segment %s", segment);
+        return;
+    }
+    fprintf(fp, "%ld", offset);
+    fclose(fp);
+}
+
+// pass the records of a segment to the sink, from offset on. count is
+// increased by the records taken, and offset moved past them. return 0 when
+// the segment is done, -1 if it's to be drained again later
+static int drain_segment(const char* path, const SpoolSink* sink, long* offset, int* count)
+{
+    char* content = NULL;
+    long size = read_file_as_string(path, &content);
+    if (size < 0)
+    {
+        LOG_ERROR("failed to read spool segment %s, keeping it", path);
+        return -1;
+    }
+    const unsigned char* p = (const unsigned char*) content + (*offset > 0 && *offset < size ? *offset : 0);
+    const unsigned char* end = (const unsigned char*) content + size;
+    while (p < end)
+    {
+        const unsigned char* start = p;
+        uint32_t head[2];
+        if ((size_t) (end - p) < sizeof(head))
+        {
+            LOG_WARN("truncated record in spool segment %s", path);
+            break;
+        }
+        memcpy(head, p, sizeof(head));
+        const unsigned char* body = p + sizeof(head);
+        if ((size_t) (end - body) < head[0] || head[0] < 1 || fnv1a(body, head[0]) != head[1])
+        {
+            LOG_WARN("truncated or corrupted record in spool segment %s, skipping the rest", path);
+            break;
+        }
+        p = body + head[0];
+
+        const char* fields[SPOOL_FIELDS];
+        size_t lens[SPOOL_FIELDS];
+        const unsigned char* q = body + 1;
+        int i = 0;
+        for (i = 0; i < SPOOL_FIELDS; i++)
+        {
+            q = get_field(q, p, &fields[i], &lens[i]);
+        }
+        if (q == NULL)
+        {
+            continue;
+        }
+        SpoolRecord record;
+        record.retain = (char) body[0];
+        record.endpoint = fields[0];
+        record.user = fields[1];
+        record.password = fields[2];
+        record.topic = fields[3];
+        record.payload = fields[4];
+        record.payloadlen = (int) lens[4];
+        if (sink->take(&record) != 0)
+        {
+            *offset = (long) (start - (const unsigned char*) content);
+            free(content);
+            return -1;
+        }
+        (*count)++;
+    }
+    *offset = size;
+    free(content);
+    return 0;
+}
+
+SpoolDrain* open_spool_drain(const char* dir, const SpoolSink* sink)
+{
+    if (sink == NULL || sink->take == NULL || sink->taken == NULL || sink->settled == NULL)
+    {
+        return NULL;
+    }
+    SpoolDrain* drain = (SpoolDrain*) malloc(sizeof(SpoolDrain));
+    if (drain == NULL)
+    {
+        return NULL;
+    }
+    mystrncpy(drain->dir, dir, MAX_LEN);
+    drain->sink = *sink;
+    drain->num = 0;
+    drain->next_shard = 0;
+    return drain;
+}
+
+void close_spool_drain(SpoolDrain* drain)
+{
+    free(drain);
+}
+
+static HandedSegment* find_handed(SpoolDrain* drain, int shard, unsigned long seq)
+{
+    int i = 0;
+    for (i = 0; i < drain->num; i++)
+    {
+        if (drain->handed[i].shard == shard && drain->handed[i].seq == seq)
+        {
+            return &drain->handed[i];
+        }
+    }
+    return NULL;
+}
+
+// remove the segments whose records the sink has all settled, and save how
+// far the partly passed ones are settled, a restart resumes from there
+static void retire_settled(SpoolDrain* drain)
+{
+    unsigned long settled = drain->sink.settled();
+    int i = 0;
+    while (i < drain->num)
+    {
+        HandedSegment* seg = &drain->handed[i];
+        if ((long) (settled - seg->mark) < 0)
+        {
+            i++;
+            continue;
+        }
+        char path[MAX_LEN];
+        sealed_segment_path(path, drain->dir, seg->shard, seg->seq);
+        if (!seg->done)
+        {
+            if (seg->saved != seg->offset)
+            {
+                save_resume_offset(path, seg->offset);
+                seg->saved = seg->offset;
+            }
+            i++;
+            continue;
+        }
+        char resume[MAX_LEN];
+        resume_path(resume, path);
+        remove(resume);
+        remove(path);
+        drain->handed[i] = drain->handed[--drain->num];
+    }
+}
+
+int spool_unsettled(SpoolDrain* drain)
+{
+    if (drain == NULL)
+    {
+        return 0;
+    }
+    retire_settled(drain);
+    unsigned long settled = drain->sink.settled();
+    int unsettled = 0;
+    int i = 0;
+    for (i = 0; i < drain->num; i++)
+    {
+        if ((long) (settled - drain->handed[i].mark) < 0)
+        {
+            unsettled++;
+        }
+    }
+    return unsettled;
+}
+
+static int compare_shards(const void* a, const void* b)
+{
+    return ((const Candidate*) a)->shard - ((const Candidate*) b)->shard;
+}
+
+int drain_spool(SpoolDrain* drain)
+{
+    if (drain == NULL)
+    {
+        return 0;
+    }
+    retire_settled(drain);
+    DIR* d = opendir(drain->dir);
+    if (d == NULL)
+    {
+        return 0;
+    }
+    // the oldest segment of each shard, which isn't passed in full yet
+    Candidate candidates[SPOOL_DRAIN_MAX];
+    int num = 0;
+    struct dirent* entry = NULL;
+    while ((entry = readdir(d)) != NULL)
+    {
+        int shard = 0;
+        unsigned long seq = 0;
+        if (!parse_segment_name(entry->d_name, &shard, &seq))
+        {
+            continue;
+        }
+        HandedSegment* seg = find_handed(drain, shard, seq);
+        if (seg != NULL && seg->done)
+        {
+            continue;
+        }
+        int i = 0;
+        while (i < num && candidates[i].shard != shard)
+        {
+            i++;
+        }
+        if (i < num)
+        {
+            if (seq < candidates[i].seq)
+            {
+                candidates[i].seq = seq;
+            }
+        }
+        else if (num < SPOOL_DRAIN_MAX)
+        {
+            candidates[num].shard = shard;
+            candidates[num].seq = seq;
+            num++;
+        }
+    }
+    closedir(d);
+    if (num == 0)
+    {
+        return 0;
+    }
+    qsort(candidates, num, sizeof(Candidate), compare_shards);
+
+    // the shards take turns, starting after the one drained last
+    int first = 0;
+    while (first < num && candidates[first].shard < drain->next_shard)
+    {
+        first++;
+    }
+    int count = 0;
+    int i = 0;
+    for (i = 0; i < num; i++)
+    {
+        const Candidate* c = &candidates[(first + i) % num];
+        char path[MAX_LEN];
+        sealed_segment_path(path, drain->dir, c->shard, c->seq);
+        HandedSegment* seg = find_handed(drain, c->shard, c->seq);
+        if (seg == NULL)
+        {
+            if (drain->num >= SPOOL_DRAIN_MAX)
+            {
+                // the sink is far behind settling what it took
+                break;
+            }
+            seg = &drain->handed[drain->num++];
+            seg->shard = c->shard;
+            seg->seq = c->seq;
+            seg->offset = read_resume_offset(path);
+            seg->saved = seg->offset;
+            seg->done = 0;
+        }
+        int rc = drain_segment(path, &drain->sink, &seg->offset, &count);
+        seg->mark = drain->sink.taken();
+        drain->next_shard = c->shard + 1;
+        if (rc != 0)
+        {
+            // the sink can't take more now
+            break;
+        }
+        seg->done = 1;
+    }
+    return count;
+}
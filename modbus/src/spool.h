@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INF_BCE_IOT_MODBUS_SDK_C_SPOOL_H
+#define INF_BCE_IOT_MODBUS_SDK_C_SPOOL_H
+
+// the spool hands messages from the shard processes to the uploader. it's a
+// directory of segment files: each shard appends to its own open segment
+// "<shard>.open", and seals it into "<shard>-<seq>.seg" when it's big or old
+// enough. the uploader publishes the sealed segments, and removes them once
+// the sender has them safe, acked or in its cache file.
+// records are checksummed, a segment left by a crashed shard is sealed and
+// uploaded up to its last complete record
+
+typedef struct Spool_t Spool;
+
+typedef struct
+{
+    const char* endpoint;
+    const char* user;
+    const char* password;
+    const char* topic;
+    const char* payload;
+    int payloadlen;
+    char retain;
+} SpoolRecord;
+
+// create the directory if needed, seal what a previous run of the shard left
+// open, and start a new segment. return NULL on failure
+Spool* open_spool(const char* dir, int shard);
+
+// append a message to the open segment, return 0 on success, -1 otherwise
+int spool_append(Spool* spool, const SpoolRecord* record);
+
+// seal the open segment if it's older than the seal interval, so the
+// uploader sees the messages in time. call it regularly
+void spool_tick(Spool* spool);
+
+// seal the open segment, and close the spool
+void close_spool(Spool* spool);
+
+// seal the open segment of a shard which is not running, e.g. crashed
+void seal_spool_orphan(const char* dir, int shard);
+
+// where the uploader passes the records to
+typedef struct
+{
+    // return 0 once it took the record, otherwise draining stops, and the
+    // next call resumes from that record
+    int (*take)(const SpoolRecord* record);
+    // the position after the records taken so far
+    unsigned long (*taken)(void);
+    // the records taken before this position are persisted or delivered
+    unsigned long (*settled)(void);
+} SpoolSink;
+
+typedef struct SpoolDrain_t SpoolDrain;
+
+// return NULL on failure
+SpoolDrain* open_spool_drain(const char* dir, const SpoolSink* sink);
+
+// pass the records of the sealed segments to the sink. the shards take turns,
+// a segment each, so a backlogged shard doesn't hold up the others; the
+// segments of a shard go in the order they were sealed. a segment is removed
+// once the sink settled all of its records, until then a restart passes them
+// again. return the number of records taken
+int drain_spool(SpoolDrain* drain);
+
+// the segments passed to the sink which it hasn't settled yet
+int spool_unsettled(SpoolDrain* drain);
+
+void close_spool_drain(SpoolDrain* drain);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wakeup.h"
+
+#include <time.h>
+
+#if defined(WIN32) || defined(WIN64)
+void init_wakeup(Wakeup* wakeup)
+{
+    wakeup->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    wakeup->generation = 0;
+}
+
+void destroy_wakeup(Wakeup* wakeup)
+{
+    CloseHandle(wakeup->event);
+}
+
+unsigned int wakeup_generation(Wakeup* wakeup)
+{
+    return InterlockedCompareExchange((volatile LONG*) &wakeup->generation, 0, 0);
+}
+
+void signal_wakeup(Wakeup* wakeup)
+{
+    InterlockedIncrement((volatile LONG*) &wakeup->generation);
+    SetEvent(wakeup->event);
+}
+
+void wait_wakeup(Wakeup* wakeup, unsigned int generation, int seconds)
+{
+    if (wakeup_generation(wakeup) == generation)
+    {
+        WaitForSingleObject(wakeup->event, seconds * 1000);
+    }
+}
+#else
+void init_wakeup(Wakeup* wakeup)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wakeup->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&wakeup->mutex, NULL);
+    wakeup->generation = 0;
+}
+
+void destroy_wakeup(Wakeup* wakeup)
+{
+    pthread_cond_destroy(&wakeup->cond);
+    pthread_mutex_destroy(&wakeup->mutex);
+}
+
+unsigned int wakeup_generation(Wakeup* wakeup)
+{
+    pthread_mutex_lock(&wakeup->mutex);
+    unsigned int generation = wakeup->generation;
+    pthread_mutex_unlock(&wakeup->mutex);
+    return generation;
+}
+
+void signal_wakeup(Wakeup* wakeup)
+{
+    pthread_mutex_lock(&wakeup->mutex);
+    wakeup->generation++;
+    pthread_cond_broadcast(&wakeup->cond);
+    pthread_mutex_unlock(&wakeup->mutex);
+}
+
+void wait_wakeup(Wakeup* wakeup, unsigned int generation, int seconds)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += seconds;
+
+    pthread_mutex_lock(&wakeup->mutex);
+    int rc = 0;
+    while (wakeup->generation == generation && rc == 0)
+    {
+        rc = pthread_cond_timedwait(&wakeup->cond, &wakeup->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&wakeup->mutex);
+}
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2016 Baidu, Inc. All Rights Reserved.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INF_BCE_IOT_MODBUS_SDK_C_WAKEUP_H
+#define INF_BCE_IOT_MODBUS_SDK_C_WAKEUP_H
+
+#if defined(WIN32) || defined(WIN64)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// wakes a thread up that waits for something to happen. every signal bumps
+// the generation: the waiter takes it before checking what it waits for,
+// and a signal after that ends the wait at once, so none is lost between
+// the check and the wait
+typedef struct
+{
+#if defined(WIN32) || defined(WIN64)
+    HANDLE event;    // auto-reset, remembers a signal nobody waited for yet
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+    volatile unsigned int generation;
+} Wakeup;
+
+void init_wakeup(Wakeup* wakeup);
+
+void destroy_wakeup(Wakeup* wakeup);
+
+unsigned int wakeup_generation(Wakeup* wakeup);
+
+// the one that changes what's waited for signals after changing it
+void signal_wakeup(Wakeup* wakeup);
+
+// wait up to seconds, unless the generation has changed since it was taken
+void wait_wakeup(Wakeup* wakeup, unsigned int generation, int seconds);
+
+#endif
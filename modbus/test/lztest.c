@@ -0,0 +1,266 @@
+// lztest.c
+// round trip and corrupt input tests of the cache record compressor, and
+// checks that the published dictionaries, which old cache records depend
+// on, never change. run it with: make test
+
+#include "lzcompress.h"
+#include "cachedict.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static int g_checks = 0;
+static int g_failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int ok, const char* what, int line)
+{
+	g_checks++;
+	if (!ok)
+	{
+		g_failures++;
+		printf("line %d: %s failed\n", line, what);
+	}
+}
+
+// every dictionary a released gateway has written with, append the new one
+// here when CACHE_DICT_VERSION is bumped; never edit an existing entry
+typedef struct PublishedDict_t
+{
+	int version;
+	size_t len;
+	uint32_t fnv;	// fnv-1a of the dictionary
+} PublishedDict;
+
+static const PublishedDict g_published[] =
+{
+	{1, 321, 0x22908519},
+};
+
+// a message compressed with the version 1 dictionary, as it is in the
+// cache file of a gateway, it must decompress forever
+static const char GOLDEN_V1_RAW[] =
+	"{\"bdModbusVer\":1,\"gatewayid\":\"gw-1\",\"trantable\":\"\",\"modbus\":{\"request\":"
+	"{\"functioncode\":3,\"slaveid\":1,\"startAddr\":0,\"length\":4},\"response\":"
+	"\"0000000000000000\"},\"timestamp\":\"1500000000\"}";
+static const uint8_t GOLDEN_V1[] =
+{
+	0x0F, 0x0A, 0x01, 0x0B, 0x4F, 0x67, 0x77, 0x2D, 0x31, 0x0E, 0x01, 0x47,
+	0x1F, 0x34, 0xE9, 0x00, 0x0C, 0x0D, 0xAD, 0x00, 0x00, 0xFF, 0x00, 0x00,
+	0x04, 0x00, 0x20, 0x22, 0x7D,
+};
+
+static uint32_t fnv1a(const char* p, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i = 0;
+	for (i = 0; i < len; i++)
+	{
+		h ^= (uint8_t) p[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+// deterministic, so a failure is reproducible
+static void fillRandom(uint8_t* p, size_t len, uint32_t seed)
+{
+	size_t i = 0;
+	for (i = 0; i < len; i++)
+	{
+		seed = seed * 1103515245U + 12345U;
+		p[i] = (uint8_t) (seed >> 16);
+	}
+}
+
+// compress, check the bound, decompress and compare
+// return the compressed size, 0 on failure
+static size_t roundTrip(const void* src, size_t len, const void* dict, size_t dictLen)
+{
+	size_t cap = lzCompressBound(len);
+	uint8_t* comp = (uint8_t*) malloc(cap);
+	uint8_t* back = (uint8_t*) malloc(len + 1);
+	size_t clen = lzCompress(src, len, dict, dictLen, comp, cap);
+	int ok = clen > 0 && clen <= cap
+		&& lzDecompress(comp, clen, dict, dictLen, back, len) == 0
+		&& memcmp(back, src, len) == 0;
+	free(comp);
+	free(back);
+	return ok ? clen : 0;
+}
+
+static void testRoundTrip()
+{
+	size_t dictLen = 0;
+	const char* dict = cacheDict(CACHE_DICT_VERSION, &dictLen);
+
+	CHECK(roundTrip("", 0, NULL, 0) > 0);
+	CHECK(roundTrip("", 0, dict, dictLen) > 0);
+	CHECK(roundTrip("a", 1, NULL, 0) > 0);
+	CHECK(roundTrip("abc", 3, dict, dictLen) > 0);
+	CHECK(roundTrip(GOLDEN_V1_RAW, sizeof(GOLDEN_V1_RAW) - 1, NULL, 0) > 0);
+	CHECK(roundTrip(GOLDEN_V1_RAW, sizeof(GOLDEN_V1_RAW) - 1, dict, dictLen) > 0);
+
+	// the dictionary is what makes a single message small
+	CHECK(roundTrip(GOLDEN_V1_RAW, sizeof(GOLDEN_V1_RAW) - 1, dict, dictLen)
+		< roundTrip(GOLDEN_V1_RAW, sizeof(GOLDEN_V1_RAW) - 1, NULL, 0));
+
+	// long runs need the extra length bytes, both literals and matches
+	size_t len = 100000;
+	uint8_t* data = (uint8_t*) malloc(len);
+	memset(data, 'a', len);
+	CHECK(roundTrip(data, len, NULL, 0) > 0);
+	CHECK(roundTrip(data, len, NULL, 0) < len / 100);
+
+	// incompressible data must stay within the bound
+	fillRandom(data, len, 1);
+	CHECK(roundTrip(data, len, NULL, 0) > 0);
+	CHECK(roundTrip(data, len, dict, dictLen) > 0);
+	CHECK(roundTrip(data, 300, NULL, 0) > 0);
+
+	// a repeat beyond the max offset, it can't be a match
+	size_t half = 70000;
+	fillRandom(data, half, 2);
+	memcpy(data + half, data, len - half);
+	CHECK(roundTrip(data, len, NULL, 0) > 0);
+
+	// short repeats overlap with themselves
+	size_t i = 0;
+	for (i = 0; i < len; i++)
+	{
+		data[i] = "abcab"[i % 5];
+	}
+	CHECK(roundTrip(data, len, dict, dictLen) > 0);
+	free(data);
+}
+
+static void testSmallDestination()
+{
+	size_t len = sizeof(GOLDEN_V1_RAW) - 1;
+	uint8_t comp[512];
+	size_t clen = lzCompress(GOLDEN_V1_RAW, len, NULL, 0, comp, sizeof(comp));
+	CHECK(clen > 0);
+	CHECK(lzCompress(GOLDEN_V1_RAW, len, NULL, 0, comp, clen - 1) == 0);
+	CHECK(lzCompress(GOLDEN_V1_RAW, len, NULL, 0, comp, 0) == 0);
+	CHECK(lzCompress(NULL, len, NULL, 0, comp, sizeof(comp)) == 0);
+}
+
+static void testCorruptInput()
+{
+	size_t dictLen = 0;
+	const char* dict = cacheDict(CACHE_DICT_VERSION, &dictLen);
+	size_t len = 4096;
+	uint8_t* data = (uint8_t*) malloc(len);
+	uint8_t* back = (uint8_t*) malloc(len + 1);
+	size_t i = 0;
+	for (i = 0; i < len; i++)
+	{
+		data[i] = GOLDEN_V1_RAW[i % (sizeof(GOLDEN_V1_RAW) - 1)] ^ (uint8_t) (i / 997);
+	}
+	size_t cap = lzCompressBound(len);
+	uint8_t* comp = (uint8_t*) malloc(cap);
+	size_t clen = lzCompress(data, len, dict, dictLen, comp, cap);
+	CHECK(clen > 0);
+
+	// a record cut short anywhere
+	int truncated = 0;
+	for (i = 0; i < clen; i++)
+	{
+		truncated += lzDecompress(comp, i, dict, dictLen, back, len) == -1;
+	}
+	CHECK(truncated == (int) clen);
+
+	// the raw length doesn't match
+	CHECK(lzDecompress(comp, clen, dict, dictLen, back, len - 1) == -1);
+	CHECK(lzDecompress(comp, clen, dict, dictLen, back, len + 1) == -1);
+
+	// trailing garbage
+	uint8_t* longer = (uint8_t*) malloc(clen + 1);
+	memcpy(longer, comp, clen);
+	longer[clen] = 0;
+	CHECK(lzDecompress(longer, clen + 1, dict, dictLen, back, len) == -1);
+	free(longer);
+
+	// any flipped byte either fails, or at worst decodes into wrong data,
+	// never out of the buffers (run it under valgrind or -fsanitize=address)
+	for (i = 0; i < clen; i++)
+	{
+		int bit = 0;
+		for (bit = 0; bit < 8; bit++)
+		{
+			comp[i] ^= 1 << bit;
+			lzDecompress(comp, clen, dict, dictLen, back, len);
+			comp[i] ^= 1 << bit;
+		}
+	}
+	CHECK(lzDecompress(comp, clen, dict, dictLen, back, len) == 0);
+	CHECK(memcmp(back, data, len) == 0);
+
+	// one literal, then a match reaching before the start or at offset 0
+	const uint8_t before[] = {0x10, 'a', 0x02, 0x00, 0x10, 'b'};
+	const uint8_t zero[] = {0x10, 'a', 0x00, 0x00, 0x10, 'b'};
+	CHECK(lzDecompress(before, sizeof(before), NULL, 0, back, 6) == -1);
+	CHECK(lzDecompress(zero, sizeof(zero), NULL, 0, back, 6) == -1);
+	// the same match is fine when there is a dictionary before it
+	CHECK(lzDecompress(before, sizeof(before), "xy", 2, back, 6) == 0);
+	CHECK(memcmp(back, "ayayab", 6) == 0);
+	// a length that never ends
+	const uint8_t endless[] = {0xF0, 0xFF, 0xFF, 0xFF};
+	CHECK(lzDecompress(endless, sizeof(endless), NULL, 0, back, len) == -1);
+	CHECK(lzDecompress(NULL, 0, NULL, 0, back, 0) == -1);
+
+	free(data);
+	free(back);
+	free(comp);
+}
+
+static void testDictionaries()
+{
+	size_t count = sizeof(g_published) / sizeof(g_published[0]);
+	CHECK(count == CACHE_DICT_VERSION);
+	size_t i = 0;
+	for (i = 0; i < count; i++)
+	{
+		size_t dictLen = 0;
+		const char* dict = cacheDict(g_published[i].version, &dictLen);
+		CHECK(dict != NULL);
+		if (dict == NULL)
+		{
+			continue;
+		}
+		if (dictLen != g_published[i].len || fnv1a(dict, dictLen) != g_published[i].fnv)
+		{
+			printf("dictionary version %d changed, old cache records can't be read\n",
+					g_published[i].version);
+			CHECK(0);
+		}
+	}
+	CHECK(cacheDict(0, NULL) == NULL);
+	CHECK(cacheDict(CACHE_DICT_VERSION + 1, NULL) == NULL);
+
+	// a record written with version 1 still decompresses
+	size_t dictLen = 0;
+	const char* dict = cacheDict(1, &dictLen);
+	char back[sizeof(GOLDEN_V1_RAW)];
+	CHECK(lzDecompress(GOLDEN_V1, sizeof(GOLDEN_V1), dict, dictLen, back,
+			sizeof(GOLDEN_V1_RAW) - 1) == 0);
+	CHECK(memcmp(back, GOLDEN_V1_RAW, sizeof(GOLDEN_V1_RAW) - 1) == 0);
+
+	// and it's useless without the dictionary
+	int rc = lzDecompress(GOLDEN_V1, sizeof(GOLDEN_V1), NULL, 0, back,
+			sizeof(GOLDEN_V1_RAW) - 1);
+	CHECK(rc == -1 || memcmp(back, GOLDEN_V1_RAW, sizeof(GOLDEN_V1_RAW) - 1) != 0);
+}
+
+int main()
+{
+	testRoundTrip();
+	testSmallDestination();
+	testCorruptInput();
+	testDictionaries();
+	printf("%d checks, %d failed\n", g_checks, g_failures);
+	return g_failures == 0 ? 0 : 1;
+}
@@ -88,9 +88,9 @@ fi
 
 # 8, download and install paho.mqtt.c
 echo "8, download and install paho.mqtt.c"
-if [ -f $OUTPUTDIR/lib/libpaho-mqtt3cs-static.a ]
+if [ -f $OUTPUTDIR/lib/libpaho-mqtt3as-static.a ]
 then
-    echo "$OUTPUTDIR/lib/libpaho-mqtt3cs-static.a exist, skipping paho.mqtt.c compilation"
+    echo "$OUTPUTDIR/lib/libpaho-mqtt3as-static.a exist, skipping paho.mqtt.c compilation"
 else
 cd $DEPSDIR
 wget https://github.com/eclipse/paho.mqtt.c/archive/v1.2.0.tar.gz